@@ -0,0 +1,234 @@
+#!/usr/bin/python3
+
+import argparse
+import csv
+import json
+import math
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+USAGE = """Runs the downloader against the bundled test_server, without a network,
+over a sweep of worker counts and file mixes, and writes the throughput,
+per-range latency and peak memory of each as JSON or CSV.
+
+Run from the repository root, after make. Options after -- are passed to
+test_server, e.g. -- -l 20 -b 4M to add 20 ms of latency to each response
+and cap each connection at 4 MiB/s, -- -C to close the connection after each
+response, or -- -R to ignore ranges."""
+
+# Mixes of files to download, as (count, size) pairs
+MIXES = {
+    "small": [(256, "64K")],
+    "huge": [(2, "256M")],
+    "mixed": [(64, "256K"), (1, "128M")],
+}
+
+WORKERS = [1, 2, 4, 8, 16]
+
+FIELDS = [
+    "engine",
+    "mix",
+    "workers",
+    "runs",
+    "bytes",
+    "seconds",
+    "throughput_mb_s",
+    "ranges",
+    "p50_range_ms",
+    "p99_range_ms",
+    "peak_rss_kb",
+]
+
+
+def parse_size(size: str):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    if size[-1] in units:
+        return int(size[:-1]) * units[size[-1]]
+    return int(size)
+
+
+def percentile(values, fraction: float):
+    """The nearest-rank percentile of a list of values."""
+    values = sorted(values)
+    return values[max(1, math.ceil(fraction * len(values))) - 1]
+
+
+def start_server(server_args, log: str):
+    server = subprocess.Popen(
+        ["./test_server", "-L", log, *server_args],
+        stdout=subprocess.PIPE,
+        text=True,
+    )
+    line = server.stdout.readline()
+    if not line.startswith("listening on "):
+        server.kill()
+        raise RuntimeError("test_server did not start")
+    return server, int(line.split()[-1])
+
+
+def write_urls(filename: str, port: int, mix):
+    total = 0
+    with open(filename, "w") as url_file:
+        for count, size in mix:
+            for i in range(count):
+                print(f"localhost:{port}/sparse/{size}/{i}", file=url_file)
+                total += parse_size(size)
+    return total
+
+
+def read_latencies(log: str):
+    """The seconds each ranged or whole GET took, from the server's log."""
+    # The server logs a request once its last byte is sent, which can be
+    # after the downloader has it and exits
+    size = -1
+    while size != os.path.getsize(log):
+        size = os.path.getsize(log)
+        time.sleep(0.05)
+
+    latencies = []
+    with open(log) as log_file:
+        for line in log_file:
+            method, _, status, _, micros = line.split()
+            if method == "GET" and status in ("200", "206"):
+                latencies.append(int(micros) / 1e6)
+    return latencies
+
+
+def peak_rss(pid: int):
+    """A running process's peak RSS in KiB, or 0 if it has exited."""
+    try:
+        with open(f"/proc/{pid}/status") as status:
+            for line in status:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def sample_rss(process, rss):
+    """Keeps the highest peak RSS of a process seen in rss[0] until it exits."""
+    while process.poll() is None:
+        rss[0] = max(rss[0], peak_rss(process.pid))
+        time.sleep(0.01)
+
+
+def run_once(exe: str, engine: str, urls: str, workers: int, log: str):
+    """Runs the downloader once, returning its time and peak RSS in KiB."""
+    download_dir = tempfile.mkdtemp(prefix="bench_")
+    open(log, "w").close()
+    try:
+        # An engine may be suffixed with +splice to splice bodies to files
+        name, _, mode = engine.partition("+")
+        args = [exe, "-e", name] + (["-z"] if mode == "splice" else [])
+        args += [urls, str(workers), download_dir]
+        start = time.monotonic()
+        process = subprocess.Popen(args, stdout=subprocess.DEVNULL)
+
+        # Sampled on the side rather than taken from wait4, whose ru_maxrss
+        # would include this script's own RSS from before the fork
+        rss = [0]
+        sampler = threading.Thread(target=sample_rss, args=(process, rss))
+        sampler.start()
+        process.wait()
+        seconds = time.monotonic() - start
+        sampler.join()
+
+        if process.returncode != 0:
+            raise RuntimeError(f"{' '.join(args)} failed")
+        return seconds, rss[0]
+    finally:
+        shutil.rmtree(download_dir)
+
+
+def bench(exe: str, engine: str, mix: str, workers: int, runs: int, port, log):
+    with tempfile.NamedTemporaryFile("w", suffix=".txt") as urls:
+        total = write_urls(urls.name, port, MIXES[mix])
+        times, latencies, peak = [], [], 0
+        for _ in range(runs):
+            seconds, rss = run_once(exe, engine, urls.name, workers, log)
+            times.append(seconds)
+            latencies.extend(read_latencies(log))
+            peak = max(peak, rss)
+
+    seconds = statistics.median(times)
+    return {
+        "engine": engine,
+        "mix": mix,
+        "workers": workers,
+        "runs": runs,
+        "bytes": total,
+        "seconds": round(seconds, 4),
+        "throughput_mb_s": round(total / seconds / (1 << 20), 2),
+        "ranges": len(latencies) // runs,
+        "p50_range_ms": round(percentile(latencies, 0.5) * 1000, 3),
+        "p99_range_ms": round(percentile(latencies, 0.99) * 1000, 3),
+        "peak_rss_kb": peak,
+    }
+
+
+def write_results(results, output: str):
+    if output.endswith(".csv"):
+        with open(output, "w", newline="") as out_file:
+            writer = csv.DictWriter(out_file, fieldnames=FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+    else:
+        out_file = open(output, "w") if output != "-" else sys.stdout
+        json.dump(results, out_file, indent=2)
+        print(file=out_file)
+        if out_file is not sys.stdout:
+            out_file.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=USAGE, formatter_class=argparse.RawTextHelpFormatter
+    )
+    parser.add_argument("-d", "--downloader", default="./downloader")
+    parser.add_argument("-o", "--output", default="-",
+                        help="a .json or .csv file, or - for JSON on stdout")
+    parser.add_argument("-w", "--workers", default=",".join(map(str, WORKERS)),
+                        help="comma separated worker counts")
+    parser.add_argument("-m", "--mixes", default=",".join(MIXES),
+                        help="comma separated mixes from: " + ", ".join(
+                            f"{name} ({' + '.join(f'{c}x{s}' for c, s in mix)})"
+                            for name, mix in MIXES.items()))
+    parser.add_argument("-e", "--engines", default="threads,epoll,uring",
+                        help="comma separated engines, any of which may "
+                             "be suffixed with +splice e.g. epoll+splice; "
+                             "uring falls back to threads where io_uring "
+                             "is unavailable")
+    parser.add_argument("-r", "--runs", type=int, default=3,
+                        help="runs of each, of which the median time is kept")
+    parser.add_argument("server_args", nargs="*",
+                        help="test_server options, after --")
+    args = parser.parse_args()
+
+    log = tempfile.mktemp(prefix="bench_", suffix=".log")
+    server, port = start_server(args.server_args, log)
+    results = []
+    try:
+        for engine in args.engines.split(","):
+            for mix in args.mixes.split(","):
+                for workers in map(int, args.workers.split(",")):
+                    result = bench(args.downloader, engine, mix, workers,
+                                   args.runs, port, log)
+                    print(f"{engine} {mix} {workers}: "
+                          f"{result['throughput_mb_s']} MB/s", file=sys.stderr)
+                    results.append(result)
+    finally:
+        server.kill()
+        server.wait()
+        os.remove(log)
+        write_results(results, args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+#include "buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MIN_CAPACITY 64
+#define POOL_SIZE 8
+#define POOL_MAX_CAPACITY (4 * 1024 * 1024)
+
+/*
+ * BufferPool - a free list of buffers owned by a single thread.
+ */
+typedef struct BufferPoolStruct {
+    Buffer* free[POOL_SIZE];
+    int count;
+} BufferPool;
+
+/**
+ * @brief Calls malloc/realloc, exiting if the allocation fails.
+ *
+ * @param data The allocation to resize, or NULL for a new allocation.
+ * @param size The number of bytes to allocate.
+ * @return void* The allocation.
+ */
+static void* checked_realloc(void* data, size_t size) {
+    data = realloc(data, size);
+    if (data == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/**
+ * Allocate an empty buffer able to hold at least `capacity` bytes
+ * @param capacity - The number of bytes to allocate up front
+ * @return buffer - Pointer to the allocated buffer
+ */
+Buffer* buffer_alloc(size_t capacity) {
+    if (capacity < MIN_CAPACITY) {
+        capacity = MIN_CAPACITY;
+    }
+
+    Buffer* buffer = checked_realloc(NULL, sizeof(Buffer));
+    buffer->data = checked_realloc(NULL, capacity);
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+/**
+ * Ensure a buffer can hold `extra` more bytes past its current length.
+ * Capacity grows geometrically, so appending n bytes one read at a time
+ * costs O(log n) reallocations rather than O(n).
+ * @param buffer - Pointer to the buffer to grow
+ * @param extra - The number of bytes that are about to be appended
+ */
+void buffer_reserve(Buffer* buffer, size_t extra) {
+    size_t required = buffer->length + extra;
+    if (required <= buffer->capacity) {
+        return;
+    }
+
+    size_t capacity = buffer->capacity * 2;
+    if (capacity < required) {
+        capacity = required;
+    }
+
+    buffer->data = checked_realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+}
+
+/**
+ * Free a buffer
+ * @param buffer - Pointer to a buffer to free
+ */
+void buffer_free(Buffer* buffer) {
+    free(buffer->data);
+    free(buffer);
+}
+
+/**
+ * Allocate an empty pool of buffers
+ * @return pool - Pointer to the allocated pool
+ */
+BufferPool* buffer_pool_alloc(void) {
+    BufferPool* pool = checked_realloc(NULL, sizeof(BufferPool));
+    pool->count = 0;
+    return pool;
+}
+
+/**
+ * Free a pool and every buffer it holds
+ * @param pool - Pointer to the pool to free
+ */
+void buffer_pool_free(BufferPool* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        buffer_free(pool->free[i]);
+    }
+    free(pool);
+}
+
+/**
+ * Take an empty buffer able to hold at least `capacity` bytes from the pool,
+ * allocating one if the pool is empty. The most recently returned buffer is
+ * preferred, as it is the most likely to still be in cache.
+ * @param pool - Pointer to the pool to take a buffer from
+ * @param capacity - The number of bytes the buffer must be able to hold
+ * @return buffer - Pointer to the buffer. Return it with buffer_pool_put
+ */
+Buffer* buffer_pool_get(BufferPool* pool, size_t capacity) {
+    if (pool == NULL || pool->count == 0) {
+        return buffer_alloc(capacity);
+    }
+
+    Buffer* buffer = pool->free[--pool->count];
+    buffer->length = 0;
+    buffer_reserve(buffer, capacity);
+    return buffer;
+}
+
+/**
+ * Return a buffer to the pool for reuse. The buffer is freed instead if the
+ * pool is full or the buffer is too large to be worth keeping.
+ * @param pool - Pointer to the pool to return the buffer to
+ * @param buffer - Pointer to the buffer to return
+ */
+void buffer_pool_put(BufferPool* pool, Buffer* buffer) {
+    if (pool == NULL || pool->count == POOL_SIZE ||
+        buffer->capacity > POOL_MAX_CAPACITY) {
+        buffer_free(buffer);
+        return;
+    }
+
+    pool->free[pool->count++] = buffer;
+}
@@ -0,0 +1,82 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+
+// A buffer object with data, a length, and the capacity allocated for data
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+
+} Buffer;
+
+
+/*
+ * BufferPool - a free list of buffers owned by a single thread, so that
+ * buffers can be recycled across requests rather than allocated and freed
+ * for each one. Not safe to share between threads.
+ */
+typedef struct BufferPoolStruct BufferPool;
+
+
+/**
+ * Allocate an empty buffer able to hold at least `capacity` bytes
+ * @param capacity - The number of bytes to allocate up front
+ * @return buffer - Pointer to the allocated buffer
+ */
+Buffer *buffer_alloc(size_t capacity);
+
+
+/**
+ * Ensure a buffer can hold `extra` more bytes past its current length.
+ * Capacity grows geometrically, so appending n bytes one read at a time
+ * costs O(log n) reallocations rather than O(n).
+ * @param buffer - Pointer to the buffer to grow
+ * @param extra - The number of bytes that are about to be appended
+ */
+void buffer_reserve(Buffer *buffer, size_t extra);
+
+
+/**
+ * Free a buffer
+ * @param buffer - Pointer to a buffer to free
+ */
+void buffer_free(Buffer *buffer);
+
+
+/**
+ * Allocate an empty pool of buffers
+ * @return pool - Pointer to the allocated pool
+ */
+BufferPool *buffer_pool_alloc(void);
+
+
+/**
+ * Free a pool and every buffer it holds
+ * @param pool - Pointer to the pool to free
+ */
+void buffer_pool_free(BufferPool *pool);
+
+
+/**
+ * Take an empty buffer able to hold at least `capacity` bytes from the pool,
+ * allocating one if the pool is empty
+ * @param pool - Pointer to the pool to take a buffer from
+ * @param capacity - The number of bytes the buffer must be able to hold
+ * @return buffer - Pointer to the buffer. Return it with buffer_pool_put
+ */
+Buffer *buffer_pool_get(BufferPool *pool, size_t capacity);
+
+
+/**
+ * Return a buffer to the pool for reuse. The buffer is freed instead if the
+ * pool is full or the buffer is too large to be worth keeping.
+ * @param pool - Pointer to the pool to return the buffer to
+ * @param buffer - Pointer to the buffer to return
+ */
+void buffer_pool_put(BufferPool *pool, Buffer *buffer);
+
+
+#endif
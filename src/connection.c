@@ -0,0 +1,387 @@
+#include "connection.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The idle sockets connected to a single host and port.
+ */
+typedef struct Host {
+    char* name;
+    int port;
+    int* idle;
+    int count;
+
+    struct Host* next;
+} Host;
+
+/*
+ * ConnectionPool - a thread safe store of idle sockets, keyed by host and
+ * port. The lock is only held while a socket is taken or returned.
+ */
+typedef struct ConnectionPoolStruct {
+    Host* hosts;
+    int max_idle;
+    Timeouts timeouts;
+
+    pthread_mutex_t mutex;
+} ConnectionPool;
+
+static const Timeouts default_timeouts = {
+    .connect = CONNECT_TIMEOUT,
+    .first_byte = FIRST_BYTE_TIMEOUT,
+    .idle = IDLE_TIMEOUT,
+};
+
+/**
+ * Allocate an empty connection pool
+ * @param max_idle - The maximum number of idle sockets to keep per host
+ * @param timeouts - The timeouts of exchanges over the pool's connections,
+ *                   or NULL for the defaults
+ * @return pool - Pointer to the allocated pool
+ */
+ConnectionPool* connection_pool_alloc(int max_idle,
+                                      const Timeouts* timeouts) {
+    ConnectionPool* pool = malloc(sizeof(ConnectionPool));
+    pool->hosts = NULL;
+    pool->max_idle = max_idle;
+    pool->timeouts = timeouts ? *timeouts : default_timeouts;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    return pool;
+}
+
+/**
+ * The timeouts of exchanges over a pool's connections
+ * @param pool - Pointer to the pool, or NULL
+ * @return timeouts - The pool's timeouts, or the defaults if pool is NULL
+ */
+const Timeouts* connection_pool_timeouts(const ConnectionPool* pool) {
+    return pool ? &pool->timeouts : &default_timeouts;
+}
+
+/**
+ * Close every idle socket in the pool and free it
+ * @param pool - Pointer to the pool to free
+ */
+void connection_pool_free(ConnectionPool* pool) {
+    Host* host = pool->hosts;
+    while (host) {
+        Host* next = host->next;
+        for (int i = 0; i < host->count; i++) {
+            close(host->idle[i]);
+        }
+        free(host->idle);
+        free(host->name);
+        free(host);
+        host = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/**
+ * @brief Finds the entry for host:port, creating it if it does not exist.
+ * The pool's lock must be held.
+ *
+ * @param pool
+ * @param name The host name.
+ * @param port The port.
+ * @return Host* The entry for host:port.
+ */
+Host* find_host(ConnectionPool* pool, const char* name, int port) {
+    for (Host* host = pool->hosts; host; host = host->next) {
+        if (host->port == port && strcmp(host->name, name) == 0) {
+            return host;
+        }
+    }
+
+    Host* host = malloc(sizeof(Host));
+    host->name = strdup(name);
+    host->port = port;
+    host->idle = malloc(sizeof(int) * pool->max_idle);
+    host->count = 0;
+    host->next = pool->hosts;
+    pool->hosts = host;
+    return host;
+}
+
+/**
+ * @brief Checks whether an idle socket is still usable. An idle socket
+ * should have nothing to read, so if it is readable the server has either
+ * closed it or sent data that belongs to no request.
+ *
+ * @param sockfd The idle socket.
+ * @return true The socket can be reused.
+ * @return false The socket should be closed.
+ */
+bool is_alive(int sockfd) {
+    struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * Check an idle socket connected to host:port out of the pool. Sockets
+ * which the server has since closed are discarded rather than returned.
+ * @param pool - Pointer to the pool
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @return sockfd - A connected socket, or -1 if there is no idle socket
+ */
+int connection_pool_get(ConnectionPool* pool, const char* host, int port) {
+    int sockfd = -1;
+
+    pthread_mutex_lock(&pool->mutex);
+    Host* entry = find_host(pool, host, port);
+    while (sockfd == -1 && entry->count > 0) {
+        // The most recently used socket is the least likely to have timed
+        // out on the server.
+        sockfd = entry->idle[--entry->count];
+        if (!is_alive(sockfd)) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return sockfd;
+}
+
+/**
+ * Return a socket to the pool once a response has been read from it in
+ * full. The socket is closed instead if the host already has `max_idle`
+ * idle sockets.
+ * @param pool - Pointer to the pool
+ * @param host - The host name the socket is connected to
+ * @param port - The port the socket is connected to
+ * @param sockfd - The socket to return
+ */
+void connection_pool_put(ConnectionPool* pool, const char* host, int port,
+                         int sockfd) {
+    pthread_mutex_lock(&pool->mutex);
+    Host* entry = find_host(pool, host, port);
+    if (entry->count < pool->max_idle) {
+        entry->idle[entry->count++] = sockfd;
+        sockfd = -1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Closes every attempt but the one that succeeded.
+ *
+ * @param connector
+ * @param winner The index of the attempt that succeeded.
+ * @return int The winning socket.
+ */
+static int connector_win(Connector* connector, int winner) {
+    int sockfd = connector->attempts[winner];
+    connector->attempts[winner] = -1;
+    connector_cancel(connector);
+    trace_end(TRACE_CONNECT, connector->traced, 0);
+    return sockfd;
+}
+
+/**
+ * Start connecting to a list of addresses. Every attempt is made with a
+ * non-blocking socket.
+ * @param connector - The connector to start
+ * @param addresses - The addresses to connect to, in order
+ * @param timeout - The seconds to wait for a connection before giving up
+ */
+void connector_start(Connector* connector, const AddressList* addresses,
+                     double timeout) {
+    connector->addresses = *addresses;
+    connector->next = 0;
+    connector->next_attempt = 0;
+    connector->deadline = now() + timeout;
+    connector->traced = trace_begin();
+    for (int i = 0; i < MAX_ADDRESSES; i++) {
+        connector->attempts[i] = -1;
+    }
+}
+
+/**
+ * Check the attempts in progress without blocking, and start the next one
+ * if it is due, or if every attempt so far has failed
+ * @param connector - The connector
+ * @return sockfd - The connected, non-blocking socket, once an attempt
+ *                  succeeds, CONNECT_PENDING while attempts are in progress,
+ *                  or -1 once every address has failed or the timeout has
+ *                  passed
+ */
+int connector_step(Connector* connector) {
+    int in_progress = 0;
+
+    for (int i = 0; i < connector->next; i++) {
+        int sockfd = connector->attempts[i];
+        if (sockfd == -1) {
+            continue;
+        }
+
+        struct pollfd pfd = {.fd = sockfd, .events = POLLOUT};
+        if (poll(&pfd, 1, 0) == 0) {
+            in_progress++;
+            continue;
+        }
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+            error == 0) {
+            return connector_win(connector, i);
+        }
+
+        // A failed attempt makes way for the next straight away
+        close(sockfd);
+        connector->attempts[i] = -1;
+        connector->next_attempt = 0;
+    }
+
+    // Start the next attempt if it is due, or straight away if there is
+    // nothing left to wait for
+    while (connector->next < connector->addresses.count &&
+           (in_progress == 0 || now() >= connector->next_attempt)) {
+        int i = connector->next++;
+        struct sockaddr* address =
+            (struct sockaddr*) &connector->addresses.addresses[i];
+
+        int sockfd =
+            socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (sockfd == -1) {
+            continue;
+        }
+
+        connector->attempts[i] = sockfd;
+        connector->next_attempt = now() + CONNECT_ATTEMPT_DELAY;
+
+        if (connect(sockfd, address, connector->addresses.lengths[i]) == 0) {
+            return connector_win(connector, i);
+        } else if (errno == EINPROGRESS) {
+            in_progress++;
+            break;
+        }
+        close(sockfd);
+        connector->attempts[i] = -1;
+        connector->next_attempt = 0;
+    }
+
+    if (in_progress > 0 && now() >= connector->deadline) {
+        fprintf(stderr, "timed out connecting\n");
+        connector_cancel(connector);
+        return -1;
+    }
+    return in_progress > 0 ? CONNECT_PENDING : -1;
+}
+
+/**
+ * The sockets of the attempts in progress, which become writable when an
+ * attempt succeeds or fails
+ * @param connector - The connector
+ * @param sockets - Filled in with up to MAX_ADDRESSES sockets
+ * @return int - The number of sockets
+ */
+int connector_sockets(const Connector* connector, int* sockets) {
+    int count = 0;
+    for (int i = 0; i < connector->next; i++) {
+        if (connector->attempts[i] != -1) {
+            sockets[count++] = connector->attempts[i];
+        }
+    }
+    return count;
+}
+
+/**
+ * How long until the next attempt is due to start, or the attempts time out
+ * @param connector - The connector
+ * @return int - The number of milliseconds
+ */
+int connector_timeout(const Connector* connector) {
+    double due = connector->deadline;
+    if (connector->next < connector->addresses.count &&
+        connector->next_attempt < due) {
+        due = connector->next_attempt;
+    }
+
+    double left = due - now();
+    return left > 0 ? (int) (left * 1000) + 1 : 0;
+}
+
+/**
+ * Stop every attempt in progress, closing their sockets
+ * @param connector - The connector
+ */
+void connector_cancel(Connector* connector) {
+    for (int i = 0; i < connector->next; i++) {
+        if (connector->attempts[i] != -1) {
+            close(connector->attempts[i]);
+            connector->attempts[i] = -1;
+        }
+    }
+}
+
+/**
+ * Connect to host:port, looking it up in `resolver`, and racing its
+ * addresses with a Connector
+ * @param resolver - The resolver to look the host up in, or NULL to resolve
+ *                   it without a cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param nonblocking - true for a non-blocking socket
+ * @param timeout - The seconds to wait for a connection before giving up
+ * @return sockfd - The connected socket, or -1 on failure
+ */
+int connect_host(Resolver* resolver, const char* host, int port,
+                 bool nonblocking, double timeout) {
+    AddressList addresses;
+    if (resolver_lookup(resolver, host, port, &addresses) == -1) {
+        return -1;
+    }
+
+    Connector connector;
+    connector_start(&connector, &addresses, timeout);
+
+    int sockfd;
+    while ((sockfd = connector_step(&connector)) == CONNECT_PENDING) {
+        struct pollfd pfds[MAX_ADDRESSES];
+        int sockets[MAX_ADDRESSES];
+        int count = connector_sockets(&connector, sockets);
+
+        for (int i = 0; i < count; i++) {
+            pfds[i] = (struct pollfd){.fd = sockets[i], .events = POLLOUT};
+        }
+        poll(pfds, count, connector_timeout(&connector));
+    }
+
+    if (sockfd == -1) {
+        fprintf(stderr, "ERROR: connect\n");
+        return -1;
+    }
+
+    int value = nonblocking;
+    if (sockfd != -1 && ioctl(sockfd, FIONBIO, &value) == -1) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    return sockfd;
+}
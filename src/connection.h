@@ -0,0 +1,167 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdbool.h>
+
+#include "resolver.h"
+#include "trace.h"
+
+// How long to wait for a connection attempt before racing the next address
+#define CONNECT_ATTEMPT_DELAY 0.25
+
+// What connector_step returns while the attempts are still in progress
+#define CONNECT_PENDING -2
+
+// The default timeouts, in seconds
+#define CONNECT_TIMEOUT 10.0
+#define FIRST_BYTE_TIMEOUT 30.0
+#define IDLE_TIMEOUT 30.0
+
+// How long each phase of an exchange may take before it is given up on, in
+// seconds
+typedef struct {
+    double connect;    // From the first attempt to connect to a connection
+    double first_byte; // From sending a request to the first response byte
+    double idle;       // Between one read of a response and the next
+} Timeouts;
+
+
+/*
+ * ConnectionPool - a thread safe store of idle, connected sockets, keyed by
+ * host and port, so that a persistent HTTP/1.1 connection can be reused by
+ * the next request to the same host instead of being closed.
+ */
+typedef struct ConnectionPoolStruct ConnectionPool;
+
+
+/*
+ * Connector - connects to the first of a list of addresses to answer, in
+ * the manner of Happy Eyeballs (RFC 8305). Addresses are tried in order,
+ * each attempt given CONNECT_ATTEMPT_DELAY to succeed before the next is
+ * started alongside it, so that an unreachable address, or a broken address
+ * family, only delays the connection rather than failing it.
+ */
+typedef struct {
+    AddressList addresses;
+    int next;                    // The next address to try
+    int attempts[MAX_ADDRESSES]; // The socket for each address tried, or -1
+                                 // once that attempt has failed
+    double next_attempt;         // When to start the next attempt
+    double deadline;             // When to give up on every attempt
+    int64_t traced;              // When connecting started, for tracing
+} Connector;
+
+
+/**
+ * Allocate an empty connection pool
+ * @param max_idle - The maximum number of idle sockets to keep per host
+ * @param timeouts - The timeouts of exchanges over the pool's connections,
+ *                   or NULL for the defaults
+ * @return pool - Pointer to the allocated pool
+ */
+ConnectionPool *connection_pool_alloc(int max_idle, const Timeouts *timeouts);
+
+
+/**
+ * The timeouts of exchanges over a pool's connections
+ * @param pool - Pointer to the pool, or NULL
+ * @return timeouts - The pool's timeouts, or the defaults if pool is NULL
+ */
+const Timeouts *connection_pool_timeouts(const ConnectionPool *pool);
+
+
+/**
+ * Close every idle socket in the pool and free it
+ * @param pool - Pointer to the pool to free
+ */
+void connection_pool_free(ConnectionPool *pool);
+
+
+/**
+ * Check an idle socket connected to host:port out of the pool. Sockets
+ * which the server has since closed are discarded rather than returned.
+ * @param pool - Pointer to the pool
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @return sockfd - A connected socket, or -1 if there is no idle socket
+ */
+int connection_pool_get(ConnectionPool *pool, const char *host, int port);
+
+
+/**
+ * Return a socket to the pool once a response has been read from it in
+ * full. The socket is closed instead if the host already has `max_idle`
+ * idle sockets.
+ * @param pool - Pointer to the pool
+ * @param host - The host name the socket is connected to
+ * @param port - The port the socket is connected to
+ * @param sockfd - The socket to return
+ */
+void connection_pool_put(ConnectionPool *pool, const char *host, int port,
+                         int sockfd);
+
+
+/**
+ * Start connecting to a list of addresses. Every attempt is made with a
+ * non-blocking socket.
+ * @param connector - The connector to start
+ * @param addresses - The addresses to connect to, in order
+ * @param timeout - The seconds to wait for a connection before giving up
+ */
+void connector_start(Connector *connector, const AddressList *addresses,
+                     double timeout);
+
+
+/**
+ * Check the attempts in progress without blocking, and start the next one
+ * if it is due, or if every attempt so far has failed
+ * @param connector - The connector
+ * @return sockfd - The connected, non-blocking socket, once an attempt
+ *                  succeeds, CONNECT_PENDING while attempts are in progress,
+ *                  or -1 once every address has failed or the timeout has
+ *                  passed
+ */
+int connector_step(Connector *connector);
+
+
+/**
+ * The sockets of the attempts in progress, which become writable when an
+ * attempt succeeds or fails
+ * @param connector - The connector
+ * @param sockets - Filled in with up to MAX_ADDRESSES sockets
+ * @return int - The number of sockets
+ */
+int connector_sockets(const Connector *connector, int *sockets);
+
+
+/**
+ * How long until the next attempt is due to start, or the attempts time out
+ * @param connector - The connector
+ * @return int - The number of milliseconds
+ */
+int connector_timeout(const Connector *connector);
+
+
+/**
+ * Stop every attempt in progress, closing their sockets
+ * @param connector - The connector
+ */
+void connector_cancel(Connector *connector);
+
+
+/**
+ * Connect to host:port, looking it up in `resolver`, and racing its
+ * addresses with a Connector
+ * @param resolver - The resolver to look the host up in, or NULL to resolve
+ *                   it without a cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param nonblocking - true for a non-blocking socket
+ * @param timeout - The seconds to wait for a connection before giving up
+ * @return sockfd - The connected socket, or -1 on failure
+ */
+int connect_host(Resolver *resolver, const char *host, int port,
+                 bool nonblocking, double timeout);
+
+
+#endif
@@ -0,0 +1,1068 @@
+#include "digest.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIGEST_X86
+#endif
+
+// The CRC32C polynomial, bit reflected
+#define CRC32C_POLY 0x82f63b78
+
+// x^(2^n) mod the polynomial, for every bit of a 64-bit count of bytes
+// turned into a count of bits
+#define X2N_SIZE 67
+
+// The bytes of each of the three lanes the SSE4.2 CRC works on at once
+#define CRC_LANE 4096
+
+// How much of a file is read at a time to catch up on it
+#define CATCH_UP_SIZE (1024 * 1024)
+
+typedef uint32_t (*Crc32c)(uint32_t, const unsigned char*, size_t);
+typedef void (*Compress)(uint32_t*, const unsigned char*);
+
+static uint32_t crc_tables[8][256];
+static uint32_t x2n_table[X2N_SIZE];
+static uint32_t lane_shift[2]; // Moves a CRC past one and two lanes
+static Crc32c crc32c_impl;
+static Compress sha256_compress_impl;
+
+static const char* digest_names[] = {"crc32c", "sha-256", "md5"};
+static const size_t digest_sizes[] = {4, SHA256_SIZE, MD5_SIZE};
+
+// A range of a file
+typedef struct {
+    off_t start;
+    off_t end;
+} Span;
+
+struct OrderedDigestStruct {
+    int fd;
+    bool sha256_wanted;
+    bool md5_wanted;
+    Sha256 sha256;
+    Md5 md5;
+
+    off_t front;   // Everything before this has been hashed
+    bool busy;     // True while a thread is hashing at the front
+    bool failed;   // True if a range could not be read back
+    Span* written; // Ranges written after the front, sorted and merged
+    int count;
+    int capacity;
+    char* buffer; // CATCH_UP_SIZE bytes, to read ranges back into
+
+    pthread_mutex_t mutex;
+};
+
+/**
+ * @brief Multiplies two polynomials modulo the CRC32C polynomial, all bit
+ * reflected.
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+
+    for (uint32_t m = (uint32_t) 1 << 31; m; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/**
+ * @brief x^(n * 2^k) modulo the CRC32C polynomial, so x^(8n) for n bytes
+ * when k is 3.
+ */
+static uint32_t x2nmodp(uint64_t n, int k) {
+    uint32_t p = (uint32_t) 1 << 31; // x^0
+
+    while (n) {
+        if (n & 1) {
+            p = multmodp(x2n_table[k], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static uint32_t crc32c_table_driven(uint32_t crc, const unsigned char* data,
+                                    size_t length) {
+    crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Eight bytes at a time, a table per byte
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc_tables[7][word & 0xff] ^ crc_tables[6][(word >> 8) & 0xff] ^
+              crc_tables[5][(word >> 16) & 0xff] ^
+              crc_tables[4][(word >> 24) & 0xff] ^
+              crc_tables[3][(word >> 32) & 0xff] ^
+              crc_tables[2][(word >> 40) & 0xff] ^
+              crc_tables[1][(word >> 48) & 0xff] ^ crc_tables[0][word >> 56];
+    }
+#endif
+
+    for (; length > 0; data++, length--) {
+        crc = (crc >> 8) ^ crc_tables[0][(crc ^ *data) & 0xff];
+    }
+    return ~crc;
+}
+
+#ifdef DIGEST_X86
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t c = ~crc;
+
+    for (; length > 0 && ((uintptr_t) data & 7); data++, length--) {
+        c = _mm_crc32_u8(c, *data);
+    }
+
+    // The instruction takes three cycles, but a new one can start every
+    // cycle, so three lanes are worked on at once and then joined.
+    while (length >= 3 * CRC_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC_LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, data + i, 8);
+            memcpy(&w1, data + CRC_LANE + i, 8);
+            memcpy(&w2, data + 2 * CRC_LANE + i, 8);
+            c = _mm_crc32_u64(c, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c = multmodp(lane_shift[1], c) ^ multmodp(lane_shift[0], c1) ^ c2;
+        data += 3 * CRC_LANE;
+        length -= 3 * CRC_LANE;
+    }
+
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; length > 0; data++, length--) {
+        c = _mm_crc32_u8(c, *data);
+    }
+    return ~(uint32_t) c;
+}
+
+#endif
+
+/**
+ * Switch between the SSE4.2 and table driven CRC32C, for benchmarks and
+ * tests. Not safe to call while other threads are working out CRCs.
+ * @param hardware - true for SSE4.2, false for tables
+ * @return bool - true if switched, false if the CPU does not have SSE4.2
+ */
+bool crc32c_use_hardware(bool hardware) {
+    if (!hardware) {
+        crc32c_impl = crc32c_table_driven;
+        return true;
+    }
+#ifdef DIGEST_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+        return true;
+    }
+#endif
+    return false;
+}
+
+/**
+ * @brief Builds the tables, and chooses the fastest CRC32C and SHA-256 the
+ * CPU supports, before main runs so that no thread can see them change.
+ */
+__attribute__((constructor)) static void digest_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_tables[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t previous = crc_tables[k - 1][n];
+            crc_tables[k][n] =
+                (previous >> 8) ^ crc_tables[0][previous & 0xff];
+        }
+    }
+
+    uint32_t p = (uint32_t) 1 << 30; // x^1
+    for (int n = 0; n < X2N_SIZE; n++) {
+        x2n_table[n] = p;
+        p = multmodp(p, p);
+    }
+    lane_shift[0] = x2nmodp(CRC_LANE, 3);
+    lane_shift[1] = x2nmodp(2 * CRC_LANE, 3);
+
+#ifdef DIGEST_X86
+    __builtin_cpu_init();
+#endif
+    if (!crc32c_use_hardware(true)) {
+        crc32c_use_hardware(false);
+    }
+    if (!sha256_use_hardware(true)) {
+        sha256_use_hardware(false);
+    }
+}
+
+/**
+ * Continue a CRC32C with more bytes
+ * @param crc - The CRC32C of the bytes so far, or 0 to start
+ * @param data - The bytes
+ * @param length - The number of bytes
+ * @return uint32_t - The CRC32C of the bytes so far followed by `data`
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    return crc32c_impl(crc, data, length);
+}
+
+/**
+ * Combine the CRC32Cs of two consecutive blocks of bytes, without the bytes
+ * @param crc1 - The CRC32C of the first block
+ * @param crc2 - The CRC32C of the second block
+ * @param length2 - The length of the second block
+ * @return uint32_t - The CRC32C of the two blocks one after the other
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2) {
+    return multmodp(x2nmodp(length2, 3), crc1) ^ crc2;
+}
+
+static uint32_t load_be32(const unsigned char* bytes) {
+    return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 |
+           (uint32_t) bytes[2] << 8 | bytes[3];
+}
+
+static void store_be32(unsigned char* bytes, uint32_t value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+static uint32_t load_le32(const unsigned char* bytes) {
+    return (uint32_t) bytes[3] << 24 | (uint32_t) bytes[2] << 16 |
+           (uint32_t) bytes[1] << 8 | bytes[0];
+}
+
+static void store_le32(unsigned char* bytes, uint32_t value) {
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
+
+static uint32_t rotate_right(uint32_t value, int bits) {
+    return value >> bits | value << (32 - bits);
+}
+
+static uint32_t rotate_left(uint32_t value, int bits) {
+    return value << bits | value >> (32 - bits);
+}
+
+/**
+ * @brief Feeds bytes to a hash a 64 byte block at a time, keeping any
+ * partial block for next time.
+ */
+static void hash_blocks(uint32_t* state, uint64_t* hashed,
+                        unsigned char* block, const unsigned char* data,
+                        size_t length,
+                        void (*compress)(uint32_t*, const unsigned char*)) {
+    size_t held = *hashed % 64;
+    *hashed += length;
+
+    if (held > 0) {
+        size_t bytes = length < 64 - held ? length : 64 - held;
+        memcpy(block + held, data, bytes);
+        data += bytes;
+        length -= bytes;
+        if (held + bytes < 64) {
+            return;
+        }
+        compress(state, block);
+    }
+
+    for (; length >= 64; data += 64, length -= 64) {
+        compress(state, data);
+    }
+    memcpy(block, data, length);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_compress(uint32_t* state, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = load_be32(block + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^
+                      rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^
+                      rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 =
+            rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + sha256_k[i] + w[i];
+        uint32_t s0 =
+            rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + s0 + majority;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+#ifdef DIGEST_X86
+
+/**
+ * @brief Compresses a block with the SHA extensions, which do two rounds
+ * per instruction and work out the message schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1"))) static void
+sha256_compress_shani(uint32_t* state, const unsigned char* block) {
+    const __m128i byte_swap =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i dcba = _mm_loadu_si128((const __m128i*) &state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i*) &state[4]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+    __m128i abef_start = abef;
+    __m128i cdgh_start = cdgh;
+
+    __m128i words[4];
+    for (int i = 0; i < 4; i++) {
+        words[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i*) (block + 16 * i)), byte_swap);
+    }
+
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; i++) {
+        __m128i schedule = _mm_add_epi32(
+            words[i % 4], _mm_loadu_si128((const __m128i*) &sha256_k[4 * i]));
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, schedule);
+        abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                     _mm_shuffle_epi32(schedule, 0x0e));
+
+        // The words four rounds of four on
+        if (i < 12) {
+            __m128i next =
+                _mm_sha256msg1_epu32(words[i % 4], words[(i + 1) % 4]);
+            next = _mm_add_epi32(
+                next,
+                _mm_alignr_epi8(words[(i + 3) % 4], words[(i + 2) % 4], 4));
+            words[i % 4] = _mm_sha256msg2_epu32(next, words[(i + 3) % 4]);
+        }
+    }
+
+    abef = _mm_add_epi32(abef, abef_start);
+    cdgh = _mm_add_epi32(cdgh, cdgh_start);
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#endif
+
+/**
+ * Switch between the SHA extensions and plain C for SHA-256, for benchmarks
+ * and tests. Not safe to call while other threads are hashing.
+ * @param hardware - true for the SHA extensions, false for plain C
+ * @return bool - true if switched, false if the CPU does not have them
+ */
+bool sha256_use_hardware(bool hardware) {
+    if (!hardware) {
+        sha256_compress_impl = sha256_compress;
+        return true;
+    }
+#ifdef DIGEST_X86
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_compress_impl = sha256_compress_shani;
+        return true;
+    }
+#endif
+    return false;
+}
+
+/**
+ * Start a SHA-256 hash
+ * @param sha - The hash to start
+ */
+void sha256_init(Sha256* sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+}
+
+/**
+ * Hash more bytes
+ * @param sha - The hash
+ * @param data - The bytes
+ * @param length - The number of bytes
+ */
+void sha256_update(Sha256* sha, const void* data, size_t length) {
+    hash_blocks(sha->state, &sha->length, sha->block, data, length,
+                sha256_compress_impl);
+}
+
+/**
+ * Finish a hash
+ * @param sha - The hash
+ * @param digest - Set to the SHA256_SIZE byte digest
+ */
+void sha256_final(Sha256* sha, unsigned char* digest) {
+    uint64_t bits = sha->length * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padding_length = 64 - (sha->length + 8) % 64;
+
+    for (int i = 0; i < 8; i++) {
+        padding[padding_length + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(sha, padding, padding_length + 8);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, sha->state[i]);
+    }
+}
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5_shifts[4][4] = {
+    {7, 12, 17, 22},
+    {5, 9, 14, 20},
+    {4, 11, 16, 23},
+    {6, 10, 15, 21},
+};
+
+static void md5_compress(uint32_t* state, const unsigned char* block) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = load_le32(block + 4 * i);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+    for (int i = 0; i < 64; i++) {
+        int round = i / 16;
+        uint32_t f;
+        int g;
+
+        switch (round) {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+                break;
+        }
+
+        uint32_t next = d;
+        d = c;
+        c = b;
+        b += rotate_left(a + f + md5_k[i] + m[g], md5_shifts[round][i % 4]);
+        a = next;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/**
+ * Start an MD5 hash
+ * @param md5 - The hash to start
+ */
+void md5_init(Md5* md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->length = 0;
+}
+
+/**
+ * Hash more bytes
+ * @param md5 - The hash
+ * @param data - The bytes
+ * @param length - The number of bytes
+ */
+void md5_update(Md5* md5, const void* data, size_t length) {
+    hash_blocks(md5->state, &md5->length, md5->block, data, length,
+                md5_compress);
+}
+
+/**
+ * Finish a hash
+ * @param md5 - The hash
+ * @param digest - Set to the MD5_SIZE byte digest
+ */
+void md5_final(Md5* md5, unsigned char* digest) {
+    uint64_t bits = md5->length * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padding_length = 64 - (md5->length + 8) % 64;
+
+    for (int i = 0; i < 8; i++) {
+        padding[padding_length + i] = bits >> (8 * i);
+    }
+    md5_update(md5, padding, padding_length + 8);
+
+    for (int i = 0; i < 4; i++) {
+        store_le32(digest + 4 * i, md5->state[i]);
+    }
+}
+
+/**
+ * The name of a digest, as in a Digest header e.g. "sha-256"
+ * @param type - The digest
+ * @return string - The name
+ */
+const char* digest_name(DigestType type) {
+    return digest_names[type];
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+/**
+ * @brief Decodes exactly `size` bytes from hex.
+ *
+ * @return int 0 on success, -1 if the text is not `size` bytes of hex.
+ */
+static int decode_hex(const char* text, size_t length, unsigned char* bytes,
+                      size_t size) {
+    if (length != size * 2) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        int high = hex_value(text[2 * i]);
+        int low = hex_value(text[2 * i + 1]);
+        if (high == -1 || low == -1) {
+            return -1;
+        }
+        bytes[i] = high << 4 | low;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes exactly `size` bytes from base64, with or without padding.
+ *
+ * @return int 0 on success, -1 if the text is not `size` bytes of base64.
+ */
+static int decode_base64(const char* text, size_t length,
+                         unsigned char* bytes, size_t size) {
+    uint32_t bits = 0;
+    int held = 0;
+    size_t decoded = 0;
+
+    while (length > 0 && text[length - 1] == '=') {
+        length--;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        int value = base64_value(text[i]);
+        if (value == -1) {
+            return -1;
+        }
+        bits = bits << 6 | value;
+        held += 6;
+        if (held >= 8) {
+            held -= 8;
+            if (decoded == size) {
+                return -1;
+            }
+            bytes[decoded++] = bits >> held;
+        }
+    }
+    return decoded == size ? 0 : -1;
+}
+
+/**
+ * Set a digest of a set from a hex or base64 value, e.g. from a Content-MD5
+ * header
+ * @param set - The set
+ * @param type - The digest
+ * @param value - The value, in hex or base64, which need not be terminated
+ * @param length - The length of the value
+ * @return int - 0 on success, -1 if the value is not a digest of that type
+ */
+int digest_set_value(DigestSet* set, DigestType type, const char* value,
+                     size_t length) {
+    // Structured field byte sequences are wrapped in colons
+    if (length >= 2 && value[0] == ':' && value[length - 1] == ':') {
+        value++;
+        length -= 2;
+    }
+
+    // Hex never has the padding that base64 of the same length would
+    size_t size = digest_sizes[type];
+    if (decode_hex(value, length, set->value[type], size) == -1 &&
+        decode_base64(value, length, set->value[type], size) == -1) {
+        return -1;
+    }
+    set->has[type] = true;
+    return 0;
+}
+
+/**
+ * Add the digests in a list of name=value pairs to a set, e.g. the value of
+ * a Digest header ("sha-256=X48E9q...=, crc32c=...") or the digests after a
+ * URL in the URL file ("sha-256=<hex> crc32c=<hex>"). Pairs may be separated
+ * by commas or spaces. Values may be hex or base64. Unknown digests are
+ * skipped.
+ * @param set - The set to add to
+ * @param list - The pairs, which need not be terminated
+ * @param length - The length of the list
+ * @return int - The number of digests added
+ */
+int digest_parse(DigestSet* set, const char* list, size_t length) {
+    int added = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        if (list[i] == ' ' || list[i] == '\t' || list[i] == ',') {
+            i++;
+            continue;
+        }
+
+        // Base64 values may end in '=', so a pair is split at its first one
+        size_t start = i;
+        while (i < length && list[i] != ' ' && list[i] != '\t' &&
+               list[i] != ',') {
+            i++;
+        }
+        const char* pair = list + start;
+        const char* equals = memchr(pair, '=', i - start);
+        if (equals == NULL) {
+            continue;
+        }
+
+        size_t name_length = equals - pair;
+        const char* value = equals + 1;
+        size_t value_length = list + i - value;
+
+        for (int type = 0; type < NUM_DIGESTS; type++) {
+            const char* name = digest_names[type];
+            bool named = (strlen(name) == name_length &&
+                          strncasecmp(pair, name, name_length) == 0) ||
+                         (type == DIGEST_SHA256 && name_length == 6 &&
+                          strncasecmp(pair, "sha256", 6) == 0);
+            if (named &&
+                digest_set_value(set, type, value, value_length) == 0) {
+                added++;
+            }
+        }
+    }
+    return added;
+}
+
+/**
+ * Set the CRC32C of a set
+ * @param set - The set
+ * @param crc - The CRC32C
+ */
+void digest_set_crc32c(DigestSet* set, uint32_t crc) {
+    store_be32(set->value[DIGEST_CRC32C], crc);
+    set->has[DIGEST_CRC32C] = true;
+}
+
+/**
+ * Format a digest of a set in lowercase hex
+ * @param set - The set
+ * @param type - The digest, which the set must have
+ * @param text - Set to the hex, at least DIGEST_TEXT_SIZE bytes
+ */
+void digest_format(const DigestSet* set, DigestType type, char* text) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < digest_sizes[type]; i++) {
+        text[2 * i] = hex[set->value[type][i] >> 4];
+        text[2 * i + 1] = hex[set->value[type][i] & 0xf];
+    }
+    text[2 * digest_sizes[type]] = '\0';
+}
+
+/**
+ * Add a range's CRC32C
+ * @param crcs - The CRCs, which start zeroed
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ * @param crc - The range's CRC32C
+ */
+void range_crcs_add(RangeCrcs* crcs, off_t start, off_t end, uint32_t crc) {
+    if (crcs->count == crcs->capacity) {
+        crcs->capacity = crcs->capacity ? crcs->capacity * 2 : 16;
+        crcs->ranges =
+            realloc(crcs->ranges, sizeof(RangeCrc) * crcs->capacity);
+    }
+    crcs->ranges[crcs->count++] = (RangeCrc){start, end, crc};
+}
+
+static int compare_ranges(const void* a, const void* b) {
+    off_t start_a = ((const RangeCrc*) a)->start;
+    off_t start_b = ((const RangeCrc*) b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * @brief Reads [start, end) of a file, continuing a CRC32C with it.
+ *
+ * @return int 0 on success, -1 if it could not all be read.
+ */
+static int read_crc(int fd, off_t start, off_t end, uint32_t* crc) {
+    char* buffer = malloc(CATCH_UP_SIZE);
+    int result = 0;
+
+    while (start < end) {
+        size_t length =
+            end - start < CATCH_UP_SIZE ? end - start : CATCH_UP_SIZE;
+        ssize_t got = pread(fd, buffer, length, start);
+        if (got <= 0) {
+            result = -1;
+            break;
+        }
+        *crc = crc32c(*crc, buffer, got);
+        start += got;
+    }
+
+    free(buffer);
+    return result;
+}
+
+/**
+ * Combine the ranges' CRCs into the CRC32C of the whole file. Parts that
+ * have no CRC, e.g. those written by an earlier run, are read from the file.
+ * @param crcs - The CRCs
+ * @param fd - The file, open for reading
+ * @param length - The length of the file
+ * @param crc - Set to the CRC32C of the file
+ * @return int - 0 on success, -1 if the ranges overlap or run past the end,
+ *               or a part could not be read
+ */
+int range_crcs_combine(RangeCrcs* crcs, int fd, off_t length, uint32_t* crc) {
+    off_t position = 0;
+    *crc = 0;
+
+    qsort(crcs->ranges, crcs->count, sizeof(RangeCrc), compare_ranges);
+
+    for (int i = 0; i < crcs->count; i++) {
+        RangeCrc* range = &crcs->ranges[i];
+        if (range->start < position || range->end > length) {
+            return -1;
+        }
+        if (range->start > position &&
+            read_crc(fd, position, range->start, crc) == -1) {
+            return -1;
+        }
+        *crc = crc32c_combine(*crc, range->crc, range->end - range->start);
+        position = range->end;
+    }
+
+    if (position < length && read_crc(fd, position, length, crc) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free the ranges' CRCs
+ * @param crcs - The CRCs
+ */
+void range_crcs_free(RangeCrcs* crcs) {
+    free(crcs->ranges);
+    crcs->ranges = NULL;
+    crcs->count = crcs->capacity = 0;
+}
+
+/**
+ * Start digests of a file which need to see its bytes in order
+ * @param fd - The file, open for reading, to catch up on ranges from
+ * @param sha256 - true to work out a SHA-256
+ * @param md5 - true to work out an MD5
+ * @return OrderedDigest* - The digests
+ */
+OrderedDigest* ordered_digest_alloc(int fd, bool sha256, bool md5) {
+    OrderedDigest* digest = calloc(1, sizeof(OrderedDigest));
+    digest->fd = fd;
+    digest->sha256_wanted = sha256;
+    digest->md5_wanted = md5;
+    sha256_init(&digest->sha256);
+    md5_init(&digest->md5);
+    pthread_mutex_init(&digest->mutex, NULL);
+    return digest;
+}
+
+static void hash(OrderedDigest* digest, const char* data, size_t length) {
+    if (digest->sha256_wanted) {
+        sha256_update(&digest->sha256, data, length);
+    }
+    if (digest->md5_wanted) {
+        md5_update(&digest->md5, data, length);
+    }
+}
+
+/**
+ * @brief Notes a range written after the front, merging it with the ranges
+ * it touches. Called with the mutex held.
+ */
+static void add_written(OrderedDigest* digest, off_t start, off_t end) {
+    int first = 0;
+    while (first < digest->count && digest->written[first].end < start) {
+        first++;
+    }
+
+    int last = first;
+    while (last < digest->count && digest->written[last].start <= end) {
+        if (digest->written[last].start < start) {
+            start = digest->written[last].start;
+        }
+        if (digest->written[last].end > end) {
+            end = digest->written[last].end;
+        }
+        last++;
+    }
+
+    if (digest->count == digest->capacity) {
+        digest->capacity = digest->capacity ? digest->capacity * 2 : 16;
+        digest->written =
+            realloc(digest->written, sizeof(Span) * digest->capacity);
+    }
+
+    // [first, last) become one range at first
+    memmove(&digest->written[first + 1], &digest->written[last],
+            sizeof(Span) * (digest->count - last));
+    digest->count += 1 - (last - first);
+    digest->written[first] = (Span){start, end};
+}
+
+/**
+ * @brief Reads back and hashes [start, end) of the file. Called by the busy
+ * thread, without the mutex.
+ */
+static void hash_from_file(OrderedDigest* digest, off_t start, off_t end) {
+    if (digest->buffer == NULL) {
+        digest->buffer = malloc(CATCH_UP_SIZE);
+    }
+
+    while (start < end) {
+        size_t length =
+            end - start < CATCH_UP_SIZE ? end - start : CATCH_UP_SIZE;
+        ssize_t got = pread(digest->fd, digest->buffer, length, start);
+        if (got <= 0) {
+            digest->failed = true;
+            return;
+        }
+        hash(digest, digest->buffer, got);
+        start += got;
+    }
+}
+
+/**
+ * @brief Hashes the ranges which the front has reached, moving the front
+ * past them, then stops being busy. Called by the busy thread, with the
+ * mutex held, which is let go while hashing.
+ */
+static void catch_up(OrderedDigest* digest) {
+    while (digest->count > 0 && digest->written[0].start <= digest->front) {
+        off_t start = digest->front;
+        off_t end = digest->written[0].end;
+        memmove(&digest->written[0], &digest->written[1],
+                sizeof(Span) * --digest->count);
+
+        if (end > start) {
+            pthread_mutex_unlock(&digest->mutex);
+            hash_from_file(digest, start, end);
+            pthread_mutex_lock(&digest->mutex);
+            digest->front = end;
+        }
+    }
+    digest->busy = false;
+}
+
+/**
+ * Hash bytes which have just been written to the file, if they are next in
+ * order, and otherwise note them to catch up on later. Safe to call from
+ * several threads at once.
+ * @param digest - The digests
+ * @param data - The bytes
+ * @param length - The number of bytes
+ * @param offset - Where in the file the bytes were written
+ */
+void ordered_digest_write(OrderedDigest* digest, const char* data,
+                          size_t length, off_t offset) {
+    pthread_mutex_lock(&digest->mutex);
+
+    if (!digest->busy && offset == digest->front) {
+        // Hashed straight from the receive buffer, without the mutex, which
+        // only one thread at a time may do
+        digest->busy = true;
+        pthread_mutex_unlock(&digest->mutex);
+        hash(digest, data, length);
+        pthread_mutex_lock(&digest->mutex);
+        digest->front += length;
+        catch_up(digest);
+    } else {
+        add_written(digest, offset, offset + length);
+        if (!digest->busy && digest->written[0].start <= digest->front) {
+            digest->busy = true;
+            catch_up(digest);
+        }
+    }
+
+    pthread_mutex_unlock(&digest->mutex);
+}
+
+/**
+ * Note a range which is already in the file, e.g. written by an earlier run,
+ * to be read and hashed once the range is next in order
+ * @param digest - The digests
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ */
+void ordered_digest_written(OrderedDigest* digest, off_t start, off_t end) {
+    pthread_mutex_lock(&digest->mutex);
+    add_written(digest, start, end);
+    pthread_mutex_unlock(&digest->mutex);
+}
+
+/**
+ * Finish the digests, once every byte of the file has been written
+ * @param digest - The digests
+ * @param length - The length of the file
+ * @param set - The digests are added to the set
+ * @return int - 0 on success, -1 if bytes are missing, or could not be read
+ */
+int ordered_digest_final(OrderedDigest* digest, off_t length,
+                         DigestSet* set) {
+    pthread_mutex_lock(&digest->mutex);
+    digest->busy = true;
+    catch_up(digest);
+    bool complete = !digest->failed && digest->front == length;
+    pthread_mutex_unlock(&digest->mutex);
+
+    if (!complete) {
+        return -1;
+    }
+
+    if (digest->sha256_wanted) {
+        sha256_final(&digest->sha256, set->value[DIGEST_SHA256]);
+        set->has[DIGEST_SHA256] = true;
+    }
+    if (digest->md5_wanted) {
+        md5_final(&digest->md5, set->value[DIGEST_MD5]);
+        set->has[DIGEST_MD5] = true;
+    }
+    return 0;
+}
+
+/**
+ * Free the digests
+ * @param digest - The digests, or NULL
+ */
+void ordered_digest_free(OrderedDigest* digest) {
+    if (digest == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&digest->mutex);
+    free(digest->written);
+    free(digest->buffer);
+    free(digest);
+}
@@ -0,0 +1,293 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/*
+ * Digests for checking downloads while they stream in, rather than reading
+ * them back afterwards.
+ *
+ * CRC32C is worked out for each range as it is written, by whichever worker
+ * writes it, and the ranges' CRCs are combined once the download finishes.
+ * It uses the SSE4.2 crc32 instruction when the CPU has it, as SHA-256 uses
+ * the SHA extensions.
+ *
+ * SHA-256 and MD5 have to see the bytes in order, so an OrderedDigest hashes
+ * bytes as they are written at the front of what has been hashed so far, and
+ * catches up on ranges written further on, from the page cache, once the
+ * front reaches them.
+ */
+
+#define SHA256_SIZE 32
+#define MD5_SIZE 16
+#define DIGEST_MAX_SIZE SHA256_SIZE
+
+// Big enough for any digest in hex, and its terminator
+#define DIGEST_TEXT_SIZE (DIGEST_MAX_SIZE * 2 + 1)
+
+typedef enum {
+    DIGEST_CRC32C, // Stored big-endian, as in a Digest header
+    DIGEST_SHA256,
+    DIGEST_MD5,
+    NUM_DIGESTS,
+} DigestType;
+
+// Digests of a resource, e.g. those it is expected to have
+typedef struct {
+    bool has[NUM_DIGESTS];
+    unsigned char value[NUM_DIGESTS][DIGEST_MAX_SIZE];
+} DigestSet;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // The number of bytes hashed
+    unsigned char block[64];
+} Sha256;
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length; // The number of bytes hashed
+    unsigned char block[64];
+} Md5;
+
+// The CRC32C of a range of a file
+typedef struct {
+    off_t start;
+    off_t end;
+    uint32_t crc;
+} RangeCrc;
+
+// The CRC32Cs of the ranges of a file written so far, in any order
+typedef struct {
+    RangeCrc *ranges;
+    int count;
+    int capacity;
+} RangeCrcs;
+
+typedef struct OrderedDigestStruct OrderedDigest;
+
+
+/**
+ * Continue a CRC32C with more bytes
+ * @param crc - The CRC32C of the bytes so far, or 0 to start
+ * @param data - The bytes
+ * @param length - The number of bytes
+ * @return uint32_t - The CRC32C of the bytes so far followed by `data`
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+
+/**
+ * Combine the CRC32Cs of two consecutive blocks of bytes, without the bytes
+ * @param crc1 - The CRC32C of the first block
+ * @param crc2 - The CRC32C of the second block
+ * @param length2 - The length of the second block
+ * @return uint32_t - The CRC32C of the two blocks one after the other
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, off_t length2);
+
+
+/**
+ * Switch between the SSE4.2 and table driven CRC32C, for benchmarks and
+ * tests. Not safe to call while other threads are working out CRCs.
+ * @param hardware - true for SSE4.2, false for tables
+ * @return bool - true if switched, false if the CPU does not have SSE4.2
+ */
+bool crc32c_use_hardware(bool hardware);
+
+
+/**
+ * Switch between the SHA extensions and plain C for SHA-256, for benchmarks
+ * and tests. Not safe to call while other threads are hashing.
+ * @param hardware - true for the SHA extensions, false for plain C
+ * @return bool - true if switched, false if the CPU does not have them
+ */
+bool sha256_use_hardware(bool hardware);
+
+
+/**
+ * Start a SHA-256 hash
+ * @param sha - The hash to start
+ */
+void sha256_init(Sha256 *sha);
+
+
+/**
+ * Hash more bytes
+ * @param sha - The hash
+ * @param data - The bytes
+ * @param length - The number of bytes
+ */
+void sha256_update(Sha256 *sha, const void *data, size_t length);
+
+
+/**
+ * Finish a hash
+ * @param sha - The hash
+ * @param digest - Set to the SHA256_SIZE byte digest
+ */
+void sha256_final(Sha256 *sha, unsigned char *digest);
+
+
+/**
+ * Start an MD5 hash
+ * @param md5 - The hash to start
+ */
+void md5_init(Md5 *md5);
+
+
+/**
+ * Hash more bytes
+ * @param md5 - The hash
+ * @param data - The bytes
+ * @param length - The number of bytes
+ */
+void md5_update(Md5 *md5, const void *data, size_t length);
+
+
+/**
+ * Finish a hash
+ * @param md5 - The hash
+ * @param digest - Set to the MD5_SIZE byte digest
+ */
+void md5_final(Md5 *md5, unsigned char *digest);
+
+
+/**
+ * The name of a digest, as in a Digest header e.g. "sha-256"
+ * @param type - The digest
+ * @return string - The name
+ */
+const char *digest_name(DigestType type);
+
+
+/**
+ * Set a digest of a set from a hex or base64 value, e.g. from a Content-MD5
+ * header
+ * @param set - The set
+ * @param type - The digest
+ * @param value - The value, in hex or base64, which need not be terminated
+ * @param length - The length of the value
+ * @return int - 0 on success, -1 if the value is not a digest of that type
+ */
+int digest_set_value(DigestSet *set, DigestType type, const char *value,
+                     size_t length);
+
+
+/**
+ * Add the digests in a list of name=value pairs to a set, e.g. the value of
+ * a Digest header ("sha-256=X48E9q...=, crc32c=...") or the digests after a
+ * URL in the URL file ("sha-256=<hex> crc32c=<hex>"). Pairs may be separated
+ * by commas or spaces. Values may be hex or base64. Unknown digests are
+ * skipped.
+ * @param set - The set to add to
+ * @param list - The pairs, which need not be terminated
+ * @param length - The length of the list
+ * @return int - The number of digests added
+ */
+int digest_parse(DigestSet *set, const char *list, size_t length);
+
+
+/**
+ * Set the CRC32C of a set
+ * @param set - The set
+ * @param crc - The CRC32C
+ */
+void digest_set_crc32c(DigestSet *set, uint32_t crc);
+
+
+/**
+ * Format a digest of a set in lowercase hex
+ * @param set - The set
+ * @param type - The digest, which the set must have
+ * @param text - Set to the hex, at least DIGEST_TEXT_SIZE bytes
+ */
+void digest_format(const DigestSet *set, DigestType type, char *text);
+
+
+/**
+ * Add a range's CRC32C
+ * @param crcs - The CRCs, which start zeroed
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ * @param crc - The range's CRC32C
+ */
+void range_crcs_add(RangeCrcs *crcs, off_t start, off_t end, uint32_t crc);
+
+
+/**
+ * Combine the ranges' CRCs into the CRC32C of the whole file. Parts that
+ * have no CRC, e.g. those written by an earlier run, are read from the file.
+ * @param crcs - The CRCs
+ * @param fd - The file, open for reading
+ * @param length - The length of the file
+ * @param crc - Set to the CRC32C of the file
+ * @return int - 0 on success, -1 if the ranges overlap or run past the end,
+ *               or a part could not be read
+ */
+int range_crcs_combine(RangeCrcs *crcs, int fd, off_t length, uint32_t *crc);
+
+
+/**
+ * Free the ranges' CRCs
+ * @param crcs - The CRCs
+ */
+void range_crcs_free(RangeCrcs *crcs);
+
+
+/**
+ * Start digests of a file which need to see its bytes in order
+ * @param fd - The file, open for reading, to catch up on ranges from
+ * @param sha256 - true to work out a SHA-256
+ * @param md5 - true to work out an MD5
+ * @return OrderedDigest* - The digests
+ */
+OrderedDigest *ordered_digest_alloc(int fd, bool sha256, bool md5);
+
+
+/**
+ * Hash bytes which have just been written to the file, if they are next in
+ * order, and otherwise note them to catch up on later. Safe to call from
+ * several threads at once.
+ * @param digest - The digests
+ * @param data - The bytes
+ * @param length - The number of bytes
+ * @param offset - Where in the file the bytes were written
+ */
+void ordered_digest_write(OrderedDigest *digest, const char *data,
+                          size_t length, off_t offset);
+
+
+/**
+ * Note a range which is already in the file, e.g. written by an earlier run,
+ * to be read and hashed once the range is next in order
+ * @param digest - The digests
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ */
+void ordered_digest_written(OrderedDigest *digest, off_t start, off_t end);
+
+
+/**
+ * Finish the digests, once every byte of the file has been written
+ * @param digest - The digests
+ * @param length - The length of the file
+ * @param set - The digests are added to the set
+ * @return int - 0 on success, -1 if bytes are missing, or could not be read
+ */
+int ordered_digest_final(OrderedDigest *digest, off_t length,
+                         DigestSet *set);
+
+
+/**
+ * Free the digests
+ * @param digest - The digests, or NULL
+ */
+void ordered_digest_free(OrderedDigest *digest);
+
+
+#endif
@@ -1,34 +1,230 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "http.h"
+#include "journal.h"
+#include "limiter.h"
+#include "planner.h"
+#include "progress.h"
 #include "queue.h"
+#include "scheduler.h"
+#include "trace.h"
 #include <libgen.h>
 
-#define FILE_SIZE 256
-
-typedef struct {
+#define DEFAULT_MIN_CHUNK (256 * 1024)
+#define DEFAULT_MAX_CHUNK (64 * 1024 * 1024)
+
+// How often an idle worker looks for a slow range to split
+#define IDLE_POLL_MS 100
+
+// The most events an event loop handles per wait
+#define MAX_EVENTS 64
+
+// Added to a download's file name to name its journal
+#define JOURNAL_SUFFIX ".journal"
+
+// How many host names are resolved at once, and how long they are cached
+#define RESOLVER_THREADS 2
+#define DNS_TTL 60.0
+
+// How many times a failed task is retried, and how long to back off before
+// the first retry, doubling each time up to a limit, in seconds
+#define RETRY_ATTEMPTS 5
+#define RETRY_DELAY 0.5
+#define RETRY_MAX_DELAY 8.0
+
+// The most ranges asked for in one request
+#define MAX_BATCH 16
+
+// How connections are driven
+typedef enum {
+    ENGINE_THREADS, // A thread per connection, which blocks on it
+    ENGINE_EPOLL,   // A thread per CPU, each with many non-blocking
+                    // connections
+    ENGINE_URING,   // A thread per connection, which moves bodies from it
+                    // to their files through its own io_uring
+} Engine;
+
+typedef enum {
+    TASK_PROBE, // The first range, made to plan a download
+    TASK_RANGE, // A range of a download
+    TASK_BATCH, // Several small ranges of a download, asked for in one
+                // request
+} TaskType;
+
+// A host, with its port, that resources are downloaded from
+typedef struct Host {
+    char* name; // e.g. localhost:8080
+    int active; // Tasks handed out for the host that have not finished,
+                // updated atomically as workers may add to it
+    struct Host* next;
+} Host;
+
+// A resource being downloaded, shared by all of its tasks
+typedef struct Download {
     char* url;
-    int min_range;
-    int max_range;
-    Buffer* result;
+    Host* host;        // The host the download is made from
+    int id;            // The download's place in the URL file, for tracing
+    int progress;      // The download's slot in the progress counts, or -1
+    int fd;            // The destination file, once the download starts
+    bool created;      // True if the destination file was made by this run
+    ResourceInfo info; // Filled in by the download's probe
+    off_t next_offset; // The start of the part not yet handed to a task
+    off_t missing_end; // The end of the missing part next_offset is in
+    int remaining;     // The number of range tasks that have not finished,
+                       // updated atomically as workers may add to it
+
+    Journal* journal; // The ranges written so far, or NULL if the download
+                      // cannot be resumed
+    bool failed;      // True if a range could not be downloaded
+    bool changed;     // True if the resource changed part way through
+    int whole;        // Set once a range's response, holding all of the
+                      // resource, has been adopted, after which the other
+                      // ranges stop, updated atomically by the adopter
+    off_t fetched;    // The bytes of ranges recorded, which are written
+                      // again if a response holding all of it is adopted
+    bool unbatched;   // True once a batch came back without some of its
+                      // ranges, after which ranges are asked for alone
+
+    DigestSet expected;     // The digests the resource should have, from the
+                            // URL file or else its header
+    RangeCrcs crcs;         // The CRC32C of each range written
+    bool spliced;           // True if a range was spliced, leaving it
+                            // without a CRC
+    OrderedDigest* ordered; // The digests which need the bytes in order, or
+                            // NULL if none are wanted
+    bool mismatched;        // True if the digests were not as expected
+
+    struct Download* next; // The next download with ranges left to plan
+} Download;
+
+typedef struct Task {
+    TaskType type;
+    Download* download;
+    Transfer transfer;  // The range to download, for a TASK_RANGE
+    struct Task* parts; // The ranges of a TASK_BATCH, in order, linked by
+                        // `next`
+    ssize_t result;     // The number of bytes written, or -1 on failure
+
+    int64_t queued;  // When the task was handed out, for tracing
+    int64_t started; // When a worker started it
+
+    int attempts;       // The number of times the task has been retried
+    int64_t not_before; // When a retry may start, on the clock of
+                        // limiter_now, or 0
+    struct Task* next;  // The next task waiting to be retried
 } Task;
 
+typedef struct Context Context;
+
 typedef struct {
-    Queue* todo;
+    Context* context;
+    int id;
+
+    Task** current;       // The tasks being run, one per connection, whose
+                          // ranges others may split
+    int num_slots;        // The number of connections the worker drives
+    int first_connection; // The progress slot of its first connection, the
+                          // rest following on
+    Uring* uring;         // The worker's ring, for the uring engine, or NULL
+    pthread_mutex_t mutex;
+
+    pthread_t thread;
+} Worker;
+
+struct Context {
+    Scheduler* todo;
     Queue* done;
 
-    pthread_t* threads;
+    ConnectionPool* connections; // Idle connections, shared by every worker
+    Resolver* resolver;          // Resolved host names, shared likewise
+    Progress* progress;          // The bytes each connection has received
+    Limiter* limiter;            // Caps the rate ranges are read at, or NULL
+    bool uring;                  // True if workers move bodies through rings
+    bool splice;                 // True if bodies are spliced to their files
+
+    Worker* workers;
+    int num_workers;
+
+    off_t min_chunk;  // The smallest part of a range worth splitting off
+    int max_per_host; // The most tasks a host may have at once, or 0 for
+                      // no limit
+    int in_flight;   // Tasks not yet collected from `done`, updated
+                     // atomically
+
+    int wakeup; // An eventfd written to when tasks are submitted, which the
+                // epoll engine's workers wait on, or -1
+};
+
+/*
+ * The state of the main thread, which feeds tasks to the workers. Workers
+ * are kept busy across files: while the last ranges of one file are in
+ * flight, the next files are already being probed.
+ *
+ * Ranges are cut from a download one at a time as there is room for them,
+ * sized by the planner from the throughput seen so far. Once nothing is left
+ * to take, an idle worker takes over the second half of the range that looks
+ * like it will finish last.
+ *
+ * Each host may be limited to a number of tasks at once. Ranges are then
+ * cut from the first download whose host has room, and URLs whose hosts
+ * are busy wait to be probed while later URLs go ahead, so that many URLs
+ * on one host do not starve the others.
+ *
+ * A task that fails for a reason that may pass, such as a connection that
+ * was reset or went quiet, is retried after a backoff. A range is picked up
+ * from the last byte written, rather than from its start.
+ *
+ * The main thread only ever blocks collecting from `done`, so workers never
+ * stay blocked putting to it.
+ */
+typedef struct {
+    FILE* url_file;
+    const char* download_dir;
+    char* line;
+    size_t line_size;
+
+    Planner planner;
     int num_workers;
+    Resolver* resolver;
+    Progress* progress;
 
-} Context;
+    Download* planning; // Downloads with ranges left to hand out
+    Download* planning_tail;
+
+    int max_in_flight; // The most tasks to hand out ahead of the workers
+    int active;        // Downloads started but not yet finished
+    int max_active;    // The number of files which may be open at once
+    int max_per_host;  // The most tasks a host may have at once, or 0
+
+    Host* hosts;       // Every host downloaded from
+    Download* waiting; // Downloads whose hosts had no room to probe them yet
+    int num_waiting;
+    Task* retries;     // Failed tasks to try again, in the order they failed
+
+    bool sha256;  // True to work out the SHA-256 of every download
+    int failures; // The number of downloads which failed
+    off_t wasted; // Bytes received and then written again, or not at all,
+                  // as a server sent all of a resource for a range
+    int next_id;  // The id of the next download
+} Pipeline;
 
 void create_directory(const char* dir) {
     struct stat st = {0};
@@ -42,40 +238,723 @@ void create_directory(const char* dir) {
     }
 }
 
+Task* new_task(TaskType type, Download* download, off_t start, off_t end) {
+    Task* task = malloc(sizeof(Task));
+    task->type = type;
+    task->download = download;
+    task->result = -1;
+    task->queued = task->started = 0;
+    task->attempts = 0;
+    task->not_before = 0;
+    task->next = NULL;
+    task->parts = NULL;
+
+    transfer_init(&task->transfer, download->fd, start, end);
+
+    // Ranges of a download that may be resumed must all come from the same
+    // version of the resource
+    if (download->journal) {
+        task->transfer.if_range = http_validator(&download->info);
+    }
+    task->transfer.ordered = download->ordered;
+    task->transfer.progress_file = download->progress;
+    task->transfer.whole = &download->whole;
+
+    return task;
+}
+
+void free_task(Task* task) {
+    transfer_destroy(&task->transfer);
+    free(task);
+}
+
+Download* new_download(const char* url) {
+    Download* download = malloc(sizeof(Download));
+    download->url = strdup(url);
+    download->host = NULL;
+    download->id = -1;
+    download->progress = -1;
+    download->fd = -1;
+    download->created = false;
+    memset(&download->info, 0, sizeof(ResourceInfo));
+    download->next_offset = 0;
+    download->missing_end = 0;
+    download->remaining = 0;
+    download->journal = NULL;
+    download->failed = false;
+    download->changed = false;
+    download->whole = 0;
+    download->fetched = 0;
+    download->unbatched = false;
+    memset(&download->expected, 0, sizeof(DigestSet));
+    memset(&download->crcs, 0, sizeof(RangeCrcs));
+    download->spliced = false;
+    download->ordered = NULL;
+    download->mismatched = false;
+    download->next = NULL;
+
+    return download;
+}
+
+void free_download(Download* download) {
+    if (download->fd != -1) {
+        close(download->fd);
+    }
+
+    // Kept after a failure, so that the next run can pick up from it, unless
+    // what has been written cannot be used
+    if (download->journal) {
+        journal_close(download->journal, !download->failed ||
+                                              download->changed ||
+                                              download->mismatched);
+    }
+
+    range_crcs_free(&download->crcs);
+    ordered_digest_free(download->ordered);
+
+    free(download->url);
+    free(download);
+}
+
+/**
+ * @brief Finds the host a URL is on, adding it to the pipeline's hosts if it
+ * is new.
+ *
+ * @param pipeline
+ * @param url
+ * @return Host* The URL's host.
+ */
+Host* host_of(Pipeline* pipeline, const char* url) {
+    size_t length = strcspn(url, "/");
+
+    for (Host* host = pipeline->hosts; host; host = host->next) {
+        if (strncmp(host->name, url, length) == 0 &&
+            host->name[length] == '\0') {
+            return host;
+        }
+    }
+
+    Host* host = malloc(sizeof(Host));
+    host->name = strndup(url, length);
+    host->active = 0;
+    host->next = pipeline->hosts;
+    pipeline->hosts = host;
+    return host;
+}
+
+/**
+ * @brief Counts a task handed out for a host, unless the host already has
+ * as many as it may.
+ *
+ * @param host
+ * @param max_per_host The most tasks a host may have at once, or 0 for no
+ * limit.
+ * @return true The task was counted.
+ * @return false The host has no room for another task.
+ */
+bool claim_host(Host* host, int max_per_host) {
+    int active = __atomic_load_n(&host->active, __ATOMIC_SEQ_CST);
+    do {
+        if (max_per_host > 0 && active >= max_per_host) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&host->active, &active, active + 1,
+                                          false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+    return true;
+}
+
+/**
+ * @brief Uncounts a finished task from its host.
+ *
+ * @param host
+ */
+void release_host(Host* host) {
+    __atomic_sub_fetch(&host->active, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Called by an idle worker when there is no queued task to take.
+ * Splits the range being downloaded by another connection that looks like it
+ * will finish last, and returns a task for its second half, so that one slow
+ * connection does not hold up the end of a download. Ranges of downloads
+ * whose server does not accept ranges are never split, nor are those of
+ * downloads whose host has no room for another task.
+ *
+ * @param context
+ * @return Task* A task for the split off half, or NULL if no range is worth
+ * splitting.
+ */
+Task* steal_in_progress(Context* context) {
+    Worker* slowest = NULL;
+    int slowest_slot = 0;
+    double slowest_left = 0;
+
+    for (int i = 0; i < context->num_workers; i++) {
+        Worker* worker = &context->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+        for (int slot = 0; slot < worker->num_slots; slot++) {
+            Task* task = worker->current[slot];
+            double left = task && task->type == TASK_RANGE
+                              ? transfer_time_left(&task->transfer)
+                              : -1;
+
+            if (left > slowest_left) {
+                slowest = worker;
+                slowest_slot = slot;
+                slowest_left = left;
+            }
+        }
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    if (slowest == NULL) {
+        return NULL;
+    }
+
+    // The connection may have moved on since it was looked at, in which case
+    // its new range is split instead, if it is worth it.
+    Task* task = NULL;
+    off_t start, end;
+
+    pthread_mutex_lock(&slowest->mutex);
+    Task* victim = slowest->current[slowest_slot];
+    if (victim && victim->type == TASK_RANGE &&
+        victim->download->info.accept_ranges &&
+        claim_host(victim->download->host, context->max_per_host)) {
+        if (transfer_split(&victim->transfer, context->min_chunk, &start,
+                           &end) == 0) {
+            // Counted while the victim is still in flight, so neither count
+            // can be seen to reach zero early.
+            __atomic_add_fetch(&victim->download->remaining, 1,
+                               __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&context->in_flight, 1, __ATOMIC_SEQ_CST);
+            task = new_task(TASK_RANGE, victim->download, start, end);
+        } else {
+            release_host(victim->download->host);
+        }
+    }
+    pthread_mutex_unlock(&slowest->mutex);
+
+    return task;
+}
+
+/**
+ * @brief Readies the transfers of a task for a worker's connection. The
+ * ranges of a batch are chained, to be asked for in one request.
+ *
+ * @param task
+ * @param context
+ * @param connection The connection's slot in the progress counts.
+ * @param uring The worker's ring, or NULL.
+ * @return Transfer* The transfer to make, the first of a batch's.
+ */
+Transfer* ready_transfers(Task* task, Context* context, int connection,
+                          Uring* uring) {
+    // A task handed out is off the retry list, so only a batch's parts are
+    // linked by `next`
+    Task* first = task->type == TASK_BATCH ? task->parts : task;
+
+    for (Task* part = first; part; part = part->next) {
+        Transfer* transfer = &part->transfer;
+        transfer->progress = context->progress;
+        transfer->limiter = context->limiter;
+        transfer->uring = uring;
+        transfer->splice = context->splice;
+        transfer->connection = connection;
+        transfer->next = part->next ? &part->next->transfer : NULL;
+        transfer_begin(transfer);
+    }
+    return &first->transfer;
+}
+
+/**
+ * @brief Runs a task, once it is due if it is a retry. A range is published
+ * as the worker's current task while it downloads, so that idle workers can
+ * split it.
+ *
+ * @param worker
+ * @param task
+ * @param pool The worker's buffer pool.
+ */
+void run_task(Worker* worker, Task* task, BufferPool* pool) {
+    Context* context = worker->context;
+    Download* download = task->download;
+
+    limiter_wait(task->not_before > limiter_now() ? task->not_before : 0);
+    trace_context(download->id);
+    trace_end(TRACE_QUEUED, task->queued, 0);
+    int64_t traced = trace_begin();
+    progress_gauge(context->progress, PROGRESS_CONNECTIONS, 1);
+    Transfer* transfer = ready_transfers(task, context,
+                                         worker->first_connection,
+                                         worker->uring);
+
+    // A probe's range is too small to be worth splitting
+    if (task->type == TASK_PROBE) {
+        task->result = http_probe(download->url, &download->info, transfer,
+                                  pool, context->connections,
+                                  context->resolver);
+        trace_end(TRACE_PROBE, traced, task->result > 0 ? task->result : 0);
+        progress_gauge(context->progress, PROGRESS_CONNECTIONS, -1);
+        return;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->current[0] = task;
+    pthread_mutex_unlock(&worker->mutex);
+
+    task->result = http_url_to_file(download->url, transfer, pool,
+                                    context->connections, context->resolver);
+    trace_end(TRACE_RANGE, traced, task->result > 0 ? task->result : 0);
+    progress_gauge(context->progress, PROGRESS_CONNECTIONS, -1);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->current[0] = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+}
+
 void* worker_thread(void* arg) {
-    Context* context = (Context*) arg;
+    Worker* worker = (Worker*) arg;
+    Context* context = worker->context;
+    BufferPool* pool = buffer_pool_alloc();
+    trace_thread("worker", worker->id);
+
+    // Without a ring of its own, a worker reads and writes bodies itself
+    worker->uring = context->uring ? uring_alloc() : NULL;
+
+    while (true) {
+        Task* task = (Task*) scheduler_try_get(context->todo, worker->id);
+        if (task) {
+            progress_gauge(context->progress, PROGRESS_TODO, -1);
+        } else {
+            task = steal_in_progress(context);
+        }
+
+        if (task) {
+            run_task(worker, task, pool);
+            progress_gauge(context->progress, PROGRESS_DONE, 1);
+            queue_put(context->done, task);
+        } else if (!scheduler_wait(context->todo, IDLE_POLL_MS)) {
+            break;
+        }
+    }
+
+    uring_free(worker->uring);
+    buffer_pool_free(pool);
+    return NULL;
+}
+
+/*
+ * The state of a worker of the epoll engine: an event loop driving one
+ * exchange per slot, each for the task in the same slot of the worker's
+ * `current`.
+ */
+typedef struct {
+    Worker* worker;
+    BufferPool* pool;
+    int epoll_fd;
+
+    Exchange* exchanges;
+    int (*watched)[MAX_ADDRESSES]; // The sockets each slot has registered
+                                   // with epoll
+    int* num_watched;
+    int64_t* starts; // When each slot's task is due to start, if it is a
+                     // retry waiting for its backoff, or else 0
+    int active; // The number of slots in use
+} EventLoop;
+
+/**
+ * @brief Registers a slot's sockets with the event loop, for writability
+ * while connecting and sending the request, and readability after. Sockets
+ * the slot no longer waits on are unregistered.
+ *
+ * @param loop
+ * @param slot
+ */
+void watch_exchange(EventLoop* loop, int slot) {
+    Exchange* exchange = &loop->exchanges[slot];
+    int sockets[MAX_ADDRESSES];
+    int count = exchange_sockets(exchange, sockets);
+
+    // Sockets that have been closed have already left the epoll set, and
+    // these calls fail harmlessly.
+    for (int i = 0; i < loop->num_watched[slot]; i++) {
+        int watched = loop->watched[slot][i];
+        bool kept = false;
+        for (int j = 0; j < count; j++) {
+            kept |= sockets[j] == watched;
+        }
+        if (!kept) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watched, NULL);
+        }
+    }
+
+    struct epoll_event event = {
+        .events = exchange_wants_write(exchange) ? EPOLLOUT : EPOLLIN,
+        .data.u64 = slot + 1,
+    };
+    for (int i = 0; i < count; i++) {
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, sockets[i], &event) ==
+                -1 &&
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sockets[i], &event) ==
+                -1) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        loop->watched[slot][i] = sockets[i];
+    }
+    loop->num_watched[slot] = count;
+}
+
+/**
+ * @brief Ends the exchange in a slot, and hands its task back to the main
+ * thread.
+ *
+ * @param loop
+ * @param slot
+ */
+void end_exchange(EventLoop* loop, int slot) {
+    Worker* worker = loop->worker;
+    Task* task = worker->current[slot];
+    Download* download = task->download;
+    Exchange* exchange = &loop->exchanges[slot];
+
+    // The socket may go back to the connection pool, so it must not be left
+    // registered here.
+    for (int i = 0; i < loop->num_watched[slot]; i++) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->watched[slot][i], NULL);
+    }
+    loop->num_watched[slot] = 0;
+
+    trace_context(download->id);
+    task->result = exchange_finish(exchange);
+    trace_end(task->type == TASK_PROBE ? TRACE_PROBE : TRACE_RANGE,
+              task->started, task->result > 0 ? task->result : 0);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->current[slot] = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+
+    Progress* progress = worker->context->progress;
+    progress_gauge(progress, PROGRESS_CONNECTIONS, -1);
+    progress_gauge(progress, PROGRESS_DONE, 1);
+
+    loop->active--;
+    queue_put(worker->context->done, task);
+}
 
-    Task* task = (Task*) queue_get(context->todo);
-    char* range = (char*) malloc(1024 * sizeof(char));
+/**
+ * @brief Starts the exchange of the task in a slot.
+ *
+ * @param loop
+ * @param slot
+ */
+void start_exchange(EventLoop* loop, int slot) {
+    Worker* worker = loop->worker;
+    Task* task = worker->current[slot];
+    loop->starts[slot] = 0;
+
+    trace_context(task->download->id);
+    trace_end(TRACE_QUEUED, task->queued, 0);
+    task->started = trace_begin();
+
+    Context* context = worker->context;
+    Transfer* transfer = ready_transfers(
+        task, context, worker->first_connection + slot, NULL);
+    progress_gauge(context->progress, PROGRESS_CONNECTIONS, 1);
+
+    ResourceInfo* info =
+        task->type == TASK_PROBE ? &task->download->info : NULL;
+    if (exchange_start(&loop->exchanges[slot], task->download->url, transfer,
+                       info, loop->pool, context->connections,
+                       context->resolver) == EXCHANGE_FAILED) {
+        end_exchange(loop, slot);
+    } else {
+        watch_exchange(loop, slot);
+    }
+}
+
+/**
+ * @brief Puts a task in a free slot, and starts its exchange, unless it is
+ * a retry that is not yet due. A range is published in the worker's
+ * `current` while it downloads, so that idle workers can split it.
+ *
+ * @param loop
+ * @param task
+ */
+void begin_exchange(EventLoop* loop, Task* task) {
+    Worker* worker = loop->worker;
+    int slot = 0;
+    while (worker->current[slot] != NULL) {
+        slot++;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->current[slot] = task;
+    pthread_mutex_unlock(&worker->mutex);
+    loop->active++;
+
+    loop->starts[slot] = task->not_before;
+    if (task->not_before <= limiter_now()) {
+        start_exchange(loop, slot);
+    }
+}
+
+/**
+ * @brief Steps the exchange in a slot, ending it if it is finished, and
+ * otherwise updating the sockets it waits on.
+ *
+ * @param loop
+ * @param slot
+ */
+void step_exchange(EventLoop* loop, int slot) {
+    trace_context(loop->worker->current[slot]->download->id);
+    ExchangeState state = exchange_step(&loop->exchanges[slot]);
+
+    if (state == EXCHANGE_DONE || state == EXCHANGE_FAILED) {
+        end_exchange(loop, slot);
+    } else {
+        watch_exchange(loop, slot);
+    }
+}
+
+/**
+ * @brief Starts the retries which are due, and steps the exchanges which
+ * are not waiting on a socket: those whose host is being resolved, and
+ * those due to race another address, to read again, or to time out.
+ * Returns how long the loop may then wait for events.
+ *
+ * @param loop
+ * @return int The longest wait, in milliseconds.
+ */
+int step_waiting(EventLoop* loop) {
+    int timeout = IDLE_POLL_MS;
+
+    for (int slot = 0; slot < loop->worker->num_slots; slot++) {
+        Exchange* exchange = &loop->exchanges[slot];
+        if (loop->worker->current[slot] == NULL) {
+            continue;
+        }
+
+        if (loop->starts[slot]) {
+            int64_t wait = loop->starts[slot] - limiter_now();
+            if (wait > 0) {
+                int left = (wait + 999999) / 1000000;
+                timeout = left < timeout ? left : timeout;
+                continue;
+            }
+            start_exchange(loop, slot);
+            if (loop->worker->current[slot] == NULL) {
+                continue;
+            }
+        }
+
+        int left = exchange_timeout(exchange);
+        if (exchange->state == EXCHANGE_RESOLVING || left == 0) {
+            step_exchange(loop, slot);
+            left = loop->worker->current[slot] ? exchange_timeout(exchange)
+                                               : -1;
+        }
+        if (left >= 0 && left < timeout) {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * @brief The worker thread of the epoll engine. Rather than blocking on one
+ * connection, it drives up to `num_slots` at once, taking a task whenever a
+ * slot is free, and otherwise waiting for any of its sockets to be ready,
+ * for more tasks to be submitted, or for a host name to be resolved.
+ *
+ * @param arg The worker.
+ * @return void* NULL
+ */
+void* epoll_worker_thread(void* arg) {
+    Worker* worker = (Worker*) arg;
+    Context* context = worker->context;
+
+    EventLoop loop = {
+        .worker = worker,
+        .pool = buffer_pool_alloc(),
+        .epoll_fd = epoll_create1(0),
+        .exchanges = malloc(sizeof(Exchange) * worker->num_slots),
+        .watched = malloc(sizeof(*loop.watched) * worker->num_slots),
+        .num_watched = calloc(worker->num_slots, sizeof(int)),
+        .starts = calloc(worker->num_slots, sizeof(int64_t)),
+    };
+    trace_thread("worker", worker->id);
+
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event wakeup = {.events = EPOLLIN | EPOLLET, .data.u64 = 0};
+    if (loop.epoll_fd == -1 ||
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, context->wakeup, &wakeup) ==
+            -1) {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    double next_steal = 0;
 
-    while (task) {
-        snprintf(range, 1024 * sizeof(char), "%d-%d", task->min_range,
-                 task->max_range);
+    while (true) {
+        while (loop.active < worker->num_slots) {
+            Task* task = (Task*) scheduler_try_get(context->todo, worker->id);
+            if (task) {
+                progress_gauge(context->progress, PROGRESS_TODO, -1);
+            }
 
-        task->result = http_url(task->url, range);
+            // Like an idle thread, an idle slot only looks for a range to
+            // split every so often.
+            if (task == NULL && transfer_now() >= next_steal) {
+                task = steal_in_progress(context);
+                if (task == NULL) {
+                    next_steal = transfer_now() + IDLE_POLL_MS / 1000.0;
+                }
+            }
 
-        queue_put(context->done, task);
-        task = (Task*) queue_get(context->todo);
+            if (task == NULL) {
+                break;
+            }
+            begin_exchange(&loop, task);
+        }
+
+        if (loop.active == 0 && !scheduler_wait(context->todo, 0)) {
+            break;
+        }
+
+        int timeout = step_waiting(&loop);
+        int num_events =
+            epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+        if (num_events == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.u64 == 0) {
+                continue;
+            }
+
+            // Several of a slot's sockets may be ready at once, and the
+            // first may end its exchange.
+            int slot = events[i].data.u64 - 1;
+            if (worker->current[slot]) {
+                step_exchange(&loop, slot);
+            }
+        }
     }
 
-    free(range);
+    close(loop.epoll_fd);
+    free(loop.starts);
+    free(loop.num_watched);
+    free(loop.watched);
+    free(loop.exchanges);
+    buffer_pool_free(loop.pool);
     return NULL;
 }
 
-Context* spawn_workers(int num_workers) {
+/**
+ * @brief Wakes the epoll engine's workers, to take newly submitted tasks or
+ * to notice a shutdown. Does nothing for the threads engine, whose workers
+ * are woken by the scheduler.
+ *
+ * @param context
+ */
+void wake_workers(Context* context) {
+    uint64_t one = 1;
+    if (context->wakeup != -1 &&
+        write(context->wakeup, &one, sizeof(one)) == -1) {
+        perror("write");
+    }
+}
+
+/**
+ * @brief Starts the workers. The threads and uring engines have a worker per
+ * connection. The epoll engine spreads the connections over a worker per
+ * CPU. The uring engine falls back to the threads engine if io_uring is
+ * unavailable. Bodies are spliced to their files if asked, except by the
+ * uring engine, which has its own way of moving them.
+ *
+ * @param num_connections The number of connections to download over.
+ * @param min_chunk The smallest part of a range worth splitting off.
+ * @param rate The most bytes to read per second, or 0 for no limit.
+ * @param max_per_host The most tasks a host may have at once, or 0 for no
+ * limit.
+ * @param timeouts How long each phase of an exchange may take.
+ * @param engine How connections are driven.
+ * @param splice True to splice bodies from sockets to files.
+ * @return Context*
+ */
+Context* spawn_workers(int num_connections, off_t min_chunk, double rate,
+                       int max_per_host, const Timeouts* timeouts,
+                       Engine engine, bool splice) {
     Context* context = (Context*) malloc(sizeof(Context));
 
-    context->todo = queue_alloc(num_workers * 2);
-    context->done = queue_alloc(num_workers * 2);
+    int num_workers = num_connections;
+    void* (*thread)(void*) = worker_thread;
+    context->wakeup = -1;
+    context->uring = false;
+    context->splice = splice;
+
+    if (engine == ENGINE_URING) {
+        Uring* uring = uring_alloc();
+        context->uring = uring != NULL;
+        uring_free(uring);
+        if (!context->uring) {
+            fprintf(stderr, "io_uring is unavailable, using threads\n");
+        }
+    }
+
+    if (engine == ENGINE_EPOLL) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 && cpus < num_connections ? cpus
+                                                         : num_connections;
+        thread = epoll_worker_thread;
+
+        if ((context->wakeup = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("eventfd");
+            exit(1);
+        }
+    }
+
+    context->todo = scheduler_alloc(num_workers);
+    context->done = queue_alloc(num_connections * 2);
+    context->connections = connection_pool_alloc(num_connections, timeouts);
+    context->resolver =
+        resolver_alloc(RESOLVER_THREADS, DNS_TTL, context->wakeup);
+
+    // As many files may be open at once as there are connections
+    context->progress = progress_alloc(num_connections, num_connections);
+    context->limiter = rate > 0 ? limiter_alloc(rate) : NULL;
 
     context->num_workers = num_workers;
+    context->min_chunk = min_chunk;
+    context->max_per_host = max_per_host;
+    context->in_flight = 0;
 
-    context->threads = (pthread_t*) malloc(sizeof(pthread_t) * num_workers);
+    context->workers = (Worker*) malloc(sizeof(Worker) * num_workers);
     int i = 0;
+    int first_connection = 0;
 
     for (i = 0; i < num_workers; ++i) {
-        if (pthread_create(&context->threads[i], NULL, worker_thread,
-                           context) != 0) {
+        Worker* worker = &context->workers[i];
+        worker->context = context;
+        worker->id = i;
+        worker->num_slots = num_connections / num_workers +
+                            (i < num_connections % num_workers);
+        worker->first_connection = first_connection;
+        first_connection += worker->num_slots;
+        worker->current = calloc(worker->num_slots, sizeof(Task*));
+        worker->uring = NULL;
+        pthread_mutex_init(&worker->mutex, NULL);
+    }
+
+    for (i = 0; i < num_workers; ++i) {
+        if (pthread_create(&context->workers[i].thread, NULL, thread,
+                           &context->workers[i]) != 0) {
             perror("pthread_create");
             exit(1);
         }
@@ -88,231 +967,1187 @@ void free_workers(Context* context) {
     int num_workers = context->num_workers;
     int i = 0;
 
-    for (i = 0; i < num_workers; ++i) {
-        queue_put(context->todo, NULL);
-    }
+    scheduler_shutdown(context->todo);
+    wake_workers(context);
 
     for (i = 0; i < num_workers; ++i) {
-        if (pthread_join(context->threads[i], NULL) != 0) {
+        if (pthread_join(context->workers[i].thread, NULL) != 0) {
             perror("pthread_join");
             exit(1);
         }
     }
 
-    queue_free(context->todo);
+    for (i = 0; i < num_workers; ++i) {
+        pthread_mutex_destroy(&context->workers[i].mutex);
+        free(context->workers[i].current);
+    }
+
+    // The resolver's threads write to the wakeup eventfd, so are joined
+    // before it is closed
+    resolver_free(context->resolver);
+    if (context->wakeup != -1) {
+        close(context->wakeup);
+    }
+
+    scheduler_free(context->todo);
     queue_free(context->done);
+    connection_pool_free(context->connections);
+    progress_free(context->progress);
+    if (context->limiter) {
+        limiter_free(context->limiter);
+    }
 
-    free(context->threads);
+    free(context->workers);
     free(context);
 }
 
-Task* new_task(char* url, int min_range, int max_range) {
-    Task* task = malloc(sizeof(Task));
-    task->result = NULL;
-    task->url = malloc(strlen(url) + 1);
-    task->min_range = min_range;
-    task->max_range = max_range;
+/**
+ * @brief Replaces all instances of old_char in a string with new_char. This
+ * relies on the string being null terminated.
+ *
+ * @param str
+ * @param old_char
+ * @param new_char
+ */
+void replace_char(char* str, char old_char, char new_char) {
+    for (size_t i = 0; i < strlen(str); i++) {
+        if (str[i] == old_char) {
+            str[i] = new_char;
+        }
+    }
+}
 
-    strcpy(task->url, url);
+/**
+ * @brief Reserves `size` bytes of disk for the file, so that ranges can be
+ * written at their final offsets in any order without fragmenting the file
+ * or running out of space part way through. Falls back to extending the file
+ * with ftruncate on filesystems that do not support fallocate.
+ *
+ * @param fd The file to preallocate.
+ * @param size The number of bytes to reserve.
+ * @return int 0 on success, -1 if the space could not be reserved.
+ */
+int preallocate(int fd, off_t size) {
+    if (size <= 0 || fallocate(fd, 0, 0, size) == 0) {
+        return 0;
+    }
 
-    return task;
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        return ftruncate(fd, size);
+    }
+
+    perror("fallocate");
+    return -1;
 }
 
-void free_task(Task* task) {
+/**
+ * @brief Names the destination file for a URL: the URL with every '/'
+ * replaced by '_', in the download directory.
+ * NOTE: It is required that the returned name is freed.
+ *
+ * @param dest_dir The directory to create the file in.
+ * @param file_url The URL of the resource.
+ * @param suffix Added to the end of the name, e.g. JOURNAL_SUFFIX, or "".
+ * @return char* The file's name.
+ */
+char* destination_name(const char* dest_dir, const char* file_url,
+                       const char* suffix) {
+    char* dest_name;
+    if (asprintf(&dest_name, "%s/%s%s", dest_dir, file_url, suffix) == -1) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+
+    replace_char(dest_name + strlen(dest_dir) + 1, '/', '_');
+    return dest_name;
+}
 
-    if (task->result) {
-        free(task->result->data);
-        free(task->result);
+/**
+ * @brief Opens the destination file for a download, for its probe to write
+ * the first range into. What the file already holds is kept until the probe
+ * shows whether an earlier run's ranges can be picked up. It is opened for
+ * reading too, so that the download's digests can read back what they need.
+ *
+ * @param dest_name The file's name, from destination_name.
+ * @param created Set to true if the file was not already there.
+ * @return int The file descriptor of the destination file.
+ */
+int open_destination(const char* dest_name, bool* created) {
+    *created = access(dest_name, F_OK) == -1;
+    int fd = open(dest_name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "error writing to: %s\n", dest_name);
+        exit(EXIT_FAILURE);
     }
+    return fd;
+}
 
-    free(task->url);
-    free(task);
+/**
+ * @brief Readies a destination file for the rest of its download, once the
+ * probe has written the first range. Whatever else the file holds is
+ * dropped, unless it is being picked up, and the file is preallocated to
+ * the resource's content length so that every task can write its range in
+ * place.
+ *
+ * @param fd The destination file.
+ * @param kept The bytes at the start of the file to keep, or -1 for all.
+ * @param size The content length of the resource.
+ * @return int 0 on success, -1 if the file could not be cut down or its
+ * space reserved.
+ */
+int size_destination(int fd, off_t kept, off_t size) {
+    if (kept >= 0 && ftruncate(fd, kept) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    return preallocate(fd, size);
 }
 
-void wait_task(const char* download_dir, Context* context) {
-    char filename[FILE_SIZE], url_file[FILE_SIZE];
-    Task* task = (Task*) queue_get(context->done);
+/**
+ * @brief Moves a download on to the first part of it, at or after `from`,
+ * which has not been written. Only a download with a journal can have parts
+ * written before it was planned, by an earlier run.
+ *
+ * @param download
+ * @param from
+ * @return true A part is missing, which now starts at next_offset and ends
+ * at missing_end.
+ * @return false The rest of the download has been written.
+ */
+bool find_missing(Download* download, off_t from) {
+    off_t content_length = download->info.content_length;
+
+    if (download->journal) {
+        if (journal_next_missing(download->journal, from,
+                                 &download->next_offset,
+                                 &download->missing_end)) {
+            return true;
+        }
+    } else if (from < content_length) {
+        download->next_offset = from;
+        download->missing_end = content_length;
+        return true;
+    }
 
-    if (task->result) {
+    download->next_offset = content_length;
+    return false;
+}
 
-        snprintf(url_file, FILE_SIZE * sizeof(char), "%d", task->min_range);
-        size_t len = strlen(url_file);
-        for (int i = 0; i < len; ++i) {
-            if (url_file[i] == '/') {
-                url_file[i] = '|';
-            }
+/**
+ * @brief Takes a download off the planning list, so that no more of its
+ * ranges are handed out.
+ *
+ * @param pipeline
+ * @param download
+ */
+void unplan_download(Pipeline* pipeline, Download* download) {
+    Download* previous = NULL;
+    Download* current = pipeline->planning;
+    while (current && current != download) {
+        previous = current;
+        current = current->next;
+    }
+    if (current == NULL) {
+        return;
+    }
+
+    if (previous) {
+        previous->next = download->next;
+    } else {
+        pipeline->planning = download->next;
+    }
+    if (pipeline->planning_tail == download) {
+        pipeline->planning_tail = previous;
+    }
+    download->next = NULL;
+}
+
+/**
+ * @brief Hands out no more of a download's ranges.
+ *
+ * @param pipeline
+ * @param download
+ */
+void drop_ranges(Pipeline* pipeline, Download* download) {
+    unplan_download(pipeline, download);
+    download->next_offset = download->info.content_length;
+}
+
+/**
+ * @brief Cuts the next range from the first download on the planning list
+ * whose host has room for it, from the part of it that is missing. A
+ * download whose server does not accept ranges, or whose size is unknown,
+ * is fetched as a single range. A download one of whose ranges adopted a
+ * response holding all of it needs no more.
+ *
+ * A missing part smaller than a chunk, as those left scattered by an earlier
+ * run are, is batched with the missing parts after it, while they add up to
+ * no more than a chunk, so that they are asked for in one request.
+ *
+ * @param pipeline
+ * @return Task* The next range or batch, or NULL if no download has any left
+ * that can be handed out.
+ */
+Task* next_range(Pipeline* pipeline) {
+    Download* download = pipeline->planning;
+    while (download) {
+        Download* next = download->next;
+        if (__atomic_load_n(&download->whole, __ATOMIC_ACQUIRE)) {
+            drop_ranges(pipeline, download);
+        } else if (claim_host(download->host, pipeline->max_per_host)) {
+            break;
+        }
+        download = next;
+    }
+    if (download == NULL) {
+        return NULL;
+    }
+
+    off_t start = download->next_offset;
+    off_t end = download->missing_end;
+    off_t budget = 0; // What is left of a chunk for a batch
+
+    if (download->info.accept_ranges && download->info.content_length > 0) {
+        off_t size = planner_chunk_size(&pipeline->planner,
+                                      download->info.content_length,
+                                      pipeline->num_workers);
+        if (end - start > size) {
+            end = start + size;
+        } else if (!download->unbatched) {
+            budget = size - (end - start);
         }
+    } else if (download->info.content_length <= 0) {
+        end = -1;
+    }
 
-        snprintf(filename, FILE_SIZE, "%s/%s", download_dir, url_file);
-        FILE* fp = fopen(filename, "w");
+    bool more = end != -1 && find_missing(download, end);
+    __atomic_add_fetch(&download->remaining, 1, __ATOMIC_SEQ_CST);
+    Task* first = new_task(TASK_RANGE, download, start, end);
+    Task* last = first;
+    int count = 1;
+
+    while (more && count < MAX_BATCH &&
+           download->missing_end - download->next_offset <= budget) {
+        start = download->next_offset;
+        end = download->missing_end;
+        budget -= end - start;
+        more = find_missing(download, end);
+
+        __atomic_add_fetch(&download->remaining, 1, __ATOMIC_SEQ_CST);
+        last = last->next = new_task(TASK_RANGE, download, start, end);
+        count++;
+    }
 
-        if (fp == NULL) {
-            fprintf(stderr, "error writing to: %s\n", filename);
-            exit(EXIT_FAILURE);
+    if (end == -1) {
+        unplan_download(pipeline, download);
+        download->next_offset = -1;
+    } else if (!more) {
+        unplan_download(pipeline, download);
+    }
+
+    if (count == 1) {
+        return first;
+    }
+    Task* batch = new_task(TASK_BATCH, download, first->transfer.start, end);
+    batch->parts = first;
+    return batch;
+}
+
+/**
+ * @brief Starts a download whose host has room for its probe, opening its
+ * destination file for the probe to write into. The probe asks for the
+ * smallest range worth a request, so that the rest can be planned as soon
+ * as possible.
+ *
+ * @param pipeline
+ * @param download
+ * @return Task* The download's probe.
+ */
+Task* start_download(Pipeline* pipeline, Download* download) {
+    pipeline->active++;
+    download->progress =
+        progress_file_start(pipeline->progress, download->url);
+
+    char* dest_name =
+        destination_name(pipeline->download_dir, download->url, "");
+    download->fd = open_destination(dest_name, &download->created);
+    free(dest_name);
+
+    return new_task(TASK_PROBE, download, 0, pipeline->planner.min_chunk);
+}
+
+/**
+ * @brief Chooses the next task to queue. Retries, and then ranges of
+ * downloads that are under way, come first, so that they finish as soon as
+ * possible. Otherwise, as
+ * long as not too many files are already open, a download is probed: one
+ * read earlier whose host was busy, or else the next URL. URLs whose hosts
+ * are busy are put aside, up to as many as may be open at once.
+ *
+ * @param pipeline
+ * @return Task* The next task, or NULL if there is nothing to queue yet.
+ */
+Task* next_task(Pipeline* pipeline) {
+    Task** retry = &pipeline->retries;
+    while (*retry) {
+        Task* task = *retry;
+        if (claim_host(task->download->host, pipeline->max_per_host)) {
+            *retry = task->next;
+            task->next = NULL;
+            return task;
+        }
+        retry = &task->next;
+    }
+
+    Task* task = next_range(pipeline);
+    if (task || pipeline->active >= pipeline->max_active) {
+        return task;
+    }
+
+    Download** link = &pipeline->waiting;
+    while (*link) {
+        Download* download = *link;
+        if (claim_host(download->host, pipeline->max_per_host)) {
+            *link = download->next;
+            download->next = NULL;
+            pipeline->num_waiting--;
+            return start_download(pipeline, download);
         }
+        link = &download->next;
+    }
 
-        char* data = http_get_content(task->result);
-        if (data) {
-            size_t length = task->result->length - (data - task->result->data);
+    ssize_t len;
+    while (pipeline->url_file &&
+           pipeline->num_waiting < pipeline->max_active) {
+        len = getline(&pipeline->line, &pipeline->line_size,
+                      pipeline->url_file);
+        if (len == -1) {
+            fclose(pipeline->url_file);
+            pipeline->url_file = NULL;
+            break;
+        }
 
-            fwrite(data, 1, length, fp);
-            fclose(fp);
+        if (len > 0 && pipeline->line[len - 1] == '\n') {
+            pipeline->line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
 
-            printf("downloaded %d bytes from %s\n", (int) length, task->url);
-        } else {
-            printf("error in response from %s\n", task->url);
+        // The URL may be followed by the digests it is expected to have
+        char* digests = pipeline->line + strcspn(pipeline->line, " \t");
+        if (*digests) {
+            *digests++ = '\0';
         }
 
-    } else {
+        http_prefetch(pipeline->line, pipeline->resolver);
+        Download* download = new_download(pipeline->line);
+        download->host = host_of(pipeline, download->url);
+        download->id = pipeline->next_id++;
+        trace_name(download->id, download->url);
+        digest_parse(&download->expected, digests, strlen(digests));
 
-        fprintf(stderr, "error downloading: %s\n", task->url);
+        if (claim_host(download->host, pipeline->max_per_host)) {
+            return start_download(pipeline, download);
+        }
+
+        // `link` is left at the end of the waiting list
+        *link = download;
+        link = &download->next;
+        pipeline->num_waiting++;
     }
 
-    free_task(task);
+    return NULL;
 }
 
 /**
- * @brief Writes the source file to the destination file.
+ * @brief Hands out as many tasks as there is room for.
  *
- * @param dest_file The destination file.
- * @param src_name The name of the source file.
- * @param buffer The buffer to store the contents of the read file.
- * @param currentTask The current task number.
- * @param tasks The total number of tasks.
- * @return int 0 for no error, -1 for an error opening the file specified by
- * src_name.
+ * @param pipeline
+ * @param context
  */
-int write_to_dest(FILE* dest_file, char* src_name, char* buffer, int bytes,
-                  int currentTask, int tasks) {
-    FILE* src_file = fopen(src_name, "r");
+void fill_queue(Pipeline* pipeline, Context* context) {
+    Task* task;
+    bool submitted = false;
+
+    while (__atomic_load_n(&context->in_flight, __ATOMIC_SEQ_CST) <
+               pipeline->max_in_flight &&
+           (task = next_task(pipeline)) != NULL) {
+        __atomic_add_fetch(&context->in_flight, 1, __ATOMIC_SEQ_CST);
+        task->queued = trace_begin();
+        progress_gauge(context->progress, PROGRESS_TODO, 1);
+        scheduler_submit(context->todo, task);
+        submitted = true;
+    }
 
-    if (src_file == NULL) {
-        return -1;
+    if (submitted) {
+        wake_workers(context);
+    }
+}
+
+/**
+ * @brief Opens a journal for a download which can be resumed: one whose
+ * ranges can be asked for, and checked against the version of the resource
+ * they were first downloaded from. The journal's ranges are only picked up
+ * if the destination file they were written to is still there.
+ *
+ * @param pipeline
+ * @param download
+ * @param dest_name The name of the download's destination file.
+ * @return true Ranges were picked up from an earlier run.
+ * @return false The download starts from nothing.
+ */
+bool open_journal(Pipeline* pipeline, Download* download,
+                  const char* dest_name) {
+    ResourceInfo* info = &download->info;
+    bool resumed = false;
+
+    if (!info->accept_ranges || info->content_length <= 0 ||
+        http_validator(info) == NULL) {
+        return false;
+    }
+
+    char* journal_name = destination_name(pipeline->download_dir,
+                                          download->url, JOURNAL_SUFFIX);
+    if (download->created) {
+        remove(journal_name);
+    }
+
+    download->journal =
+        journal_open(journal_name, info->content_length, info->etag,
+                     info->last_modified, &resumed);
+    free(journal_name);
+
+    return resumed;
+}
+
+/**
+ * @brief Starts the digests of a download which need its bytes in order: a
+ * SHA-256 or MD5 which it is expected to have, or the SHA-256 of every
+ * download if asked for. Digests in the resource's header are only expected
+ * if the URL file gave none of the same type. Ranges written before the
+ * digests started, by the probe or by an earlier run, are read back once
+ * the digests reach them.
+ *
+ * @param pipeline
+ * @param download A download whose destination file is open, and whose
+ * journal, if it has one, includes the probe's range.
+ * @param probed The number of bytes the probe wrote.
+ */
+void start_digests(Pipeline* pipeline, Download* download, off_t probed) {
+    DigestSet* expected = &download->expected;
+    const DigestSet* header = &download->info.digests;
+
+    for (int type = 0; type < NUM_DIGESTS; type++) {
+        if (!expected->has[type] && header->has[type]) {
+            expected->has[type] = true;
+            memcpy(expected->value[type], header->value[type],
+                   DIGEST_MAX_SIZE);
+        }
     }
 
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFSIZ, src_file)) > 0) {
-        fwrite(buffer, bytes_read, 1, dest_file);
+    bool sha256 = pipeline->sha256 || expected->has[DIGEST_SHA256];
+    bool md5 = expected->has[DIGEST_MD5];
+    if (!sha256 && !md5) {
+        return;
+    }
+    download->ordered = ordered_digest_alloc(download->fd, sha256, md5);
+
+    if (download->journal) {
+        off_t content_length = download->info.content_length;
+        off_t from = 0, start, end;
+        while (journal_next_missing(download->journal, from, &start, &end)) {
+            if (start > from) {
+                ordered_digest_written(download->ordered, from, start);
+            }
+            from = end;
+        }
+        if (from < content_length) {
+            ordered_digest_written(download->ordered, from, content_length);
+        }
+    } else if (probed > 0) {
+        ordered_digest_written(download->ordered, 0, probed);
+    }
+}
+
+/**
+ * @brief Records the part of a range written so far in the download's
+ * journal and CRCs. A range that was spliced has no CRC.
+ *
+ * @param download
+ * @param transfer The range.
+ * @param end One past the last byte of the range written.
+ */
+void record_written(Download* download, Transfer* transfer, off_t end) {
+    if (download->journal) {
+        journal_record(download->journal, transfer->start, end);
+    }
+    download->fetched += end - transfer->start;
+    if (transfer->spliced) {
+        download->spliced = true;
+    } else {
+        range_crcs_add(&download->crcs, transfer->start, end, transfer->crc);
     }
+}
 
-    fclose(src_file);
-    remove(src_name);
+/**
+ * @brief Works out the digests of a download that has been written in full,
+ * combining the CRCs of its ranges, and checks them against those it is
+ * expected to have. A download which does not match has failed. Spliced
+ * ranges were never seen, so they are read back for the CRC32C, which is
+ * only worked out for them if it is expected.
+ *
+ * @param download
+ */
+void check_digests(Download* download) {
+    DigestSet actual = {{0}};
+    off_t length = download->info.content_length;
+    bool want_crc =
+        !download->spliced || download->expected.has[DIGEST_CRC32C];
+    uint32_t crc;
+
+    // A download of unknown length is a single range, which may have been
+    // spliced, so its length is that of the file
+    struct stat st;
+    if (length <= 0 && fstat(download->fd, &st) == 0) {
+        length = st.st_size;
+    }
+
+    if ((want_crc && range_crcs_combine(&download->crcs, download->fd, length,
+                                        &crc) == -1) ||
+        (download->ordered &&
+         ordered_digest_final(download->ordered, length, &actual) == -1)) {
+        fprintf(stderr, "could not work out digests of: %s\n",
+                download->url);
+        download->failed = true;
+        return;
+    }
+    if (want_crc) {
+        digest_set_crc32c(&actual, crc);
+    }
+
+    bool verified = false;
+    char text[DIGEST_TEXT_SIZE];
+    printf("digests of %s:", download->url);
+    for (int type = 0; type < NUM_DIGESTS; type++) {
+        if (actual.has[type]) {
+            digest_format(&actual, type, text);
+            printf(" %s=%s", digest_name(type), text);
+        }
+    }
+
+    for (int type = 0; type < NUM_DIGESTS; type++) {
+        if (!actual.has[type] || !download->expected.has[type]) {
+            continue;
+        }
+        if (memcmp(actual.value[type], download->expected.value[type],
+                   DIGEST_MAX_SIZE) == 0) {
+            verified = true;
+        } else {
+            download->mismatched = true;
+        }
+    }
+    const char* outcome = download->mismatched ? " (mismatch)"
+                          : verified           ? " (verified)"
+                                               : "";
+    printf("%s\n", outcome);
+
+    if (download->mismatched) {
+        download->failed = true;
+        for (int type = 0; type < NUM_DIGESTS; type++) {
+            if (actual.has[type] && download->expected.has[type]) {
+                digest_format(&download->expected, type, text);
+                fprintf(stderr, "digest mismatch: %s expected %s=%s\n",
+                        download->url, digest_name(type), text);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Plans the rest of a download whose probe has written its first
+ * range, readying its destination file and adding it to the planning list.
+ * If an earlier run left a journal for the same version of the resource,
+ * only what neither it nor the probe wrote is planned. A server which does
+ * not send ranges sent the probe all of the resource, as it did if the
+ * probe's range was the whole of it.
+ *
+ * @param pipeline
+ * @param download
+ * @param probe The probe's range.
+ * @param probed The number of bytes the probe wrote.
+ * @return int 0 on success, 1 if nothing more of it is needed, or -1 if the
+ * download cannot go ahead.
+ */
+int plan_download(Pipeline* pipeline, Download* download, Transfer* probe,
+                  off_t probed) {
+    const ResourceInfo* info = &download->info;
+    char* dest_name =
+        destination_name(pipeline->download_dir, download->url, "");
+    bool resumed = open_journal(pipeline, download, dest_name);
+
+    if (size_destination(download->fd, resumed ? -1 : probed,
+                         info->content_length) == -1) {
+        close(download->fd);
+        download->fd = -1;
+        remove(dest_name);
+        free(dest_name);
+        return -1;
+    }
+    free(dest_name);
+
+    download->missing_end = info->content_length;
+    progress_file_size(pipeline->progress, download->progress,
+                       info->content_length > 0 ? info->content_length : 0,
+                       resumed ? journal_completed(download->journal) : 0);
+    if (resumed) {
+        printf("resuming %s with %lld of %lld bytes\n", download->url,
+               (long long) journal_completed(download->journal),
+               (long long) info->content_length);
+    }
+    if (probed > 0) {
+        record_written(download, probe, probed);
+    }
+    start_digests(pipeline, download, probed);
+
+    // The rest of a resource of unknown size is one range, unless the probe
+    // came up short of its range, at the end of the resource
+    if (!info->accept_ranges) {
+        return 1;
+    } else if (info->content_length <= 0) {
+        if (probed < pipeline->planner.min_chunk) {
+            return 1;
+        }
+        download->next_offset = probed;
+    } else if (!find_missing(download, probed)) {
+        return 1;
+    }
+
+    if (pipeline->planning_tail) {
+        pipeline->planning_tail->next = download;
+    } else {
+        pipeline->planning = download;
+    }
+    pipeline->planning_tail = download;
     return 0;
 }
 
 /**
- * @brief Replaces all instances of old_char in a string with new_char. This
- * relies on the string being null terminated.
+ * @brief Whether a failed task is worth trying again. Errors the server
+ * says are the request's fault will not go away, nor will a change to the
+ * resource. A range of a download that cannot be resumed part way through
+ * is only retried if nothing of it was written.
  *
- * @param str
- * @param old_char
- * @param new_char
+ * @param task A task which has failed.
+ * @return true The task should be retried.
+ * @return false The task's download has failed.
  */
-void replace_char(char* str, char old_char, char new_char) {
-    for (size_t i = 0; i < strlen(str); i++) {
-        if (str[i] == old_char) {
-            str[i] = new_char;
+bool should_retry(const Task* task) {
+    const Transfer* transfer = &task->transfer;
+    const ResourceInfo* info = &task->download->info;
+    int status = transfer->status;
+
+    if (task->attempts >= RETRY_ATTEMPTS || task->download->failed ||
+        transfer->changed) {
+        return false;
+    }
+    if (status >= 400 && status < 500 && status != 408 && status != 429) {
+        return false;
+    }
+    return task->type == TASK_PROBE || transfer->completed == 0 ||
+           (info->accept_ranges && info->content_length > 0);
+}
+
+/**
+ * @brief Queues a failed task to be tried again, once it has backed off for
+ * a time that doubles with each attempt, with jitter so that connections
+ * which failed together do not retry together. What a range wrote before it
+ * failed is kept, and the retry asks for the rest.
+ *
+ * @param pipeline
+ * @param task A task which has failed, and should be retried.
+ * @param backoff False to retry the task straight away, as one whose
+ * request succeeded with some but not all of its range, which counts as no
+ * attempt.
+ */
+void retry_task(Pipeline* pipeline, Task* task, bool backoff) {
+    Download* download = task->download;
+    Transfer* transfer = &task->transfer;
+    off_t from = transfer->start + transfer->completed;
+    Task* retry;
+
+    if (task->type == TASK_PROBE) {
+        retry = new_task(TASK_PROBE, download, 0, pipeline->planner.min_chunk);
+    } else if (transfer->adopted) {
+        // A server which sent all of the resource for a range will send all
+        // of it again, so nothing written is kept
+        pipeline->wasted += transfer->completed;
+        from = 0;
+        retry = new_task(TASK_RANGE, download, 0, -1);
+        retry->transfer.adopted = true;
+        __atomic_add_fetch(&download->remaining, 1, __ATOMIC_SEQ_CST);
+    } else {
+        if (transfer->completed > 0) {
+            record_written(download, transfer, from);
+        }
+
+        // The range may have been finished by the write that failed
+        if (transfer->end >= 0 && from >= transfer->end) {
+            return;
         }
+        retry = new_task(TASK_RANGE, download, from, transfer->end);
+        __atomic_add_fetch(&download->remaining, 1, __ATOMIC_SEQ_CST);
+    }
+
+    double delay = RETRY_DELAY * (1 << task->attempts);
+    if (delay > RETRY_MAX_DELAY) {
+        delay = RETRY_MAX_DELAY;
+    }
+    delay *= backoff ? 0.5 + drand48() / 2 : 0;
+    retry->attempts = task->attempts + backoff;
+    retry->not_before = backoff ? limiter_now() + (int64_t) (delay * 1e9) : 0;
+
+    if (backoff) {
+        fprintf(stderr,
+                "retrying %s from %lld in %.1fs (attempt %d of %d)\n",
+                download->url, (long long) from, delay, retry->attempts,
+                RETRY_ATTEMPTS);
+    }
+
+    Task** link = &pipeline->retries;
+    while (*link) {
+        link = &(*link)->next;
     }
+    *link = retry;
 }
 
 /**
- * Merge all files in from src to file with name dest synchronously
- * by reading each file, and writing its contents to the dest file.
- * @param src_dir - char pointer to src directory holding files to merge.
- * @param file_url - char pointer to the name of the file's url.
- * @param bytes - The maximum byte size downloaded.
- * @param tasks - The tasks needed for the multipart download.
+ * @brief Reports a range that has been written, and feeds its throughput to
+ * the planner.
+ *
+ * @param pipeline
+ * @param task A task which has written its range.
  */
-void merge_files(char* src_dir, char* file_url, int bytes, int tasks) {
-    int dest_name_len = strlen(src_dir) + strlen(file_url) + 2;
-    char dest_name[dest_name_len];
+void report_range(Pipeline* pipeline, Task* task) {
+    printf("downloaded %lld bytes from %s\n", (long long) task->result,
+           task->download->url);
+    planner_record(&pipeline->planner, task->result,
+                   transfer_now() - task->transfer.started);
+}
 
-    replace_char(file_url, '/', '_');
-    snprintf(dest_name, dest_name_len, "%s/%s", src_dir, file_url);
+/**
+ * @brief Makes a range which adopted a response holding all of the resource
+ * the only one of its download. What its other ranges recorded has been
+ * written again, so it is wasted, and their CRCs give way to the range's.
+ *
+ * @param pipeline
+ * @param download
+ */
+void adopt_whole(Pipeline* pipeline, Download* download) {
+    fprintf(stderr, "server sent all of %s for a range\n", download->url);
+    pipeline->wasted += download->fetched;
+    download->fetched = 0;
+    range_crcs_free(&download->crcs);
+    download->spliced = false;
+    drop_ranges(pipeline, download);
+}
+
+/**
+ * @brief Finishes a download once all of it has been handed out and every
+ * range has finished: its digests are checked, and its file closed.
+ *
+ * @param pipeline
+ * @param download
+ * @param ended True if a range of the download was the last to finish.
+ * @return true The download was finished, and freed.
+ */
+bool end_download(Pipeline* pipeline, Download* download, bool ended) {
+    if (!ended) {
+        return false;
+    }
 
-    FILE* dest_file = fopen(dest_name, "w");
+    if (!download->failed && download->fd != -1) {
+        trace_context(download->id);
+        int64_t traced = trace_begin();
+        check_digests(download);
+        trace_end(TRACE_DIGEST, traced, download->info.content_length);
+        trace_context(-1);
+    }
+    pipeline->failures += download->failed;
+    progress_file_end(pipeline->progress, download->progress);
+    free_download(download);
+    pipeline->active--;
+    return true;
+}
 
-    if (dest_file == NULL) {
+/**
+ * @brief Handles a probe returned by a worker. A finished probe is reported,
+ * and has its download planned. A failed one is retried if it is worth it.
+ *
+ * @param pipeline
+ * @param task
+ */
+void finish_probe(Pipeline* pipeline, Task* task) {
+    Download* download = task->download;
+
+    if (task->result == -1 && should_retry(task)) {
+        retry_task(pipeline, task, true);
+        free_task(task);
         return;
     }
 
-    // The maximum amount of bytes required to represent the largest task
-    // number.
-    int max_bytes_len = snprintf(NULL, 0, "%d", bytes * tasks);
-    int src_name_len = strlen(src_dir) + max_bytes_len + 2;
-    char src_filename[src_name_len];
+    if (task->result > 0) {
+        report_range(pipeline, task);
+    }
+    int planned = task->result == -1
+                      ? -1
+                      : plan_download(pipeline, download, &task->transfer,
+                                      task->result);
+    if (planned == -1) {
+        download->failed = true;
+        fprintf(stderr, "error downloading: %s\n", download->url);
+    }
 
-    char buffer[BUFSIZ];
-    for (int i = 0; i < tasks; i++) {
-        int src_file_num = bytes * i;
-        snprintf(src_filename, src_name_len, "%s/%d", src_dir, src_file_num);
+    // A file made only for a probe that failed is not left behind
+    if (task->result == -1 && download->created) {
+        char* dest_name =
+            destination_name(pipeline->download_dir, download->url, "");
+        remove(dest_name);
+        free(dest_name);
+    }
 
-        if (write_to_dest(dest_file, src_filename, buffer, bytes, i, tasks) !=
-            0) {
+    end_download(pipeline, download, planned != 0);
+    free_task(task);
+}
+
+/**
+ * @brief Handles a range returned by a worker. A finished range is reported,
+ * unless it was part of a batch, and recorded; if the response brought only
+ * some of the range, as a batch's may, the rest is asked for again straight
+ * away. A failed range, or one of which the response brought nothing, is
+ * retried if it is worth it. A range which another
+ * range of its download has superseded, by adopting a response holding all
+ * of the resource, is dropped.
+ *
+ * @param pipeline
+ * @param task
+ * @param batched True if the range was asked for in a batch, which has been
+ * reported.
+ */
+void finish_range(Pipeline* pipeline, Task* task, bool batched) {
+    Download* download = task->download;
+    Transfer* transfer = &task->transfer;
+    bool superseded = !transfer->adopted &&
+                      __atomic_load_n(&download->whole, __ATOMIC_ACQUIRE);
+
+    // A response which brought none of a range it did not finish, as a
+    // server that keeps leaving the range out might send, is a failure, so
+    // that the range is only asked for so many times
+    bool partial = task->result >= 0 && transfer->end >= 0 &&
+                   transfer->start + task->result < transfer->end;
+    bool empty = partial && task->result == 0;
+
+    if (superseded) {
+        pipeline->wasted += transfer->completed;
+        drop_ranges(pipeline, download);
+    } else if (task->result >= 0 && !empty) {
+        if (!batched) {
+            report_range(pipeline, task);
+        }
+        if (transfer->adopted) {
+            adopt_whole(pipeline, download);
+        }
+        if (partial) {
+            retry_task(pipeline, task, false);
+        } else {
+            record_written(download, transfer,
+                           transfer->start + task->result);
+        }
+    } else if (should_retry(task)) {
+        retry_task(pipeline, task, true);
+    } else if (transfer->changed) {
+        // What has been written is of another version, so the rest of the
+        // download is abandoned, along with its journal
+        download->failed = download->changed = true;
+        drop_ranges(pipeline, download);
+        fprintf(stderr, "changed while downloading: %s\n", download->url);
+    } else {
+        download->failed = true;
+        fprintf(stderr, "error downloading: %s\n", download->url);
+    }
+
+    // A download is only finished once all of it has been handed out.
+    end_download(pipeline, download,
+                 __atomic_sub_fetch(&download->remaining, 1,
+                                    __ATOMIC_SEQ_CST) == 0 &&
+                     (download->next_offset == -1 ||
+                      download->next_offset >=
+                          download->info.content_length));
+    free_task(task);
+}
+
+/**
+ * @brief Handles a batch returned by a worker. The batch is reported as one
+ * range, and then each of its ranges is handled as if it had been asked for
+ * alone, with what the response wrote of it, or the response's failure. A
+ * server may answer with only some of the ranges, or with all of them
+ * merged into one, and the ranges it left out are asked for again, alone,
+ * as are any more of the download's.
+ *
+ * @param pipeline
+ * @param batch
+ */
+void finish_batch(Pipeline* pipeline, Task* batch) {
+    Download* download = batch->download;
+    const Transfer* first = &batch->parts->transfer;
+    bool whole = __atomic_load_n(&download->whole, __ATOMIC_ACQUIRE);
+
+    if (batch->result >= 0) {
+        printf("downloaded %lld bytes in ranges from %s\n",
+               (long long) batch->result, download->url);
+        planner_record(&pipeline->planner, batch->result,
+                       transfer_now() - first->started);
+    }
+
+    // Only the first range hears about the response
+    for (Task* part = batch->parts; part; part = part->next) {
+        Transfer* transfer = &part->transfer;
+        transfer->status = first->status;
+        transfer->changed = first->changed;
+        part->result = batch->result == -1 ? -1 : transfer->completed;
+
+        if (batch->result >= 0 && !whole && transfer->end >= 0 &&
+            transfer->start + transfer->completed < transfer->end) {
+            download->unbatched = true;
+        }
+    }
+
+    // The download is freed after its last range
+    Task* part = batch->parts;
+    while (part) {
+        Task* next = part->next;
+        part->next = NULL;
+        finish_range(pipeline, part, true);
+        part = next;
+    }
+    free_task(batch);
+}
+
+/**
+ * @brief Handles a task returned by a worker, freeing its host's place.
+ *
+ * @param pipeline
+ * @param task
+ */
+void finish_task(Pipeline* pipeline, Task* task) {
+    release_host(task->download->host);
+
+    if (task->type == TASK_PROBE) {
+        finish_probe(pipeline, task);
+    } else if (task->type == TASK_BATCH) {
+        finish_batch(pipeline, task);
+    } else {
+        finish_range(pipeline, task, false);
+    }
+}
+
+/**
+ * @brief Parses a size in bytes, which may have a K, M or G suffix.
+ *
+ * @param str The size e.g. 512K
+ * @return off_t The size in bytes, or -1 if it is not a valid size.
+ */
+off_t parse_size(const char* str) {
+    char* end;
+    long long size = strtoll(str, &end, 10);
+    long long unit = 1;
+
+    switch (*end) {
+        case 'G':
+            unit *= 1024;
+            // fall through
+        case 'M':
+            unit *= 1024;
+            // fall through
+        case 'K':
+            unit *= 1024;
+            end++;
             break;
-        };
     }
-    fclose(dest_file);
+
+    if (end == str || *end != '\0' || size <= 0 || size > LLONG_MAX / unit) {
+        return -1;
+    }
+    return size * unit;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        fprintf(stderr,
-                "usage: ./downloader url_file num_workers download_dir\n");
+    const char* usage = "usage: ./downloader [-e threads|epoll|uring] [-z] "
+                        "[-m min_chunk] [-M max_chunk] [-s] [-T trace_file] "
+                        "[-P metrics_file] [-p interval] [-r rate] "
+                        "[-H max_per_host] [-t connect,first_byte,idle] "
+                        "url_file num_workers download_dir\n";
+    off_t min_chunk = DEFAULT_MIN_CHUNK;
+    off_t max_chunk = DEFAULT_MAX_CHUNK;
+    Engine engine = ENGINE_THREADS;
+    bool splice = false;
+    bool sha256 = false;
+    const char* trace_file = NULL;
+    const char* metrics_file = NULL;
+    double interval = 0;
+    off_t rate = 0;
+    int max_per_host = 0;
+    Timeouts timeouts = {CONNECT_TIMEOUT, FIRST_BYTE_TIMEOUT, IDLE_TIMEOUT};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:zm:M:sT:P:p:r:H:t:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    engine = ENGINE_THREADS;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                splice = true;
+                break;
+            case 'm':
+                min_chunk = parse_size(optarg);
+                break;
+            case 'M':
+                max_chunk = parse_size(optarg);
+                break;
+            case 's':
+                sha256 = true;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'P':
+                metrics_file = optarg;
+                break;
+            case 'p':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                rate = parse_size(optarg);
+                break;
+            case 'H':
+                max_per_host = atoi(optarg);
+                break;
+            case 't':
+                if (sscanf(optarg, "%lf,%lf,%lf", &timeouts.connect,
+                           &timeouts.first_byte, &timeouts.idle) != 3 ||
+                    timeouts.connect <= 0 || timeouts.first_byte <= 0 ||
+                    timeouts.idle <= 0) {
+                    fprintf(stderr, "%s", usage);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 3 || min_chunk == -1 || max_chunk < min_chunk ||
+        rate == -1 || max_per_host < 0 || atoi(argv[optind + 1]) < 1) {
+        fprintf(stderr, "%s", usage);
         exit(1);
     }
 
-    char* url_file = argv[1];
-    int num_workers = atoi(argv[2]);
-    char* download_dir = argv[3];
+    char* url_file = argv[optind];
+    int num_workers = atoi(argv[optind + 1]);
+    char* download_dir = argv[optind + 2];
 
     create_directory(download_dir);
     FILE* fp = fopen(url_file, "r");
-    char* line = NULL;
-    size_t len = 0;
 
     if (fp == NULL) {
         exit(EXIT_FAILURE);
     }
 
-    // spawn threads and create work queue(s)
-    Context* context = spawn_workers(num_workers);
-
-    int work = 0, bytes = 0, num_tasks = 0;
-    while ((len = getline(&line, &len, fp)) != -1) {
+    if (trace_file || metrics_file) {
+        trace_enable();
+        trace_thread("main", -1);
+    }
 
-        if (line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
+    // Retries back off by different amounts in different runs
+    srand48(limiter_now() ^ getpid());
 
-        num_tasks = get_num_tasks(line, num_workers);
-        bytes = get_max_chunk_size();
+    // spawn threads and create work queue(s)
+    Context* context = spawn_workers(num_workers, min_chunk, rate,
+                                     max_per_host, &timeouts, engine, splice);
+
+    Pipeline pipeline = {
+        .url_file = fp,
+        .download_dir = download_dir,
+        .num_workers = num_workers,
+        .resolver = context->resolver,
+        .progress = context->progress,
+        .max_in_flight = num_workers * 2,
+        .max_active = num_workers,
+        .max_per_host = max_per_host,
+        .sha256 = sha256,
+    };
+    planner_init(&pipeline.planner, min_chunk, max_chunk);
+
+    if (interval > 0 &&
+        progress_start(context->progress, interval, stderr) == -1) {
+        fprintf(stderr, "could not start reporting progress\n");
+    }
 
-        for (int i = 0; i < num_tasks; i++) {
-            ++work;
-            queue_put(context->todo,
-                      new_task(line, i * bytes, ((i + 1) * bytes) - 1));
-        }
+    while (true) {
+        fill_queue(&pipeline, context);
 
-        // Get results back
-        while (work > 0) {
-            --work;
-            wait_task(download_dir, context);
+        if (__atomic_load_n(&context->in_flight, __ATOMIC_SEQ_CST) == 0) {
+            break;
         }
 
-        /* Merge the files -- simple synchronous method
-         * Then remove the chunked download files
-         * Beware, this is not an efficient method
-         */
-        merge_files(download_dir, line, bytes, num_tasks);
+        // Get a result back
+        int64_t traced = trace_begin();
+        Task* task = (Task*) queue_get(context->done);
+        trace_end(TRACE_WAIT, traced, 0);
+        progress_gauge(context->progress, PROGRESS_DONE, -1);
+        __atomic_sub_fetch(&context->in_flight, 1, __ATOMIC_SEQ_CST);
+        finish_task(&pipeline, task);
     }
 
     // cleanup
-    fclose(fp);
-    free(line);
+    free(pipeline.line);
+    while (pipeline.hosts) {
+        Host* next = pipeline.hosts->next;
+        free(pipeline.hosts->name);
+        free(pipeline.hosts);
+        pipeline.hosts = next;
+    }
 
+    progress_stop(context->progress);
     free_workers(context);
 
-    return 0;
+    // Every other thread has finished, so their traces can be read
+    if (trace_file) {
+        trace_write_chrome(trace_file);
+    }
+    if (metrics_file) {
+        trace_write_prometheus(metrics_file);
+    }
+    trace_free();
+
+    if (pipeline.wasted > 0) {
+        printf("wasted %lld bytes on ranges sent again in full\n",
+               (long long) pipeline.wasted);
+    }
+
+    return pipeline.failures == 0 ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,422 @@
+#include "header.h"
+#include "scan.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_PREFIX "HTTP/1."
+
+/**
+ * @brief Whether each character may appear in a field name (a token, in RFC
+ * 7230's terms), filled in on first use.
+ */
+static bool token_chars[UCHAR_MAX + 1];
+
+static void init_token_chars() {
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        token_chars[c] = isalnum(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+    }
+}
+
+static bool is_token_char(char c) {
+    return token_chars[(unsigned char) c];
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Initialise a parser for a new header
+ * @param parser - The parser to initialise
+ */
+void header_parser_init(HeaderParser* parser) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_token_chars);
+
+    // The fields are only read up to num_fields, so are left as they are
+    memset(parser, 0, offsetof(HeaderParser, fields));
+    parser->num_fields = 0;
+    parser->end = 0;
+    parser->state = PARSE_STATUS_LINE;
+}
+
+/**
+ * @brief Parses a status line e.g. HTTP/1.1 206 Partial Content
+ *
+ * @param parser
+ * @param data
+ * @param start The start of the line.
+ * @param end The end of the line, before any carriage return.
+ * @return int 0 on success, -1 if the line is malformed.
+ */
+static int parse_status_line(HeaderParser* parser, const char* data,
+                             size_t start, size_t end) {
+    const char* line = data + start;
+    size_t length = end - start;
+    size_t prefix = strlen(HTTP_PREFIX);
+
+    // HTTP/1.x SSS, then an optional reason
+    if (length < prefix + 5 || strncasecmp(line, HTTP_PREFIX, prefix) != 0 ||
+        !isdigit((unsigned char) line[prefix]) || line[prefix + 1] != ' ') {
+        return -1;
+    }
+    parser->minor_version = line[prefix] - '0';
+
+    const char* status = line + prefix + 2;
+    parser->status = 0;
+    for (int i = 0; i < 3; i++) {
+        if (!isdigit((unsigned char) status[i])) {
+            return -1;
+        }
+        parser->status = parser->status * 10 + status[i] - '0';
+    }
+
+    size_t reason = prefix + 5;
+    if (reason < length) {
+        if (line[reason] != ' ') {
+            return -1;
+        }
+        reason++;
+    }
+    parser->reason = (Slice){start + reason, length - reason};
+    return 0;
+}
+
+/**
+ * @brief Parses a field line e.g. Content-Length: 500
+ *
+ * @param parser
+ * @param data
+ * @param start The start of the line.
+ * @param colon The line's first colon, or 0 if it has none.
+ * @param end The end of the line, before any carriage return.
+ * @return int 0 on success, -1 if the line is malformed.
+ */
+static int parse_field(HeaderParser* parser, const char* data, size_t start,
+                       size_t colon, size_t end) {
+    // A line starting with whitespace continues the previous value (an
+    // obsolete line fold), which is extended to take it in.
+    if (is_space(data[start])) {
+        if (parser->num_fields == 0) {
+            return -1;
+        }
+        HeaderField* field = &parser->fields[parser->num_fields - 1];
+        while (end > start && is_space(data[end - 1])) {
+            end--;
+        }
+        if (end > start) {
+            field->value.length = end - field->value.offset;
+        }
+        return 0;
+    }
+
+    if (parser->num_fields == MAX_HEADER_FIELDS) {
+        return -1;
+    }
+
+    if (colon == 0 || colon == start) {
+        return -1;
+    }
+    for (size_t i = start; i < colon; i++) {
+        if (!is_token_char(data[i])) {
+            return -1;
+        }
+    }
+
+    size_t value = colon + 1;
+    while (value < end && is_space(data[value])) {
+        value++;
+    }
+    while (end > value && is_space(data[end - 1])) {
+        end--;
+    }
+
+    HeaderField* field = &parser->fields[parser->num_fields++];
+    field->name = (Slice){start, colon - start};
+    field->value = (Slice){value, end - value};
+    return 0;
+}
+
+/**
+ * Parse as much of a header as has arrived. Call again with the same buffer,
+ * including the bytes already parsed, each time more arrives.
+ * @param parser - The parser
+ * @param data - The bytes received so far, starting with the status line
+ * @param length - The number of bytes received so far
+ * @return int - HEADER_DONE once the blank line ending the header has been
+ *               parsed, HEADER_INCOMPLETE if more is needed, or HEADER_ERROR
+ *               if the header is malformed or longer than MAX_HEADER_SIZE
+ */
+int header_parser_parse(HeaderParser* parser, const char* data,
+                        size_t length) {
+    while (parser->state == PARSE_STATUS_LINE ||
+           parser->state == PARSE_FIELDS) {
+        // Find the line's colon and line feed in one scan. Offset 0 is in
+        // the status line, so can never be a field's colon.
+        size_t at = parser->scanned;
+        if (at < length) {
+            at += scan_for(data + at, length - at,
+                           parser->colon ? '\n' : ':', '\n');
+        }
+
+        if (at == length) {
+            parser->scanned = length;
+            if (length > MAX_HEADER_SIZE) {
+                parser->state = PARSE_ERROR;
+            }
+            break;
+        }
+        parser->scanned = at + 1;
+        if (data[at] == ':') {
+            parser->colon = at;
+            continue;
+        }
+
+        size_t start = parser->line_start;
+        size_t colon = parser->colon;
+        size_t next = at + 1;
+        size_t end = at;
+        if (end > start && data[end - 1] == '\r') {
+            end--;
+        }
+        parser->line_start = next;
+        parser->colon = 0;
+
+        if (next > MAX_HEADER_SIZE) {
+            parser->state = PARSE_ERROR;
+        } else if (parser->state == PARSE_STATUS_LINE) {
+            parser->state = parse_status_line(parser, data, start, end) == 0
+                                ? PARSE_FIELDS
+                                : PARSE_ERROR;
+        } else if (end == start) {
+            parser->end = next;
+            parser->state = PARSE_DONE;
+        } else if (parse_field(parser, data, start, colon, end) == -1) {
+            parser->state = PARSE_ERROR;
+        }
+    }
+
+    switch (parser->state) {
+        case PARSE_DONE:
+            return HEADER_DONE;
+        case PARSE_ERROR:
+            return HEADER_ERROR;
+        default:
+            return HEADER_INCOMPLETE;
+    }
+}
+
+/**
+ * Whether a slice equals a string, case-insensitively
+ * @param data - The buffer the slice is in
+ * @param slice - The slice
+ * @param string - The string to compare against
+ * @return bool - true if they are equal
+ */
+bool slice_equals(const char* data, Slice slice, const char* string) {
+    return strlen(string) == slice.length &&
+           strncasecmp(data + slice.offset, string, slice.length) == 0;
+}
+
+/**
+ * Find a header field by name, case-insensitively
+ * @param parser - A parser which has parsed a whole header
+ * @param data - The buffer the header was parsed from
+ * @param name - The field name, without the colon e.g. "Content-Length"
+ * @return field - The first field with the name, or NULL if there is none
+ */
+const HeaderField* header_find(const HeaderParser* parser, const char* data,
+                               const char* name) {
+    for (int i = 0; i < parser->num_fields; i++) {
+        if (slice_equals(data, parser->fields[i].name, name)) {
+            return &parser->fields[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Whether a comma separated list, such as a Transfer-Encoding or Connection
+ * value, contains a token, case-insensitively
+ * @param data - The buffer the slice is in
+ * @param slice - The list
+ * @param token - The token to look for e.g. "chunked"
+ * @return bool - true if the list contains the token
+ */
+bool slice_has_token(const char* data, Slice slice, const char* token) {
+    size_t at = slice.offset;
+    size_t end = slice.offset + slice.length;
+
+    while (at < end) {
+        while (at < end && (is_space(data[at]) || data[at] == ',')) {
+            at++;
+        }
+
+        size_t item = at;
+        while (at < end && data[at] != ',') {
+            at++;
+        }
+
+        size_t item_end = at;
+        while (item_end > item && is_space(data[item_end - 1])) {
+            item_end--;
+        }
+        if (item_end > item &&
+            slice_equals(data, (Slice){item, item_end - item}, token)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Copy a parameter of a field value, such as the boundary of a Content-Type
+ * of multipart/byteranges; boundary=3d6b6a416f9b5
+ * @param data - The buffer the slice is in
+ * @param slice - The field value, a media type then parameters, each after
+ *                a semicolon
+ * @param name - The parameter's name, matched case-insensitively
+ * @param value - Set to the parameter's value, unquoted and NUL terminated
+ * @param size - The size of `value`
+ * @return int - 0 on success, -1 if there is no such parameter, or its value
+ *               is empty or does not fit
+ */
+int slice_to_parameter(const char* data, Slice slice, const char* name,
+                       char* value, size_t size) {
+    size_t at = slice.offset;
+    size_t end = slice.offset + slice.length;
+
+    // Skip the media type
+    while (at < end && data[at] != ';') {
+        at++;
+    }
+
+    while (at < end) {
+        at++;
+        while (at < end && is_space(data[at])) {
+            at++;
+        }
+        size_t key = at;
+        while (at < end && data[at] != '=' && data[at] != ';') {
+            at++;
+        }
+        size_t key_end = at;
+        while (key_end > key && is_space(data[key_end - 1])) {
+            key_end--;
+        }
+        if (at == end || data[at] == ';') {
+            continue;
+        }
+        at++;
+
+        // A quoted string may hold semicolons, and escaped quotes
+        size_t length = 0;
+        bool fits = true;
+        if (at < end && data[at] == '"') {
+            at++;
+            while (at < end && data[at] != '"') {
+                if (data[at] == '\\' && at + 1 < end) {
+                    at++;
+                }
+                fits &= length + 1 < size;
+                if (fits) {
+                    value[length++] = data[at];
+                }
+                at++;
+            }
+        } else {
+            while (at < end && data[at] != ';' && !is_space(data[at])) {
+                fits &= length + 1 < size;
+                if (fits) {
+                    value[length++] = data[at];
+                }
+                at++;
+            }
+        }
+        while (at < end && data[at] != ';') {
+            at++;
+        }
+
+        if (slice_equals(data, (Slice){key, key_end - key}, name)) {
+            value[length] = '\0';
+            return fits && length > 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse a slice of decimal digits, such as a Content-Length
+ * @param data - The buffer the slice is in
+ * @param slice - The slice
+ * @param value - Set to the number
+ * @return int - 0 on success, -1 if the slice is not a non-negative number
+ */
+int slice_to_number(const char* data, Slice slice, long long* value) {
+    if (slice.length == 0) {
+        return -1;
+    }
+
+    long long number = 0;
+    for (size_t i = slice.offset; i < slice.offset + slice.length; i++) {
+        int digit = data[i] - '0';
+        if (digit < 0 || digit > 9 || number > (LLONG_MAX - digit) / 10) {
+            return -1;
+        }
+        number = number * 10 + digit;
+    }
+
+    *value = number;
+    return 0;
+}
+
+/**
+ * Parse a Content-Range of bytes, e.g. bytes 0-499/1234, whose range is an
+ * asterisk if it could not be satisfied, as is the size if it is unknown
+ * @param data - The buffer the slice is in
+ * @param slice - The Content-Range
+ * @param first - Set to the first byte of the range, or -1 if unsatisfied
+ * @param last - Set to the last byte of the range, or -1 if unsatisfied
+ * @param total - Set to the size of the resource, or -1 if it is unknown
+ * @return int - 0 on success, -1 if the slice is not such a range, or its
+ *               bytes are out of order or past the end
+ */
+int slice_to_content_range(const char* data, Slice slice, long long* first,
+                           long long* last, long long* total) {
+    const char* text = data + slice.offset;
+    const char* slash = memchr(text, '/', slice.length);
+    if (slice.length < 6 || strncasecmp(text, "bytes ", 6) != 0 ||
+        slash == NULL) {
+        return -1;
+    }
+
+    Slice range = {slice.offset + 6, slash - text - 6};
+    Slice size = {slash - data + 1, slice.length - (slash - text) - 1};
+    *total = -1;
+    if (!slice_equals(data, size, "*") &&
+        slice_to_number(data, size, total) == -1) {
+        return -1;
+    }
+
+    if (slice_equals(data, range, "*")) {
+        *first = *last = -1;
+        return 0;
+    }
+    const char* dash = memchr(data + range.offset, '-', range.length);
+    if (dash == NULL) {
+        return -1;
+    }
+    Slice from = {range.offset, dash - data - range.offset};
+    Slice to = {dash - data + 1, range.length - from.length - 1};
+    if (slice_to_number(data, from, first) == -1 ||
+        slice_to_number(data, to, last) == -1 || *last < *first ||
+        (*total >= 0 && *last >= *total)) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#ifndef HEADER_H
+#define HEADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_HEADER_FIELDS 64
+#define MAX_HEADER_SIZE (64 * 1024)
+
+// What header_parser_parse found
+#define HEADER_ERROR -1
+#define HEADER_INCOMPLETE 0
+#define HEADER_DONE 1
+
+
+/*
+ * Slice - a run of bytes in the buffer being parsed, given as an offset
+ * rather than a pointer so that it stays valid if the buffer is reallocated
+ * as it grows.
+ */
+typedef struct {
+    size_t offset;
+    size_t length;
+} Slice;
+
+
+// A header field, without the colon, or whitespace around the value
+typedef struct {
+    Slice name;
+    Slice value;
+} HeaderField;
+
+
+// Where the parser is within the header
+typedef enum {
+    PARSE_STATUS_LINE, // Waiting for the rest of the status line
+    PARSE_FIELDS,      // Waiting for the rest of a field, or the blank line
+    PARSE_DONE,        // The whole header has been parsed
+    PARSE_ERROR,       // The header is malformed
+} ParseState;
+
+
+/*
+ * HeaderParser - an incremental HTTP/1.x response header parser. The header
+ * is parsed in place, a line at a time, as it arrives in a buffer: each call
+ * picks up where the last left off, so every byte is only looked at once,
+ * and nothing is copied or modified. The status line is split into its
+ * version and status, and each field into a name and value slice.
+ */
+typedef struct {
+    ParseState state;
+    size_t line_start; // The start of the line being parsed
+    size_t scanned;    // How far the buffer has been searched for a newline
+    size_t colon;      // The line's first colon, or 0 if not yet found
+
+    int minor_version; // e.g. 1 for HTTP/1.1
+    int status;        // e.g. 206
+    Slice reason;      // e.g. Partial Content
+
+    HeaderField fields[MAX_HEADER_FIELDS];
+    int num_fields;
+
+    size_t end; // The length of the header, including the blank line
+} HeaderParser;
+
+
+/**
+ * Initialise a parser for a new header
+ * @param parser - The parser to initialise
+ */
+void header_parser_init(HeaderParser *parser);
+
+
+/**
+ * Parse as much of a header as has arrived. Call again with the same buffer,
+ * including the bytes already parsed, each time more arrives.
+ * @param parser - The parser
+ * @param data - The bytes received so far, starting with the status line
+ * @param length - The number of bytes received so far
+ * @return int - HEADER_DONE once the blank line ending the header has been
+ *               parsed, HEADER_INCOMPLETE if more is needed, or HEADER_ERROR
+ *               if the header is malformed or longer than MAX_HEADER_SIZE
+ */
+int header_parser_parse(HeaderParser *parser, const char *data,
+                        size_t length);
+
+
+/**
+ * Find a header field by name, case-insensitively
+ * @param parser - A parser which has parsed a whole header
+ * @param data - The buffer the header was parsed from
+ * @param name - The field name, without the colon e.g. "Content-Length"
+ * @return field - The first field with the name, or NULL if there is none
+ */
+const HeaderField *header_find(const HeaderParser *parser, const char *data,
+                               const char *name);
+
+
+/**
+ * Whether a slice equals a string, case-insensitively
+ * @param data - The buffer the slice is in
+ * @param slice - The slice
+ * @param string - The string to compare against
+ * @return bool - true if they are equal
+ */
+bool slice_equals(const char *data, Slice slice, const char *string);
+
+
+/**
+ * Whether a comma separated list, such as a Transfer-Encoding or Connection
+ * value, contains a token, case-insensitively
+ * @param data - The buffer the slice is in
+ * @param slice - The list
+ * @param token - The token to look for e.g. "chunked"
+ * @return bool - true if the list contains the token
+ */
+bool slice_has_token(const char *data, Slice slice, const char *token);
+
+
+/**
+ * Copy a parameter of a field value, such as the boundary of a Content-Type
+ * of multipart/byteranges; boundary=3d6b6a416f9b5
+ * @param data - The buffer the slice is in
+ * @param slice - The field value, a media type then parameters, each after
+ *                a semicolon
+ * @param name - The parameter's name, matched case-insensitively
+ * @param value - Set to the parameter's value, unquoted and NUL terminated
+ * @param size - The size of `value`
+ * @return int - 0 on success, -1 if there is no such parameter, or its value
+ *               is empty or does not fit
+ */
+int slice_to_parameter(const char *data, Slice slice, const char *name,
+                       char *value, size_t size);
+
+
+/**
+ * Parse a slice of decimal digits, such as a Content-Length
+ * @param data - The buffer the slice is in
+ * @param slice - The slice
+ * @param value - Set to the number
+ * @return int - 0 on success, -1 if the slice is not a non-negative number
+ */
+int slice_to_number(const char *data, Slice slice, long long *value);
+
+
+/**
+ * Parse a Content-Range of bytes, e.g. bytes 0-499/1234, whose range is an
+ * asterisk if it could not be satisfied, as is the size if it is unknown
+ * @param data - The buffer the slice is in
+ * @param slice - The Content-Range
+ * @param first - Set to the first byte of the range, or -1 if unsatisfied
+ * @param last - Set to the last byte of the range, or -1 if unsatisfied
+ * @param total - Set to the size of the resource, or -1 if it is unknown
+ * @return int - 0 on success, -1 if the slice is not such a range, or its
+ *               bytes are out of order or past the end
+ */
+int slice_to_content_range(const char *data, Slice slice, long long *first,
+                           long long *last, long long *total);
+
+
+#endif
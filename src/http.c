@@ -1,24 +1,30 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <assert.h>
-#include <ctype.h>
-#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#include "connection.h"
 #include "http.h"
+#include "scan.h"
+#include "trace.h"
 
 #define BUF_SIZE 1024
 #define BAD_SOCKET -1
-#define PORT_STR_LEN 20
-
-#define ACCEPT_RANGES "accept-ranges:"
-#define BYTES "bytes"
-
-#define CONTENT_LENGTH "content-length:"
+#define RECV_SIZE 65536
+#define HEADER_ALLOWANCE 4096
+#define RANGE_LEN 64
+#define SPLICE_SIZE (1024 * 1024)
 
 /**
  * @brief Creates and connects a socket.
@@ -28,77 +34,73 @@
  * @return int The connected socket.
  */
 int create_socket(char* host, int port) {
-    struct addrinfo hints;               // server address info
-    struct addrinfo* server_addr = NULL; // connector's address information
-    int sockfd;
-    char port_str[PORT_STR_LEN];
-
-    if (snprintf(port_str, PORT_STR_LEN, "%d", port) <= 0) {
-        printf("ERROR: Malformed port\n");
-        return BAD_SOCKET;
-    }
-
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        printf("ERROR: socket\n");
-        return BAD_SOCKET;
-    }
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(host, port_str, &hints, &server_addr) != 0) {
-        printf("ERROR: getaddrinfo\n");
-        freeaddrinfo(server_addr);
-        return BAD_SOCKET;
-    }
+    return connect_host(NULL, host, port, false, CONNECT_TIMEOUT);
+}
 
-    if (connect(sockfd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
-        printf("ERROR: connect\n");
-        freeaddrinfo(server_addr);
-        return BAD_SOCKET;
+/**
+ * @brief Sets how long a blocking socket may wait on a read or a write
+ * before it fails with EAGAIN.
+ *
+ * @param sockfd
+ * @param seconds
+ * @return int 0 on success, -1 on failure.
+ */
+int set_socket_timeout(int sockfd, double seconds) {
+    struct timeval timeout = {
+        .tv_sec = (time_t) seconds,
+        .tv_usec = (seconds - (time_t) seconds) * 1000000,
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) == -1 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout)) == -1) {
+        perror("setsockopt");
+        return -1;
     }
-
-    freeaddrinfo(server_addr);
-    return sockfd;
+    return 0;
 }
 
 /**
- * @brief Creates a buffer object
+ * @brief Estimates the size of the response to a range request, so that its
+ * buffer can be allocated up front instead of grown as it is read.
  *
- * @param size The size of the data.
- * @return Buffer*
+ * @param range Byte range e.g. 0-500, or an empty string for the whole
+ * resource.
+ * @return size_t The expected size of the response, including its header.
  */
-Buffer* create_buffer(int size) {
-    Buffer* buffer = malloc(sizeof(Buffer));
-    buffer->data = malloc(size * sizeof(char));
-    buffer->length = 0;
-    return buffer;
+size_t range_size_hint(const char* range) {
+    long long min_range, max_range;
+    if (sscanf(range, "%lld-%lld", &min_range, &max_range) == 2 &&
+        max_range >= min_range) {
+        return (size_t) max_range - min_range + 1 + HEADER_ALLOWANCE;
+    }
+    return HEADER_ALLOWANCE;
 }
 
 /**
  * @brief Reads the socket until it is empty, and returns a buffer of the
- * socket's contents.
+ * socket's contents. The buffer is NUL terminated, so that it can be searched
+ * as a string.
  * NOTE: It is required that the returned buffer is freed.
  *
  * @param sockfd - The socket to read from.
+ * @param size_hint - The expected size of the response.
  * @return Buffer* - The socket's contents.
  */
-Buffer* read_socket(int sockfd) {
-    int allocated = BUF_SIZE;
-    int bytes_read = 0;
-
-    Buffer* buffer = create_buffer(allocated);
+Buffer* read_socket(int sockfd, size_t size_hint) {
+    Buffer* buffer = buffer_alloc(size_hint + 1);
+    ssize_t bytes_read;
 
-    while ((bytes_read =
-                read(sockfd, &buffer->data[buffer->length], BUF_SIZE)) > 0) {
-        buffer->length += bytes_read;
-        if (buffer->length + BUF_SIZE > allocated) {
-            allocated += BUF_SIZE;
-            buffer->data = realloc(buffer->data, allocated);
+    do {
+        buffer_reserve(buffer, BUF_SIZE + 1);
+        bytes_read = read(sockfd, &buffer->data[buffer->length],
+                          buffer->capacity - buffer->length - 1);
+        if (bytes_read > 0) {
+            buffer->length += bytes_read;
         }
-    }
+    } while (bytes_read > 0);
 
+    buffer->data[buffer->length] = '\0';
     return buffer;
 }
 
@@ -132,16 +134,1266 @@ Buffer* http_query(char* host, char* page, const char* range, int port) {
     snprintf(header, length, format, page, host, range);
 
     if (write(sockfd, header, strlen(header)) == -1) {
-        printf("ERROR: send header");
+        fprintf(stderr, "ERROR: send header\n");
+        close(sockfd);
         return NULL;
     }
 
-    Buffer* buffer = read_socket(sockfd);
+    int64_t traced = trace_begin();
+    Buffer* buffer = read_socket(sockfd, range_size_hint(range));
+    trace_end(TRACE_RECEIVE, traced, buffer->length);
 
     close(sockfd);
     return buffer;
 }
 
+/**
+ * @brief Writes all of `length` bytes of `data` to `fd` at `offset`, retrying
+ * on short writes.
+ *
+ * @param fd The file descriptor to write to.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @param offset The offset in the file to start writing at.
+ * @return int 0 on success, -1 on a write error.
+ */
+int write_all_at(int fd, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written == -1) {
+            perror("pwrite");
+            return -1;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Initialises the state for reading a response.
+ *
+ * @param response The response to initialise.
+ * @param head True if the response is to a HEAD request, and so has no body.
+ * @param transfer The range to write the body into, or NULL for a HEAD.
+ * @param pool The pool to take the header buffer from.
+ */
+void response_init(Response* response, bool head, Transfer* transfer,
+                   BufferPool* pool) {
+    memset(response, 0, sizeof(Response));
+    response->header = buffer_pool_get(pool, HEADER_ALLOWANCE);
+    header_parser_init(&response->parser);
+    response->head = head;
+    response->transfer = transfer;
+    response->pipe[0] = response->pipe[1] = -1;
+}
+
+/**
+ * @brief Returns the response's header buffer to the pool. A response read
+ * in full is traced as received.
+ *
+ * @param response
+ * @param pool
+ */
+void response_free(Response* response, BufferPool* pool) {
+    if (response->complete) {
+        trace_end(TRACE_RECEIVE, response->first_byte, response->received);
+    }
+    if (response->header) {
+        buffer_pool_put(pool, response->header);
+    }
+    if (response->pipe[0] != -1) {
+        close(response->pipe[0]);
+        close(response->pipe[1]);
+    }
+    free(response->multipart);
+}
+
+/**
+ * @brief Finds the value of a header field in the response's header.
+ *
+ * @param response A response whose header has been parsed.
+ * @param name The field name, without the colon e.g. "Content-Length".
+ * @return const Slice* The field's value, or NULL if there is no such field.
+ */
+const Slice* response_field(const Response* response, const char* name) {
+    const HeaderField* field =
+        header_find(&response->parser, response->header->data, name);
+    return field ? &field->value : NULL;
+}
+
+/**
+ * @brief Copies a header field's value into a validator. A value too long to
+ * fit, or folded over several lines, is left out rather than cut short.
+ *
+ * @param response A response whose header has been parsed.
+ * @param name The field name e.g. "ETag".
+ * @param validator Set to the value, or "" if it is missing or left out.
+ */
+void copy_validator(const Response* response, const char* name,
+                    char* validator) {
+    const char* header = response->header->data;
+    const Slice* value = response_field(response, name);
+
+    validator[0] = '\0';
+    if (value && value->length < VALIDATOR_SIZE &&
+        scan_for(header + value->offset, value->length, '\r', '\n') ==
+            value->length) {
+        memcpy(validator, header + value->offset, value->length);
+        validator[value->length] = '\0';
+    }
+}
+
+/**
+ * @brief Gets whether the server accepts byte ranges, the size, the
+ * validators, and any digests, from the response to a probe. A 206 gives
+ * the size in its Content-Range. A 200 to a range request is all of the
+ * resource, from a server which does not send ranges, so the transfer is
+ * lengthened to take all of it. A 416 to the first range is of an empty
+ * resource, and nothing of its body is written.
+ *
+ * @param response A response whose header has been parsed, to a HEAD
+ * request or to a request for a range starting at 0.
+ * @param info Filled in with what the response says about the resource.
+ * @return int 0 on success, -1 if the range is not the one asked for.
+ */
+int response_probe_result(const Response* response, ResourceInfo* info) {
+    const char* header = response->header->data;
+    const Slice* ranges = response_field(response, "Accept-Ranges");
+    const Slice* length = response_field(response, "Content-Length");
+    const Slice* content_range = response_field(response, "Content-Range");
+    Transfer* transfer = response->transfer;
+    bool partial =
+        transfer && (response->status == 206 || response->status == 416);
+    long long first, last, value = 0;
+
+    // A probe is never split, so its range can be changed without the lock
+    if (partial) {
+        if (content_range == NULL ||
+            slice_to_content_range(header, *content_range, &first, &last,
+                                   &value) == -1 ||
+            (response->status == 206
+                 ? first != transfer->start || last >= transfer->end
+                 : value != 0)) {
+            fprintf(stderr, "server sent the wrong range\n");
+            return -1;
+        }
+        transfer->end = response->status == 206 ? last + 1 : transfer->start;
+        info->accept_ranges = true;
+        info->content_length = value > 0 ? value : 0;
+    } else {
+        info->accept_ranges = response->head && ranges &&
+                              slice_has_token(header, *ranges, "bytes");
+        if (length == NULL || slice_to_number(header, *length, &value) == -1) {
+            value = 0;
+        }
+        info->content_length = value;
+        if (transfer) {
+            transfer->end = -1;
+        }
+    }
+
+    copy_validator(response, "ETag", info->etag);
+    copy_validator(response, "Last-Modified", info->last_modified);
+
+    // Digests of the whole resource, whichever header they come in
+    const char* digest_fields[] = {"Digest", "Repr-Digest"};
+    memset(&info->digests, 0, sizeof(DigestSet));
+    for (int i = 0; i < 2; i++) {
+        const Slice* digests = response_field(response, digest_fields[i]);
+        if (digests) {
+            digest_parse(&info->digests, header + digests->offset,
+                         digests->length);
+        }
+    }
+
+    // Content-MD5 is of the body, which for a range is only part of it
+    const Slice* md5 = response_field(response, "Content-MD5");
+    if (md5 && !partial) {
+        digest_set_value(&info->digests, DIGEST_MD5, header + md5->offset,
+                         md5->length);
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether a response is of the version of the resource a validator
+ * is of, by its ETag or else its Last-Modified.
+ *
+ * @param response A response whose header has been parsed.
+ * @param validator An If-Range validator, from http_validator.
+ * @return true The response has the same validator.
+ * @return false The resource has changed, or the response does not say.
+ */
+bool response_matches(const Response* response, const char* validator) {
+    char value[VALIDATOR_SIZE];
+
+    copy_validator(response, "ETag", value);
+    if (value[0] == '\0') {
+        copy_validator(response, "Last-Modified", value);
+    }
+    return value[0] != '\0' && strcmp(value, validator) == 0;
+}
+
+/**
+ * @brief Readies a response whose body is multipart/byteranges to be
+ * decoded, if it is one.
+ *
+ * @param response A 206 response, whose header has been parsed.
+ * @return int 1 if the body is multipart, 0 if it is not, or -1 if it has
+ * no boundary.
+ */
+int response_start_multipart(Response* response) {
+    const char* header = response->header->data;
+    const Slice* content_type = response_field(response, "Content-Type");
+    if (content_type == NULL) {
+        return 0;
+    }
+
+    // The media type comes before any parameters
+    Slice type = *content_type;
+    const char* semicolon = memchr(header + type.offset, ';', type.length);
+    if (semicolon) {
+        type.length = semicolon - (header + type.offset);
+    }
+    while (type.length > 0 && (header[type.offset + type.length - 1] == ' ' ||
+                               header[type.offset + type.length - 1] == '\t')) {
+        type.length--;
+    }
+    if (!slice_equals(header, type, "multipart/byteranges")) {
+        return 0;
+    }
+
+    Multipart* multipart = calloc(1, sizeof(Multipart));
+    response->multipart = multipart;
+    multipart->state = PART_DELIMITER;
+    return slice_to_parameter(header, *content_type, "boundary",
+                              multipart->boundary, BOUNDARY_SIZE) == 0
+               ? 1
+               : -1;
+}
+
+/**
+ * @brief Checks that a response to a range request is of the range asked
+ * for. A 200 holds all of the resource, from a server which did not send
+ * the range, and is adopted by the transfer so that the resource is only
+ * sent in full once, unless another transfer of it adopted one first. The
+ * response to a request for several ranges may be any of them, or a
+ * multipart body of them, and is routed to the ranges by where it is in the
+ * resource.
+ *
+ * @param response A response to a range request, whose header has been
+ * parsed.
+ * @return int 0 on success, 1 if the body is not wanted as another transfer
+ * adopted a response first, or -1 if the range is not the one asked for.
+ */
+int response_check_range(Response* response) {
+    const char* header = response->header->data;
+    const Slice* content_range = response_field(response, "Content-Range");
+    Transfer* transfer = response->transfer;
+    long long first, last, total;
+
+    if (response->status == 200) {
+        if (transfer_adopt(transfer) == -1) {
+            return 1;
+        }
+        // The adopting range takes all of the resource, the others' too
+        transfer->next = NULL;
+        return 0;
+    }
+
+    int multipart =
+        response->status == 206 ? response_start_multipart(response) : 0;
+    if (multipart == 1) {
+        return 0;
+    }
+    if (multipart == -1 || response->status != 206 ||
+        content_range == NULL ||
+        slice_to_content_range(header, *content_range, &first, &last,
+                               &total) == -1 ||
+        first == -1 ||
+        (transfer->next == NULL &&
+         transfer_check_range(transfer, first, last) == -1)) {
+        fprintf(stderr, "server sent the wrong range\n");
+        return -1;
+    }
+    response->offset = first;
+    return 0;
+}
+
+/**
+ * @brief Works out how the body of the response is framed, and whether the
+ * connection can be reused after it, from the parsed status line and header.
+ *
+ * @param response A response whose header has been parsed.
+ * @return int 0 on success, -1 if the framing cannot be worked out.
+ */
+int response_parse_header(Response* response) {
+    const char* header = response->header->data;
+    response->status = response->parser.status;
+    Transfer* transfer = response->transfer;
+    if (transfer) {
+        transfer->status = response->status;
+    }
+
+    const Slice* connection = response_field(response, "Connection");
+    if (response->parser.minor_version >= 1) {
+        response->keep_alive =
+            !connection || !slice_has_token(header, *connection, "close");
+    } else {
+        response->keep_alive =
+            connection && slice_has_token(header, *connection, "keep-alive");
+    }
+
+    const Slice* transfer_encoding =
+        response_field(response, "Transfer-Encoding");
+    const Slice* content_length = response_field(response, "Content-Length");
+
+    // A server which no longer has the version of the resource the range is
+    // of sends all of the new version instead. One which does not send
+    // ranges sends all of the same version.
+    if (transfer && transfer->if_range && response->status == 200 &&
+        !response_matches(response, transfer->if_range)) {
+        transfer->changed = true;
+        return -1;
+    }
+
+    // The body of an error is not the range, and must not be written as if
+    // it were. A probe's first range is past the end of an empty resource.
+    bool empty = response->info && response->status == 416;
+    if (transfer && !empty &&
+        (response->status < 200 || response->status > 299)) {
+        fprintf(stderr, "server responded with status %d\n",
+                response->status);
+        return -1;
+    }
+    if (response->info &&
+        response_probe_result(response, response->info) == -1) {
+        return -1;
+    }
+
+    // A body which another transfer is already getting all of is left
+    // unread, and the connection with it
+    int checked =
+        transfer && !response->info ? response_check_range(response) : 0;
+    if (checked == -1) {
+        return -1;
+    } else if (checked == 1) {
+        response->framing = BODY_NONE;
+        response->keep_alive = false;
+        response->complete = true;
+        return 0;
+    }
+
+    if (response->head || response->status == 204 ||
+        response->status == 304) {
+        response->framing = BODY_NONE;
+    } else if (transfer_encoding &&
+               slice_has_token(header, *transfer_encoding, "chunked")) {
+        response->framing = BODY_CHUNKED;
+        response->chunk_state = CHUNK_SIZE;
+    } else if (content_length) {
+        response->framing = BODY_LENGTH;
+        if (slice_to_number(header, *content_length, &response->remaining) ==
+            -1) {
+            return -1;
+        }
+    } else {
+        response->framing = BODY_UNTIL_CLOSE;
+        response->keep_alive = false;
+    }
+
+    response->complete = response->framing == BODY_NONE ||
+                         (response->framing == BODY_LENGTH &&
+                          response->remaining == 0);
+    return 0;
+}
+
+/**
+ * @brief Writes bytes claimed from a transfer to its file, and adds them to
+ * its digests and to the response's count.
+ *
+ * @param response
+ * @param transfer The transfer the bytes were claimed from.
+ * @param data The bytes.
+ * @param granted The number of bytes claimed.
+ * @param offset Where they were claimed at.
+ * @return int 0 on success, -1 on a write error.
+ */
+int write_claimed(Response* response, Transfer* transfer, const char* data,
+                  size_t granted, off_t offset) {
+    if (granted > 0) {
+        int64_t traced = trace_begin();
+        if (write_all_at(transfer->fd, data, granted, offset) == -1) {
+            return -1;
+        }
+        trace_end(TRACE_WRITE, traced, granted);
+
+        traced = trace_begin();
+        transfer_wrote(transfer, data, granted, offset);
+        trace_end(TRACE_HASH, traced, granted);
+    }
+    response->written += granted;
+    return 0;
+}
+
+/**
+ * @brief Writes body bytes of a response to several ranges to those ranges
+ * they carry on from, by where in the resource they are. Bytes no range is
+ * waiting for, such as those between ranges a server merged, are dropped,
+ * as are those of a range cut short.
+ *
+ * @param response A response whose `offset` is where in the resource the
+ * bytes are.
+ * @param data The body bytes.
+ * @param length The number of body bytes.
+ * @return int 0 on success, -1 on a write error.
+ */
+int response_route(Response* response, const char* data, size_t length) {
+    off_t from = response->offset;
+    off_t to = from + length;
+    response->offset = to;
+
+    for (Transfer* transfer = response->transfer; transfer;
+         transfer = transfer->next) {
+        off_t position = transfer->start + transfer->completed;
+        if (position < from || position >= to) {
+            continue;
+        }
+
+        off_t offset;
+        size_t granted = transfer_claim(transfer, to - position, &offset);
+        if (write_claimed(response, transfer, data + (position - from),
+                          granted, offset) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes a multipart/byteranges body, routing the data of each part
+ * to the ranges it carries on (see response_route). Each part's header gives
+ * its range, and so the length of its data, so the data is never searched
+ * for a boundary. Delimiter and header lines may be split across calls.
+ *
+ * @param response
+ * @param data The body bytes.
+ * @param length The number of body bytes.
+ * @return int 0 on success, -1 on malformed input or a write error.
+ */
+int response_demultiplex(Response* response, const char* data,
+                         size_t length) {
+    Multipart* multipart = response->multipart;
+    const char* boundary = multipart->boundary;
+    size_t boundary_length = strlen(boundary);
+    size_t consumed = 0;
+
+    while (consumed < length && multipart->state != PART_EPILOGUE) {
+        const char* at = data + consumed;
+        size_t available = length - consumed;
+
+        if (multipart->state == PART_DATA) {
+            size_t bytes = available < (size_t) multipart->remaining
+                               ? available
+                               : (size_t) multipart->remaining;
+            if (response_route(response, at, bytes) == -1) {
+                return -1;
+            }
+            consumed += bytes;
+            multipart->remaining -= bytes;
+            if (multipart->remaining == 0) {
+                multipart->state = PART_DELIMITER;
+            }
+            continue;
+        }
+
+        // Every other state consumes a line, as in response_dechunk
+        size_t line_feed = scan_for(at, available, '\n', '\n');
+        bool newline = line_feed < available;
+        size_t bytes = newline ? line_feed + 1 : available;
+        if (multipart->line_length + bytes >= CHUNK_LINE_SIZE) {
+            return -1;
+        }
+        memcpy(&multipart->line[multipart->line_length], at, bytes);
+        multipart->line_length += bytes;
+        consumed += bytes;
+
+        if (!newline) {
+            break;
+        }
+        char* line = multipart->line;
+        size_t line_length = multipart->line_length;
+        while (line_length > 0 && (line[line_length - 1] == '\n' ||
+                                   line[line_length - 1] == '\r')) {
+            line_length--;
+        }
+        line[line_length] = '\0';
+        multipart->line_length = 0;
+
+        if (multipart->state == PART_DELIMITER) {
+            // Anything before a delimiter, such as the line break ending the
+            // last part's data, is ignored
+            bool delimiter = line_length >= boundary_length + 2 &&
+                             strncmp(line, "--", 2) == 0 &&
+                             strncmp(line + 2, boundary, boundary_length) == 0;
+            const char* rest = line + 2 + boundary_length;
+            if (delimiter && *rest == '\0') {
+                multipart->state = PART_HEADER;
+                multipart->remaining = -1;
+            } else if (delimiter && strcmp(rest, "--") == 0) {
+                multipart->state = PART_EPILOGUE;
+            }
+        } else if (line_length == 0) {
+            // A part without a range cannot be placed
+            if (multipart->remaining == -1) {
+                return -1;
+            }
+            multipart->state = PART_DATA;
+        } else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+            size_t value = 14;
+            while (line[value] == ' ' || line[value] == '\t') {
+                value++;
+            }
+            long long first, last, total;
+            if (slice_to_content_range(line,
+                                       (Slice){value, line_length - value},
+                                       &first, &last, &total) == -1 ||
+                first == -1) {
+                return -1;
+            }
+            response->offset = first;
+            multipart->remaining = last - first + 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes body bytes into the response's range, after those already
+ * written. If the range has been cut short by a split, only the bytes up to
+ * its new end are written, and the response is finished early. The rest of
+ * the body is left unread, so the connection cannot be reused. The body of
+ * a response to several ranges is routed to them instead.
+ *
+ * @param response
+ * @param data The body bytes.
+ * @param length The number of body bytes.
+ * @return int 0 on success, -1 on a write error.
+ */
+int response_write(Response* response, const char* data, size_t length) {
+    if (response->multipart) {
+        return response_demultiplex(response, data, length);
+    } else if (response->transfer->next) {
+        return response_route(response, data, length);
+    }
+
+    Transfer* transfer = response->transfer;
+    off_t offset;
+    size_t granted = transfer_claim(transfer, length, &offset);
+
+    if (write_claimed(response, transfer, data, granted, offset) == -1) {
+        return -1;
+    }
+
+    if (granted < length) {
+        response->complete = true;
+        response->keep_alive = false;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes a chunked transfer encoded body, writing the data of each
+ * chunk to the response's file. Chunk size lines and the trailer may be split
+ * across calls.
+ *
+ * @param response
+ * @param data The encoded bytes.
+ * @param length The number of encoded bytes.
+ * @return ssize_t The number of bytes consumed, or -1 on malformed input or a
+ * write error. Bytes after the end of the body are not consumed.
+ */
+ssize_t response_dechunk(Response* response, const char* data,
+                         size_t length) {
+    size_t consumed = 0;
+
+    while (consumed < length && !response->complete) {
+        const char* at = data + consumed;
+        size_t available = length - consumed;
+
+        if (response->chunk_state == CHUNK_DATA) {
+            size_t bytes = available < (size_t) response->remaining
+                               ? available
+                               : (size_t) response->remaining;
+            if (response_write(response, at, bytes) == -1) {
+                return -1;
+            }
+            consumed += bytes;
+            response->remaining -= bytes;
+            if (response->remaining == 0) {
+                response->chunk_state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+
+        // Every other state consumes a line, which is collected until its
+        // line feed arrives.
+        size_t line_feed = scan_for(at, available, '\n', '\n');
+        bool newline = line_feed < available;
+        size_t bytes = newline ? line_feed + 1 : available;
+        if (response->line_length + bytes >= CHUNK_LINE_SIZE) {
+            return -1;
+        }
+        memcpy(&response->line[response->line_length], at, bytes);
+        response->line_length += bytes;
+        consumed += bytes;
+
+        if (!newline) {
+            break;
+        }
+        response->line[response->line_length] = '\0';
+        bool blank = response->line_length <= 2;
+        response->line_length = 0;
+
+        switch (response->chunk_state) {
+            case CHUNK_SIZE: {
+                char* end;
+                response->remaining = strtoll(response->line, &end, 16);
+                if (end == response->line || response->remaining < 0) {
+                    return -1;
+                }
+                response->chunk_state =
+                    response->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (!blank) {
+                    return -1;
+                }
+                response->chunk_state = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER:
+                response->complete = blank;
+                break;
+            case CHUNK_DATA:
+                break;
+        }
+    }
+
+    return consumed;
+}
+
+/**
+ * @brief Chooses where the next read from the socket should go. Until the
+ * whole header has arrived, reads go straight into the header buffer, after
+ * what has arrived so far, so that the header can be parsed where it lies
+ * without being copied. After that, they go into the receive buffer.
+ *
+ * @param response
+ * @param recv_buffer The receive buffer.
+ * @param space Set to the number of bytes that may be read.
+ * @return char* Where to read to.
+ */
+char* response_read_buffer(Response* response, Buffer* recv_buffer,
+                           size_t* space) {
+    if (response->header_done) {
+        *space = recv_buffer->capacity;
+        return recv_buffer->data;
+    }
+
+    Buffer* header = response->header;
+    buffer_reserve(header, BUF_SIZE);
+    *space = header->capacity - header->length;
+    return &header->data[header->length];
+}
+
+/**
+ * @brief Handles bytes read from the socket, to where response_read_buffer
+ * said. Header bytes are parsed in place. Once the blank line terminating
+ * the header has been read, body bytes are decoded according to the
+ * response's framing and written straight to the response's file.
+ *
+ * @param response
+ * @param data The bytes read.
+ * @param length The number of bytes read.
+ * @return int 0 on success, -1 on a malformed response or a write error.
+ */
+int response_received(Response* response, char* data, size_t length) {
+    if (response->received == 0) {
+        trace_end(TRACE_FIRST_BYTE, response->requested, 0);
+        response->first_byte = trace_begin();
+    }
+    response->received += length;
+
+    if (!response->header_done) {
+        Buffer* header = response->header;
+        header->length += length;
+
+        switch (header_parser_parse(&response->parser, header->data,
+                                    header->length)) {
+            case HEADER_INCOMPLETE:
+                return 0;
+            case HEADER_ERROR:
+                return -1;
+        }
+
+        // Whatever followed the header in the same read is body
+        response->header_done = true;
+        data = &header->data[response->parser.end];
+        length = header->length - response->parser.end;
+        header->length = response->parser.end;
+
+        if (response_parse_header(response) == -1) {
+            return -1;
+        }
+    }
+
+    size_t consumed = 0;
+    switch (response->framing) {
+        case BODY_LENGTH:
+            consumed = length < (size_t) response->remaining
+                           ? length
+                           : (size_t) response->remaining;
+            if (response_write(response, data, consumed) == -1) {
+                return -1;
+            }
+            response->remaining -= consumed;
+            response->complete |= response->remaining == 0;
+            break;
+        case BODY_CHUNKED: {
+            ssize_t dechunked = response_dechunk(response, data, length);
+            if (dechunked == -1) {
+                return -1;
+            }
+            consumed = dechunked;
+            break;
+        }
+        case BODY_UNTIL_CLOSE:
+            if (response_write(response, data, length) == -1) {
+                return -1;
+            }
+            consumed = length;
+            break;
+        case BODY_NONE:
+            break;
+    }
+
+    // Anything after the end of the body belongs to no request, so the
+    // connection cannot be trusted for another one.
+    if (consumed < length) {
+        response->keep_alive = false;
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes tokens from the response's limiter for bytes read, if its
+ * transfer has one.
+ *
+ * @param response
+ * @param length The number of bytes read.
+ * @return int64_t When to read again, as from limiter_take, or 0.
+ */
+int64_t response_limit(Response* response, size_t length) {
+    Transfer* transfer = response->transfer;
+    return transfer && transfer->limiter
+               ? limiter_take(transfer->limiter, length)
+               : 0;
+}
+
+/**
+ * @brief Ends a body delimited by the connection closing. The body of a
+ * range whose end is known must reach it, or else it was cut short, as by a
+ * reset, and the range must be asked for again rather than recorded as
+ * written. A probe's body may end anywhere, as the rest of the download is
+ * planned from what it wrote.
+ *
+ * @param response A response whose connection has closed.
+ * @return int 0 if the body is complete, -1 if it was cut short.
+ */
+int response_close(Response* response) {
+    Transfer* transfer = response->transfer;
+    if (transfer && !response->info && !transfer_finished(transfer)) {
+        fprintf(stderr, "connection closed before the end of the range\n");
+        return -1;
+    }
+    response->complete = true;
+    return 0;
+}
+
+/**
+ * @brief Whether the rest of a response's body can be moved through its
+ * transfer's ring: a body of known length, after the header.
+ *
+ * @param response
+ * @return true The body can be moved.
+ * @return false The body must be read.
+ */
+bool response_can_move(const Response* response) {
+    return response->header_done && !response->complete &&
+           response->framing == BODY_LENGTH && response->transfer &&
+           response->transfer->uring && !response->multipart &&
+           !response->transfer->next;
+}
+
+// A piece of a body moved through a ring
+typedef struct {
+    size_t length;   // The bytes asked for
+    off_t offset;    // Where in the file they go
+    size_t received; // The bytes which arrived
+    int pending;     // Completions of its chain still to come
+    bool written;    // True once it is in the file, until it is hashed
+} Piece;
+
+/**
+ * @brief Moves the rest of a body of known length from the socket to the
+ * file through the transfer's ring, a piece at a time, each piece claimed
+ * from the transfer before it is received. The next piece is received while
+ * the last is written and hashed, into the ring's other buffer. Writes may
+ * complete out of order, but pieces are hashed in order, as the CRC needs.
+ * A recv that does not complete within the idle timeout fails the
+ * response.
+ *
+ * @param sockfd The socket to read from.
+ * @param response A response whose body can be moved.
+ * @param timeouts The timeouts to read with.
+ * @return int 0 if the body was moved in full, -1 otherwise.
+ */
+int response_move(int sockfd, Response* response, const Timeouts* timeouts) {
+    Transfer* transfer = response->transfer;
+    Uring* uring = transfer->uring;
+    if (uring_files(uring, sockfd, transfer->fd) == -1) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    Piece pieces[URING_SLOTS];
+    memset(pieces, 0, sizeof(pieces));
+    int slot = 0;     // The buffer the next piece is received into
+    int oldest = 0;   // The buffer of the oldest piece not yet hashed
+    int pending = 0;  // Completions still to come, of every piece
+    bool receiving = false;
+    bool failed = false;
+
+    while (true) {
+        Piece* next = &pieces[slot];
+        if (!failed && !receiving && !response->complete &&
+            next->pending == 0 && !next->written) {
+            size_t wanted = response->remaining < URING_BUFFER_SIZE
+                                ? response->remaining
+                                : URING_BUFFER_SIZE;
+            size_t granted = transfer_claim(transfer, wanted, &next->offset);
+
+            // The range has been cut short by a split, so the rest of the
+            // body is left unread, as in response_write
+            if (granted < wanted) {
+                response->complete = true;
+                response->keep_alive = false;
+            }
+            if (granted > 0) {
+                next->length = granted;
+                next->received = 0;
+                next->pending = 3;
+                uring_move(uring, slot, granted, next->offset,
+                           timeouts->idle);
+                pending += 3;
+                receiving = true;
+            }
+        }
+        if (pending == 0) {
+            break;
+        }
+
+        UringEvent event;
+        if (uring_wait(uring, &event) == -1) {
+            perror("io_uring_enter");
+            failed = true;
+            break;
+        }
+        Piece* piece = &pieces[event.slot];
+        piece->pending--;
+        pending--;
+
+        switch (event.op) {
+            case URING_RECV:
+                receiving = false;
+                piece->received = event.result > 0 ? event.result : 0;
+                response->received += piece->received;
+                if (piece->received < piece->length) {
+                    failed = true;
+                    break;
+                }
+                response->remaining -= piece->received;
+                response->complete |= response->remaining == 0;
+                slot = (slot + 1) % URING_SLOTS;
+                limiter_wait(response_limit(response, piece->received));
+                break;
+            case URING_TIMEOUT:
+                if (event.result == -ETIME) {
+                    fprintf(stderr, "timed out waiting for more of the "
+                                    "response\n");
+                }
+                break;
+            case URING_WRITE: {
+                // A write cut short is finished here, as is one cancelled
+                // because its recv came up short, with what did arrive
+                char* data = uring_buffer(uring, event.slot);
+                size_t done = event.result > 0 ? event.result : 0;
+                if (event.result < 0 && event.result != -ECANCELED) {
+                    errno = -event.result;
+                    perror("write");
+                    failed = true;
+                } else if (done < piece->received &&
+                           write_all_at(transfer->fd, data + done,
+                                        piece->received - done,
+                                        piece->offset + done) == -1) {
+                    failed = true;
+                } else {
+                    piece->written = true;
+                }
+                break;
+            }
+        }
+
+        // A piece whose write failed holds up every later one for good
+        while (pieces[oldest].written) {
+            Piece* written = &pieces[oldest];
+            int64_t traced = trace_begin();
+            transfer_wrote(transfer, uring_buffer(uring, oldest),
+                           written->received, written->offset);
+            trace_end(TRACE_HASH, traced, written->received);
+            response->written += written->received;
+            written->written = false;
+            oldest = (oldest + 1) % URING_SLOTS;
+        }
+    }
+
+    // The ring's references would keep the socket open after it is closed
+    uring_files(uring, -1, -1);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Whether the rest of a response's body can be spliced from the
+ * socket to the file: a body of known length, after the header. Whatever of
+ * the body arrived with the header has already been written by
+ * response_received.
+ *
+ * @param response
+ * @return true The body can be spliced.
+ * @return false The body must be read.
+ */
+bool response_can_splice(const Response* response) {
+    return response->header_done && !response->complete &&
+           response->framing == BODY_LENGTH && response->transfer &&
+           response->transfer->splice && !response->multipart &&
+           !response->transfer->next;
+}
+
+/**
+ * @brief Splices the next piece of a body of known length from the socket
+ * into the response's pipe, and from there into the file, without the bytes
+ * being copied into memory. The pipe is made on the first call. A piece is
+ * claimed from the transfer once it is in the pipe, as in response_write,
+ * and what a split leaves unclaimed is dropped with the pipe.
+ *
+ * @param response A response whose body can be spliced.
+ * @param sockfd The socket to splice from.
+ * @param nonblocking True to return rather than wait if nothing has arrived.
+ * @return ssize_t The number of bytes taken from the socket, 0 if the
+ * connection was closed, or -1 on failure, with errno EAGAIN if the socket
+ * timed out or, when not blocking, had nothing to splice.
+ */
+ssize_t response_splice(Response* response, int sockfd, bool nonblocking) {
+    Transfer* transfer = response->transfer;
+    if (response->pipe[0] == -1) {
+        if (pipe2(response->pipe, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        // A bigger pipe takes more at a time, but the default still works
+        fcntl(response->pipe[1], F_SETPIPE_SZ, SPLICE_SIZE);
+    }
+
+    size_t wanted = response->remaining < SPLICE_SIZE ? response->remaining
+                                                      : SPLICE_SIZE;
+    ssize_t taken =
+        splice(sockfd, NULL, response->pipe[1], NULL, wanted,
+               SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0));
+    if (taken <= 0) {
+        return taken;
+    }
+    response->received += taken;
+    response->remaining -= taken;
+
+    off_t offset;
+    size_t granted = transfer_claim(transfer, taken, &offset);
+    loff_t position = offset;
+    int64_t traced = trace_begin();
+    for (size_t left = granted; left > 0;) {
+        ssize_t spliced = splice(response->pipe[0], NULL, transfer->fd,
+                                 &position, left, SPLICE_F_MOVE);
+        if (spliced <= 0) {
+            // The pipe was filled from the socket, so it cannot run dry
+            return -1;
+        }
+        left -= spliced;
+    }
+    trace_end(TRACE_WRITE, traced, granted);
+    transfer_spliced(transfer, granted, offset);
+    response->written += granted;
+
+    if (granted < (size_t) taken) {
+        response->complete = true;
+        response->keep_alive = false;
+    } else {
+        response->complete = response->remaining == 0;
+    }
+    return taken;
+}
+
+/**
+ * @brief Reads the socket until the response is complete, handing everything
+ * read to the response. Reading pauses whenever the transfer's limiter says
+ * to. The socket's timeout is the first byte timeout until the response
+ * starts to arrive, and the idle timeout after. Once the header has been
+ * read, a body of known length is moved by the transfer's ring, if it has
+ * one, or spliced, if the transfer asks for that.
+ *
+ * @param sockfd The socket to read from, with the first byte timeout set.
+ * @param response The response to read.
+ * @param pool The pool to take the receive buffer from.
+ * @param timeouts The timeouts to read with.
+ * @return int 0 if the response was read in full, -1 otherwise.
+ */
+int read_response(int sockfd, Response* response, BufferPool* pool,
+                  const Timeouts* timeouts) {
+    Buffer* recv_buffer = buffer_pool_get(pool, RECV_SIZE);
+    ssize_t bytes_read = 0;
+    bool splicing = false;
+    int result = 0;
+
+    while (!response->complete) {
+        if ((splicing = response_can_splice(response))) {
+            if ((bytes_read = response_splice(response, sockfd, false)) <= 0) {
+                break;
+            }
+            limiter_wait(response_limit(response, bytes_read));
+            continue;
+        }
+
+        size_t space;
+        char* data = response_read_buffer(response, recv_buffer, &space);
+        if ((bytes_read = read(sockfd, data, space)) <= 0) {
+            break;
+        }
+        if (response->received == 0 &&
+            set_socket_timeout(sockfd, timeouts->idle) == -1) {
+            result = -1;
+            break;
+        }
+        if (response_received(response, data, bytes_read) == -1) {
+            result = -1;
+            break;
+        }
+        limiter_wait(response_limit(response, bytes_read));
+
+        if (response_can_move(response)) {
+            result = response_move(sockfd, response, timeouts);
+            break;
+        }
+    }
+
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fprintf(stderr, "timed out waiting for %s\n",
+                response->received ? "more of the response" : "a response");
+        result = -1;
+    } else if (bytes_read == -1) {
+        perror(splicing ? "splice" : "read");
+        result = -1;
+    } else if (bytes_read == 0 && response->header_done &&
+               response->framing == BODY_UNTIL_CLOSE &&
+               response_close(response) == -1) {
+        result = -1;
+    }
+
+    buffer_pool_put(pool, recv_buffer);
+    return result == 0 && response->complete ? 0 : -1;
+}
+
+/**
+ * @brief Sends a request over a connection to host:port, reusing an idle
+ * connection from the pool if there is one, and reads the response. A reused
+ * connection may have been closed by the server just as it was checked out,
+ * so if it fails before any of the response arrives, the request is retried
+ * once on a fresh connection. The connection is returned to the pool if the
+ * response leaves it reusable. Each phase of the exchange is given up on
+ * once it takes longer than the pool's timeouts allow.
+ *
+ * @param host The host name e.g. www.canterbury.ac.nz
+ * @param port e.g. 80
+ * @param request The request to send.
+ * @param response The initialised response to read into.
+ * @param pool The pool to take the receive buffer from.
+ * @param connections The pool of idle connections.
+ * @param resolver The resolver to look the host up in.
+ * @return int 0 if the response was read in full, -1 otherwise.
+ */
+int http_exchange(char* host, int port, const char* request,
+                  Response* response, BufferPool* pool,
+                  ConnectionPool* connections, Resolver* resolver) {
+    const Timeouts* timeouts = connection_pool_timeouts(connections);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int sockfd = connection_pool_get(connections, host, port);
+        bool reused = sockfd != BAD_SOCKET;
+
+        if (!reused &&
+            (sockfd = connect_host(resolver, host, port, false,
+                                   timeouts->connect)) == BAD_SOCKET) {
+            return -1;
+        }
+
+        int result = -1;
+        response->requested = trace_begin();
+        if (set_socket_timeout(sockfd, timeouts->first_byte) == 0 &&
+            send(sockfd, request, strlen(request), MSG_NOSIGNAL) != -1) {
+            result = read_response(sockfd, response, pool, timeouts);
+        }
+
+        if (result == 0 && response->keep_alive) {
+            connection_pool_put(connections, host, port, sockfd);
+        } else {
+            close(sockfd);
+        }
+
+        if (result == 0 || !reused || response->received > 0) {
+            return result;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Formats the byte ranges of a transfer, and of any chained after it,
+ * for a Range field e.g. 0-499,1000-1499.
+ * NOTE: It is required that the returned string is freed.
+ *
+ * @param transfer
+ * @return char* The ranges.
+ */
+char* format_ranges(const Transfer* transfer) {
+    int count = 0;
+    for (const Transfer* range = transfer; range; range = range->next) {
+        count++;
+    }
+
+    char* ranges = malloc(count * RANGE_LEN);
+    size_t length = 0;
+    for (const Transfer* range = transfer; range; range = range->next) {
+        const char* separator = range == transfer ? "" : ",";
+        if (range->end >= 0) {
+            length += snprintf(ranges + length, RANGE_LEN, "%s%lld-%lld",
+                               separator, (long long) range->start,
+                               (long long) range->end - 1);
+        } else {
+            length += snprintf(ranges + length, RANGE_LEN, "%s%lld-",
+                               separator, (long long) range->start);
+        }
+    }
+    return ranges;
+}
+
+/**
+ * @brief Formats an HTTP 1.1 request for a page: a GET of `transfer`'s range,
+ * conditional on its If-Range validator if it has one, or a HEAD if
+ * `transfer` is NULL.
+ * NOTE: It is required that the returned request is freed.
+ *
+ * @param host The host name e.g. www.canterbury.ac.nz
+ * @param port e.g. 80
+ * @param page e.g. /index.html
+ * @param transfer The range to request, or NULL for a HEAD request.
+ * @return char* The request.
+ */
+char* format_request(const char* host, int port, const char* page,
+                     const Transfer* transfer) {
+    char* request;
+    int length;
+
+    // The Host field names the port too, unless it is the default, and an
+    // IPv6 address goes in brackets
+    char authority[BUF_SIZE];
+    bool ipv6 = strchr(host, ':') != NULL;
+    if (port == 80) {
+        snprintf(authority, BUF_SIZE, ipv6 ? "[%s]" : "%s", host);
+    } else {
+        snprintf(authority, BUF_SIZE, ipv6 ? "[%s]:%d" : "%s:%d", host, port);
+    }
+
+    if (transfer == NULL) {
+        length = asprintf(&request,
+                          "HEAD /%s HTTP/1.1\r\n"
+                          "Host: %s\r\n"
+                          "User-Agent: getter\r\n\r\n",
+                          page, authority);
+    } else {
+        char* range = format_ranges(transfer);
+        length = asprintf(&request,
+                          "GET /%s HTTP/1.1\r\n"
+                          "Host: %s\r\n"
+                          "Range: bytes=%s\r\n"
+                          "%s%s%s"
+                          "User-Agent: getter\r\n\r\n",
+                          page, authority, range,
+                          transfer->if_range ? "If-Range: " : "",
+                          transfer->if_range ? transfer->if_range : "",
+                          transfer->if_range ? "\r\n" : "");
+        free(range);
+    }
+
+    if (length == -1) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    return request;
+}
+
+/**
+ * Perform an HTTP 1.1 range query to a given host and page and port number,
+ * streaming the body of the response into `transfer`'s range of its file. The
+ * connection is taken from, and returned to, `connections`.
+ *
+ * @param host The host name e.g. www.canterbury.ac.nz
+ * @param page e.g. /index.html
+ * @param port e.g. 80
+ * @param transfer The range to request, and write the body into.
+ * @param info Filled in from the response's header, for a probe, or NULL.
+ * @param pool The pool to take the receive buffers from.
+ * @param connections The pool of idle connections.
+ * @param resolver The resolver to look the host up in.
+ * @return ssize_t The number of body bytes written, or -1 on failure.
+ */
+ssize_t http_query_to_file(char* host, char* page, int port,
+                           Transfer* transfer, ResourceInfo* info,
+                           BufferPool* pool, ConnectionPool* connections,
+                           Resolver* resolver) {
+    char* request = format_request(host, port, page, transfer);
+
+    Response response;
+    response_init(&response, false, transfer, pool);
+    response.info = info;
+    int result = http_exchange(host, port, request, &response, pool,
+                               connections, resolver);
+    response_free(&response, pool);
+    free(request);
+
+    return result == 0 ? response.written : -1;
+}
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -151,14 +1403,49 @@ Buffer* http_query(char* host, char* page, const char* range, int port) {
  * @return string response or NULL on failure (buffer is not HTTP response)
  */
 char* http_get_content(Buffer* response) {
+    return response->data + scan_header_end(response->data, response->length);
+}
+
+/**
+ * @brief Splits a URL, e.g. example.com:8080/files/a.bin, into its host, port
+ * and page, in place. The port is 80 unless the URL gives one. An IPv6
+ * address is given in brackets, e.g. [::1]:8080/files/a.bin.
+ *
+ * @param url A copy of the URL, which is left holding only the host.
+ * @param page Set to the page, after the first '/'.
+ * @param port Set to the port.
+ * @return int 0 on success, -1 if the URL has no page or a bad port.
+ */
+int split_url(char* url, char** page, int* port) {
+    char* slash = strchr(url, '/');
+    if (slash == NULL) {
+        return -1;
+    }
+    *slash = '\0';
+    *page = slash + 1;
 
-    char* header_end = strstr(response->data, "\r\n\r\n");
+    char* colon = strrchr(url, ':');
+    if (url[0] == '[') {
+        char* bracket = strchr(url, ']');
+        if (bracket == NULL || (bracket[1] != ':' && bracket[1] != '\0')) {
+            return -1;
+        }
+        colon = bracket[1] == ':' ? bracket + 1 : NULL;
+        *bracket = '\0';
+        memmove(url, url + 1, bracket - url);
+    }
 
-    if (header_end) {
-        return header_end + 4;
-    } else {
-        return response->data;
+    *port = 80;
+    if (colon) {
+        char* end;
+        long value = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || value < 1 || value > 65535) {
+            return -1;
+        }
+        *colon = '\0';
+        *port = value;
     }
+    return 0;
 }
 
 /**
@@ -170,15 +1457,13 @@ char* http_get_content(Buffer* response) {
  */
 Buffer* http_url(const char* url, const char* range) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
+    snprintf(host, BUF_SIZE, "%s", url);
 
-    char* page = strstr(host, "/");
+    char* page;
+    int port;
 
-    if (page) {
-        page[0] = '\0';
-
-        ++page;
-        return http_query(host, page, range, 80);
+    if (split_url(host, &page, &port) == 0) {
+        return http_query(host, page, range, port);
     } else {
 
         fprintf(stderr, "could not split url into host/page %s\n", url);
@@ -187,167 +1472,435 @@ Buffer* http_url(const char* url, const char* range) {
 }
 
 /**
- * @brief Performs an HTTP head request.
- *
- * @param host
- * @param page
- * @param port
- * @return Buffer*
+ * Splits an HTTP url into host, port and page. On success, calls
+ * http_query_to_file to stream the body of the response into `transfer`'s
+ * range of its file.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile, or with a
+ *              port e.g. localhost:8080/files/a.bin
+ * @param transfer - The range to request, and write the body into
+ * @param pool - The calling thread's pool to take receive buffers from
+ * @param connections - The pool of idle connections to reuse
+ * @param resolver - The resolver to look the host up in
+ * @return ssize_t - The number of body bytes written, or -1 on failure
  */
-Buffer* http_head(char* host, char* page, int port) {
-    int sockfd = create_socket(host, port);
+ssize_t http_url_to_file(const char* url, Transfer* transfer,
+                         BufferPool* pool, ConnectionPool* connections,
+                         Resolver* resolver) {
+    char host[BUF_SIZE];
+    snprintf(host, BUF_SIZE, "%s", url);
 
-    if (sockfd == BAD_SOCKET) {
-        return NULL;
+    char* page;
+    int port;
+
+    if (split_url(host, &page, &port) == 0) {
+        return http_query_to_file(host, page, port, transfer, NULL, pool,
+                                  connections, resolver);
+    } else {
+
+        fprintf(stderr, "could not split url into host/page %s\n", url);
+        return -1;
     }
+}
 
-    char* format = "HEAD /%s HTTP/1.0\r\n"
-                   "Host: %s\r\n"
-                   "User-Agent: getter\r\n\r\n";
-    size_t length = strlen(format) + strlen(host) + strlen(page);
-    char header[length];
-    snprintf(header, length, format, page, host);
+/**
+ * Requests the first range of a given URL, and gets from the response's
+ * header whether the server accepts byte ranges for it, its size, its
+ * validators, and any digests of it, while the body is written into the
+ * range. A server which does not send ranges sends the whole resource,
+ * which is written in full. Safe to call from several threads at once.
+ * @param url   The URL of the resource to download
+ * @param info   Filled in with what the server says about the resource
+ * @param transfer   The first range, starting at 0, to write the body into
+ * @param pool   The calling thread's pool to take receive buffers from
+ * @param connections   The pool of idle connections to make the request with
+ * @param resolver   The resolver to look the host up in
+ * @return ssize_t  The number of body bytes written, or -1 on failure
+ */
+ssize_t http_probe(const char* url, ResourceInfo* info, Transfer* transfer,
+                   BufferPool* pool, ConnectionPool* connections,
+                   Resolver* resolver) {
+    char host[BUF_SIZE];
+    snprintf(host, BUF_SIZE, "%s", url);
 
-    if (write(sockfd, header, strlen(header)) == -1) {
-        printf("ERROR: send header");
-        close(sockfd);
-        return NULL;
+    char* page;
+    int port;
+    if (split_url(host, &page, &port) == -1) {
+        fprintf(stderr, "could not split url into host/page %s\n", url);
+        return -1;
     }
 
-    Buffer* buffer = read_socket(sockfd);
+    return http_query_to_file(host, page, port, transfer, info, pool,
+                              connections, resolver);
+}
 
-    close(sockfd);
-    return buffer;
+/**
+ * The validator to send in an If-Range header, so that a range is only sent
+ * if the resource still matches it: the ETag if it is a strong one, or else
+ * the Last-Modified date
+ * @param info   A resource's details, from http_probe
+ * @return string   The validator, or NULL if the resource has none
+ */
+const char* http_validator(const ResourceInfo* info) {
+    // Weak ETags cannot be used to ask for a range
+    if (info->etag[0] && strncmp(info->etag, "W/", 2) != 0) {
+        return info->etag;
+    }
+    return info->last_modified[0] ? info->last_modified : NULL;
 }
 
 /**
- * @brief Returns a pointer to the character after whitespace.
+ * Starts resolving the host of a URL in the background, so that it is
+ * ready by the time the URL is downloaded.
+ * @param url   The URL of a resource to download
+ * @param resolver   The resolver to resolve the host in
+ */
+void http_prefetch(const char* url, Resolver* resolver) {
+    char host[BUF_SIZE];
+    snprintf(host, BUF_SIZE, "%s", url);
+
+    char* page;
+    int port;
+    if (split_url(host, &page, &port) == 0) {
+        resolver_prefetch(resolver, host, port);
+    }
+}
+
+/**
+ * @brief Sets whether a socket is non-blocking.
  *
- * @param location The character to start the search from.
- * @param buffer The `buffer`, of which `location` resides inside.
- * @return char* The pointer to the character after whitespace.
+ * @param sockfd
+ * @param nonblocking
+ * @return int 0 on success, -1 on failure.
  */
-char* consume_whitespace(char* location, Buffer* buffer) {
-    char* end = buffer->data + buffer->length;
-    while (*location == ' ' && location <= end) {
-        location++;
+int set_nonblocking(int sockfd, bool nonblocking) {
+    int value = nonblocking;
+    return ioctl(sockfd, FIONBIO, &value);
+}
+
+/**
+ * @brief Looks the exchange's host up without blocking, and starts
+ * connecting to it once it has been resolved.
+ *
+ * @param exchange
+ * @return ExchangeState The state the exchange is now in.
+ */
+ExchangeState exchange_resolve(Exchange* exchange) {
+    AddressList addresses;
+
+    switch (resolver_try_lookup(exchange->resolver, exchange->host,
+                                exchange->port, &addresses)) {
+        case RESOLVE_DONE:
+            connector_start(&exchange->connector, &addresses,
+                            connection_pool_timeouts(exchange->connections)
+                                ->connect);
+            exchange->state = EXCHANGE_CONNECTING;
+            break;
+        case RESOLVE_PENDING:
+            exchange->state = EXCHANGE_RESOLVING;
+            break;
+        default:
+            exchange->state = EXCHANGE_FAILED;
+            break;
     }
-    return location;
+    return exchange->state;
 }
 
 /**
- * @brief Returns a Boolean indicating if the HTTP header has an Accept-Ranges
- * value of "bytes".
+ * @brief Gives an exchange until a number of seconds after a time to make
+ * progress.
  *
- * @param buffer The buffer containing the HTTP header.
- * @return true The HTTP header has an "Accept-Ranges" header with a value of
- * "bytes".
- * @return false The HTTP header does not have an "Accept-Ranges" header with a
- * value of "bytes".
+ * @param exchange
+ * @param from The time, on the clock of limiter_now.
+ * @param seconds
  */
-bool get_accept_ranges(Buffer* buffer) {
-    char* accept_header = strstr(buffer->data, ACCEPT_RANGES);
-    if (accept_header == NULL) {
-        return false;
+void exchange_extend(Exchange* exchange, int64_t from, double seconds) {
+    exchange->deadline = from + (int64_t) (seconds * 1e9);
+}
+
+/**
+ * @brief Starts an exchange for a URL, over an idle connection if there is
+ * one, or else a new non-blocking connection.
+ *
+ * @param exchange
+ * @param url
+ * @param transfer The range to request, or NULL for a HEAD request.
+ * @param info Filled in from the response's header, for a probe, or NULL.
+ * @param pool The pool to take receive buffers from.
+ * @param connections The pool of idle connections.
+ * @param resolver The resolver to look the host up in.
+ * @return ExchangeState EXCHANGE_FAILED if the exchange could not start.
+ */
+ExchangeState exchange_start(Exchange* exchange, const char* url,
+                             Transfer* transfer, ResourceInfo* info,
+                             BufferPool* pool, ConnectionPool* connections,
+                             Resolver* resolver) {
+    memset(exchange, 0, sizeof(Exchange));
+    exchange->sockfd = BAD_SOCKET;
+    exchange->state = EXCHANGE_FAILED;
+    exchange->pool = pool;
+    exchange->connections = connections;
+    exchange->resolver = resolver;
+    response_init(&exchange->response, transfer == NULL, transfer, pool);
+    exchange->response.info = info;
+
+    exchange->host = strdup(url);
+    if (split_url(exchange->host, &exchange->page, &exchange->port) == -1) {
+        fprintf(stderr, "could not split url into host/page %s\n", url);
+        return exchange->state;
     }
 
-    char* value_start =
-        consume_whitespace(accept_header + strlen(ACCEPT_RANGES), buffer);
+    exchange->request = format_request(exchange->host, exchange->port,
+                                       exchange->page, transfer);
+    exchange->request_length = strlen(exchange->request);
+
+    exchange->sockfd = connection_pool_get(connections, exchange->host,
+                                           exchange->port);
+    if (exchange->sockfd != BAD_SOCKET &&
+        set_nonblocking(exchange->sockfd, true) == 0) {
+        exchange->reused = true;
+        exchange->state = EXCHANGE_SENDING;
+        exchange_extend(exchange, limiter_now(),
+                        connection_pool_timeouts(connections)->first_byte);
+        return exchange->state;
+    }
 
-    char* accept_value = strstr(value_start, BYTES);
-    // If there is a substring matching BYTES, than it should be at the location
-    // `accept_header`.
-    return value_start == accept_value;
+    if (exchange->sockfd != BAD_SOCKET) {
+        close(exchange->sockfd);
+        exchange->sockfd = BAD_SOCKET;
+    }
+    return exchange_resolve(exchange);
 }
 
 /**
- * @brief Gets the Content-Length value from the HTTP header.
+ * @brief Whether the exchange is waiting for its socket to be writable.
  *
- * @param bufferThe buffer containing the HTTP header.
- * @return int The value for the Content-Length header. 0 if the header does not
- * exist.
+ * @param exchange
+ * @return true The exchange is connecting, or sending its request.
+ * @return false The exchange is waiting for the response, or has ended.
  */
-int get_content_length(Buffer* buffer) {
-    char* length_header = strstr(buffer->data, CONTENT_LENGTH);
-    if (length_header == NULL) {
-        return 0;
-    }
+bool exchange_wants_write(const Exchange* exchange) {
+    return exchange->state == EXCHANGE_CONNECTING ||
+           exchange->state == EXCHANGE_SENDING;
+}
 
-    return atoi(length_header + strlen(CONTENT_LENGTH));
+/**
+ * @brief The sockets the exchange is waiting on: every connection attempt
+ * in progress while connecting, and otherwise its one socket, unless it is
+ * waiting for its limiter instead.
+ *
+ * @param exchange
+ * @param sockets Filled in with up to MAX_ADDRESSES sockets.
+ * @return int The number of sockets.
+ */
+int exchange_sockets(const Exchange* exchange, int* sockets) {
+    switch (exchange->state) {
+        case EXCHANGE_CONNECTING:
+            return connector_sockets(&exchange->connector, sockets);
+        case EXCHANGE_RECEIVING:
+            if (exchange->resume) {
+                return 0;
+            }
+            // fall through
+        case EXCHANGE_SENDING:
+            sockets[0] = exchange->sockfd;
+            return 1;
+        default:
+            return 0;
+    }
 }
 
 /**
- * @brief Parses the header for Accept-Ranges and Content-Length headers.
+ * @brief How long the exchange can wait for its sockets before it must be
+ * stepped anyway, to start racing another address, to read again once its
+ * limiter allows, or to give up on a server that has gone quiet.
  *
- * @param buffer
- * @param accept_ranges
- * @param content_length
+ * @param exchange
+ * @return int The number of milliseconds, or -1 for no limit.
  */
-void parse_head(Buffer* buffer, bool* accept_ranges, int* content_length) {
-    // Converts the buffer to a lower case.
-    for (size_t i = 0; i < buffer->length; i++) {
-        buffer->data[i] = tolower(buffer->data[i]);
+int exchange_timeout(const Exchange* exchange) {
+    if (exchange->state == EXCHANGE_CONNECTING) {
+        return connector_timeout(&exchange->connector);
     }
 
-    *accept_ranges = get_accept_ranges(buffer);
-    *content_length = get_content_length(buffer);
+    // The deadline is never before the limiter allows a read
+    int64_t due = exchange->resume ? exchange->resume : exchange->deadline;
+    if (due && (exchange->state == EXCHANGE_SENDING ||
+                exchange->state == EXCHANGE_RECEIVING)) {
+        int64_t left = due - limiter_now();
+        return left > 0 ? (left + 999999) / 1000000 : 0;
+    }
+    return -1;
 }
 
 /**
- * @brief Divides the numerator by the denominator, and returns the ceiling of
- * the floating point value as an integer.
+ * @brief Handles an exchange failing. A reused connection may have been
+ * closed by the server just as it was checked out, so if it fails before any
+ * of the response arrives, the request is retried once on a new connection.
  *
- * @param num
- * @param denom
- * @return int
+ * @param exchange
+ * @return ExchangeState The state the exchange is now in.
  */
-int divide_ceil(int num, int denom) {
-    int result = (float) num / denom;
-    if (result * denom < num) {
-        result++;
+ExchangeState exchange_fail(Exchange* exchange) {
+    if (!exchange->reused || exchange->retried ||
+        exchange->response.received > 0) {
+        exchange->state = EXCHANGE_FAILED;
+        return exchange->state;
     }
-    return result;
+
+    close(exchange->sockfd);
+    exchange->sockfd = BAD_SOCKET;
+    exchange->reused = false;
+    exchange->retried = true;
+    exchange->sent = 0;
+
+    return exchange_resolve(exchange);
 }
 
 /**
- * Makes a HEAD request to a given URL and gets the content length
- * Then determines max_chunk_size and number of split downloads needed
- * @param url   The URL of the resource to download
- * @param threads   The number of threads to be used for the download
- * @return int  The number of downloads needed satisfying max_chunk_size
- *              to download the resource
+ * @brief Makes as much progress on an exchange as its socket allows without
+ * blocking. At most one read is made, so that one busy connection cannot
+ * starve the others of an event loop, and none while the transfer's limiter
+ * is holding reads back.
+ *
+ * @param exchange
+ * @return ExchangeState The state the exchange is now in.
  */
-int get_num_tasks(char* url, int threads) {
-    char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
-    char* page = strstr(host, "/");
+ExchangeState exchange_step(Exchange* exchange) {
+    Response* response = &exchange->response;
+    const Timeouts* timeouts = connection_pool_timeouts(exchange->connections);
 
-    if (page) {
-        page[0] = '\0';
-        ++page;
-    } else {
-        return 0;
+    if (exchange->state == EXCHANGE_RESOLVING &&
+        exchange_resolve(exchange) == EXCHANGE_RESOLVING) {
+        return exchange->state;
     }
 
-    Buffer* buffer = http_head(host, page, 80);
-    if (buffer == NULL) {
-        return 0;
+    if (exchange->state == EXCHANGE_CONNECTING) {
+        int sockfd = connector_step(&exchange->connector);
+        if (sockfd == CONNECT_PENDING) {
+            return exchange->state;
+        } else if (sockfd == BAD_SOCKET) {
+            fprintf(stderr, "ERROR: connect\n");
+            exchange->state = EXCHANGE_FAILED;
+            return exchange->state;
+        }
+        exchange->sockfd = sockfd;
+        exchange->state = EXCHANGE_SENDING;
+        exchange_extend(exchange, limiter_now(), timeouts->first_byte);
     }
 
-    bool accept_ranges;
-    int content_length;
-    parse_head(buffer, &accept_ranges, &content_length);
-    buffer_free(buffer);
+    if ((exchange->state == EXCHANGE_SENDING ||
+         exchange->state == EXCHANGE_RECEIVING) &&
+        !exchange->resume && limiter_now() >= exchange->deadline) {
+        fprintf(stderr, "timed out waiting for %s\n",
+                response->received ? "more of the response" : "a response");
+        return exchange_fail(exchange);
+    }
 
-    if (accept_ranges == false || content_length < BUF_SIZE) {
-        max_chunk_size = content_length;
-        return 1;
+    if (exchange->state == EXCHANGE_SENDING) {
+        while (exchange->sent < exchange->request_length) {
+            ssize_t sent = send(exchange->sockfd,
+                                exchange->request + exchange->sent,
+                                exchange->request_length - exchange->sent,
+                                MSG_NOSIGNAL);
+            if (sent == -1) {
+                return errno == EAGAIN ? exchange->state
+                                       : exchange_fail(exchange);
+            }
+            exchange->sent += sent;
+        }
+        exchange->response.requested = trace_begin();
+        exchange->state = EXCHANGE_RECEIVING;
+        exchange_extend(exchange, limiter_now(), timeouts->first_byte);
+        return exchange->state;
+    }
+
+    if (exchange->state != EXCHANGE_RECEIVING) {
+        return exchange->state;
+    }
+    if (exchange->resume) {
+        if (limiter_now() < exchange->resume) {
+            return exchange->state;
+        }
+        exchange->resume = 0;
+    }
+
+    Buffer* recv_buffer = NULL;
+    bool splicing = response_can_splice(response);
+    ssize_t bytes_read;
+    int result = 0;
+
+    if (splicing) {
+        bytes_read = response_splice(response, exchange->sockfd, true);
     } else {
-        max_chunk_size = divide_ceil(content_length, threads);
-        return threads;
+        size_t space;
+        recv_buffer = buffer_pool_get(exchange->pool, RECV_SIZE);
+        char* data = response_read_buffer(response, recv_buffer, &space);
+        bytes_read = read(exchange->sockfd, data, space);
+        if (bytes_read > 0) {
+            result = response_received(response, data, bytes_read);
+        }
     }
+
+    if (result == -1) {
+        exchange->state = EXCHANGE_FAILED;
+    } else if (bytes_read > 0) {
+        exchange->resume = response_limit(response, bytes_read);
+        exchange_extend(exchange,
+                        exchange->resume ? exchange->resume : limiter_now(),
+                        timeouts->idle);
+        if (response->complete) {
+            exchange->state = EXCHANGE_DONE;
+        }
+    } else if (bytes_read == 0) {
+        if (response->header_done && response->framing == BODY_UNTIL_CLOSE &&
+            response_close(response) == 0) {
+            exchange->state = EXCHANGE_DONE;
+        } else {
+            exchange_fail(exchange);
+        }
+    } else if (errno != EAGAIN) {
+        perror(splicing ? "splice" : "read");
+        exchange_fail(exchange);
+    }
+
+    if (recv_buffer) {
+        buffer_pool_put(exchange->pool, recv_buffer);
+    }
+    return exchange->state;
 }
 
-int get_max_chunk_size() {
-    return max_chunk_size;
+/**
+ * @brief Ends an exchange, pooling or closing its connection.
+ *
+ * @param exchange
+ * @return ssize_t The number of body bytes written, 0 for a HEAD request, or
+ * -1 on failure.
+ */
+ssize_t exchange_finish(Exchange* exchange) {
+    Response* response = &exchange->response;
+    ssize_t result = -1;
+
+    if (exchange->state == EXCHANGE_DONE) {
+        result = response->written;
+
+        // Pooled sockets are blocking, as http_exchange expects
+        if (response->keep_alive &&
+            set_nonblocking(exchange->sockfd, false) == 0) {
+            connection_pool_put(exchange->connections, exchange->host,
+                                exchange->port, exchange->sockfd);
+            exchange->sockfd = BAD_SOCKET;
+        }
+    }
+
+    if (exchange->sockfd != BAD_SOCKET) {
+        close(exchange->sockfd);
+    }
+    if (exchange->state == EXCHANGE_CONNECTING) {
+        connector_cancel(&exchange->connector);
+    }
+
+    response_free(response, exchange->pool);
+    free(exchange->request);
+    free(exchange->host);
+    return result;
 }
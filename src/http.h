@@ -1,13 +1,140 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdbool.h>
+#include <sys/types.h>
 
-// A buffer object with data, and a length
+#include "buffer.h"
+#include "connection.h"
+#include "digest.h"
+#include "header.h"
+#include "resolver.h"
+#include "transfer.h"
+
+#define CHUNK_LINE_SIZE 256
+#define VALIDATOR_SIZE 256
+#define BOUNDARY_SIZE 72 // Room for a multipart boundary, at most 70 long
+
+// How the end of a response's body is found
+typedef enum {
+    BODY_NONE,        // There is no body e.g. the response to a HEAD
+    BODY_LENGTH,      // The body is Content-Length bytes long
+    BODY_CHUNKED,     // The body uses chunked transfer encoding
+    BODY_UNTIL_CLOSE, // The body ends when the server closes the connection
+} BodyFraming;
+
+// Where the chunked transfer decoder is within the body
+typedef enum {
+    CHUNK_SIZE,     // Reading a chunk size line
+    CHUNK_DATA,     // Reading a chunk's data
+    CHUNK_DATA_END, // Reading the line break after a chunk's data
+    CHUNK_TRAILER,  // Reading the trailer, after the last chunk
+} ChunkState;
+
+// Where the multipart/byteranges decoder is within the body
+typedef enum {
+    PART_DELIMITER, // Reading lines up to the next boundary delimiter
+    PART_HEADER,    // Reading a part's header, up to its blank line
+    PART_DATA,      // Reading a part's data
+    PART_EPILOGUE,  // After the closing delimiter, where all is ignored
+} PartState;
+
+// The state of a multipart/byteranges body, whose parts are ranges
+typedef struct {
+    char boundary[BOUNDARY_SIZE]; // Without the leading "--"
+    PartState state;
+    char line[CHUNK_LINE_SIZE]; // A partially received line
+    size_t line_length;
+    long long remaining; // Data bytes left in the part, or -1 until its
+                         // header has given its range
+} Multipart;
+
+// What a probe found out about a resource
 typedef struct {
-    char *data;
-    size_t length;
+    bool accept_ranges;                 // True if the server sends ranges
+    off_t content_length;               // The size, or 0 if unknown
+    char etag[VALIDATOR_SIZE];          // The ETag, or "" if there is none
+    char last_modified[VALIDATOR_SIZE]; // The Last-Modified date, or ""
+    DigestSet digests; // From a Digest, Repr-Digest or Content-MD5 header
+} ResourceInfo;
 
-} Buffer;
+// The state of a response that is being read
+typedef struct {
+    Buffer *header;      // The header, read into until it has all arrived
+    HeaderParser parser; // Parses the header where it lies in `header`
+    bool header_done;    // True once the blank line ending the header is read
+    bool head;           // True if the response is to a HEAD request
+    int status;          // The status code e.g. 206
+    bool keep_alive;     // True if the connection can be reused afterwards
+    bool complete;       // True once the whole response has been read
+
+    BodyFraming framing;
+    ChunkState chunk_state;
+    char line[CHUNK_LINE_SIZE]; // A partially received chunk size line
+    size_t line_length;
+    long long remaining; // Bytes left in the body, or in the current chunk
+
+    Transfer *transfer; // The range to write the body into, and any
+                        // chained after it
+    ResourceInfo *info; // Filled in from the header, for a probe, or NULL
+    Multipart *multipart; // Decodes the body, if it is multipart, or NULL
+    off_t offset;         // Where in the resource the next body byte is,
+                          // if it is routed to several ranges
+    int pipe[2];        // The pipe the body is spliced through, or -1 until
+                        // it is first needed
+    ssize_t written;    // The number of body bytes written
+    size_t received;    // The number of bytes read, including the header
+
+    int64_t requested;  // When the request was sent, for tracing
+    int64_t first_byte; // When the first byte of the response arrived
+} Response;
+
+
+// The stage an exchange has reached
+typedef enum {
+    EXCHANGE_RESOLVING,  // Waiting for the host to be resolved
+    EXCHANGE_CONNECTING, // Waiting for a new connection to be established
+    EXCHANGE_SENDING,    // Waiting to send the rest of the request
+    EXCHANGE_RECEIVING,  // Waiting for more of the response
+    EXCHANGE_DONE,       // The response has been read in full
+    EXCHANGE_FAILED,     // The exchange cannot go on
+} ExchangeState;
+
+/*
+ * Exchange - a request and its response over a non-blocking socket, for an
+ * event loop to drive. The loop waits until the sockets from
+ * exchange_sockets are writable, if exchange_wants_write says so, or else
+ * readable, and then calls exchange_step, until the exchange is done or has
+ * failed. exchange_step must also be called once exchange_timeout expires,
+ * and whenever the resolver has resolved a name while the exchange is
+ * resolving. Each phase of the exchange is given up on once it has taken
+ * longer than the connection pool's timeouts allow.
+ */
+typedef struct {
+    ExchangeState state;
+    int sockfd;
+    Connector connector; // The attempts to connect, before there is a socket
+    bool reused;  // True if the socket came from the connection pool
+    bool retried; // True once the request has been retried on a new socket
+
+    char *host; // A copy of the URL, split into the host and page
+    char *page;
+    int port;
+
+    char *request;
+    size_t request_length;
+    size_t sent;
+
+    int64_t resume;   // When to read again, once reads have been limited,
+                      // or 0
+    int64_t deadline; // When to give up waiting on the socket, on the clock
+                      // of limiter_now, or 0 before there is a socket
+
+    Response response;
+    BufferPool *pool;
+    ConnectionPool *connections;
+    Resolver *resolver;
+} Exchange;
 
 
 /**
@@ -48,27 +175,148 @@ Buffer *http_url(const char *url, const char *range);
 
 
 /**
- * Free a buffer
- * @param buffer - Pointer to a buffer to free
- */ 
-inline static void buffer_free(Buffer *buffer) {
-    free(buffer->data);
-    free(buffer);
-}
+ * Splits an HTTP url into host, port and page, and requests `transfer`'s
+ * range of it. Rather than buffering the response, the body is written into
+ * the range as it arrives. Only the header is held in memory. If the range is
+ * cut short by transfer_split while the response is arriving, the rest of
+ * the response is not read. If the transfer has an If-Range validator, and
+ * the resource no longer matches it, nothing is written and the transfer is
+ * marked as changed. A response of another range fails, but a 200 holding
+ * all of the resource is adopted by the transfer (see transfer_adopt), or
+ * left unread if another transfer of the resource adopted one first. If the
+ * transfer has a limiter, reading pauses whenever it says to.
+ * The ranges of any transfers chained after the first are asked for in the
+ * same request. The server may send them as a multipart/byteranges body, or
+ * as a single range, or all of the resource, and each range takes what it
+ * can of what is sent; any it gets none or only part of are left short.
+ * The query is made over HTTP 1.1, on a persistent connection taken from
+ * `connections`, which is returned to it once the response has been read.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile, or with a
+ *              port e.g. localhost:8080/files/a.bin
+ * @param transfer - The range to request, and write the body into
+ * @param pool - The calling thread's pool to take receive buffers from, or
+ *               NULL to allocate them for this request only
+ * @param connections - The pool of idle connections to reuse
+ * @param resolver - The resolver to look the host up in, or NULL
+ * @return ssize_t - The number of body bytes written, or -1 on failure
+ */
+ssize_t http_url_to_file(const char *url, Transfer *transfer,
+                         BufferPool *pool, ConnectionPool *connections,
+                         Resolver *resolver);
 
 
 /**
- * Makes a HEAD request to a given URL and gets the content length
- * maxByteSize is set from this, and number of split downloads determined
+ * Requests the first range of a given URL, and gets from the response's
+ * header whether the server accepts byte ranges for it, its size, its
+ * validators, and any digests of it, while the body is written into the
+ * range. A server which does not send ranges sends the whole resource,
+ * which is written in full. Safe to call from several threads at once.
  * @param url   The URL of the resource to download
- * @param threads   The number of threads to be used for the download
- * @return int  The number of downloads needed satisfying maxByteSize
- *              to download the resource
+ * @param info   Filled in with what the server says about the resource
+ * @param transfer   The first range, starting at 0, to write the body into
+ * @param pool   The calling thread's pool to take receive buffers from
+ * @param connections   The pool of idle connections to make the request with
+ * @param resolver   The resolver to look the host up in, or NULL
+ * @return ssize_t  The number of body bytes written, or -1 on failure
  */
-int get_num_tasks(char *url, int threads);
+ssize_t http_probe(const char *url, ResourceInfo *info, Transfer *transfer,
+                   BufferPool *pool, ConnectionPool *connections,
+                   Resolver *resolver);
 
-int max_chunk_size; // The maximum size in bytes of a chunk to download
 
-int get_max_chunk_size(void);
+/**
+ * The validator to send in an If-Range header, so that a range is only sent
+ * if the resource still matches it: the ETag if it is a strong one, or else
+ * the Last-Modified date
+ * @param info   A resource's details, from http_probe
+ * @return string   The validator, or NULL if the resource has none
+ */
+const char *http_validator(const ResourceInfo *info);
+
+
+/**
+ * Starts resolving the host of a URL in the background, so that it is
+ * ready by the time the URL is downloaded.
+ * @param url   The URL of a resource to download
+ * @param resolver   The resolver to resolve the host in
+ */
+void http_prefetch(const char *url, Resolver *resolver);
+
+
+/**
+ * Starts an exchange for a URL: a range request for `transfer`, whose body
+ * is written into its range as it arrives, or a HEAD request if `transfer`
+ * is NULL. Given `info`, the exchange is a probe, as by http_probe. An idle
+ * connection is taken from `connections` if there is one,
+ * otherwise the host is looked up without blocking, and connections to its
+ * addresses are raced. Whatever the returned state,
+ * the exchange must be ended with exchange_finish.
+ * @param exchange - The exchange to start
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param transfer - The range to request, or NULL to make a HEAD request
+ * @param info - Filled in with what the server says about the resource, or
+ *               NULL
+ * @param pool - The calling thread's pool to take receive buffers from
+ * @param connections - The pool of idle connections to reuse
+ * @param resolver - The resolver to look the host up in, or NULL to resolve
+ *                   it there and then
+ * @return ExchangeState - EXCHANGE_FAILED if the exchange could not start
+ */
+ExchangeState exchange_start(Exchange *exchange, const char *url,
+                             Transfer *transfer, ResourceInfo *info,
+                             BufferPool *pool, ConnectionPool *connections,
+                             Resolver *resolver);
+
+
+/**
+ * Whether the exchange is waiting for its socket to become writable, rather
+ * than readable
+ * @param exchange - The exchange
+ * @return bool - true while connecting or sending the request
+ */
+bool exchange_wants_write(const Exchange *exchange);
+
+
+/**
+ * The sockets to wait on: every connection attempt in progress while
+ * connecting, then the exchange's one socket
+ * @param exchange - The exchange
+ * @param sockets - Filled in with up to MAX_ADDRESSES sockets
+ * @return int - The number of sockets, 0 while resolving or while reads are
+ *               held back by the transfer's limiter
+ */
+int exchange_sockets(const Exchange *exchange, int *sockets);
+
+
+/**
+ * How long to wait on the exchange's sockets before calling exchange_step
+ * anyway, to race the next address or to read again once the transfer's
+ * limiter allows
+ * @param exchange - The exchange
+ * @return int - The number of milliseconds, or -1 for no limit
+ */
+int exchange_timeout(const Exchange *exchange);
+
+
+/**
+ * Makes as much progress as the socket allows without blocking. Call once
+ * the socket is ready. A reused connection which fails before any of the
+ * response arrives is replaced by a new one, in which case the exchange's
+ * socket changes.
+ * @param exchange - The exchange
+ * @return ExchangeState - The state the exchange is now in
+ */
+ExchangeState exchange_step(Exchange *exchange);
+
+
+/**
+ * Ends an exchange, returning its connection to the pool if the response
+ * left it reusable and closing it otherwise
+ * @param exchange - The exchange to end
+ * @return ssize_t - The number of body bytes written for a range request, 0
+ *                   for a HEAD request, or -1 if the exchange failed
+ */
+ssize_t exchange_finish(Exchange *exchange);
+
 
 #endif
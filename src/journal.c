@@ -0,0 +1,302 @@
+#include "journal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "getter-journal 1"
+#define INITIAL_RANGES 16
+#define RECORD_LEN 48
+
+// A range of the download which has been written
+typedef struct {
+    off_t start;
+    off_t end;
+} Range;
+
+struct JournalStruct {
+    char* path;
+    int fd; // The journal's file, opened for appending records
+
+    off_t content_length;
+    char* etag;
+    char* last_modified;
+
+    Range* ranges; // Sorted, with touching ranges merged
+    int num_ranges;
+    int capacity;
+};
+
+/**
+ * @brief Adds a range to the journal's ranges, merging it with any it
+ * overlaps or touches.
+ *
+ * @param journal
+ * @param start
+ * @param end
+ */
+static void add_range(Journal* journal, off_t start, off_t end) {
+    if (start >= end) {
+        return;
+    }
+
+    // The ranges [first, last) are merged into the new one
+    int first = 0;
+    while (first < journal->num_ranges && journal->ranges[first].end < start) {
+        first++;
+    }
+    int last = first;
+    while (last < journal->num_ranges && journal->ranges[last].start <= end) {
+        Range* range = &journal->ranges[last++];
+        start = range->start < start ? range->start : start;
+        end = range->end > end ? range->end : end;
+    }
+
+    if (first == last && journal->num_ranges == journal->capacity) {
+        journal->capacity *= 2;
+        journal->ranges =
+            realloc(journal->ranges, journal->capacity * sizeof(Range));
+    }
+
+    // Make room for one range in place of [first, last)
+    memmove(&journal->ranges[first + 1], &journal->ranges[last],
+            (journal->num_ranges - last) * sizeof(Range));
+    journal->num_ranges += 1 - (last - first);
+    journal->ranges[first] = (Range){start, end};
+}
+
+/**
+ * @brief Gets the value of a header line of the journal.
+ *
+ * @param line The line, without its line feed.
+ * @param key The line's key e.g. "etag".
+ * @return const char* The value, or NULL if the line is for another key.
+ */
+static const char* header_value(const char* line, const char* key) {
+    size_t length = strlen(key);
+    if (strncmp(line, key, length) != 0 || line[length] != ' ') {
+        return NULL;
+    }
+    return line + length + 1;
+}
+
+/**
+ * @brief Reads the ranges from a journal's file, if it was written for the
+ * same resource as the journal.
+ *
+ * @param journal
+ * @return true The file was for the same resource, and its ranges were read.
+ * @return false There is no file, or it was for another resource.
+ */
+static bool load(Journal* journal) {
+    FILE* file = fopen(journal->path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    const char* expected[] = {JOURNAL_MAGIC, NULL, journal->etag,
+                              journal->last_modified};
+    const char* keys[] = {NULL, "length", "etag", "last-modified"};
+    char length[RECORD_LEN];
+    snprintf(length, RECORD_LEN, "%lld", (long long) journal->content_length);
+    expected[1] = length;
+
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t read;
+    int lines = 0;
+    bool same = true;
+
+    while (same && (read = getline(&line, &line_size, file)) != -1) {
+        // A line without its line feed was cut short
+        if (line[read - 1] != '\n') {
+            break;
+        }
+        line[read - 1] = '\0';
+
+        if (lines < 4) {
+            const char* value = keys[lines] ? header_value(line, keys[lines])
+                                            : line;
+            same = value && strcmp(value, expected[lines]) == 0;
+        } else {
+            long long start, end;
+            if (sscanf(line, "%lld %lld", &start, &end) == 2 && start >= 0 &&
+                end <= journal->content_length) {
+                add_range(journal, start, end);
+            }
+        }
+        lines++;
+    }
+
+    free(line);
+    fclose(file);
+
+    if (!same || lines < 4) {
+        journal->num_ranges = 0;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the journal's file afresh, with its ranges merged, and opens
+ * it to append to. The file is written beside the old one and renamed over
+ * it, so that the old one is intact if writing fails.
+ *
+ * @param journal
+ * @return int 0 on success, -1 on failure.
+ */
+static int rewrite(Journal* journal) {
+    size_t tmp_length = strlen(journal->path) + 5;
+    char tmp[tmp_length];
+    snprintf(tmp, tmp_length, "%s.tmp", journal->path);
+
+    FILE* file = fopen(tmp, "w");
+    if (file == NULL) {
+        perror("journal");
+        return -1;
+    }
+
+    fprintf(file, "%s\nlength %lld\netag %s\nlast-modified %s\n",
+            JOURNAL_MAGIC, (long long) journal->content_length, journal->etag,
+            journal->last_modified);
+    for (int i = 0; i < journal->num_ranges; i++) {
+        fprintf(file, "%lld %lld\n", (long long) journal->ranges[i].start,
+                (long long) journal->ranges[i].end);
+    }
+
+    if (fclose(file) != 0 || rename(tmp, journal->path) == -1) {
+        perror("journal");
+        remove(tmp);
+        return -1;
+    }
+
+    journal->fd = open(journal->path, O_WRONLY | O_APPEND);
+    return journal->fd == -1 ? -1 : 0;
+}
+
+/**
+ * Open the journal for a download, picking up the ranges it has already
+ * recorded if it was written for the same resource, or starting it afresh
+ * otherwise
+ * @param path - The journal's file e.g. downloads/host_file.journal
+ * @param content_length - The size of the resource
+ * @param etag - The resource's ETag, or "" if it has none
+ * @param last_modified - The resource's Last-Modified date, or "" if none
+ * @param resumed - Set to true if ranges were picked up from an earlier run
+ * @return journal - The journal, or NULL if its file could not be written
+ */
+Journal* journal_open(const char* path, off_t content_length,
+                      const char* etag, const char* last_modified,
+                      bool* resumed) {
+    Journal* journal = malloc(sizeof(Journal));
+    journal->path = strdup(path);
+    journal->fd = -1;
+    journal->content_length = content_length;
+    journal->etag = strdup(etag);
+    journal->last_modified = strdup(last_modified);
+    journal->capacity = INITIAL_RANGES;
+    journal->ranges = malloc(journal->capacity * sizeof(Range));
+    journal->num_ranges = 0;
+
+    // Without a validator there is no telling whether the resource changed
+    *resumed = (*etag || *last_modified) && load(journal) &&
+               journal->num_ranges > 0;
+
+    if (rewrite(journal) == -1) {
+        journal_close(journal, false);
+        return NULL;
+    }
+    return journal;
+}
+
+/**
+ * Record that a range of the download has been written
+ * @param journal - The journal
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ * @return int - 0 on success, -1 if the record could not be written
+ */
+int journal_record(Journal* journal, off_t start, off_t end) {
+    if (start >= end) {
+        return 0;
+    }
+    add_range(journal, start, end);
+
+    // One write, so that a record is never interleaved with another
+    char record[RECORD_LEN];
+    int length = snprintf(record, RECORD_LEN, "%lld %lld\n",
+                          (long long) start, (long long) end);
+    if (write(journal->fd, record, length) != length) {
+        perror("journal");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the first range of the download, at or after an offset, which has
+ * not been recorded
+ * @param journal - The journal
+ * @param from - The offset to look from
+ * @param start - Set to the start of the missing range
+ * @param end - Set to one past the end of the missing range
+ * @return bool - true if a range is missing, false if everything from
+ *                `from` on has been recorded
+ */
+bool journal_next_missing(const Journal* journal, off_t from, off_t* start,
+                          off_t* end) {
+    *end = journal->content_length;
+
+    for (int i = 0; i < journal->num_ranges; i++) {
+        const Range* range = &journal->ranges[i];
+        if (range->end <= from) {
+            continue;
+        }
+        if (range->start <= from) {
+            from = range->end;
+        } else {
+            *end = range->start;
+            break;
+        }
+    }
+
+    *start = from;
+    return from < *end;
+}
+
+/**
+ * The number of bytes of the download that have been recorded
+ * @param journal - The journal
+ * @return off_t - The number of bytes
+ */
+off_t journal_completed(const Journal* journal) {
+    off_t completed = 0;
+    for (int i = 0; i < journal->num_ranges; i++) {
+        completed += journal->ranges[i].end - journal->ranges[i].start;
+    }
+    return completed;
+}
+
+/**
+ * Close a journal
+ * @param journal - The journal to close
+ * @param discard - true to delete its file, once the download is complete or
+ *                  what it recorded can no longer be used
+ */
+void journal_close(Journal* journal, bool discard) {
+    if (journal->fd != -1) {
+        close(journal->fd);
+    }
+    if (discard) {
+        remove(journal->path);
+    }
+
+    free(journal->path);
+    free(journal->etag);
+    free(journal->last_modified);
+    free(journal->ranges);
+    free(journal);
+}
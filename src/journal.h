@@ -0,0 +1,90 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+/*
+ * Journal - a record, kept in a file next to a download, of which byte
+ * ranges of it have been written, so that a download cut short can be picked
+ * up where it left off. Alongside the ranges it keeps the content length and
+ * validators (ETag and Last-Modified) of the resource they were downloaded
+ * from, so that they are only reused while the resource is unchanged.
+ *
+ * The file is text: a header of the resource's details, then a line per
+ * range, appended as each is written. A line cut short by a crash is
+ * ignored. It is rewritten with the ranges merged each time it is opened.
+ *
+ *   getter-journal 1
+ *   length 2000000
+ *   etag "5f7cf1e2-1e8480"
+ *   last-modified Tue, 06 Oct 2026 21:40:02 GMT
+ *   0 262144
+ *   524288 786432
+ *
+ * A range is recorded once its bytes have been handed to the OS, so the
+ * journal survives the downloader dying, but not necessarily the machine.
+ * Not safe to share between threads.
+ */
+typedef struct JournalStruct Journal;
+
+
+/**
+ * Open the journal for a download, picking up the ranges it has already
+ * recorded if it was written for the same resource, or starting it afresh
+ * otherwise
+ * @param path - The journal's file e.g. downloads/host_file.journal
+ * @param content_length - The size of the resource
+ * @param etag - The resource's ETag, or "" if it has none
+ * @param last_modified - The resource's Last-Modified date, or "" if none
+ * @param resumed - Set to true if ranges were picked up from an earlier run
+ * @return journal - The journal, or NULL if its file could not be written
+ */
+Journal *journal_open(const char *path, off_t content_length,
+                      const char *etag, const char *last_modified,
+                      bool *resumed);
+
+
+/**
+ * Record that a range of the download has been written
+ * @param journal - The journal
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range
+ * @return int - 0 on success, -1 if the record could not be written
+ */
+int journal_record(Journal *journal, off_t start, off_t end);
+
+
+/**
+ * Find the first range of the download, at or after an offset, which has
+ * not been recorded
+ * @param journal - The journal
+ * @param from - The offset to look from
+ * @param start - Set to the start of the missing range
+ * @param end - Set to one past the end of the missing range
+ * @return bool - true if a range is missing, false if everything from
+ *                `from` on has been recorded
+ */
+bool journal_next_missing(const Journal *journal, off_t from, off_t *start,
+                          off_t *end);
+
+
+/**
+ * The number of bytes of the download that have been recorded
+ * @param journal - The journal
+ * @return off_t - The number of bytes
+ */
+off_t journal_completed(const Journal *journal);
+
+
+/**
+ * Close a journal
+ * @param journal - The journal to close
+ * @param discard - true to delete its file, once the download is complete or
+ *                  what it recorded can no longer be used
+ */
+void journal_close(Journal *journal, bool discard);
+
+
+#endif
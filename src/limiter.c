@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "limiter.h"
+
+struct LimiterStruct {
+    double cost;   // Nanoseconds per byte
+    int64_t burst; // Nanoseconds of debt allowed before readers wait
+    int64_t paid;  // When every byte taken so far will have been paid for,
+                   // updated atomically
+};
+
+/**
+ * Allocate a limiter
+ * @param rate - The most bytes to read per second
+ * @return Limiter* - The limiter, with a full bucket
+ */
+Limiter* limiter_alloc(double rate) {
+    Limiter* limiter = malloc(sizeof(Limiter));
+    limiter->cost = 1e9 / rate;
+    limiter->burst = LIMITER_BURST * 1e9;
+    limiter->paid = 0;
+    return limiter;
+}
+
+/**
+ * Free a limiter
+ * @param limiter - The limiter
+ */
+void limiter_free(Limiter* limiter) {
+    free(limiter);
+}
+
+/**
+ * The current time, on the clock limiter_take's deadlines are on
+ * @return int64_t - Nanoseconds on a monotonic clock
+ */
+int64_t limiter_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Take tokens for bytes that have been read. Safe to call from any thread,
+ * and takes no locks.
+ * @param limiter - The limiter
+ * @param bytes - The number of bytes read
+ * @return int64_t - The time to wait until before reading again, on the
+ *                   clock of limiter_now, or 0 if there is no need to wait
+ */
+int64_t limiter_take(Limiter* limiter, size_t bytes) {
+    int64_t now = limiter_now();
+    int64_t cost = bytes * limiter->cost;
+    int64_t paid = __atomic_load_n(&limiter->paid, __ATOMIC_RELAXED);
+    int64_t taken;
+
+    // Time that has gone by unused is not saved up, beyond the burst that
+    // is always allowed
+    do {
+        taken = (paid > now ? paid : now) + cost;
+    } while (!__atomic_compare_exchange_n(&limiter->paid, &paid, taken, true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    int64_t deadline = taken - limiter->burst;
+    return deadline > now ? deadline : 0;
+}
+
+/**
+ * Sleep until a time from limiter_take
+ * @param deadline - The time to wait until, or 0 to return at once
+ */
+void limiter_wait(int64_t deadline) {
+    if (deadline == 0) {
+        return;
+    }
+
+    struct timespec until = {
+        .tv_sec = deadline / 1000000000LL,
+        .tv_nsec = deadline % 1000000000LL,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+           EINTR) {
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Limiter - a token bucket which caps the rate bytes are read at, shared by
+ * every connection.
+ *
+ * Rather than a count of tokens refilled under a lock, the bucket is kept
+ * as the one time at which every byte taken so far will have been paid for,
+ * which readers push on with a compare-and-swap, so taking tokens costs a
+ * single atomic operation. Bytes are taken after they are read: a reader
+ * that has run the bucket more than a burst into debt waits until the debt
+ * is down to a burst before reading again.
+ */
+
+// The bytes that may be read at once without waiting, in seconds of the rate
+#define LIMITER_BURST 0.1
+
+typedef struct LimiterStruct Limiter;
+
+
+/**
+ * Allocate a limiter
+ * @param rate - The most bytes to read per second
+ * @return Limiter* - The limiter, with a full bucket
+ */
+Limiter *limiter_alloc(double rate);
+
+
+/**
+ * Free a limiter
+ * @param limiter - The limiter
+ */
+void limiter_free(Limiter *limiter);
+
+
+/**
+ * The current time, on the clock limiter_take's deadlines are on
+ * @return int64_t - Nanoseconds on a monotonic clock
+ */
+int64_t limiter_now(void);
+
+
+/**
+ * Take tokens for bytes that have been read. Safe to call from any thread,
+ * and takes no locks.
+ * @param limiter - The limiter
+ * @param bytes - The number of bytes read
+ * @return int64_t - The time to wait until before reading again, on the
+ *                   clock of limiter_now, or 0 if there is no need to wait
+ */
+int64_t limiter_take(Limiter *limiter, size_t bytes);
+
+
+/**
+ * Sleep until a time from limiter_take
+ * @param deadline - The time to wait until, or 0 to return at once
+ */
+void limiter_wait(int64_t deadline);
+
+
+#endif
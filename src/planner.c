@@ -0,0 +1,74 @@
+#include "planner.h"
+
+#define TARGET_SECONDS 2.0
+
+// The weight of the newest sample in the throughput moving average
+#define THROUGHPUT_WEIGHT 0.25
+
+/**
+ * @brief Divides the numerator by the denominator, rounding up.
+ *
+ * @param num
+ * @param denom
+ * @return off_t
+ */
+off_t divide_ceil(off_t num, off_t denom) {
+    return num / denom + (num % denom != 0);
+}
+
+/**
+ * Initialise a planner
+ * @param planner - Pointer to the planner to initialise
+ * @param min_chunk - The smallest range worth a request of its own
+ * @param max_chunk - The largest range to request at once
+ */
+void planner_init(Planner* planner, off_t min_chunk, off_t max_chunk) {
+    planner->min_chunk = min_chunk;
+    planner->max_chunk = max_chunk;
+    planner->throughput = 0;
+}
+
+/**
+ * Choose the size of the next range to request from a download
+ * @param planner - Pointer to the planner
+ * @param content_length - The size of the whole resource
+ * @param workers - The number of workers the download can be spread over
+ * @return off_t - The size of the next range
+ */
+off_t planner_chunk_size(Planner* planner, off_t content_length,
+                         int workers) {
+    off_t size = divide_ceil(content_length, workers);
+
+    if (planner->throughput > 0 &&
+        planner->throughput * TARGET_SECONDS < size) {
+        size = planner->throughput * TARGET_SECONDS;
+    }
+
+    if (size > planner->max_chunk) {
+        size = planner->max_chunk;
+    }
+    if (size < planner->min_chunk) {
+        size = planner->min_chunk;
+    }
+    return size;
+}
+
+/**
+ * Record the throughput of a finished range
+ * @param planner - Pointer to the planner
+ * @param bytes - The number of bytes transferred
+ * @param seconds - The time the range took
+ */
+void planner_record(Planner* planner, off_t bytes, double seconds) {
+    if (bytes <= 0 || seconds <= 0) {
+        return;
+    }
+
+    double sample = bytes / seconds;
+    if (planner->throughput == 0) {
+        planner->throughput = sample;
+    } else {
+        planner->throughput = THROUGHPUT_WEIGHT * sample +
+                              (1 - THROUGHPUT_WEIGHT) * planner->throughput;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <sys/types.h>
+
+/*
+ * Planner - chooses how large a range of a download to request at a time.
+ *
+ * Ranges are sized so that a file is spread over the workers, but no range
+ * takes much longer than TARGET_SECONDS at the throughput connections have
+ * been seeing, so that the work can be rebalanced as it goes. Ranges are
+ * always kept within [min_chunk, max_chunk].
+ */
+typedef struct {
+    off_t min_chunk;   // The smallest range worth a request of its own
+    off_t max_chunk;   // The largest range to request at once
+    double throughput; // Bytes per second seen by one connection, 0 if unknown
+
+} Planner;
+
+
+/**
+ * Initialise a planner
+ * @param planner - Pointer to the planner to initialise
+ * @param min_chunk - The smallest range worth a request of its own
+ * @param max_chunk - The largest range to request at once
+ */
+void planner_init(Planner *planner, off_t min_chunk, off_t max_chunk);
+
+
+/**
+ * Choose the size of the next range to request from a download
+ * @param planner - Pointer to the planner
+ * @param content_length - The size of the whole resource
+ * @param workers - The number of workers the download can be spread over
+ * @return off_t - The size of the next range
+ */
+off_t planner_chunk_size(Planner *planner, off_t content_length, int workers);
+
+
+/**
+ * Record the throughput of a finished range
+ * @param planner - Pointer to the planner
+ * @param bytes - The number of bytes transferred
+ * @param seconds - The time the range took
+ */
+void planner_record(Planner *planner, off_t bytes, double seconds);
+
+
+#endif
@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "progress.h"
+
+#define NAME_SIZE 256
+#define CACHE_LINE 64
+#define TEXT_SIZE 32
+
+// A count on a cache line of its own
+typedef struct {
+    int64_t bytes __attribute__((aligned(CACHE_LINE))); // Updated atomically
+} Counter;
+
+typedef struct {
+    bool used;
+    unsigned generation; // Counts the files the slot has been given to
+    char name[NAME_SIZE];
+    off_t size; // 0 if unknown
+    off_t done; // Bytes that were there before it started
+    Counter received;
+} File;
+
+struct ProgressStruct {
+    Counter* connections;
+    int num_connections;
+    File* files;
+    int num_files;
+    int gauges[NUM_PROGRESS_GAUGES]; // Updated atomically
+
+    pthread_mutex_t mutex; // Protects the files' names, sizes and slots,
+                           // and `stop`
+    pthread_cond_t wake;   // Signalled to stop the reporter
+    bool stop;
+    bool running;
+    pthread_t thread;
+    double interval;
+    FILE* out;
+
+    double rate; // Bytes per second over the last interval, read and
+                 // written atomically
+
+    // The reporter's last sample
+    double started;
+    double last_time;
+    int64_t last_total;
+    int64_t* last_connections;
+    int64_t* last_files;
+    unsigned* last_generations;
+};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Formats a number of bytes e.g. 1.5 MiB
+ */
+static void format_size(char* text, double bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(text, TEXT_SIZE, unit == 0 ? "%.0f %s" : "%.1f %s", bytes,
+             units[unit]);
+}
+
+/**
+ * @brief Formats how long it will take to receive some bytes at a rate
+ * e.g. 2m05s, or ? if it cannot be told.
+ */
+static void format_eta(char* text, double bytes, double rate) {
+    if (rate <= 0 || bytes < 0) {
+        snprintf(text, TEXT_SIZE, "?");
+        return;
+    }
+
+    long long seconds = (long long) (bytes / rate + 0.5);
+    if (seconds >= 3600) {
+        snprintf(text, TEXT_SIZE, "%lldh%02lldm", seconds / 3600,
+                 seconds / 60 % 60);
+    } else if (seconds >= 60) {
+        snprintf(text, TEXT_SIZE, "%lldm%02llds", seconds / 60, seconds % 60);
+    } else {
+        snprintf(text, TEXT_SIZE, "%llds", seconds);
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Allocates zeroed memory aligned to a cache line.
+ */
+static void* alloc_aligned(size_t size) {
+    void* memory;
+    if (posix_memalign(&memory, CACHE_LINE, size) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    return memset(memory, 0, size);
+}
+
+/**
+ * Allocate progress counts
+ * @param num_files - The most files that are downloaded at once
+ * @param num_connections - The number of connections
+ * @return Progress* - The counts, all zero
+ */
+Progress* progress_alloc(int num_files, int num_connections) {
+    Progress* progress = calloc(1, sizeof(Progress));
+
+    progress->connections = alloc_aligned(sizeof(Counter) * num_connections);
+    progress->num_connections = num_connections;
+    progress->files = alloc_aligned(sizeof(File) * num_files);
+    progress->num_files = num_files;
+
+    progress->last_connections = calloc(num_connections, sizeof(int64_t));
+    progress->last_files = calloc(num_files, sizeof(int64_t));
+    progress->last_generations = calloc(num_files, sizeof(unsigned));
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&progress->mutex, NULL);
+
+    return progress;
+}
+
+/**
+ * Free progress counts, stopping the reporter if it was started
+ * @param progress - The counts
+ */
+void progress_free(Progress* progress) {
+    progress_stop(progress);
+
+    pthread_cond_destroy(&progress->wake);
+    pthread_mutex_destroy(&progress->mutex);
+    free(progress->connections);
+    free(progress->files);
+    free(progress->last_connections);
+    free(progress->last_files);
+    free(progress->last_generations);
+    free(progress);
+}
+
+/**
+ * Give a file that is starting a slot. Called from the main thread only.
+ * @param progress - The counts
+ * @param name - The file's name e.g. its URL
+ * @return int - The file's slot, or -1 if every slot is taken
+ */
+int progress_file_start(Progress* progress, const char* name) {
+    int slot = -1;
+
+    pthread_mutex_lock(&progress->mutex);
+    for (int i = 0; i < progress->num_files && slot == -1; i++) {
+        File* file = &progress->files[i];
+        if (!file->used) {
+            file->used = true;
+            file->generation++;
+            snprintf(file->name, NAME_SIZE, "%s", name);
+            file->size = file->done = 0;
+            __atomic_store_n(&file->received.bytes, 0, __ATOMIC_RELAXED);
+            slot = i;
+        }
+    }
+    pthread_mutex_unlock(&progress->mutex);
+
+    return slot;
+}
+
+/**
+ * Set the size of a file once it is known, and how much of it was already
+ * there e.g. from an earlier run. Called from the main thread only.
+ * @param progress - The counts
+ * @param file - The file's slot, or -1
+ * @param size - The file's size, or 0 if unknown
+ * @param done - The bytes already there, which are not counted as received
+ */
+void progress_file_size(Progress* progress, int file, off_t size,
+                        off_t done) {
+    if (file == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&progress->mutex);
+    progress->files[file].size = size;
+    progress->files[file].done = done;
+    pthread_mutex_unlock(&progress->mutex);
+}
+
+/**
+ * Free a file's slot, once nothing more will be added to it. Called from
+ * the main thread only.
+ * @param progress - The counts
+ * @param file - The file's slot, or -1
+ */
+void progress_file_end(Progress* progress, int file) {
+    if (file == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&progress->mutex);
+    progress->files[file].used = false;
+    pthread_mutex_unlock(&progress->mutex);
+}
+
+/**
+ * Count bytes received. Safe to call from any thread, and takes no locks.
+ * The counts are only ever sampled, so nothing needs to be ordered with
+ * them.
+ * @param progress - The counts
+ * @param file - The slot of the file they are for, or -1
+ * @param connection - The connection they came over
+ * @param bytes - The number of bytes
+ */
+void progress_add(Progress* progress, int file, int connection,
+                  size_t bytes) {
+    __atomic_add_fetch(&progress->connections[connection].bytes, bytes,
+                       __ATOMIC_RELAXED);
+    if (file != -1) {
+        __atomic_add_fetch(&progress->files[file].received.bytes, bytes,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Move a gauge up or down. Safe to call from any thread, and takes no locks.
+ * @param progress - The counts
+ * @param gauge - The gauge
+ * @param delta - How much to move it by
+ */
+void progress_gauge(Progress* progress, ProgressGauge gauge, int delta) {
+    __atomic_add_fetch(&progress->gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * The total rate bytes were received at, over the reporter's last interval
+ * @param progress - The counts
+ * @return double - Bytes per second, or 0 before the reporter's first
+ *                  sample, or if it was not started
+ */
+double progress_rate(Progress* progress) {
+    double rate;
+    __atomic_load(&progress->rate, &rate, __ATOMIC_RELAXED);
+    return rate;
+}
+
+/**
+ * @brief Samples the counts, and reports the rates since the last sample.
+ *
+ * @param progress
+ */
+static void report(Progress* progress) {
+    double time = now();
+    double elapsed = time - progress->last_time;
+    progress->last_time = time;
+
+    // The connections' rates, of those that received anything
+    double rates[progress->num_connections];
+    int receiving = 0;
+    int64_t total = 0;
+    for (int i = 0; i < progress->num_connections; i++) {
+        int64_t bytes = __atomic_load_n(&progress->connections[i].bytes,
+                                        __ATOMIC_RELAXED);
+        if (bytes > progress->last_connections[i]) {
+            rates[receiving++] =
+                (bytes - progress->last_connections[i]) / elapsed;
+        }
+        progress->last_connections[i] = bytes;
+        total += bytes;
+    }
+    qsort(rates, receiving, sizeof(double), compare_doubles);
+
+    double rate = (total - progress->last_total) / elapsed;
+    progress->last_total = total;
+    __atomic_store(&progress->rate, &rate, __ATOMIC_RELAXED);
+
+    char rate_text[TEXT_SIZE], total_text[TEXT_SIZE], eta_text[TEXT_SIZE];
+    char slowest[TEXT_SIZE], median[TEXT_SIZE], fastest[TEXT_SIZE];
+    format_size(rate_text, rate);
+    format_size(total_text, total);
+    if (receiving > 0) {
+        format_size(slowest, rates[0]);
+        format_size(median, rates[receiving / 2]);
+        format_size(fastest, rates[receiving - 1]);
+    }
+
+    flockfile(progress->out);
+    pthread_mutex_lock(&progress->mutex);
+
+    // What is left of the files under way whose sizes are known
+    off_t left = 0;
+    for (int i = 0; i < progress->num_files; i++) {
+        File* file = &progress->files[i];
+        if (file->used && file->size > 0) {
+            left += file->size - file->done -
+                    __atomic_load_n(&file->received.bytes, __ATOMIC_RELAXED);
+        }
+    }
+    format_eta(eta_text, left, rate);
+
+    fprintf(progress->out,
+            "[%7.1fs] %s/s, %s received, ETA %s; %d connections",
+            time - progress->started, rate_text, total_text, eta_text,
+            __atomic_load_n(&progress->gauges[PROGRESS_CONNECTIONS],
+                            __ATOMIC_RELAXED));
+    if (receiving > 0) {
+        fprintf(progress->out, ", %d receiving at %s/s-%s/s (median %s/s)",
+                receiving, slowest, fastest, median);
+    }
+    fprintf(progress->out, "; %d queued, %d done\n",
+            __atomic_load_n(&progress->gauges[PROGRESS_TODO],
+                            __ATOMIC_RELAXED),
+            __atomic_load_n(&progress->gauges[PROGRESS_DONE],
+                            __ATOMIC_RELAXED));
+
+    for (int i = 0; i < progress->num_files; i++) {
+        File* file = &progress->files[i];
+        int64_t bytes =
+            __atomic_load_n(&file->received.bytes, __ATOMIC_RELAXED);
+
+        // A slot given to another file since the last sample starts afresh
+        int64_t last = progress->last_generations[i] == file->generation
+                           ? progress->last_files[i]
+                           : 0;
+        progress->last_files[i] = bytes;
+        progress->last_generations[i] = file->generation;
+        if (!file->used) {
+            continue;
+        }
+
+        double file_rate = (bytes - last) / elapsed;
+        off_t have = file->done + bytes;
+        char have_text[TEXT_SIZE], size_text[TEXT_SIZE];
+        format_size(have_text, have);
+        format_size(rate_text, file_rate);
+
+        if (file->size > 0) {
+            format_size(size_text, file->size);
+            format_eta(eta_text, file->size - have, file_rate);
+            fprintf(progress->out, "    %s: %s of %s (%.0f%%) at %s/s, "
+                                   "ETA %s\n",
+                    file->name, have_text, size_text,
+                    100.0 * have / file->size, rate_text, eta_text);
+        } else {
+            fprintf(progress->out, "    %s: %s at %s/s\n", file->name,
+                    have_text, rate_text);
+        }
+    }
+
+    pthread_mutex_unlock(&progress->mutex);
+    fflush(progress->out);
+    funlockfile(progress->out);
+}
+
+/**
+ * @brief The reporter thread: reports every interval until it is stopped.
+ *
+ * @param arg The progress counts.
+ * @return void* NULL
+ */
+static void* reporter_thread(void* arg) {
+    Progress* progress = (Progress*) arg;
+
+    pthread_mutex_lock(&progress->mutex);
+    while (!progress->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        long long nanos = deadline.tv_nsec + progress->interval * 1e9;
+        deadline.tv_sec += nanos / 1000000000;
+        deadline.tv_nsec = nanos % 1000000000;
+
+        while (!progress->stop &&
+               pthread_cond_timedwait(&progress->wake, &progress->mutex,
+                                      &deadline) == 0) {
+        }
+        if (progress->stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&progress->mutex);
+        report(progress);
+        pthread_mutex_lock(&progress->mutex);
+    }
+    pthread_mutex_unlock(&progress->mutex);
+
+    return NULL;
+}
+
+/**
+ * Start a thread which reports progress every interval: the total rate
+ * and ETA, the rates of the connections, the queues' depths, and each
+ * file's rate and ETA
+ * @param progress - The counts
+ * @param interval - The seconds between reports
+ * @param out - Where to write the reports e.g. stderr
+ * @return int - 0 on success, -1 if the thread could not be started
+ */
+int progress_start(Progress* progress, double interval, FILE* out) {
+    progress->interval = interval;
+    progress->out = out;
+    progress->started = progress->last_time = now();
+
+    if (pthread_create(&progress->thread, NULL, reporter_thread, progress) !=
+        0) {
+        return -1;
+    }
+    progress->running = true;
+    return 0;
+}
+
+/**
+ * Stop the reporter, if it was started, after a last report of the totals
+ * @param progress - The counts
+ */
+void progress_stop(Progress* progress) {
+    if (!progress->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&progress->mutex);
+    progress->stop = true;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->mutex);
+    pthread_join(progress->thread, NULL);
+    progress->running = false;
+
+    int64_t total = 0;
+    for (int i = 0; i < progress->num_connections; i++) {
+        total += __atomic_load_n(&progress->connections[i].bytes,
+                                 __ATOMIC_RELAXED);
+    }
+
+    double elapsed = now() - progress->started;
+    char total_text[TEXT_SIZE], rate_text[TEXT_SIZE];
+    format_size(total_text, total);
+    format_size(rate_text, elapsed > 0 ? total / elapsed : 0);
+    fprintf(progress->out, "[%7.1fs] %s received, at %s/s on average\n",
+            elapsed, total_text, rate_text);
+    fflush(progress->out);
+}
@@ -0,0 +1,128 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+
+/*
+ * Progress - live counts of the bytes each connection and each file has
+ * received, for a reporter thread to show rates and ETAs from while a run
+ * goes on.
+ *
+ * Workers bump the counts with atomic adds as bytes arrive, taking no locks.
+ * Each connection's count has a cache line of its own, so that connections
+ * do not slow each other down; the total is the sum of them. Files are
+ * given a slot for as long as they are being downloaded, by the main
+ * thread, which takes a lock only to name and size them.
+ *
+ * The reporter samples the counts every interval, and works out rates from
+ * the difference since the last sample. The latest total rate is also
+ * there for anything that wants to adapt to it.
+ */
+
+typedef struct ProgressStruct Progress;
+
+// Levels that go up and down, rather than counts
+typedef enum {
+    PROGRESS_CONNECTIONS, // Tasks being run over a connection
+    PROGRESS_TODO,        // Tasks waiting for a worker
+    PROGRESS_DONE,        // Finished tasks waiting for the main thread
+    NUM_PROGRESS_GAUGES,
+} ProgressGauge;
+
+
+/**
+ * Allocate progress counts
+ * @param num_files - The most files that are downloaded at once
+ * @param num_connections - The number of connections
+ * @return Progress* - The counts, all zero
+ */
+Progress *progress_alloc(int num_files, int num_connections);
+
+
+/**
+ * Free progress counts, stopping the reporter if it was started
+ * @param progress - The counts
+ */
+void progress_free(Progress *progress);
+
+
+/**
+ * Give a file that is starting a slot. Called from the main thread only.
+ * @param progress - The counts
+ * @param name - The file's name e.g. its URL
+ * @return int - The file's slot, or -1 if every slot is taken
+ */
+int progress_file_start(Progress *progress, const char *name);
+
+
+/**
+ * Set the size of a file once it is known, and how much of it was already
+ * there e.g. from an earlier run. Called from the main thread only.
+ * @param progress - The counts
+ * @param file - The file's slot, or -1
+ * @param size - The file's size, or 0 if unknown
+ * @param done - The bytes already there, which are not counted as received
+ */
+void progress_file_size(Progress *progress, int file, off_t size, off_t done);
+
+
+/**
+ * Free a file's slot, once nothing more will be added to it. Called from
+ * the main thread only.
+ * @param progress - The counts
+ * @param file - The file's slot, or -1
+ */
+void progress_file_end(Progress *progress, int file);
+
+
+/**
+ * Count bytes received. Safe to call from any thread, and takes no locks.
+ * @param progress - The counts
+ * @param file - The slot of the file they are for, or -1
+ * @param connection - The connection they came over
+ * @param bytes - The number of bytes
+ */
+void progress_add(Progress *progress, int file, int connection, size_t bytes);
+
+
+/**
+ * Move a gauge up or down. Safe to call from any thread, and takes no locks.
+ * @param progress - The counts
+ * @param gauge - The gauge
+ * @param delta - How much to move it by
+ */
+void progress_gauge(Progress *progress, ProgressGauge gauge, int delta);
+
+
+/**
+ * The total rate bytes were received at, over the reporter's last interval
+ * @param progress - The counts
+ * @return double - Bytes per second, or 0 before the reporter's first
+ *                  sample, or if it was not started
+ */
+double progress_rate(Progress *progress);
+
+
+/**
+ * Start a thread which reports progress every interval: the total rate
+ * and ETA, the rates of the connections, the queues' depths, and each
+ * file's rate and ETA
+ * @param progress - The counts
+ * @param interval - The seconds between reports
+ * @param out - Where to write the reports e.g. stderr
+ * @return int - 0 on success, -1 if the thread could not be started
+ */
+int progress_start(Progress *progress, double interval, FILE *out);
+
+
+/**
+ * Stop the reporter, if it was started, after a last report of the totals
+ * @param progress - The counts
+ */
+void progress_stop(Progress *progress);
+
+
+#endif
@@ -0,0 +1,273 @@
+
+#include "queue.h"
+
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+// How many times to retry a full or empty queue before sleeping, when there
+// is more than one CPU for the other side to make progress on
+#define SPIN_LIMIT 128
+
+/*
+ * A slot in the ring. `sequence` says whose turn it is: a producer may fill
+ * the slot at position p when sequence == p, and a consumer may empty it
+ * when sequence == p + 1.
+ */
+typedef struct {
+    size_t sequence;
+    void* item;
+} Slot;
+
+/*
+ * A futex to sleep on until the other side of the queue makes progress.
+ * `epoch` changes whenever it does, and `waiters` lets the other side skip
+ * the wake up system call when nobody is asleep.
+ */
+typedef struct {
+    uint32_t epoch;
+    uint32_t waiters;
+} Waitpoint;
+
+/*
+ * Queue - a lock free, bounded, multi producer multi consumer ring, after
+ * Dmitry Vyukov's design. Producers and consumers each claim a position
+ * with a compare and swap on their own counter, which live on separate cache
+ * lines so that they do not bounce between producer and consumer cores.
+ * Threads that find the queue full or empty spin briefly, then park on a
+ * futex instead of burning CPU.
+ */
+typedef struct QueueStruct {
+    size_t tail __attribute__((aligned(CACHE_LINE))); // Next position to fill
+    Waitpoint not_empty;
+
+    size_t head __attribute__((aligned(CACHE_LINE))); // Next to empty
+    Waitpoint not_full;
+
+    Slot* slots __attribute__((aligned(CACHE_LINE)));
+    size_t mask;
+    int spin_limit;
+} Queue;
+
+/**
+ * @brief Tells the CPU that this is a spin loop, where it knows how, so that
+ * the other hyperthread of the core can make progress.
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static long futex(uint32_t* address, int op, uint32_t value) {
+    return syscall(SYS_futex, address, op, value, NULL, NULL, 0);
+}
+
+/**
+ * @brief Records progress on one side of the queue, waking a thread parked
+ * on it if there is one.
+ *
+ * @param waitpoint
+ */
+static void signal(Waitpoint* waitpoint) {
+    __atomic_add_fetch(&waitpoint->epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waitpoint->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex(&waitpoint->epoch, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+/**
+ * @brief Parks the calling thread until the epoch moves on from `epoch`.
+ * Returns straight away if it already has.
+ *
+ * @param waitpoint
+ * @param epoch The epoch seen before the failed attempt.
+ */
+static void park(Waitpoint* waitpoint, uint32_t epoch) {
+    __atomic_add_fetch(&waitpoint->waiters, 1, __ATOMIC_SEQ_CST);
+    futex(&waitpoint->epoch, FUTEX_WAIT_PRIVATE, epoch);
+    __atomic_sub_fetch(&waitpoint->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Attempts to put an item into the ring without blocking.
+ *
+ * @param queue
+ * @param item
+ * @return true The item was added.
+ * @return false The ring is full.
+ */
+static bool try_put(Queue* queue, void* item) {
+    size_t position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        Slot* slot = &queue->slots[position & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->tail, &position,
+                                            position + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                slot->item = item;
+                __atomic_store_n(&slot->sequence, position + 1,
+                                 __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Attempts to take an item from the ring without blocking.
+ *
+ * @param queue
+ * @param item Set to the item taken.
+ * @return true An item was taken.
+ * @return false The ring is empty.
+ */
+static bool try_get(Queue* queue, void** item) {
+    size_t position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    while (true) {
+        Slot* slot = &queue->slots[position & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->head, &position,
+                                            position + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                *item = slot->item;
+                __atomic_store_n(&slot->sequence, position + queue->mask + 1,
+                                 __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Allocate a concurrent queue of a specific size. The size is rounded up to
+ * a power of two.
+ * @param size - The size of memory to allocate to the queue
+ * @return queue - Pointer to the allocated queue
+ */
+Queue* queue_alloc(int size) {
+    size_t capacity = 2;
+    while (capacity < (size_t) size) {
+        capacity *= 2;
+    }
+
+    Queue* queue;
+    if (posix_memalign((void**) &queue, CACHE_LINE, sizeof(Queue)) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+
+    queue->slots = malloc(sizeof(Slot) * capacity);
+    queue->mask = capacity - 1;
+    queue->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->not_empty = (Waitpoint){0, 0};
+    queue->not_full = (Waitpoint){0, 0};
+
+    for (size_t i = 0; i < capacity; i++) {
+        queue->slots[i].sequence = i;
+    }
+
+    return queue;
+}
+
+/**
+ * Free a concurrent queue and associated memory
+ *
+ * Don't call this function while the queue is still in use.
+ * (Note, this is a pre-condition to the function and does not need
+ * to be checked)
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void queue_free(Queue* queue) {
+    free(queue->slots);
+    free(queue);
+}
+
+/**
+ * Place an item into the concurrent queue.
+ * If no space available then queue will spin briefly, then sleep
+ * until a space is available when it will
+ * put the item into the queue and immediately return
+ *
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue. Uses void* to hold an arbitrary
+ *               type. User's responsibility to manage memory and ensure
+ *               it is correctly typed.
+ */
+void queue_put(Queue* queue, void* item) {
+    for (int spins = 0;; spins++) {
+        uint32_t epoch =
+            __atomic_load_n(&queue->not_full.epoch, __ATOMIC_SEQ_CST);
+
+        if (try_put(queue, item)) {
+            signal(&queue->not_empty);
+            return;
+        }
+
+        if (spins < queue->spin_limit) {
+            cpu_relax();
+        } else {
+            park(&queue->not_full, epoch);
+        }
+    }
+}
+
+/**
+ * Get an item from the concurrent queue
+ *
+ * If there is no item available then queue_get
+ * will spin briefly, then sleep until an item becomes available when
+ * it will immediately return that item.
+ *
+ * @param queue - Pointer to queue to get item from
+ * @return item - item retrieved from queue. void* type since it can be
+ *                arbitrary
+ */
+void* queue_get(Queue* queue) {
+    void* item;
+
+    for (int spins = 0;; spins++) {
+        uint32_t epoch =
+            __atomic_load_n(&queue->not_empty.epoch, __ATOMIC_SEQ_CST);
+
+        if (try_get(queue, &item)) {
+            signal(&queue->not_full);
+            return item;
+        }
+
+        if (spins < queue->spin_limit) {
+            cpu_relax();
+        } else {
+            park(&queue->not_empty, epoch);
+        }
+    }
+}
@@ -0,0 +1,381 @@
+#include "resolver.h"
+#include "trace.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT_STR_LEN 20
+
+// How long a failed resolution is remembered, before it is tried again
+#define NEGATIVE_TTL 5.0
+
+typedef enum {
+    ENTRY_PENDING,  // Not resolved yet
+    ENTRY_RESOLVED, // Resolved, although it may have expired
+    ENTRY_FAILED,   // Could not be resolved
+} EntryState;
+
+/*
+ * A cached host and port.
+ */
+typedef struct Entry {
+    char* host;
+    int port;
+    EntryState state;
+    AddressList addresses;
+    double expires; // When the entry should be resolved again
+    bool queued;    // True while waiting for, or being, resolved
+
+    struct Entry* next;
+    struct Entry* next_queued;
+} Entry;
+
+/*
+ * Resolver - a cache of entries, and a queue of entries waiting to be
+ * resolved by the resolver's threads. Entries are never removed, only
+ * resolved again once they expire, until the resolver is freed. An expired
+ * entry is still used while it is being resolved again.
+ */
+typedef struct ResolverStruct {
+    Entry* entries;
+    Entry* queue_head;
+    Entry* queue_tail;
+
+    double ttl;
+    int notify_fd;
+    int resolutions;
+    bool shutdown;
+
+    pthread_t* threads;
+    int num_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;   // Signalled when an entry is queued
+    pthread_cond_t resolved; // Broadcast when an entry is resolved
+} Resolver;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Resolve a host and port there and then, without a cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param addresses - Filled in with the addresses the host resolved to
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int resolve_host(const char* host, int port, AddressList* addresses) {
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    char port_str[PORT_STR_LEN];
+
+    snprintf(port_str, PORT_STR_LEN, "%d", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int64_t traced = trace_begin();
+    int error = getaddrinfo(host, port_str, &hints, &result);
+    trace_end(TRACE_DNS, traced, 0);
+    if (error != 0) {
+        fprintf(stderr, "ERROR: getaddrinfo\n");
+        return -1;
+    }
+
+    // The addresses of the first family returned, and of the other
+    struct addrinfo* families[2][MAX_ADDRESSES];
+    int counts[2] = {0, 0};
+
+    for (struct addrinfo* info = result; info; info = info->ai_next) {
+        int family = info->ai_family == result->ai_family ? 0 : 1;
+        if ((info->ai_family == AF_INET || info->ai_family == AF_INET6) &&
+            counts[family] < MAX_ADDRESSES) {
+            families[family][counts[family]++] = info;
+        }
+    }
+
+    // The two families are interleaved, so that if one is broken the other
+    // is tried straight away.
+    addresses->count = 0;
+    for (int i = 0; i < counts[0] || i < counts[1]; i++) {
+        for (int family = 0; family < 2; family++) {
+            if (i < counts[family] && addresses->count < MAX_ADDRESSES) {
+                struct addrinfo* info = families[family][i];
+                memcpy(&addresses->addresses[addresses->count],
+                       info->ai_addr, info->ai_addrlen);
+                addresses->lengths[addresses->count++] = info->ai_addrlen;
+            }
+        }
+    }
+
+    freeaddrinfo(result);
+    return addresses->count > 0 ? 0 : -1;
+}
+
+/**
+ * @brief A resolver thread: resolves queued entries one at a time, waking
+ * everyone waiting on the resolver after each.
+ *
+ * @param arg The resolver.
+ * @return void* NULL
+ */
+void* resolver_thread(void* arg) {
+    Resolver* resolver = (Resolver*) arg;
+    trace_thread("resolver", -1);
+
+    pthread_mutex_lock(&resolver->mutex);
+    while (true) {
+        while (!resolver->shutdown && resolver->queue_head == NULL) {
+            pthread_cond_wait(&resolver->queued, &resolver->mutex);
+        }
+        if (resolver->shutdown) {
+            break;
+        }
+
+        Entry* entry = resolver->queue_head;
+        resolver->queue_head = entry->next_queued;
+        if (resolver->queue_head == NULL) {
+            resolver->queue_tail = NULL;
+        }
+        resolver->resolutions++;
+        pthread_mutex_unlock(&resolver->mutex);
+
+        AddressList addresses;
+        bool ok = resolve_host(entry->host, entry->port, &addresses) == 0;
+
+        pthread_mutex_lock(&resolver->mutex);
+        if (ok) {
+            entry->addresses = addresses;
+            entry->state = ENTRY_RESOLVED;
+            entry->expires = now() + resolver->ttl;
+        } else if (entry->state != ENTRY_RESOLVED) {
+            entry->state = ENTRY_FAILED;
+            entry->expires = now() + NEGATIVE_TTL;
+        } else {
+            // Keep using the stale addresses for now
+            entry->expires = now() + NEGATIVE_TTL;
+        }
+        entry->queued = false;
+        pthread_cond_broadcast(&resolver->resolved);
+
+        if (resolver->notify_fd != -1) {
+            uint64_t one = 1;
+            if (write(resolver->notify_fd, &one, sizeof(one)) == -1) {
+                perror("write");
+            }
+        }
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return NULL;
+}
+
+/**
+ * Allocate a resolver and start its threads
+ * @param num_threads - The number of names to resolve at once
+ * @param ttl - How many seconds a resolved name is cached for
+ * @param notify_fd - An eventfd to write to whenever a name has been
+ *                    resolved, or -1
+ * @return resolver - Pointer to the allocated resolver
+ */
+Resolver* resolver_alloc(int num_threads, double ttl, int notify_fd) {
+    Resolver* resolver = malloc(sizeof(Resolver));
+    resolver->entries = NULL;
+    resolver->queue_head = NULL;
+    resolver->queue_tail = NULL;
+    resolver->ttl = ttl;
+    resolver->notify_fd = notify_fd;
+    resolver->resolutions = 0;
+    resolver->shutdown = false;
+    resolver->num_threads = num_threads;
+
+    pthread_mutex_init(&resolver->mutex, NULL);
+    pthread_cond_init(&resolver->queued, NULL);
+    pthread_cond_init(&resolver->resolved, NULL);
+
+    resolver->threads = malloc(sizeof(pthread_t) * num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&resolver->threads[i], NULL, resolver_thread,
+                           resolver) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    return resolver;
+}
+
+/**
+ * Stop the resolver's threads and free it
+ * @param resolver - Pointer to the resolver to free
+ */
+void resolver_free(Resolver* resolver) {
+    pthread_mutex_lock(&resolver->mutex);
+    resolver->shutdown = true;
+    pthread_cond_broadcast(&resolver->queued);
+    pthread_mutex_unlock(&resolver->mutex);
+
+    for (int i = 0; i < resolver->num_threads; i++) {
+        pthread_join(resolver->threads[i], NULL);
+    }
+
+    Entry* entry = resolver->entries;
+    while (entry) {
+        Entry* next = entry->next;
+        free(entry->host);
+        free(entry);
+        entry = next;
+    }
+
+    pthread_cond_destroy(&resolver->resolved);
+    pthread_cond_destroy(&resolver->queued);
+    pthread_mutex_destroy(&resolver->mutex);
+    free(resolver->threads);
+    free(resolver);
+}
+
+/**
+ * @brief Finds the entry for host:port, creating it if it does not exist,
+ * and queues it to be resolved if it has not been, or has expired. The
+ * resolver's lock must be held.
+ *
+ * @param resolver
+ * @param host
+ * @param port
+ * @return Entry* The entry for host:port.
+ */
+static Entry* find_entry(Resolver* resolver, const char* host, int port) {
+    Entry* entry = resolver->entries;
+    while (entry && (entry->port != port || strcmp(entry->host, host) != 0)) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(Entry));
+        entry->host = strdup(host);
+        entry->port = port;
+        entry->state = ENTRY_PENDING;
+        entry->next = resolver->entries;
+        resolver->entries = entry;
+    } else if (entry->queued || entry->state == ENTRY_PENDING ||
+               now() < entry->expires) {
+        return entry;
+    }
+
+    // A failure is not used once it has expired, but stale addresses are
+    // while they are resolved again.
+    if (entry->state == ENTRY_FAILED) {
+        entry->state = ENTRY_PENDING;
+    }
+
+    entry->queued = true;
+    entry->next_queued = NULL;
+    if (resolver->queue_tail) {
+        resolver->queue_tail->next_queued = entry;
+    } else {
+        resolver->queue_head = entry;
+    }
+    resolver->queue_tail = entry;
+    pthread_cond_signal(&resolver->queued);
+
+    return entry;
+}
+
+/**
+ * Start resolving a host and port in the background, if it is not cached,
+ * so that it is ready by the time it is looked up. Never blocks.
+ * @param resolver - Pointer to the resolver
+ * @param host - The host name
+ * @param port - The port
+ */
+void resolver_prefetch(Resolver* resolver, const char* host, int port) {
+    pthread_mutex_lock(&resolver->mutex);
+    find_entry(resolver, host, port);
+    pthread_mutex_unlock(&resolver->mutex);
+}
+
+/**
+ * Look up a host and port, waiting for it to be resolved if it is not
+ * cached. A NULL resolver resolves the host there and then.
+ * @param resolver - Pointer to the resolver, or NULL
+ * @param host - The host name
+ * @param port - The port
+ * @param addresses - Filled in with the addresses the host resolved to
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int resolver_lookup(Resolver* resolver, const char* host, int port,
+                    AddressList* addresses) {
+    if (resolver == NULL) {
+        return resolve_host(host, port, addresses);
+    }
+
+    pthread_mutex_lock(&resolver->mutex);
+    Entry* entry = find_entry(resolver, host, port);
+    while (entry->state == ENTRY_PENDING) {
+        pthread_cond_wait(&resolver->resolved, &resolver->mutex);
+    }
+
+    int result = -1;
+    if (entry->state == ENTRY_RESOLVED) {
+        *addresses = entry->addresses;
+        result = 0;
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return result;
+}
+
+/**
+ * Look up a host and port without blocking. If it is not cached, it starts
+ * being resolved, and the resolver's notify_fd is written to once it has
+ * been. A NULL resolver resolves the host there and then.
+ * @param resolver - Pointer to the resolver, or NULL
+ * @param host - The host name
+ * @param port - The port
+ * @param addresses - Filled in with the addresses, once resolved
+ * @return int - RESOLVE_DONE, RESOLVE_PENDING, or RESOLVE_FAILED
+ */
+int resolver_try_lookup(Resolver* resolver, const char* host, int port,
+                        AddressList* addresses) {
+    if (resolver == NULL) {
+        return resolve_host(host, port, addresses) == 0 ? RESOLVE_DONE
+                                                        : RESOLVE_FAILED;
+    }
+
+    pthread_mutex_lock(&resolver->mutex);
+    Entry* entry = find_entry(resolver, host, port);
+
+    int result = RESOLVE_PENDING;
+    if (entry->state == ENTRY_RESOLVED) {
+        *addresses = entry->addresses;
+        result = RESOLVE_DONE;
+    } else if (entry->state == ENTRY_FAILED) {
+        result = RESOLVE_FAILED;
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return result;
+}
+
+/**
+ * The number of times the resolver has called getaddrinfo
+ * @param resolver - Pointer to the resolver
+ * @return int - The number of resolutions
+ */
+int resolver_resolutions(Resolver* resolver) {
+    pthread_mutex_lock(&resolver->mutex);
+    int resolutions = resolver->resolutions;
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return resolutions;
+}
@@ -0,0 +1,108 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+
+#define MAX_ADDRESSES 8
+
+// What a non-blocking lookup found
+#define RESOLVE_FAILED -1
+#define RESOLVE_DONE 0
+#define RESOLVE_PENDING 1
+
+
+/*
+ * AddressList - the addresses a host resolved to, in the order they should
+ * be tried: alternating between IPv6 and IPv4, starting with the family of
+ * the first address returned.
+ */
+typedef struct {
+    struct sockaddr_storage addresses[MAX_ADDRESSES];
+    socklen_t lengths[MAX_ADDRESSES];
+    int count;
+} AddressList;
+
+
+/*
+ * Resolver - a thread safe cache of resolved host names, keyed by host and
+ * port. Names are resolved by the resolver's own threads, so that a worker
+ * never has to block on getaddrinfo while it could be doing something else,
+ * and each name is only resolved once however many workers ask for it.
+ */
+typedef struct ResolverStruct Resolver;
+
+
+/**
+ * Resolve a host and port there and then, without a cache
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param port - e.g. 80
+ * @param addresses - Filled in with the addresses the host resolved to
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int resolve_host(const char *host, int port, AddressList *addresses);
+
+
+/**
+ * Allocate a resolver and start its threads
+ * @param num_threads - The number of names to resolve at once
+ * @param ttl - How many seconds a resolved name is cached for
+ * @param notify_fd - An eventfd to write to whenever a name has been
+ *                    resolved, or -1
+ * @return resolver - Pointer to the allocated resolver
+ */
+Resolver *resolver_alloc(int num_threads, double ttl, int notify_fd);
+
+
+/**
+ * Stop the resolver's threads and free it
+ * @param resolver - Pointer to the resolver to free
+ */
+void resolver_free(Resolver *resolver);
+
+
+/**
+ * Start resolving a host and port in the background, if it is not cached,
+ * so that it is ready by the time it is looked up. Never blocks.
+ * @param resolver - Pointer to the resolver
+ * @param host - The host name
+ * @param port - The port
+ */
+void resolver_prefetch(Resolver *resolver, const char *host, int port);
+
+
+/**
+ * Look up a host and port, waiting for it to be resolved if it is not
+ * cached. A NULL resolver resolves the host there and then.
+ * @param resolver - Pointer to the resolver, or NULL
+ * @param host - The host name
+ * @param port - The port
+ * @param addresses - Filled in with the addresses the host resolved to
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int resolver_lookup(Resolver *resolver, const char *host, int port,
+                    AddressList *addresses);
+
+
+/**
+ * Look up a host and port without blocking. If it is not cached, it starts
+ * being resolved, and the resolver's notify_fd is written to once it has
+ * been. A NULL resolver resolves the host there and then.
+ * @param resolver - Pointer to the resolver, or NULL
+ * @param host - The host name
+ * @param port - The port
+ * @param addresses - Filled in with the addresses, once resolved
+ * @return int - RESOLVE_DONE, RESOLVE_PENDING, or RESOLVE_FAILED
+ */
+int resolver_try_lookup(Resolver *resolver, const char *host, int port,
+                        AddressList *addresses);
+
+
+/**
+ * The number of times the resolver has called getaddrinfo
+ * @param resolver - Pointer to the resolver
+ * @return int - The number of resolutions
+ */
+int resolver_resolutions(Resolver *resolver);
+
+
+#endif
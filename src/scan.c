@@ -0,0 +1,236 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef size_t (*ScanFor)(const char*, size_t, char, char);
+typedef size_t (*ScanHeaderEnd)(const char*, size_t);
+
+static ScanLevel current_level;
+static ScanFor scan_for_impl;
+static ScanHeaderEnd scan_header_end_impl;
+
+static size_t scan_for_scalar(const char* data, size_t length, char a,
+                              char b) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == a || data[i] == b) {
+            return i;
+        }
+    }
+    return length;
+}
+
+static size_t scan_header_end_scalar(const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        size_t next = i + 1;
+        if (next < length && data[next] == '\r') {
+            next++;
+        }
+        if (next < length && data[next] == '\n') {
+            return next + 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * @brief The offset past the blank line starting with the line feed at `at`,
+ * once a vector scan has found one there.
+ */
+static size_t blank_line_end(const char* data, size_t at) {
+    return data[at + 1] == '\n' ? at + 2 : at + 3;
+}
+
+static size_t scan_for_sse2(const char* data, size_t length, char a, char b) {
+    __m128i match_a = _mm_set1_epi8(a);
+    __m128i match_b = _mm_set1_epi8(b);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (data + i));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(block, match_a),
+                         _mm_cmpeq_epi8(block, match_b)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_for_scalar(data + i, length - i, a, b);
+}
+
+static size_t scan_header_end_sse2(const char* data, size_t length) {
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    // A blank line may start at any of the 16 positions from i, so the
+    // two bytes after the last one are loaded too.
+    for (; i + 18 <= length; i += 16) {
+        __m128i at0 = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i at1 = _mm_loadu_si128((const __m128i*) (data + i + 1));
+        __m128i at2 = _mm_loadu_si128((const __m128i*) (data + i + 2));
+
+        // \n\n or \n\r\n
+        __m128i blank = _mm_and_si128(
+            _mm_cmpeq_epi8(at0, lf),
+            _mm_or_si128(_mm_cmpeq_epi8(at1, lf),
+                         _mm_and_si128(_mm_cmpeq_epi8(at1, cr),
+                                       _mm_cmpeq_epi8(at2, lf))));
+        unsigned mask = _mm_movemask_epi8(blank);
+        if (mask) {
+            return blank_line_end(data, i + __builtin_ctz(mask));
+        }
+    }
+
+    size_t end = scan_header_end_scalar(data + i, length - i);
+    return end ? i + end : 0;
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_for_avx2(const char* data, size_t length, char a, char b) {
+    __m256i match_a = _mm256_set1_epi8(a);
+    __m256i match_b = _mm256_set1_epi8(b);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (data + i));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, match_a),
+                            _mm256_cmpeq_epi8(block, match_b)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    // The SSE2 scanner is not VEX encoded, so would stall on the dirty upper
+    // halves of the registers if they were not cleared first
+    _mm256_zeroupper();
+    return i + scan_for_sse2(data + i, length - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_header_end_avx2(const char* data, size_t length) {
+    __m256i cr = _mm256_set1_epi8('\r');
+    __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 34 <= length; i += 32) {
+        __m256i at0 = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i at1 = _mm256_loadu_si256((const __m256i*) (data + i + 1));
+        __m256i at2 = _mm256_loadu_si256((const __m256i*) (data + i + 2));
+
+        __m256i blank = _mm256_and_si256(
+            _mm256_cmpeq_epi8(at0, lf),
+            _mm256_or_si256(_mm256_cmpeq_epi8(at1, lf),
+                            _mm256_and_si256(_mm256_cmpeq_epi8(at1, cr),
+                                             _mm256_cmpeq_epi8(at2, lf))));
+        unsigned mask = _mm256_movemask_epi8(blank);
+        if (mask) {
+            return blank_line_end(data, i + __builtin_ctz(mask));
+        }
+    }
+
+    _mm256_zeroupper();
+    size_t end = scan_header_end_sse2(data + i, length - i);
+    return end ? i + end : 0;
+}
+
+#endif
+
+/**
+ * Switch to another level's scanners, for benchmarks and tests. Not safe to
+ * call while other threads are scanning.
+ * @param level - The level to use
+ * @return bool - true if switched, false if the CPU does not support it
+ */
+bool scan_use(ScanLevel level) {
+    switch (level) {
+        case SCAN_SCALAR:
+            scan_for_impl = scan_for_scalar;
+            scan_header_end_impl = scan_header_end_scalar;
+            break;
+#ifdef SCAN_X86
+        case SCAN_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return false;
+            }
+            scan_for_impl = scan_for_sse2;
+            scan_header_end_impl = scan_header_end_sse2;
+            break;
+        case SCAN_AVX2:
+            // Checks CPUID for AVX2, and that the OS saves the registers
+            if (!__builtin_cpu_supports("avx2")) {
+                return false;
+            }
+            scan_for_impl = scan_for_avx2;
+            scan_header_end_impl = scan_header_end_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    current_level = level;
+    return true;
+}
+
+/**
+ * @brief Chooses the fastest scanners the CPU supports, before main runs so
+ * that no thread can see them change.
+ */
+__attribute__((constructor)) static void scan_init() {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    if (!scan_use(SCAN_AVX2) && !scan_use(SCAN_SSE2)) {
+        scan_use(SCAN_SCALAR);
+    }
+}
+
+/**
+ * Find the first occurrence of either of two bytes
+ * @param data - The bytes to search
+ * @param length - The number of bytes to search
+ * @param a - A byte to look for
+ * @param b - Another byte to look for, which may be the same as a
+ * @return size_t - The offset of the first a or b, or length if there is
+ *                  neither
+ */
+size_t scan_for(const char* data, size_t length, char a, char b) {
+    return scan_for_impl(data, length, a, b);
+}
+
+/**
+ * Find the blank line ending a header: a line feed followed by another, with
+ * an optional carriage return between them
+ * @param data - The bytes to search, starting with the header
+ * @param length - The number of bytes to search
+ * @return size_t - The offset just past the blank line, where the body
+ *                  starts, or 0 if the blank line has not arrived
+ */
+size_t scan_header_end(const char* data, size_t length) {
+    return scan_header_end_impl(data, length);
+}
+
+/**
+ * The scanners in use
+ * @return level - The level chosen when the program loaded, or by scan_use
+ */
+ScanLevel scan_level() {
+    return current_level;
+}
+
+/**
+ * The name of a level, e.g. "avx2"
+ * @param level - The level
+ * @return string - The name
+ */
+const char* scan_level_name(ScanLevel level) {
+    static const char* names[] = {"scalar", "sse2", "avx2"};
+    return names[level];
+}
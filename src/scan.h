@@ -0,0 +1,68 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/*
+ * Byte scanners for the delimiters of HTTP/1.x framing: line feeds, colons
+ * and the blank line ending a header. Each has a scalar, SSE2 and AVX2
+ * version, and the fastest the CPU supports is chosen when the program
+ * loads.
+ */
+typedef enum {
+    SCAN_SCALAR, // A byte at a time
+    SCAN_SSE2,   // 16 bytes at a time
+    SCAN_AVX2,   // 32 bytes at a time
+} ScanLevel;
+
+
+/**
+ * Find the first occurrence of either of two bytes
+ * @param data - The bytes to search
+ * @param length - The number of bytes to search
+ * @param a - A byte to look for
+ * @param b - Another byte to look for, which may be the same as a
+ * @return size_t - The offset of the first a or b, or length if there is
+ *                  neither
+ */
+size_t scan_for(const char *data, size_t length, char a, char b);
+
+
+/**
+ * Find the blank line ending a header: a line feed followed by another, with
+ * an optional carriage return between them
+ * @param data - The bytes to search, starting with the header
+ * @param length - The number of bytes to search
+ * @return size_t - The offset just past the blank line, where the body
+ *                  starts, or 0 if the blank line has not arrived
+ */
+size_t scan_header_end(const char *data, size_t length);
+
+
+/**
+ * The scanners in use
+ * @return level - The level chosen when the program loaded, or by scan_use
+ */
+ScanLevel scan_level();
+
+
+/**
+ * Switch to another level's scanners, for benchmarks and tests. Not safe to
+ * call while other threads are scanning.
+ * @param level - The level to use
+ * @return bool - true if switched, false if the CPU does not support it
+ */
+bool scan_use(ScanLevel level);
+
+
+/**
+ * The name of a level, e.g. "avx2"
+ * @param level - The level
+ * @return string - The name
+ */
+const char *scan_level_name(ScanLevel level);
+
+
+#endif
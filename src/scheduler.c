@@ -0,0 +1,245 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define INITIAL_CAPACITY 64
+
+/*
+ * A growable ring of items. The owning worker works at the bottom, thieves
+ * at the top.
+ */
+typedef struct {
+    void** items;
+    int capacity;
+    int top;   // The index of the oldest item
+    int count; // The number of items
+
+    pthread_mutex_t mutex;
+} Deque;
+
+/*
+ * Scheduler - a deque per worker, plus what sleeping workers wait on.
+ * `pending` counts the items in every deque, so that a worker can tell
+ * whether there is anything to steal without locking every deque.
+ */
+typedef struct SchedulerStruct {
+    Deque* deques;
+    int num_workers;
+    int next_deque; // The deque the next submitted item goes on
+
+    int pending;
+    int sleepers;
+    bool shutdown;
+
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t work_available;
+} Scheduler;
+
+/**
+ * Allocate a scheduler for a number of workers
+ * @param num_workers - The number of workers, numbered 0 to num_workers - 1
+ * @return scheduler - Pointer to the allocated scheduler
+ */
+Scheduler* scheduler_alloc(int num_workers) {
+    Scheduler* scheduler = malloc(sizeof(Scheduler));
+    scheduler->deques = malloc(sizeof(Deque) * num_workers);
+    scheduler->num_workers = num_workers;
+    scheduler->next_deque = 0;
+    scheduler->pending = 0;
+    scheduler->sleepers = 0;
+    scheduler->shutdown = false;
+
+    for (int i = 0; i < num_workers; i++) {
+        Deque* deque = &scheduler->deques[i];
+        deque->items = malloc(sizeof(void*) * INITIAL_CAPACITY);
+        deque->capacity = INITIAL_CAPACITY;
+        deque->top = 0;
+        deque->count = 0;
+        pthread_mutex_init(&deque->mutex, NULL);
+    }
+
+    pthread_mutex_init(&scheduler->idle_mutex, NULL);
+    pthread_cond_init(&scheduler->work_available, NULL);
+
+    return scheduler;
+}
+
+/**
+ * Free a scheduler. Don't call this function while the scheduler is still
+ * in use.
+ * @param scheduler - Pointer to the scheduler to free
+ */
+void scheduler_free(Scheduler* scheduler) {
+    for (int i = 0; i < scheduler->num_workers; i++) {
+        pthread_mutex_destroy(&scheduler->deques[i].mutex);
+        free(scheduler->deques[i].items);
+    }
+
+    pthread_mutex_destroy(&scheduler->idle_mutex);
+    pthread_cond_destroy(&scheduler->work_available);
+
+    free(scheduler->deques);
+    free(scheduler);
+}
+
+/**
+ * @brief Adds an item to the bottom of a deque, and wakes a sleeping worker
+ * if there is one.
+ *
+ * @param scheduler
+ * @param deque
+ * @param item
+ */
+void push_bottom(Scheduler* scheduler, Deque* deque, void* item) {
+    pthread_mutex_lock(&deque->mutex);
+
+    if (deque->count == deque->capacity) {
+        void** items = malloc(sizeof(void*) * deque->capacity * 2);
+        for (int i = 0; i < deque->count; i++) {
+            items[i] = deque->items[(deque->top + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity *= 2;
+        deque->top = 0;
+    }
+
+    deque->items[(deque->top + deque->count) % deque->capacity] = item;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->mutex);
+
+    // A sleeper counts itself before checking `pending`, and this counts the
+    // item before checking `sleepers`, so one of the two always sees the
+    // other.
+    __atomic_add_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scheduler->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&scheduler->idle_mutex);
+        pthread_cond_signal(&scheduler->work_available);
+        pthread_mutex_unlock(&scheduler->idle_mutex);
+    }
+}
+
+/**
+ * @brief Takes an item from one end of a deque.
+ *
+ * @param scheduler
+ * @param deque
+ * @param bottom True to take the newest item, false to take the oldest.
+ * @return void* The item, or NULL if the deque is empty.
+ */
+void* take(Scheduler* scheduler, Deque* deque, bool bottom) {
+    void* item = NULL;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count > 0) {
+        deque->count--;
+        if (bottom) {
+            item = deque->items[(deque->top + deque->count) % deque->capacity];
+        } else {
+            item = deque->items[deque->top];
+            deque->top = (deque->top + 1) % deque->capacity;
+        }
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    if (item) {
+        __atomic_sub_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return item;
+}
+
+/**
+ * Submit an item from outside the workers. Items are spread over the
+ * workers' deques in turn. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param item - The item to submit. Must not be NULL
+ */
+void scheduler_submit(Scheduler* scheduler, void* item) {
+    int next = __atomic_fetch_add(&scheduler->next_deque, 1, __ATOMIC_RELAXED);
+    push_bottom(scheduler,
+                &scheduler->deques[(unsigned) next % scheduler->num_workers],
+                item);
+}
+
+/**
+ * Push an item onto a worker's own deque. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param worker - The number of the calling worker
+ * @param item - The item to push. Must not be NULL
+ */
+void scheduler_push(Scheduler* scheduler, int worker, void* item) {
+    push_bottom(scheduler, &scheduler->deques[worker], item);
+}
+
+/**
+ * Take an item without blocking: the most recently pushed item on the
+ * worker's own deque, or else the oldest item on another worker's.
+ * @param scheduler - Pointer to the scheduler
+ * @param worker - The number of the calling worker
+ * @return item - The item, or NULL if every deque is empty
+ */
+void* scheduler_try_get(Scheduler* scheduler, int worker) {
+    void* item = take(scheduler, &scheduler->deques[worker], true);
+
+    for (int i = 1; item == NULL && i < scheduler->num_workers; i++) {
+        if (__atomic_load_n(&scheduler->pending, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        int victim = (worker + i) % scheduler->num_workers;
+        item = take(scheduler, &scheduler->deques[victim], false);
+    }
+
+    return item;
+}
+
+/**
+ * Sleep until an item may be available, the timeout expires, or the
+ * scheduler is shut down.
+ * @param scheduler - Pointer to the scheduler
+ * @param timeout_ms - The longest time to sleep for
+ * @return bool - false once the scheduler has been shut down and every deque
+ *                is empty, true otherwise
+ */
+bool scheduler_wait(Scheduler* scheduler, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&scheduler->idle_mutex);
+    __atomic_add_fetch(&scheduler->sleepers, 1, __ATOMIC_SEQ_CST);
+
+    int rc = 0;
+    while (rc != ETIMEDOUT && !scheduler->shutdown &&
+           __atomic_load_n(&scheduler->pending, __ATOMIC_SEQ_CST) == 0) {
+        rc = pthread_cond_timedwait(&scheduler->work_available,
+                                    &scheduler->idle_mutex, &deadline);
+    }
+
+    __atomic_sub_fetch(&scheduler->sleepers, 1, __ATOMIC_SEQ_CST);
+    bool running = !scheduler->shutdown ||
+                   __atomic_load_n(&scheduler->pending, __ATOMIC_SEQ_CST) > 0;
+    pthread_mutex_unlock(&scheduler->idle_mutex);
+
+    return running;
+}
+
+/**
+ * Shut the scheduler down, waking every sleeping worker. Workers should
+ * keep taking items until scheduler_wait returns false.
+ * @param scheduler - Pointer to the scheduler
+ */
+void scheduler_shutdown(Scheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->idle_mutex);
+    scheduler->shutdown = true;
+    pthread_cond_broadcast(&scheduler->work_available);
+    pthread_mutex_unlock(&scheduler->idle_mutex);
+}
@@ -0,0 +1,80 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+
+
+/*
+ * Scheduler - a work stealing scheduler. Each worker has its own deque of
+ * items: it pushes and pops at the bottom of its own deque, and when that is
+ * empty it steals from the top of another worker's. Workers therefore only
+ * contend with each other when one of them runs out of work, rather than on
+ * every item as they would with a single shared queue.
+ */
+typedef struct SchedulerStruct Scheduler;
+
+
+/**
+ * Allocate a scheduler for a number of workers
+ * @param num_workers - The number of workers, numbered 0 to num_workers - 1
+ * @return scheduler - Pointer to the allocated scheduler
+ */
+Scheduler *scheduler_alloc(int num_workers);
+
+
+/**
+ * Free a scheduler. Don't call this function while the scheduler is still
+ * in use.
+ * @param scheduler - Pointer to the scheduler to free
+ */
+void scheduler_free(Scheduler *scheduler);
+
+
+/**
+ * Submit an item from outside the workers. Items are spread over the
+ * workers' deques in turn. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param item - The item to submit. Must not be NULL
+ */
+void scheduler_submit(Scheduler *scheduler, void *item);
+
+
+/**
+ * Push an item onto a worker's own deque. Never blocks.
+ * @param scheduler - Pointer to the scheduler
+ * @param worker - The number of the calling worker
+ * @param item - The item to push. Must not be NULL
+ */
+void scheduler_push(Scheduler *scheduler, int worker, void *item);
+
+
+/**
+ * Take an item without blocking: the most recently pushed item on the
+ * worker's own deque, or else the oldest item on another worker's.
+ * @param scheduler - Pointer to the scheduler
+ * @param worker - The number of the calling worker
+ * @return item - The item, or NULL if every deque is empty
+ */
+void *scheduler_try_get(Scheduler *scheduler, int worker);
+
+
+/**
+ * Sleep until an item may be available, the timeout expires, or the
+ * scheduler is shut down.
+ * @param scheduler - Pointer to the scheduler
+ * @param timeout_ms - The longest time to sleep for
+ * @return bool - false once the scheduler has been shut down and every deque
+ *                is empty, true otherwise
+ */
+bool scheduler_wait(Scheduler *scheduler, int timeout_ms);
+
+
+/**
+ * Shut the scheduler down, waking every sleeping worker. Workers should
+ * keep taking items until scheduler_wait returns false.
+ * @param scheduler - Pointer to the scheduler
+ */
+void scheduler_shutdown(Scheduler *scheduler);
+
+
+#endif
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define THREAD_NAME_SIZE 32
+
+static const char* phase_names[NUM_TRACE_PHASES] = {
+    [TRACE_PROBE] = "probe",
+    [TRACE_RANGE] = "range",
+    [TRACE_QUEUED] = "queued",
+    [TRACE_DNS] = "dns",
+    [TRACE_CONNECT] = "connect",
+    [TRACE_FIRST_BYTE] = "first_byte",
+    [TRACE_RECEIVE] = "receive",
+    [TRACE_WRITE] = "write",
+    [TRACE_HASH] = "hash",
+    [TRACE_WAIT] = "wait",
+    [TRACE_DIGEST] = "digest",
+};
+
+typedef struct {
+    int64_t start;    // Nanoseconds on the monotonic clock
+    int64_t duration; // Nanoseconds
+    int64_t bytes;
+    int id; // The download, or -1
+    TracePhase phase;
+} Span;
+
+typedef struct {
+    uint64_t buckets[TRACE_BUCKETS]; // Spans by duration, not cumulative
+    uint64_t count;
+    int64_t duration; // The total nanoseconds
+    int64_t bytes;    // The total bytes
+} Histogram;
+
+// The spans of one thread, which only that thread writes to
+typedef struct TraceThreadStruct {
+    Span spans[TRACE_RING_SIZE];
+    uint64_t recorded; // Every span ever recorded, of which the last
+                       // TRACE_RING_SIZE are in `spans`
+    Histogram histograms[NUM_TRACE_PHASES];
+    char name[THREAD_NAME_SIZE];
+    int tid;
+    struct TraceThreadStruct* next;
+} TraceThread;
+
+static bool enabled = false;
+static int64_t epoch; // When recording started, which the trace starts from
+
+// Every thread that has recorded, added to as threads start recording
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceThread* threads = NULL;
+static int num_threads = 0;
+
+static __thread TraceThread* self = NULL;
+static __thread int context = -1;
+
+// The URL of each download, by id
+static char** names = NULL;
+static int num_names = 0;
+
+static int64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+/**
+ * @brief The calling thread's spans, which are set up the first time it
+ * records one.
+ */
+static TraceThread* this_thread() {
+    if (self == NULL) {
+        self = calloc(1, sizeof(TraceThread));
+
+        pthread_mutex_lock(&threads_mutex);
+        self->tid = ++num_threads;
+        self->next = threads;
+        threads = self;
+        pthread_mutex_unlock(&threads_mutex);
+
+        snprintf(self->name, THREAD_NAME_SIZE, "thread %d", self->tid);
+    }
+    return self;
+}
+
+/**
+ * Start recording. Must be called before any other thread is started.
+ */
+void trace_enable(void) {
+    epoch = now_ns();
+    enabled = true;
+}
+
+/**
+ * The time a span starts, to hand to trace_end
+ * @return int64_t - Nanoseconds on a monotonic clock, or 0 when not
+ *                   recording
+ */
+int64_t trace_begin(void) {
+    return enabled ? now_ns() : 0;
+}
+
+/**
+ * Record a span of a phase which began at `begin`, attributed to the
+ * calling thread's current download
+ * @param phase - The phase
+ * @param begin - From trace_begin. Nothing is recorded if it is 0
+ * @param bytes - The number of bytes the span handled, or 0
+ */
+void trace_end(TracePhase phase, int64_t begin, int64_t bytes) {
+    if (begin == 0) {
+        return;
+    }
+
+    int64_t duration = now_ns() - begin;
+    TraceThread* thread = this_thread();
+    Span* span = &thread->spans[thread->recorded++ % TRACE_RING_SIZE];
+    span->start = begin;
+    span->duration = duration;
+    span->bytes = bytes;
+    span->id = context;
+    span->phase = phase;
+
+    // Bucket k holds durations under 2^k microseconds
+    unsigned long long micros = duration / 1000;
+    int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket > TRACE_BUCKETS - 1) {
+        bucket = TRACE_BUCKETS - 1;
+    }
+
+    Histogram* histogram = &thread->histograms[phase];
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->duration += duration;
+    histogram->bytes += bytes;
+}
+
+/**
+ * Set the download the calling thread's spans are attributed to, until it
+ * is set again
+ * @param id - The download's id, from trace_name, or -1 for none
+ */
+void trace_context(int id) {
+    context = id;
+}
+
+/**
+ * Name the calling thread in the trace e.g. "worker 3"
+ * @param name - The name
+ * @param index - Appended to the name, unless it is -1
+ */
+void trace_thread(const char* name, int index) {
+    if (!enabled) {
+        return;
+    }
+
+    TraceThread* thread = this_thread();
+    if (index == -1) {
+        snprintf(thread->name, THREAD_NAME_SIZE, "%s", name);
+    } else {
+        snprintf(thread->name, THREAD_NAME_SIZE, "%s %d", name, index);
+    }
+}
+
+/**
+ * Name a download in the trace. Called from the main thread only.
+ * @param id - The download's id, counting up from 0
+ * @param url - The download's URL
+ */
+void trace_name(int id, const char* url) {
+    if (!enabled) {
+        return;
+    }
+
+    if (id >= num_names) {
+        int count = id * 2 + 16;
+        names = realloc(names, sizeof(char*) * count);
+        memset(names + num_names, 0, sizeof(char*) * (count - num_names));
+        num_names = count;
+    }
+    free(names[id]);
+    names[id] = strdup(url);
+}
+
+/**
+ * @brief Writes a string as a JSON string, with its quotes.
+ */
+static void write_json_string(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*) string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/**
+ * Write the recorded spans as a Chrome trace. Every other thread that
+ * recorded spans must have finished.
+ * @param path - The file to write
+ * @return int - 0 on success, -1 on failure
+ */
+int trace_write_chrome(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char* separator = "";
+
+    for (TraceThread* thread = threads; thread; thread = thread->next) {
+        fprintf(file,
+                "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"tid\": %d, \"args\": {\"name\": ",
+                separator, thread->tid);
+        write_json_string(file, thread->name);
+        fprintf(file, "}}");
+        separator = ",\n";
+
+        uint64_t first = thread->recorded > TRACE_RING_SIZE
+                             ? thread->recorded - TRACE_RING_SIZE
+                             : 0;
+        for (uint64_t i = first; i < thread->recorded; i++) {
+            Span* span = &thread->spans[i % TRACE_RING_SIZE];
+            fprintf(file,
+                    ",\n{\"name\": \"%s\", \"cat\": \"downloader\", "
+                    "\"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %lld",
+                    phase_names[span->phase], thread->tid,
+                    (span->start - epoch) / 1000.0, span->duration / 1000.0,
+                    (long long) span->bytes);
+            if (span->id >= 0) {
+                fprintf(file, ", \"download\": %d", span->id);
+                if (span->id < num_names && names[span->id]) {
+                    fprintf(file, ", \"url\": ");
+                    write_json_string(file, names[span->id]);
+                }
+            }
+            fprintf(file, "}}");
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * Write a histogram of the durations of each phase, in the Prometheus text
+ * format. Every other thread that recorded spans must have finished.
+ * @param path - The file to write
+ * @return int - 0 on success, -1 on failure
+ */
+int trace_write_prometheus(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    // The threads' histograms added together
+    Histogram totals[NUM_TRACE_PHASES] = {0};
+    uint64_t dropped = 0;
+    for (TraceThread* thread = threads; thread; thread = thread->next) {
+        for (int phase = 0; phase < NUM_TRACE_PHASES; phase++) {
+            Histogram* from = &thread->histograms[phase];
+            for (int i = 0; i < TRACE_BUCKETS; i++) {
+                totals[phase].buckets[i] += from->buckets[i];
+            }
+            totals[phase].count += from->count;
+            totals[phase].duration += from->duration;
+            totals[phase].bytes += from->bytes;
+        }
+        if (thread->recorded > TRACE_RING_SIZE) {
+            dropped += thread->recorded - TRACE_RING_SIZE;
+        }
+    }
+
+    fprintf(file, "# HELP downloader_phase_seconds How long each phase of "
+                  "the pipeline took.\n"
+                  "# TYPE downloader_phase_seconds histogram\n");
+    for (int phase = 0; phase < NUM_TRACE_PHASES; phase++) {
+        Histogram* histogram = &totals[phase];
+        uint64_t cumulative = 0;
+
+        for (int i = 0; i < TRACE_BUCKETS - 1; i++) {
+            cumulative += histogram->buckets[i];
+            fprintf(file,
+                    "downloader_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} "
+                    "%llu\n",
+                    phase_names[phase], (double) (1LL << i) / 1e6,
+                    (unsigned long long) cumulative);
+        }
+        fprintf(file,
+                "downloader_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} "
+                "%llu\n"
+                "downloader_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                "downloader_phase_seconds_count{phase=\"%s\"} %llu\n",
+                phase_names[phase], (unsigned long long) histogram->count,
+                phase_names[phase], histogram->duration / 1e9,
+                phase_names[phase], (unsigned long long) histogram->count);
+    }
+
+    fprintf(file, "# HELP downloader_phase_bytes_total The bytes each phase "
+                  "of the pipeline handled.\n"
+                  "# TYPE downloader_phase_bytes_total counter\n");
+    for (int phase = 0; phase < NUM_TRACE_PHASES; phase++) {
+        fprintf(file, "downloader_phase_bytes_total{phase=\"%s\"} %lld\n",
+                phase_names[phase], (long long) totals[phase].bytes);
+    }
+
+    fprintf(file, "# HELP downloader_trace_dropped_spans_total Spans left "
+                  "out of the trace because a thread's ring was full.\n"
+                  "# TYPE downloader_trace_dropped_spans_total counter\n"
+                  "downloader_trace_dropped_spans_total %llu\n",
+            (unsigned long long) dropped);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * Free everything recorded. Every other thread that recorded spans must
+ * have finished.
+ */
+void trace_free(void) {
+    enabled = false;
+
+    while (threads) {
+        TraceThread* next = threads->next;
+        free(threads);
+        threads = next;
+    }
+    num_threads = 0;
+    self = NULL;
+
+    for (int i = 0; i < num_names; i++) {
+        free(names[i]);
+    }
+    free(names);
+    names = NULL;
+    num_names = 0;
+}
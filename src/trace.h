@@ -0,0 +1,119 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * Tracing - timed spans of each phase of the pipeline, so that it can be
+ * seen where the time goes.
+ *
+ * Each thread records its spans in a ring buffer of its own, and adds their
+ * durations to a histogram of its own per phase, so that recording takes no
+ * locks. Once the ring is full, the oldest spans are overwritten, but every
+ * span is still counted in the histograms. The buffers are only read once
+ * every other thread has finished, to write a Chrome trace (which Perfetto
+ * also opens) and a Prometheus text summary of the histograms.
+ *
+ * Until trace_enable is called, nothing is recorded, and trace_begin and
+ * trace_end cost little more than a call.
+ */
+
+// The most recent spans each thread keeps
+#define TRACE_RING_SIZE 16384
+
+// Histogram buckets are for durations under 1, 2, 4, ... microseconds, with
+// one more for longer ones
+#define TRACE_BUCKETS 28
+
+typedef enum {
+    TRACE_PROBE,      // The first range, made to plan a download
+    TRACE_RANGE,      // A range of a download, from start to finish
+    TRACE_QUEUED,     // A task waiting to be taken by a worker
+    TRACE_DNS,        // Looking a host name up
+    TRACE_CONNECT,    // Connecting, from the first attempt to a winner
+    TRACE_FIRST_BYTE, // From sending a request to its first response byte
+    TRACE_RECEIVE,    // From the first response byte to the last
+    TRACE_WRITE,      // Writing received bytes to a file
+    TRACE_HASH,       // Working out digests of bytes as they are written
+    TRACE_WAIT,       // The main thread waiting for a finished task
+    TRACE_DIGEST,     // Finishing a download's digests, once it is written
+    NUM_TRACE_PHASES,
+} TracePhase;
+
+
+/**
+ * Start recording. Must be called before any other thread is started.
+ */
+void trace_enable(void);
+
+
+/**
+ * The time a span starts, to hand to trace_end
+ * @return int64_t - Nanoseconds on a monotonic clock, or 0 when not
+ *                   recording
+ */
+int64_t trace_begin(void);
+
+
+/**
+ * Record a span of a phase which began at `begin`, attributed to the
+ * calling thread's current download
+ * @param phase - The phase
+ * @param begin - From trace_begin. Nothing is recorded if it is 0
+ * @param bytes - The number of bytes the span handled, or 0
+ */
+void trace_end(TracePhase phase, int64_t begin, int64_t bytes);
+
+
+/**
+ * Set the download the calling thread's spans are attributed to, until it
+ * is set again
+ * @param id - The download's id, from trace_name, or -1 for none
+ */
+void trace_context(int id);
+
+
+/**
+ * Name the calling thread in the trace e.g. "worker 3"
+ * @param name - The name
+ * @param index - Appended to the name, unless it is -1
+ */
+void trace_thread(const char *name, int index);
+
+
+/**
+ * Name a download in the trace. Called from the main thread only.
+ * @param id - The download's id, counting up from 0
+ * @param url - The download's URL
+ */
+void trace_name(int id, const char *url);
+
+
+/**
+ * Write the recorded spans as a Chrome trace. Every other thread that
+ * recorded spans must have finished.
+ * @param path - The file to write
+ * @return int - 0 on success, -1 on failure
+ */
+int trace_write_chrome(const char *path);
+
+
+/**
+ * Write a histogram of the durations of each phase, in the Prometheus text
+ * format. Every other thread that recorded spans must have finished.
+ * @param path - The file to write
+ * @return int - 0 on success, -1 on failure
+ */
+int trace_write_prometheus(const char *path);
+
+
+/**
+ * Free everything recorded. Every other thread that recorded spans must
+ * have finished.
+ */
+void trace_free(void);
+
+
+#endif
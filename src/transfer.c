@@ -0,0 +1,256 @@
+#include "transfer.h"
+
+#include <time.h>
+
+/**
+ * Initialise a transfer of the range [start, end) into a file
+ * @param transfer - Pointer to the transfer to initialise
+ * @param fd - The file to write the range into
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range, or -1 for the rest of
+ *              the resource
+ */
+void transfer_init(Transfer* transfer, int fd, off_t start, off_t end) {
+    transfer->fd = fd;
+    transfer->start = start;
+    transfer->end = end;
+    transfer->written = 0;
+    transfer->completed = 0;
+    transfer->started = 0;
+    transfer->status = 0;
+    transfer->if_range = NULL;
+    transfer->changed = false;
+    transfer->crc = 0;
+    transfer->ordered = NULL;
+    transfer->progress = NULL;
+    transfer->limiter = NULL;
+    transfer->uring = NULL;
+    transfer->splice = false;
+    transfer->spliced = false;
+    transfer->whole = NULL;
+    transfer->adopted = false;
+    transfer->next = NULL;
+    transfer->progress_file = -1;
+    transfer->connection = 0;
+
+    pthread_mutex_init(&transfer->mutex, NULL);
+}
+
+/**
+ * Destroy a transfer initialised with transfer_init
+ * @param transfer - Pointer to the transfer to destroy
+ */
+void transfer_destroy(Transfer* transfer) {
+    pthread_mutex_destroy(&transfer->mutex);
+}
+
+/**
+ * The current time in seconds, from a monotonic clock
+ * @return double - The current time
+ */
+double transfer_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Mark a transfer as having begun
+ * @param transfer - Pointer to the transfer
+ */
+void transfer_begin(Transfer* transfer) {
+    double now = transfer_now();
+
+    pthread_mutex_lock(&transfer->mutex);
+    transfer->started = now;
+    pthread_mutex_unlock(&transfer->mutex);
+}
+
+/**
+ * @brief Whether another transfer of the resource has adopted a response
+ * holding all of it, so that this one is no longer needed.
+ *
+ * @param transfer
+ * @return true The transfer should stop.
+ * @return false The transfer's range is still wanted.
+ */
+static bool superseded(const Transfer* transfer) {
+    return transfer->whole && !transfer->adopted &&
+           __atomic_load_n(transfer->whole, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Claim the next bytes of the range for writing. Fewer than `length` bytes
+ * are granted if the range ends sooner, and none once another transfer has
+ * adopted a response holding all of the resource. Claiming before writing
+ * means a split can never hand out bytes that are about to be written.
+ * @param transfer - Pointer to the transfer
+ * @param length - The number of bytes that have been received
+ * @param offset - Set to the file offset to write the granted bytes at
+ * @return size_t - The number of bytes granted, 0 once the range is complete
+ */
+size_t transfer_claim(Transfer* transfer, size_t length, off_t* offset) {
+    pthread_mutex_lock(&transfer->mutex);
+
+    off_t position = transfer->start + transfer->written;
+    if (superseded(transfer)) {
+        length = 0;
+    } else if (transfer->end >= 0 &&
+               position + (off_t) length > transfer->end) {
+        length = transfer->end - position;
+    }
+    transfer->written += length;
+
+    pthread_mutex_unlock(&transfer->mutex);
+
+    *offset = position;
+    return length;
+}
+
+/**
+ * Whether all of the range has been claimed, so that a body which ends
+ * there has not been cut short
+ * @param transfer - Pointer to the transfer
+ * @return bool - True if the range is complete, or its end is unknown
+ */
+bool transfer_finished(Transfer* transfer) {
+    pthread_mutex_lock(&transfer->mutex);
+    bool finished = transfer->end < 0 ||
+                    transfer->start + transfer->written >= transfer->end;
+    pthread_mutex_unlock(&transfer->mutex);
+
+    return finished;
+}
+
+/**
+ * Check that the range a response is of starts where the transfer asked
+ * for it to, and reaches the transfer's end. The end may have been brought
+ * forward by a split since the range was asked for, but never moves back.
+ * @param transfer - Pointer to the transfer
+ * @param first - The offset of the first byte of the response's range
+ * @param last - The offset of the last byte of the response's range
+ * @return int - 0 if the range is the one asked for, -1 if not
+ */
+int transfer_check_range(Transfer* transfer, off_t first, off_t last) {
+    pthread_mutex_lock(&transfer->mutex);
+    bool matches = first == transfer->start &&
+                   (transfer->end < 0 || last + 1 >= transfer->end);
+    pthread_mutex_unlock(&transfer->mutex);
+
+    return matches ? 0 : -1;
+}
+
+/**
+ * Adopt a response holding all of the resource, widening the transfer to
+ * take all of it, unless another transfer of the resource already has.
+ * Must be called before anything is claimed.
+ * @param transfer - Pointer to the transfer
+ * @return int - 0 if the transfer now takes all of the resource, -1 if
+ *               another transfer adopted a response first
+ */
+int transfer_adopt(Transfer* transfer) {
+    int unset = 0;
+    if (transfer->whole && !transfer->adopted &&
+        !__atomic_compare_exchange_n(transfer->whole, &unset, 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&transfer->mutex);
+    transfer->adopted = true;
+    transfer->start = 0;
+    transfer->end = -1;
+    pthread_mutex_unlock(&transfer->mutex);
+    return 0;
+}
+
+/**
+ * Add bytes written at an offset granted by transfer_claim to the range's
+ * digests, and count them towards its progress
+ * @param transfer - Pointer to the transfer
+ * @param data - The bytes written
+ * @param length - The number of bytes written
+ * @param offset - Where they were written
+ */
+void transfer_wrote(Transfer* transfer, const char* data, size_t length,
+                    off_t offset) {
+    transfer->crc = crc32c(transfer->crc, data, length);
+    transfer->completed += length;
+    if (transfer->ordered) {
+        ordered_digest_write(transfer->ordered, data, length, offset);
+    }
+    if (transfer->progress) {
+        progress_add(transfer->progress, transfer->progress_file,
+                     transfer->connection, length);
+    }
+}
+
+/**
+ * Count bytes spliced into the file at an offset granted by transfer_claim.
+ * They were never seen, so the range is left without a CRC, and the
+ * download's ordered digests read them back from the file.
+ * @param transfer - Pointer to the transfer
+ * @param length - The number of bytes spliced
+ * @param offset - Where they were spliced to
+ */
+void transfer_spliced(Transfer* transfer, size_t length, off_t offset) {
+    transfer->spliced = true;
+    transfer->completed += length;
+    if (transfer->ordered) {
+        ordered_digest_written(transfer->ordered, offset, offset + length);
+    }
+    if (transfer->progress) {
+        progress_add(transfer->progress, transfer->progress_file,
+                     transfer->connection, length);
+    }
+}
+
+/**
+ * Estimate how long a transfer will take to finish, from its rate so far
+ * @param transfer - Pointer to the transfer
+ * @return double - The estimated seconds left, or -1 if the transfer has not
+ *                  begun, has not received anything, or has no known end
+ */
+double transfer_time_left(Transfer* transfer) {
+    double now = transfer_now();
+    double left = -1;
+
+    pthread_mutex_lock(&transfer->mutex);
+    if (transfer->started > 0 && transfer->written > 0 && transfer->end >= 0) {
+        double rate = transfer->written / (now - transfer->started);
+        left = (transfer->end - transfer->start - transfer->written) / rate;
+    }
+    pthread_mutex_unlock(&transfer->mutex);
+
+    return left;
+}
+
+/**
+ * Split the unclaimed rest of a transfer in half, bringing its end forward
+ * to the midpoint. The second half is left for another transfer.
+ * @param transfer - Pointer to the transfer to split
+ * @param min_size - The smallest half worth splitting off
+ * @param start - Set to the start of the second half
+ * @param end - Set to one past the end of the second half
+ * @return int - 0 on success, -1 if the rest is too small to split
+ */
+int transfer_split(Transfer* transfer, off_t min_size, off_t* start,
+                   off_t* end) {
+    int result = -1;
+
+    pthread_mutex_lock(&transfer->mutex);
+    if (transfer->end >= 0 && !superseded(transfer)) {
+        off_t position = transfer->start + transfer->written;
+        off_t rest = transfer->end - position;
+
+        if (rest >= 2 * min_size) {
+            *start = position + rest / 2;
+            *end = transfer->end;
+            transfer->end = *start;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&transfer->mutex);
+
+    return result;
+}
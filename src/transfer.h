@@ -0,0 +1,189 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "digest.h"
+#include "limiter.h"
+#include "progress.h"
+#include "uring.h"
+
+/*
+ * Transfer - a byte range of a resource being written into a file.
+ *
+ * The worker making the transfer and the thread scheduling it share it, so
+ * `end` and `written` are protected by `mutex`. The scheduler may bring `end`
+ * forward while the transfer is under way, handing the rest of the range to
+ * another worker, in which case the transfer stops once it reaches the new
+ * end. The range's digests are only touched by the worker writing it.
+ *
+ * A server which does not send ranges sends all of the resource instead.
+ * The first of a resource's transfers to get such a response adopts it,
+ * taking on all of the resource, and the others stop at their next claim.
+ *
+ * Several ranges may be asked for in one request by chaining their
+ * transfers with `next`. Such ranges are never split.
+ */
+typedef struct Transfer {
+    int fd;         // The file to write the range into
+    off_t start;    // The offset of the first byte of the range
+    off_t end;      // One past the last byte of the range, or -1 if unknown
+    off_t written;   // The number of bytes of the range claimed so far
+    off_t completed; // The number of those which have been written to the
+                     // file and hashed, only touched by the worker
+    double started;  // When the transfer began (see transfer_now), or 0
+    int status;      // The status code of the response, or 0 if none came
+
+    const char *if_range; // A validator the resource must still match for
+                          // the range to be sent, or NULL
+    bool changed;         // Set if the resource no longer matched if_range
+
+    uint32_t crc;           // The CRC32C of the bytes written so far
+    OrderedDigest *ordered; // The download's digests which need its bytes
+                            // in order, or NULL
+
+    Progress *progress; // Counts the bytes written, or NULL
+    Limiter *limiter;   // Caps the rate the range is read at, or NULL
+    Uring *uring;       // Moves the body from the socket to the file, or
+                        // NULL to read it and write it
+    bool splice;        // True to splice the body from the socket to the
+                        // file, so that it is never copied into memory
+    bool spliced;       // Set once any of the range has been spliced, as
+                        // `crc` then misses those bytes
+    int *whole;         // Set once a response holding all of the resource
+                        // has been adopted by one of its transfers, shared
+                        // by them all and updated atomically, or NULL
+    bool adopted;       // True if this transfer adopted such a response
+    struct Transfer *next; // The next range asked for in the same request,
+                           // further on in the resource, or NULL
+    int progress_file;  // The download's slot in `progress`, or -1
+    int connection;     // The connection's slot in `progress`
+
+    pthread_mutex_t mutex;
+
+} Transfer;
+
+
+/**
+ * Initialise a transfer of the range [start, end) into a file
+ * @param transfer - Pointer to the transfer to initialise
+ * @param fd - The file to write the range into
+ * @param start - The offset of the first byte of the range
+ * @param end - One past the last byte of the range, or -1 for the rest of
+ *              the resource
+ */
+void transfer_init(Transfer *transfer, int fd, off_t start, off_t end);
+
+
+/**
+ * Destroy a transfer initialised with transfer_init
+ * @param transfer - Pointer to the transfer to destroy
+ */
+void transfer_destroy(Transfer *transfer);
+
+
+/**
+ * The current time in seconds, from a monotonic clock
+ * @return double - The current time
+ */
+double transfer_now(void);
+
+
+/**
+ * Mark a transfer as having begun
+ * @param transfer - Pointer to the transfer
+ */
+void transfer_begin(Transfer *transfer);
+
+
+/**
+ * Claim the next bytes of the range for writing. Fewer than `length` bytes
+ * are granted if the range ends sooner, and none once another transfer has
+ * adopted a response holding all of the resource.
+ * @param transfer - Pointer to the transfer
+ * @param length - The number of bytes that have been received
+ * @param offset - Set to the file offset to write the granted bytes at
+ * @return size_t - The number of bytes granted, 0 once the range is complete
+ */
+size_t transfer_claim(Transfer *transfer, size_t length, off_t *offset);
+
+
+/**
+ * Whether all of the range has been claimed, so that a body which ends
+ * there has not been cut short
+ * @param transfer - Pointer to the transfer
+ * @return bool - True if the range is complete, or its end is unknown
+ */
+bool transfer_finished(Transfer *transfer);
+
+
+/**
+ * Check that the range a response is of starts where the transfer asked
+ * for it to, and reaches the transfer's end
+ * @param transfer - Pointer to the transfer
+ * @param first - The offset of the first byte of the response's range
+ * @param last - The offset of the last byte of the response's range
+ * @return int - 0 if the range is the one asked for, -1 if not
+ */
+int transfer_check_range(Transfer *transfer, off_t first, off_t last);
+
+
+/**
+ * Adopt a response holding all of the resource, widening the transfer to
+ * take all of it, unless another transfer of the resource already has.
+ * Must be called before anything is claimed.
+ * @param transfer - Pointer to the transfer
+ * @return int - 0 if the transfer now takes all of the resource, -1 if
+ *               another transfer adopted a response first
+ */
+int transfer_adopt(Transfer *transfer);
+
+
+/**
+ * Add bytes written at an offset granted by transfer_claim to the range's
+ * digests, and count them towards its progress
+ * @param transfer - Pointer to the transfer
+ * @param data - The bytes written
+ * @param length - The number of bytes written
+ * @param offset - Where they were written
+ */
+void transfer_wrote(Transfer *transfer, const char *data, size_t length,
+                    off_t offset);
+
+
+/**
+ * Count bytes spliced into the file at an offset granted by transfer_claim.
+ * They were never seen, so the range is left without a CRC, and the
+ * download's ordered digests read them back from the file.
+ * @param transfer - Pointer to the transfer
+ * @param length - The number of bytes spliced
+ * @param offset - Where they were spliced to
+ */
+void transfer_spliced(Transfer *transfer, size_t length, off_t offset);
+
+
+/**
+ * Estimate how long a transfer will take to finish, from its rate so far
+ * @param transfer - Pointer to the transfer
+ * @return double - The estimated seconds left, or -1 if the transfer has not
+ *                  begun, has not received anything, or has no known end
+ */
+double transfer_time_left(Transfer *transfer);
+
+
+/**
+ * Split the unclaimed rest of a transfer in half, bringing its end forward
+ * to the midpoint. The second half is left for another transfer.
+ * @param transfer - Pointer to the transfer to split
+ * @param min_size - The smallest half worth splitting off
+ * @param start - Set to the start of the second half
+ * @param end - Set to one past the end of the second half
+ * @return int - 0 on success, -1 if the rest is too small to split
+ */
+int transfer_split(Transfer *transfer, off_t min_size, off_t *start,
+                   off_t *end);
+
+
+#endif
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// Room for the chains of every slot, three entries each
+#define URING_ENTRIES 8
+
+// The fixed files' indexes
+#define SOCKET_FILE 0
+#define DEST_FILE 1
+#define NUM_FILES 2
+
+// The operations the ring needs the kernel to support
+static const int needed_ops[] = {IORING_OP_RECV, IORING_OP_LINK_TIMEOUT,
+                                 IORING_OP_WRITE_FIXED};
+
+struct UringStruct {
+    int fd;
+    void* rings; // The submission and completion rings, mapped together
+    size_t rings_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned unpublished; // Entries being filled in, past the tail
+    unsigned to_submit;   // Entries queued since the last io_uring_enter
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    char* buffers; // URING_SLOTS buffers, one after another
+    struct __kernel_timespec timeouts[URING_SLOTS]; // Read by the kernel
+                                                    // while a chain is in
+                                                    // flight
+};
+
+/**
+ * @brief Asks the kernel whether it supports every operation the ring
+ * needs.
+ *
+ * @param fd The ring.
+ * @return true Every operation is supported.
+ * @return false One is not, or the kernel cannot say.
+ */
+static bool supports_ops(int fd) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    bool supported =
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                256) == 0;
+
+    for (size_t i = 0; supported && i < sizeof(needed_ops) / sizeof(int);
+         i++) {
+        int op = needed_ops[i];
+        supported = op <= probe->last_op &&
+                    (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+/**
+ * @brief Maps the ring's queues into memory.
+ *
+ * @param uring A ring whose fd has been set up.
+ * @param params The parameters it was set up with.
+ * @return int 0 on success, -1 on failure.
+ */
+static int map_rings(Uring* uring, const struct io_uring_params* params) {
+    size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(int);
+    size_t cq_size = params->cq_off.cqes +
+                     params->cq_entries * sizeof(struct io_uring_cqe);
+    uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd,
+                        IORING_OFF_SQ_RING);
+    if (uring->rings == MAP_FAILED) {
+        uring->rings = NULL;
+        return -1;
+    }
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        return -1;
+    }
+
+    char* rings = uring->rings;
+    uring->sq_tail = (unsigned*) (rings + params->sq_off.tail);
+    uring->sq_array = (unsigned*) (rings + params->sq_off.array);
+    uring->sq_mask = *(unsigned*) (rings + params->sq_off.ring_mask);
+    uring->cq_head = (unsigned*) (rings + params->cq_off.head);
+    uring->cq_tail = (unsigned*) (rings + params->cq_off.tail);
+    uring->cq_mask = *(unsigned*) (rings + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*) (rings + params->cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Registers the ring's buffers, and an empty table of fixed files.
+ *
+ * @param uring
+ * @return int 0 on success, -1 on failure.
+ */
+static int register_resources(Uring* uring) {
+    struct iovec buffers[URING_SLOTS];
+    for (int slot = 0; slot < URING_SLOTS; slot++) {
+        buffers[slot].iov_base = uring_buffer(uring, slot);
+        buffers[slot].iov_len = URING_BUFFER_SIZE;
+    }
+    int files[NUM_FILES] = {-1, -1};
+
+    return syscall(__NR_io_uring_register, uring->fd,
+                   IORING_REGISTER_BUFFERS, buffers, URING_SLOTS) == 0 &&
+                   syscall(__NR_io_uring_register, uring->fd,
+                           IORING_REGISTER_FILES, files, NUM_FILES) == 0
+               ? 0
+               : -1;
+}
+
+/**
+ * Set up a ring, if the kernel supports every operation it needs
+ * @return Uring* - The ring, or NULL if io_uring is unavailable
+ */
+Uring* uring_alloc(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    Uring* uring = calloc(1, sizeof(Uring));
+    uring->fd = fd;
+
+    // Older kernels map the two rings separately, and are not worth
+    // supporting
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) || !supports_ops(fd) ||
+        map_rings(uring, &params) == -1 ||
+        posix_memalign((void**) &uring->buffers, sysconf(_SC_PAGESIZE),
+                       URING_SLOTS * URING_BUFFER_SIZE) != 0 ||
+        register_resources(uring) == -1) {
+        uring_free(uring);
+        return NULL;
+    }
+
+    return uring;
+}
+
+/**
+ * Free a ring, which must have nothing in flight
+ * @param uring - The ring, or NULL
+ */
+void uring_free(Uring* uring) {
+    if (uring == NULL) {
+        return;
+    }
+
+    close(uring->fd);
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->rings) {
+        munmap(uring->rings, uring->rings_size);
+    }
+    free(uring->buffers);
+    free(uring);
+}
+
+/**
+ * One of the ring's buffers
+ * @param uring - The ring
+ * @param slot - The buffer's slot, less than URING_SLOTS
+ * @return char* - The buffer, of URING_BUFFER_SIZE bytes
+ */
+char* uring_buffer(Uring* uring, int slot) {
+    return uring->buffers + (size_t) slot * URING_BUFFER_SIZE;
+}
+
+/**
+ * Set the fixed files pieces are moved between. The ring holds a reference
+ * to each, so they must be cleared, with -1, before the socket is closed
+ * for the close to take effect.
+ * @param uring - The ring
+ * @param sockfd - The socket to receive from, or -1
+ * @param fd - The file to write to, or -1
+ * @return int - 0 on success, -1 on failure
+ */
+int uring_files(Uring* uring, int sockfd, int fd) {
+    int files[NUM_FILES] = {sockfd, fd};
+    struct io_uring_files_update update = {
+        .offset = 0,
+        .fds = (uintptr_t) files,
+    };
+    return syscall(__NR_io_uring_register, uring->fd,
+                   IORING_REGISTER_FILES_UPDATE, &update, NUM_FILES) ==
+                   NUM_FILES
+               ? 0
+               : -1;
+}
+
+/**
+ * @brief Takes the next submission queue entry past those being filled in,
+ * cleared. The kernel does not see it until it is published.
+ *
+ * @param uring
+ * @param op The operation, for uring_wait to report.
+ * @param slot The slot of the piece.
+ * @return struct io_uring_sqe* The entry, to be filled in.
+ */
+static struct io_uring_sqe* queue_sqe(Uring* uring, UringOp op, int slot) {
+    // Only this thread moves the tail, so it can be read plainly
+    unsigned tail = *uring->sq_tail + uring->unpublished++;
+    unsigned index = tail & uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) slot * 4 + op;
+    uring->sq_array[index] = index;
+    return sqe;
+}
+
+/**
+ * @brief Hands the entries which have been filled in to the kernel, by
+ * moving the tail past them all at once. The store releases them, so the
+ * kernel, which may be polling the ring, never sees one half filled in.
+ *
+ * @param uring
+ */
+static void publish_sqes(Uring* uring) {
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + uring->unpublished,
+                     __ATOMIC_RELEASE);
+    uring->to_submit += uring->unpublished;
+    uring->unpublished = 0;
+}
+
+/**
+ * Queue the chain moving a piece from the socket to the file. It is
+ * submitted by the next uring_wait.
+ * @param uring - The ring
+ * @param slot - The buffer to receive the piece into, which must be free
+ * @param length - The length of the piece, at most URING_BUFFER_SIZE
+ * @param offset - Where in the file to write the piece
+ * @param timeout - The seconds the recv may take before it is cancelled
+ */
+void uring_move(Uring* uring, int slot, size_t length, off_t offset,
+                double timeout) {
+    char* buffer = uring_buffer(uring, slot);
+    struct __kernel_timespec* limit = &uring->timeouts[slot];
+    limit->tv_sec = (long long) timeout;
+    limit->tv_nsec = (timeout - (long long) timeout) * 1e9;
+
+    struct io_uring_sqe* recv = queue_sqe(uring, URING_RECV, slot);
+    recv->opcode = IORING_OP_RECV;
+    recv->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    recv->fd = SOCKET_FILE;
+    recv->addr = (uintptr_t) buffer;
+    recv->len = length;
+    recv->msg_flags = MSG_WAITALL;
+
+    struct io_uring_sqe* timer = queue_sqe(uring, URING_TIMEOUT, slot);
+    timer->opcode = IORING_OP_LINK_TIMEOUT;
+    timer->flags = IOSQE_IO_LINK;
+    timer->fd = -1;
+    timer->addr = (uintptr_t) limit;
+    timer->len = 1;
+
+    struct io_uring_sqe* write = queue_sqe(uring, URING_WRITE, slot);
+    write->opcode = IORING_OP_WRITE_FIXED;
+    write->flags = IOSQE_FIXED_FILE;
+    write->fd = DEST_FILE;
+    write->addr = (uintptr_t) buffer;
+    write->len = length;
+    write->off = offset;
+    write->buf_index = slot;
+
+    publish_sqes(uring);
+}
+
+/**
+ * Submit what has been queued, and wait for the next completion
+ * @param uring - The ring
+ * @param event - Filled in with the completion
+ * @return int - 0 on success, -1 if io_uring_enter failed
+ */
+int uring_wait(Uring* uring, UringEvent* event) {
+    while (true) {
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head != tail && uring->to_submit == 0) {
+            struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+            event->op = cqe->user_data % 4;
+            event->slot = cqe->user_data / 4;
+            event->result = cqe->res;
+            __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        int submitted =
+            syscall(__NR_io_uring_enter, uring->fd, uring->to_submit,
+                    head == tail ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        uring->to_submit -= submitted;
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/*
+ * Uring - an io_uring, set up with raw system calls, which moves a body from
+ * a socket to its place in a file.
+ *
+ * The ring has URING_SLOTS registered buffers, and two fixed files: the
+ * socket and the file. Each piece of a body is received into a buffer by a
+ * recv that waits for all of the piece, linked to a timeout on it and to a
+ * write of the buffer to the piece's offset, so that a single io_uring_enter
+ * submits the lot. A recv which comes up short breaks the chain, and the
+ * write is cancelled.
+ *
+ * A ring belongs to one thread.
+ */
+
+// The number of buffers, and so of pieces which may be in flight at once
+#define URING_SLOTS 2
+
+// The size of each buffer, the most a piece may be
+#define URING_BUFFER_SIZE (256 * 1024)
+
+typedef struct UringStruct Uring;
+
+// The operations of a piece, whose completions uring_wait returns
+typedef enum {
+    URING_RECV,    // The piece was received into its buffer
+    URING_TIMEOUT, // The timeout on the recv fired, or was cancelled
+    URING_WRITE,   // The buffer was written to the file
+} UringOp;
+
+typedef struct {
+    UringOp op;
+    int slot;   // The buffer of the piece
+    int result; // What the system call would have returned, or -errno
+} UringEvent;
+
+
+/**
+ * Set up a ring, if the kernel supports every operation it needs
+ * @return Uring* - The ring, or NULL if io_uring is unavailable
+ */
+Uring *uring_alloc(void);
+
+
+/**
+ * Free a ring, which must have nothing in flight
+ * @param uring - The ring, or NULL
+ */
+void uring_free(Uring *uring);
+
+
+/**
+ * One of the ring's buffers
+ * @param uring - The ring
+ * @param slot - The buffer's slot, less than URING_SLOTS
+ * @return char* - The buffer, of URING_BUFFER_SIZE bytes
+ */
+char *uring_buffer(Uring *uring, int slot);
+
+
+/**
+ * Set the fixed files pieces are moved between. The ring holds a reference
+ * to each, so they must be cleared, with -1, before the socket is closed
+ * for the close to take effect.
+ * @param uring - The ring
+ * @param sockfd - The socket to receive from, or -1
+ * @param fd - The file to write to, or -1
+ * @return int - 0 on success, -1 on failure
+ */
+int uring_files(Uring *uring, int sockfd, int fd);
+
+
+/**
+ * Queue the chain moving a piece from the socket to the file. It is
+ * submitted by the next uring_wait.
+ * @param uring - The ring
+ * @param slot - The buffer to receive the piece into, which must be free
+ * @param length - The length of the piece, at most URING_BUFFER_SIZE
+ * @param offset - Where in the file to write the piece
+ * @param timeout - The seconds the recv may take before it is cancelled
+ */
+void uring_move(Uring *uring, int slot, size_t length, off_t offset,
+                double timeout);
+
+
+/**
+ * Submit what has been queued, and wait for the next completion
+ * @param uring - The ring
+ * @param event - Filled in with the completion
+ * @return int - 0 on success, -1 if io_uring_enter failed
+ */
+int uring_wait(Uring *uring, UringEvent *event);
+
+
+#endif
@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer.h"
+
+/*
+ * Compares the receive buffer strategies of read_socket:
+ *   before - a fresh buffer per response, grown by a fixed 1024 bytes
+ *   after  - a pooled buffer per thread, sized up front and grown
+ *            geometrically
+ * Every thread "receives" RANGES responses of RANGE_SIZE bytes, in reads of
+ * up to READ_SIZE bytes, as a socket would deliver them.
+ *
+ * Allocations are counted by wrapping malloc and realloc at link time
+ * (-Wl,--wrap=malloc,--wrap=realloc).
+ *
+ * ./buffer_bench [threads] [range_size]
+ */
+
+#define RANGES 64
+#define READ_SIZE 16384
+#define OLD_BUF_SIZE 1024
+#define HEADER_ALLOWANCE 4096
+
+static uint64_t allocations;
+
+void* __real_malloc(size_t size);
+void* __real_realloc(void* data, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_realloc(void* data, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(data, size);
+}
+
+static size_t range_size = 4 * 1024 * 1024;
+static char source[READ_SIZE];
+
+/**
+ * @brief Simulates a read from a socket, which returns a varying amount of
+ * data up to `count` bytes.
+ */
+static size_t fake_read(char* dest, size_t count, size_t remaining,
+                        unsigned int* seed) {
+    size_t bytes = 1 + rand_r(seed) % READ_SIZE;
+    if (bytes > count) {
+        bytes = count;
+    }
+    if (bytes > remaining) {
+        bytes = remaining;
+    }
+    memcpy(dest, source, bytes);
+    return bytes;
+}
+
+void* receive_before(void* arg) {
+    unsigned int seed = (uintptr_t) arg;
+
+    for (int i = 0; i < RANGES; i++) {
+        // The original read_socket: create_buffer, then a fixed increment.
+        size_t allocated = OLD_BUF_SIZE, length = 0;
+        char* data = malloc(allocated);
+        size_t bytes;
+        while ((bytes = fake_read(&data[length], OLD_BUF_SIZE,
+                                  range_size - length, &seed)) > 0) {
+            length += bytes;
+            if (length + OLD_BUF_SIZE > allocated) {
+                allocated += OLD_BUF_SIZE;
+                data = realloc(data, allocated);
+            }
+        }
+        free(data);
+    }
+    return NULL;
+}
+
+void* receive_after(void* arg) {
+    unsigned int seed = (uintptr_t) arg;
+    BufferPool* pool = buffer_pool_alloc();
+
+    for (int i = 0; i < RANGES; i++) {
+        Buffer* buffer =
+            buffer_pool_get(pool, range_size + HEADER_ALLOWANCE + 1);
+        size_t bytes;
+        do {
+            buffer_reserve(buffer, OLD_BUF_SIZE + 1);
+            bytes = fake_read(&buffer->data[buffer->length],
+                              buffer->capacity - buffer->length - 1,
+                              range_size - buffer->length, &seed);
+            buffer->length += bytes;
+        } while (bytes > 0);
+        buffer_pool_put(pool, buffer);
+    }
+
+    buffer_pool_free(pool);
+    return NULL;
+}
+
+void run(const char* name, void* (*receive)(void*), int num_threads) {
+    pthread_t threads[num_threads];
+    struct timespec start, end;
+
+    allocations = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, receive, (void*) (uintptr_t) i);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double ranges = (double) RANGES * num_threads;
+
+    printf("%-7s allocations: %10llu (%9.1f per range)  %8.1f MiB/s\n", name,
+           (unsigned long long) allocations, allocations / ranges,
+           ranges * range_size / seconds / (1024 * 1024));
+}
+
+int main(int argc, char** argv) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2) {
+        range_size = strtoul(argv[2], NULL, 10);
+    }
+
+    printf("%d threads, %d ranges of %zu bytes each\n", num_threads, RANGES,
+           range_size);
+    run("before", receive_before, num_threads);
+    run("after", receive_after, num_threads);
+
+    return 0;
+}
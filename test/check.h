@@ -0,0 +1,31 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/*
+ * The unit tests' checks: CHECK reports a failed condition and carries on,
+ * and check_result reports whether any failed, as the test's exit status.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);        \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+/**
+ * @brief Prints whether every check passed.
+ *
+ * @return int 0 if every check passed, otherwise 1.
+ */
+static inline int check_result(void) {
+    printf("%s\n", failures == 0 ? "all tests passed" : "tests failed");
+    return failures == 0 ? 0 : 1;
+}
+
+#endif
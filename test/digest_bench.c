@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "digest.h"
+
+/*
+ * Benchmarks the digests the downloader works out as ranges arrive, in
+ * receive buffer sized pieces: CRC32C from tables and with SSE4.2, SHA-256
+ * in plain C and with the SHA extensions, and MD5. Also times combining the
+ * CRCs of a file's ranges, which is all that is left to do once the last
+ * range arrives.
+ *
+ * ./digest_bench [megabytes]
+ */
+
+#define DEFAULT_MEGABYTES 256
+#define PIECE_SIZE (64 * 1024)
+#define RANGE_SIZE (256 * 1024)
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, size_t bytes, double elapsed) {
+    printf("%-16s %8.0f MB/s\n", name, bytes / elapsed / 1e6);
+}
+
+static uint32_t time_crc32c(const char* name, const unsigned char* data,
+                            size_t size) {
+    uint32_t crc = 0;
+    double started = now();
+    for (size_t at = 0; at < size; at += PIECE_SIZE) {
+        crc = crc32c(crc, data + at, PIECE_SIZE);
+    }
+    report(name, size, now() - started);
+    return crc;
+}
+
+static void time_sha256(const char* name, const unsigned char* data,
+                        size_t size, unsigned char* digest) {
+    Sha256 sha;
+    double started = now();
+    sha256_init(&sha);
+    for (size_t at = 0; at < size; at += PIECE_SIZE) {
+        sha256_update(&sha, data + at, PIECE_SIZE);
+    }
+    sha256_final(&sha, digest);
+    report(name, size, now() - started);
+}
+
+int main(int argc, char** argv) {
+    size_t size = (size_t) (argc > 1 ? atol(argv[1]) : DEFAULT_MEGABYTES)
+                  << 20;
+    unsigned char* data = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = i * 2654435761u >> 13;
+    }
+
+    bool hardware = crc32c_use_hardware(true);
+    uint32_t expected = 0;
+    if (hardware) {
+        expected = time_crc32c("crc32c sse4.2", data, size);
+    }
+    crc32c_use_hardware(false);
+    uint32_t crc = time_crc32c("crc32c tables", data, size);
+    if (hardware && crc != expected) {
+        printf("CRCs differ\n");
+        return 1;
+    }
+    crc32c_use_hardware(hardware);
+
+    unsigned char digest[DIGEST_MAX_SIZE];
+    hardware = sha256_use_hardware(true);
+    if (hardware) {
+        time_sha256("sha-256 sha-ni", data, size, digest);
+    }
+    sha256_use_hardware(false);
+    time_sha256("sha-256 plain", data, size, digest);
+    sha256_use_hardware(hardware);
+
+    Md5 md5;
+    double started = now();
+    md5_init(&md5);
+    for (size_t at = 0; at < size; at += PIECE_SIZE) {
+        md5_update(&md5, data + at, PIECE_SIZE);
+    }
+    md5_final(&md5, digest);
+    report("md5", size, now() - started);
+
+    // The ranges' CRCs, worked out as they arrived, combined at the end
+    RangeCrcs crcs = {0};
+    for (size_t at = 0; at < size; at += RANGE_SIZE) {
+        range_crcs_add(&crcs, at, at + RANGE_SIZE,
+                       crc32c(0, data + at, RANGE_SIZE));
+    }
+    started = now();
+    range_crcs_combine(&crcs, -1, size, &crc);
+    double elapsed = now() - started;
+    printf("combining %d range CRCs: %.3f ms%s\n", crcs.count, elapsed * 1e3,
+           crc == expected || !hardware ? "" : " (wrong)");
+
+    range_crcs_free(&crcs);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "digest.h"
+
+/*
+ * Tests the digests: CRC32C in hardware and from tables, combining CRCs,
+ * SHA-256 in hardware and plain C, and MD5, against published vectors,
+ * parsing expected digests, and hashing a file written out of order.
+ *
+ * ./digest_test
+ */
+
+#define RANDOM_SIZE (64 * 1024)
+#define RANDOM_RUNS 500
+#define FILE_SIZE (3 * 1024 * 1024 + 17)
+
+static void fill_random(unsigned char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = rand();
+    }
+}
+
+static bool sha256_is(const char* text, size_t length, const char* hex) {
+    Sha256 sha;
+    DigestSet set = {0};
+    char formatted[DIGEST_TEXT_SIZE];
+
+    sha256_init(&sha);
+    sha256_update(&sha, text, length);
+    sha256_final(&sha, set.value[DIGEST_SHA256]);
+    digest_format(&set, DIGEST_SHA256, formatted);
+    return strcmp(formatted, hex) == 0;
+}
+
+static bool md5_is(const char* text, const char* hex) {
+    Md5 md5;
+    DigestSet set = {0};
+    char formatted[DIGEST_TEXT_SIZE];
+
+    md5_init(&md5);
+    md5_update(&md5, text, strlen(text));
+    md5_final(&md5, set.value[DIGEST_MD5]);
+    digest_format(&set, DIGEST_MD5, formatted);
+    return strcmp(formatted, hex) == 0;
+}
+
+void test_crc32c() {
+    unsigned char* data = malloc(RANDOM_SIZE);
+    fill_random(data, RANDOM_SIZE);
+
+    bool hardware = crc32c_use_hardware(true);
+    if (!hardware) {
+        printf("no SSE4.2, testing tables only\n");
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        crc32c_use_hardware(pass == 0 && hardware);
+        CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+        CHECK(crc32c(0, "", 0) == 0);
+
+        // Continuing a CRC is the same as working it out in one go
+        uint32_t crc = crc32c(0, "1234", 4);
+        CHECK(crc32c(crc, "56789", 5) == 0xe3069283);
+    }
+
+    // Hardware and tables agree at every alignment and length, including
+    // lengths long enough for the three lane loop
+    for (int run = 0; run < RANDOM_RUNS && hardware; run++) {
+        size_t offset = rand() % 64;
+        size_t length = rand() % (RANDOM_SIZE - offset);
+        crc32c_use_hardware(true);
+        uint32_t fast = crc32c(run, data + offset, length);
+        crc32c_use_hardware(false);
+        CHECK(fast == crc32c(run, data + offset, length));
+    }
+    crc32c_use_hardware(hardware);
+
+    free(data);
+}
+
+void test_combine() {
+    unsigned char* data = malloc(RANDOM_SIZE);
+    fill_random(data, RANDOM_SIZE);
+
+    for (int run = 0; run < RANDOM_RUNS; run++) {
+        size_t length = rand() % RANDOM_SIZE;
+        size_t split = length ? rand() % (length + 1) : 0;
+        uint32_t whole = crc32c(0, data, length);
+        uint32_t first = crc32c(0, data, split);
+        uint32_t second = crc32c(0, data + split, length - split);
+        CHECK(crc32c_combine(first, second, length - split) == whole);
+    }
+
+    // Combining with nothing moves a CRC along by a length, which must add
+    // up past 32 bits
+    uint32_t crc = crc32c(0, data, 100);
+    off_t big = (off_t) 1 << 32;
+    CHECK(crc32c_combine(crc32c_combine(crc, 0, big), 0, 5) ==
+          crc32c_combine(crc, 0, big + 5));
+    CHECK(crc32c_combine(crc32c_combine(crc, 0, big / 2), 0, big / 2) ==
+          crc32c_combine(crc, 0, big));
+    CHECK(crc32c_combine(crc32c_combine(crc, 0, 3 * big), 0, 7 * big) ==
+          crc32c_combine(crc, 0, 10 * big));
+
+    free(data);
+}
+
+static void test_sha256() {
+    CHECK(sha256_is("", 0, "e3b0c44298fc1c149afbf4c8996fb924"
+                           "27ae41e4649b934ca495991b7852b855"));
+    CHECK(sha256_is("abc", 3, "ba7816bf8f01cfea414140de5dae2223"
+                              "b00361a396177a9cb410ff61f20015ad"));
+    CHECK(sha256_is("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                    56, "248d6a61d20638b8e5c026930c3e6039"
+                        "a33ce45964ff2167f6ecedd419db06c1"));
+
+    // A million a's, in pieces which do not line up with blocks
+    Sha256 sha;
+    DigestSet set = {0};
+    char formatted[DIGEST_TEXT_SIZE];
+    char a[1000];
+    memset(a, 'a', sizeof(a));
+    sha256_init(&sha);
+    for (int i = 0; i < 1000; i++) {
+        sha256_update(&sha, a, 999);
+    }
+    sha256_update(&sha, a, 1000);
+    sha256_final(&sha, set.value[DIGEST_SHA256]);
+    digest_format(&set, DIGEST_SHA256, formatted);
+    CHECK(strcmp(formatted, "cdc76e5c9914fb9281a1c7e284d73e67"
+                            "f1809a48a497200e046d39ccc7112cd0") == 0);
+}
+
+void test_hashes() {
+    bool hardware = sha256_use_hardware(true);
+    if (!hardware) {
+        printf("no SHA extensions, testing plain C only\n");
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        sha256_use_hardware(pass == 0 && hardware);
+        test_sha256();
+    }
+    sha256_use_hardware(hardware);
+
+    CHECK(md5_is("", "d41d8cd98f00b204e9800998ecf8427e"));
+    CHECK(md5_is("abc", "900150983cd24fb0d6963f7d28e17f72"));
+    CHECK(md5_is("message digest", "f96b697d7cb7938d525a2f31aaf161d0"));
+    CHECK(md5_is("1234567890123456789012345678901234567890"
+                 "1234567890123456789012345678901234567890",
+                 "57edf4a22be3c955ac49da2e2107b67a"));
+}
+
+void test_parse() {
+    const char* sha256_hex =
+        "b94d27b9934d3e08a52e52d7da7dabfac484efe37a5380ee9088f7ace2efcde9";
+    char formatted[DIGEST_TEXT_SIZE];
+    DigestSet set = {0};
+
+    // A Digest header
+    const char* header =
+        "SHA-256=uU0nuZNNPgilLlLX2n2r+sSE7+N6U4DukIj3rOLvzek=, unixsum=30637";
+    CHECK(digest_parse(&set, header, strlen(header)) == 1);
+    CHECK(set.has[DIGEST_SHA256] && !set.has[DIGEST_MD5]);
+    digest_format(&set, DIGEST_SHA256, formatted);
+    CHECK(strcmp(formatted, sha256_hex) == 0);
+
+    // The digests after a URL, in hex
+    memset(&set, 0, sizeof(set));
+    const char* list = "md5=5eb63bbbe01eeed093cb22bb8f5acdc3 crc32c=c99465aa";
+    CHECK(digest_parse(&set, list, strlen(list)) == 2);
+    digest_format(&set, DIGEST_CRC32C, formatted);
+    CHECK(strcmp(formatted, "c99465aa") == 0);
+    digest_format(&set, DIGEST_MD5, formatted);
+    CHECK(strcmp(formatted, "5eb63bbbe01eeed093cb22bb8f5acdc3") == 0);
+
+    // A Repr-Digest header, and a Content-MD5 header
+    memset(&set, 0, sizeof(set));
+    const char* repr = "sha-256=:uU0nuZNNPgilLlLX2n2r+sSE7+N6U4DukIj3rOLvzek=:";
+    CHECK(digest_parse(&set, repr, strlen(repr)) == 1);
+    CHECK(digest_set_value(&set, DIGEST_MD5, "XrY7u+Ae7tCTyyK7j1rNww==", 24) ==
+          0);
+    digest_format(&set, DIGEST_MD5, formatted);
+    CHECK(strcmp(formatted, "5eb63bbbe01eeed093cb22bb8f5acdc3") == 0);
+
+    // Values of the wrong length, or which are not hex or base64
+    memset(&set, 0, sizeof(set));
+    const char* bad = "sha-256=abcd, md5=!!!, crc32c=, crc32c";
+    CHECK(digest_parse(&set, bad, strlen(bad)) == 0);
+    CHECK(!set.has[DIGEST_SHA256] && !set.has[DIGEST_MD5] &&
+          !set.has[DIGEST_CRC32C]);
+}
+
+/**
+ * @brief Writes a file in ranges, in random order, working out the CRC of
+ * each range and feeding it to an ordered digest, as the downloader does.
+ * Some ranges are left as if written by an earlier run.
+ */
+void test_out_of_order() {
+    char path[] = "/tmp/digest_test_XXXXXX";
+    int fd = mkstemp(path);
+    unsigned char* data = malloc(FILE_SIZE);
+    fill_random(data, FILE_SIZE);
+
+    Sha256 sha;
+    DigestSet expected = {0};
+    sha256_init(&sha);
+    sha256_update(&sha, data, FILE_SIZE);
+    sha256_final(&sha, expected.value[DIGEST_SHA256]);
+    uint32_t expected_crc = crc32c(0, data, FILE_SIZE);
+
+    // Cut into ranges of random sizes, then shuffled
+    off_t starts[256];
+    int count = 0;
+    for (off_t at = 0; at < FILE_SIZE; at += 1 + rand() % 40000) {
+        starts[count++] = at;
+    }
+    starts[count] = FILE_SIZE;
+    int order[256];
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (int i = count - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    RangeCrcs crcs = {0};
+    OrderedDigest* digest = ordered_digest_alloc(fd, true, true);
+
+    for (int i = 0; i < count; i++) {
+        off_t start = starts[order[i]];
+        off_t end = starts[order[i] + 1];
+        CHECK(pwrite(fd, data + start, end - start, start) == end - start);
+
+        if (i % 5 == 0) {
+            ordered_digest_written(digest, start, end);
+            continue;
+        }
+
+        // Written in pieces, as they arrive
+        uint32_t crc = 0;
+        for (off_t at = start; at < end; at += 1000) {
+            size_t length = end - at < 1000 ? end - at : 1000;
+            crc = crc32c(crc, data + at, length);
+            ordered_digest_write(digest, (char*) data + at, length, at);
+        }
+        range_crcs_add(&crcs, start, end, crc);
+    }
+
+    uint32_t crc;
+    DigestSet set = {0};
+    CHECK(range_crcs_combine(&crcs, fd, FILE_SIZE, &crc) == 0);
+    CHECK(crc == expected_crc);
+    CHECK(ordered_digest_final(digest, FILE_SIZE, &set) == 0);
+    CHECK(set.has[DIGEST_SHA256] && set.has[DIGEST_MD5]);
+    CHECK(memcmp(set.value[DIGEST_SHA256], expected.value[DIGEST_SHA256],
+                 SHA256_SIZE) == 0);
+
+    // Overlapping ranges cannot be combined
+    range_crcs_add(&crcs, 10, 20, 0);
+    CHECK(range_crcs_combine(&crcs, fd, FILE_SIZE, &crc) == -1);
+
+    range_crcs_free(&crcs);
+    ordered_digest_free(digest);
+
+    // A file with a range missing has no ordered digest
+    digest = ordered_digest_alloc(fd, true, false);
+    ordered_digest_write(digest, (char*) data, 100, 0);
+    ordered_digest_written(digest, 200, FILE_SIZE);
+    CHECK(ordered_digest_final(digest, FILE_SIZE, &set) == -1);
+    ordered_digest_free(digest);
+
+    close(fd);
+    remove(path);
+    free(data);
+}
+
+int main(int argc, char** argv) {
+    srand(1);
+
+    test_crc32c();
+    test_combine();
+    test_hashes();
+    test_parse();
+    test_out_of_order();
+
+    return check_result();
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Downloads sparse objects from a test_server that makes every few of its
+# responses go wrong: a 503, a connection reset part way through, a stall
+# part way through, a server that never answers, and a body without a
+# length whose connection closes part way through. Each download must
+# still finish, with the CRC32C it is given, and match the same object
+# generated locally. Short timeouts keep the stalls from taking long.
+#
+# Run from the repository root, after make:
+#
+# ./test/fault_download.sh [num_workers] [downloader options...]
+
+workers=${1:-4}
+shift 1 2>/dev/null
+sizes="4M 9M 1M 16M"
+
+dir=$(mktemp -d)
+./test_server -b 16M -F error,reset,stall,silent,close -N 3 \
+    -L "$dir/requests.log" > "$dir/server.log" &
+server=$!
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+for attempt in $(seq 50); do
+    port=$(sed -n 's/^listening on //p' "$dir/server.log")
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+if [ -z "$port" ]; then
+    echo "test_server did not start"
+    exit 1
+fi
+
+for size in $sizes; do
+    echo "localhost:$port/sparse/$size crc32c=$(./test_server -c "$size")"
+done > "$dir/urls.txt"
+
+start=$(date +%s.%N)
+./downloader -m 1M -t 1,1,1 "$@" "$dir/urls.txt" "$workers" "$dir/out" \
+    > "$dir/downloader.log" 2> "$dir/errors.log"
+status=$?
+end=$(date +%s.%N)
+
+verified=$(grep -c "(verified)" "$dir/downloader.log")
+if [ $status -ne 0 ] || [ "$verified" -ne 4 ]; then
+    echo "FAIL: $verified of 4 downloads verified"
+    cat "$dir/downloader.log" "$dir/errors.log"
+    exit 1
+fi
+
+for size in $sizes; do
+    expected=$(./test_server -g "$size" | cksum)
+    actual=$(cksum < "$dir/out/localhost:${port}_sparse_$size")
+    if [ "$expected" != "$actual" ]; then
+        echo "FAIL: $size expected cksum $expected, got $actual"
+        exit 1
+    fi
+done
+
+faults=$(awk '$3 == 503 || $3 == 0' "$dir/requests.log" | wc -l)
+retries=$(grep -c "^retrying" "$dir/errors.log")
+seconds=$(awk "BEGIN { printf \"%.1f\", $end - $start }")
+echo "PASS: in ${seconds}s, after $retries retries ($faults failed" \
+    "responses, and the resets and stalls)"
@@ -0,0 +1,141 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "header.h"
+
+/*
+ * Compares the throughput of the old and new ways of reading a HEAD response:
+ *   before - copy the header into a buffer, lowercase all of it, then strstr
+ *            for the end of the header, Accept-Ranges, and Content-Length
+ *   after  - parse the header in place with a HeaderParser, in one go, and
+ *            again as it would arrive over several reads
+ *
+ * ./header_bench [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 1000000
+#define READ_SIZE 64
+
+static const char header[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 12 Oct 2026 04:12:33 GMT\r\n"
+    "Server: Apache/2.4.41 (Ubuntu)\r\n"
+    "Last-Modified: Tue, 06 Oct 2026 21:40:02 GMT\r\n"
+    "ETag: \"5f7cf1e2-1e8480\"\r\n"
+    "Cache-Control: public, max-age=86400\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Strict-Transport-Security: max-age=63072000\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 2000000\r\n"
+    "Connection: keep-alive\r\n\r\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * @brief The old parse_head, with get_accept_ranges and get_content_length.
+ */
+static int parse_before(char* buffer, size_t length, int* accept_ranges) {
+    memcpy(buffer, header, length + 1);
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = tolower(buffer[i]);
+    }
+
+    if (strstr(buffer, "\r\n\r\n") == NULL) {
+        return -1;
+    }
+
+    char* ranges = strstr(buffer, "accept-ranges:");
+    *accept_ranges = 0;
+    if (ranges) {
+        char* value = ranges + strlen("accept-ranges:");
+        while (*value == ' ') {
+            value++;
+        }
+        *accept_ranges = strstr(value, "bytes") == value;
+    }
+
+    char* content_length = strstr(buffer, "content-length:");
+    return content_length ? atoi(content_length + strlen("content-length:"))
+                          : 0;
+}
+
+/**
+ * @brief Parses the header with a HeaderParser, as it arrives in reads of
+ * `read_size` bytes.
+ */
+static int parse_after(size_t length, size_t read_size, int* accept_ranges) {
+    HeaderParser parser;
+    header_parser_init(&parser);
+
+    int result = HEADER_INCOMPLETE;
+    for (size_t received = 0; result == HEADER_INCOMPLETE;) {
+        received = received + read_size < length ? received + read_size
+                                                 : length;
+        result = header_parser_parse(&parser, header, received);
+    }
+
+    const HeaderField* ranges = header_find(&parser, header, "Accept-Ranges");
+    *accept_ranges = ranges && slice_has_token(header, ranges->value, "bytes");
+
+    const HeaderField* content_length =
+        header_find(&parser, header, "Content-Length");
+    long long value = 0;
+    if (content_length) {
+        slice_to_number(header, content_length->value, &value);
+    }
+    return (int) value;
+}
+
+static void report(const char* name, double elapsed, long iterations,
+                   size_t length) {
+    printf("%-16s %8.1f ns/header %8.1f MiB/s\n", name,
+           elapsed / iterations * 1e9,
+           (double) length * iterations / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    size_t length = strlen(header);
+    char* buffer = malloc(length + 1);
+    long checksum = 0;
+    int accept_ranges;
+
+    printf("%zu byte header, %ld iterations\n", length, iterations);
+
+    double started = now();
+    for (long i = 0; i < iterations; i++) {
+        checksum += parse_before(buffer, length, &accept_ranges);
+        checksum += accept_ranges;
+    }
+    report("before", now() - started, iterations, length);
+
+    started = now();
+    for (long i = 0; i < iterations; i++) {
+        checksum -= parse_after(length, length, &accept_ranges);
+        checksum -= accept_ranges;
+    }
+    report("after", now() - started, iterations, length);
+
+    started = now();
+    for (long i = 0; i < iterations; i++) {
+        checksum += parse_after(length, READ_SIZE, &accept_ranges);
+        checksum += accept_ranges;
+    }
+    report("after, 64B reads", now() - started, iterations, length);
+
+    // Each parse adds or subtracts the same, so one result per iteration
+    long expected = 2000001 * iterations;
+    printf("checksum %ld (expected %ld)\n", checksum, expected);
+
+    free(buffer);
+    return checksum == expected ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "header.h"
+
+/*
+ * Fuzz harness for the header parser. Every input is parsed in one go, and
+ * again a byte at a time as if each byte arrived in its own read, and the
+ * two results must agree, with every slice inside the header.
+ *
+ * Run standalone, it mutates a few well formed headers at random:
+ *   ./header_fuzz [iterations] [seed]
+ * Or build it for libFuzzer, for coverage guided fuzzing:
+ *   clang -g -fsanitize=fuzzer,address -DLIBFUZZER -Isrc src/header.c \
+ *         test/header_fuzz.c -o header_fuzz
+ */
+
+#define DEFAULT_ITERATIONS 200000
+#define MAX_INPUT 4096
+
+static const char* seeds[] = {
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Content-Range: bytes 0-499/1234\r\n"
+    "Content-Length: 500\r\n"
+    "Accept-Ranges: bytes\r\n\r\nbody",
+    "HTTP/1.0 200 OK\nServer: x\nConnection: keep-alive\n\n",
+    "HTTP/1.1 200 OK\r\n"
+    "Transfer-Encoding: gzip, chunked\r\n"
+    "X-Folded: first\r\n"
+    "  second\r\n\r\n",
+    "http/1.1 204 \r\n\r\n",
+};
+
+static void check(int condition, const char* message) {
+    if (!condition) {
+        fprintf(stderr, "header_fuzz: %s\n", message);
+        abort();
+    }
+}
+
+static void check_slice(Slice slice, size_t limit) {
+    check(slice.offset <= limit && slice.length <= limit - slice.offset,
+          "slice outside the header");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const char* input = (const char*) data;
+
+    HeaderParser whole;
+    header_parser_init(&whole);
+    int result = header_parser_parse(&whole, input, size);
+
+    HeaderParser pieces;
+    header_parser_init(&pieces);
+    int piece_result = HEADER_INCOMPLETE;
+    for (size_t length = 0;
+         length <= size && piece_result == HEADER_INCOMPLETE; length++) {
+        piece_result = header_parser_parse(&pieces, input, length);
+    }
+
+    check(result == piece_result, "results differ");
+    if (result != HEADER_DONE) {
+        return 0;
+    }
+
+    check(whole.end <= size, "header ends after the input");
+    check(whole.end == pieces.end, "header ends differ");
+    check(whole.status == pieces.status, "statuses differ");
+    check(whole.status >= 0 && whole.status <= 999, "status out of range");
+    check(whole.num_fields == pieces.num_fields, "field counts differ");
+    check(whole.num_fields <= MAX_HEADER_FIELDS, "too many fields");
+    check_slice(whole.reason, whole.end);
+
+    for (int i = 0; i < whole.num_fields; i++) {
+        HeaderField* field = &whole.fields[i];
+        HeaderField* piece = &pieces.fields[i];
+        check(memcmp(field, piece, sizeof(HeaderField)) == 0,
+              "fields differ");
+        check_slice(field->name, whole.end);
+        check_slice(field->value, whole.end);
+        check(field->name.length > 0, "empty field name");
+
+        long long number;
+        slice_to_number(input, field->value, &number);
+        slice_has_token(input, field->value, "chunked");
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+static uint64_t state;
+
+static uint64_t next_random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * @brief Mutates an input in place, favouring the bytes that matter to the
+ * parser.
+ *
+ * @param input
+ * @param size The size of the input.
+ * @return size_t The new size of the input.
+ */
+static size_t mutate(char* input, size_t size) {
+    static const char interesting[] = "\r\n:, \tHTTP/1.0123456789";
+    int mutations = 1 + next_random() % 8;
+
+    for (int i = 0; i < mutations && size > 0; i++) {
+        size_t at = next_random() % size;
+        char byte = next_random() % 2
+                        ? interesting[next_random() % strlen(interesting)]
+                        : (char) next_random();
+
+        switch (next_random() % 4) {
+            case 0: // Replace a byte
+                input[at] = byte;
+                break;
+            case 1: // Insert a byte
+                if (size < MAX_INPUT) {
+                    memmove(input + at + 1, input + at, size - at);
+                    input[at] = byte;
+                    size++;
+                }
+                break;
+            case 2: // Delete a byte
+                memmove(input + at, input + at + 1, size - at - 1);
+                size--;
+                break;
+            case 3: // Truncate
+                size = at;
+                break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    state = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (state == 0) {
+        state = 1;
+    }
+
+    int num_seeds = sizeof(seeds) / sizeof(seeds[0]);
+    long outcomes[3] = {0, 0, 0};
+
+    for (long i = 0; i < iterations; i++) {
+        char input[MAX_INPUT];
+        const char* seed = seeds[i % num_seeds];
+        size_t size = strlen(seed);
+        memcpy(input, seed, size);
+
+        if (i >= num_seeds) {
+            size = mutate(input, size);
+        }
+
+        HeaderParser parser;
+        header_parser_init(&parser);
+        outcomes[header_parser_parse(&parser, input, size) + 1]++;
+
+        LLVMFuzzerTestOneInput((const uint8_t*) input, size);
+    }
+
+    printf("%ld inputs: %ld parsed, %ld incomplete, %ld rejected\n",
+           iterations, outcomes[HEADER_DONE + 1],
+           outcomes[HEADER_INCOMPLETE + 1], outcomes[HEADER_ERROR + 1]);
+    return 0;
+}
+
+#endif
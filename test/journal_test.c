@@ -0,0 +1,171 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "journal.h"
+
+/*
+ * Tests the download journal: merging ranges as they are recorded, finding
+ * what is missing, and picking the ranges back up, or not, when it is opened
+ * again.
+ *
+ * ./journal_test
+ */
+
+#define LENGTH 200
+#define RANDOM_RUNS 2000
+#define ETAG "\"5f7cf1e2-c8\""
+
+static char path[] = "/tmp/journal_test_XXXXXX";
+
+static Journal* open_fresh() {
+    bool resumed;
+    remove(path);
+    Journal* journal = journal_open(path, LENGTH, ETAG, "", &resumed);
+    CHECK(journal != NULL && !resumed);
+    return journal;
+}
+
+void test_missing() {
+    Journal* journal = open_fresh();
+    off_t start, end;
+
+    CHECK(journal_next_missing(journal, 0, &start, &end));
+    CHECK(start == 0 && end == LENGTH);
+
+    journal_record(journal, 50, 100);
+    journal_record(journal, 0, 10);
+    CHECK(journal_next_missing(journal, 0, &start, &end));
+    CHECK(start == 10 && end == 50);
+    CHECK(journal_next_missing(journal, 60, &start, &end));
+    CHECK(start == 100 && end == LENGTH);
+
+    // Touching ranges merge
+    journal_record(journal, 10, 50);
+    CHECK(journal_next_missing(journal, 0, &start, &end));
+    CHECK(start == 100 && end == LENGTH);
+
+    journal_record(journal, 100, LENGTH);
+    CHECK(!journal_next_missing(journal, 0, &start, &end));
+    CHECK(journal_completed(journal) == LENGTH);
+
+    journal_close(journal, true);
+    CHECK(access(path, F_OK) == -1);
+}
+
+void test_resume() {
+    Journal* journal = open_fresh();
+    journal_record(journal, 20, 40);
+    journal_record(journal, 100, 150);
+    journal_close(journal, false);
+
+    bool resumed;
+    journal = journal_open(path, LENGTH, ETAG, "", &resumed);
+    CHECK(resumed);
+    CHECK(journal_completed(journal) == 70);
+    journal_close(journal, false);
+
+    // Another version of the resource starts afresh
+    journal = journal_open(path, LENGTH, "\"other\"", "", &resumed);
+    CHECK(!resumed);
+    CHECK(journal_completed(journal) == 0);
+    journal_close(journal, false);
+
+    // As does one which cannot be told apart from another version
+    journal = journal_open(path, LENGTH, "", "", &resumed);
+    journal_record(journal, 0, 10);
+    journal_close(journal, false);
+    journal = journal_open(path, LENGTH, "", "", &resumed);
+    CHECK(!resumed);
+    journal_close(journal, true);
+}
+
+void test_torn_record() {
+    Journal* journal = open_fresh();
+    journal_record(journal, 0, 30);
+    journal_close(journal, false);
+
+    // A crash part way through appending a record
+    FILE* file = fopen(path, "a");
+    fputs("30 6", file);
+    fclose(file);
+
+    bool resumed;
+    journal = journal_open(path, LENGTH, ETAG, "", &resumed);
+    CHECK(resumed);
+    CHECK(journal_completed(journal) == 30);
+
+    // The torn record is dropped, so later ones are not appended to it
+    journal_record(journal, 100, 110);
+    journal_close(journal, false);
+    journal = journal_open(path, LENGTH, ETAG, "", &resumed);
+    CHECK(journal_completed(journal) == 40);
+    journal_close(journal, true);
+}
+
+void test_random() {
+    srand(1);
+
+    for (int run = 0; run < RANDOM_RUNS; run++) {
+        char done[LENGTH] = {0};
+        Journal* journal = open_fresh();
+
+        int records = rand() % 30;
+        for (int i = 0; i < records; i++) {
+            int start = rand() % LENGTH;
+            int end = start + rand() % (LENGTH - start + 1);
+            journal_record(journal, start, end);
+            memset(done + start, 1, end - start);
+        }
+
+        if (rand() % 2) {
+            bool resumed;
+            journal_close(journal, false);
+            journal = journal_open(path, LENGTH, ETAG, "", &resumed);
+        }
+
+        int completed = 0;
+        for (int i = 0; i < LENGTH; i++) {
+            completed += done[i];
+        }
+        CHECK(journal_completed(journal) == completed);
+
+        // The missing ranges are exactly what was not recorded
+        char missing[LENGTH] = {0};
+        off_t from = 0, start, end;
+        while (journal_next_missing(journal, from, &start, &end)) {
+            for (int i = start; i < end; i++) {
+                missing[i] = 1;
+            }
+            from = end;
+        }
+        for (int i = 0; i < LENGTH; i++) {
+            if (missing[i] == done[i]) {
+                CHECK(missing[i] != done[i]);
+                break;
+            }
+        }
+
+        journal_close(journal, true);
+    }
+}
+
+int main(int argc, char** argv) {
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_missing();
+    test_resume();
+    test_torn_record();
+    test_random();
+
+    remove(path);
+    return check_result();
+}
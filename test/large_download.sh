@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Downloads a sparse multi-GiB object from test_server, and checks it against
+# the checksum of the same object generated locally. With the default size,
+# ranges, offsets and lengths cross both the 2 GiB and 4 GiB boundaries. The
+# downloader is also given the object's CRC32C to verify as it downloads.
+#
+# Needs as much free disk as the object's size, as the download is
+# preallocated. Run from the repository root, after make:
+#
+# ./test/large_download.sh [size] [num_workers] [downloader options...]
+
+size=${1:-5G}
+workers=${2:-8}
+shift 2 2>/dev/null
+
+dir=$(mktemp -d)
+./test_server > "$dir/server.log" &
+server=$!
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+for attempt in $(seq 50); do
+    port=$(sed -n 's/^listening on //p' "$dir/server.log")
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+if [ -z "$port" ]; then
+    echo "test_server did not start"
+    exit 1
+fi
+
+crc=$(./test_server -c "$size")
+echo "localhost:$port/sparse/$size crc32c=$crc" > "$dir/urls.txt"
+start=$(date +%s.%N)
+./downloader "$@" "$dir/urls.txt" "$workers" "$dir/out" > "$dir/downloader.log"
+status=$?
+end=$(date +%s.%N)
+
+output="$dir/out/localhost:${port}_sparse_$size"
+if [ $status -ne 0 ] || [ ! -f "$output" ] ||
+    ! grep -q "(verified)" "$dir/downloader.log"; then
+    echo "FAIL: download failed or was not verified"
+    cat "$dir/downloader.log"
+    exit 1
+fi
+
+expected=$(./test_server -g "$size" | cksum)
+actual=$(cksum < "$output")
+seconds=$(awk "BEGIN { printf \"%.1f\", $end - $start }")
+
+if [ "$expected" == "$actual" ]; then
+    echo "PASS: $size in ${seconds}s, cksum $actual"
+else
+    echo "FAIL: expected cksum $expected, got $actual"
+    exit 1
+fi
@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "check.h"
+#include "limiter.h"
+
+/*
+ * Tests the bandwidth limiter: that a burst may be read at once, that
+ * readers then wait for as long as the rate says, and that readers on
+ * several threads sharing it are held to the rate between them.
+ *
+ * ./limiter_test
+ */
+
+#define RATE (8.0 * 1024 * 1024)
+#define NUM_THREADS 4
+#define READ_SIZE (64 * 1024)
+#define READS_PER_THREAD 16
+
+static void* reader(void* arg) {
+    Limiter* limiter = (Limiter*) arg;
+    for (int i = 0; i < READS_PER_THREAD; i++) {
+        limiter_wait(limiter_take(limiter, READ_SIZE));
+    }
+    return NULL;
+}
+
+void test_burst() {
+    Limiter* limiter = limiter_alloc(1000000);
+
+    // A burst is a tenth of a second's worth, 100000 bytes
+    CHECK(limiter_take(limiter, 50000) == 0);
+    CHECK(limiter_take(limiter, 40000) == 0);
+
+    // 40000 bytes over the burst, which take 40 ms to pay for
+    int64_t now = limiter_now();
+    int64_t deadline = limiter_take(limiter, 50000);
+    CHECK(deadline - now > 30000000 && deadline - now <= 40000000);
+
+    limiter_wait(deadline);
+    CHECK(limiter_now() >= deadline);
+
+    // Waiting paid the debt down to a burst, so reading more must wait
+    CHECK(limiter_take(limiter, 1000) > 0);
+
+    limiter_wait(0);
+    limiter_free(limiter);
+}
+
+void test_threads() {
+    Limiter* limiter = limiter_alloc(RATE);
+    int64_t started = limiter_now();
+
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, reader, limiter);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Everything but the burst is paid for at the rate, less the last read,
+    // which is not waited for
+    double bytes = NUM_THREADS * READS_PER_THREAD * READ_SIZE;
+    double expected = (bytes - READ_SIZE) / RATE - LIMITER_BURST;
+    double elapsed = (limiter_now() - started) / 1e9;
+    printf("%.0f bytes in %.3fs, expected %.3fs\n", bytes, elapsed, expected);
+    CHECK(elapsed > expected * 0.95);
+    CHECK(elapsed < expected * 2);
+
+    limiter_free(limiter);
+}
+
+int main(int argc, char** argv) {
+    test_burst();
+    test_threads();
+
+    return check_result();
+}
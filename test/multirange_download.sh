@@ -0,0 +1,137 @@
+#!/bin/bash
+#
+# Resumes a sparse object from a test_server, with an earlier run's journal
+# and a file with many small holes in it, so that the holes are asked for
+# several at a time, and sent back as multipart/byteranges bodies. The
+# download must finish, with the CRC32C it is given, and match the same
+# object generated locally, in fewer requests than there are holes. It must
+# also finish when the server sends only the first of several ranges (-S),
+# sends all of the resource instead (-F full), or resets the connection part
+# way through a body (-F reset). A server which never sends the ranges it
+# says it does (-F empty) must have the download fail, after a few retries,
+# rather than be asked for them forever.
+#
+# Run from the repository root, after make:
+#
+# ./test/multirange_download.sh [num_workers] [downloader options...]
+
+workers=${1:-4}
+shift 1 2>/dev/null
+size=4M
+bytes=4194304
+holes=24
+hole_size=10000
+
+dir=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+# Starts a test_server with the given options, setting `server` and `port`
+start_server() {
+    rm -f "$dir/requests.log" "$dir/server.log"
+    ./test_server -b 16M -L "$dir/requests.log" "$@" > "$dir/server.log" &
+    server=$!
+    port=
+    for attempt in $(seq 50); do
+        port=$(sed -n 's/^listening on //p' "$dir/server.log")
+        [ -n "$port" ] && break
+        sleep 0.1
+    done
+    if [ -z "$port" ]; then
+        echo "test_server did not start"
+        exit 1
+    fi
+}
+
+# Leaves the object as an earlier run might have, with holes after the
+# probe's range that its journal does not cover, filled with bytes that are
+# never in the object
+leave_holes() {
+    rm -rf "$dir/out"
+    mkdir "$dir/out"
+    local file="$dir/out/localhost:${port}_sparse_$size"
+    ./test_server -g "$size" > "$file"
+
+    printf 'getter-journal 1\nlength %d\netag "sparse-%x"\nlast-modified \n' \
+        $bytes $bytes > "$file.journal"
+    local written=0
+    for i in $(seq 0 $((holes - 1))); do
+        local start=$((1048576 + i * 100000 + i * i * 499))
+        head -c $hole_size /dev/zero | tr '\0' '\377' |
+            dd of="$file" bs=$hole_size seek=$start oflag=seek_bytes \
+                conv=notrunc status=none
+        echo "$written $start" >> "$file.journal"
+        written=$((start + hole_size))
+    done
+    echo "$written $bytes" >> "$file.journal"
+}
+
+# Resumes the download, setting `status` and `gets`
+resume() {
+    leave_holes
+    echo "localhost:$port/sparse/$size crc32c=$(./test_server -c "$size")" \
+        > "$dir/urls.txt"
+
+    ./downloader -m 1M -t 1,1,1 "$@" "$dir/urls.txt" "$workers" "$dir/out" \
+        > "$dir/downloader.log" 2> "$dir/errors.log"
+    status=$?
+    gets=$(grep -c "^GET /sparse/$size " "$dir/requests.log")
+}
+
+# Resumes the download, and checks what was written
+download() {
+    resume "$@"
+
+    verified=$(grep -c "(verified)" "$dir/downloader.log")
+    if [ $status -ne 0 ] || [ "$verified" -ne 1 ]; then
+        echo "FAIL: the download was not verified"
+        cat "$dir/downloader.log" "$dir/errors.log"
+        exit 1
+    fi
+
+    expected=$(./test_server -g "$size" | cksum)
+    actual=$(cksum < "$dir/out/localhost:${port}_sparse_$size")
+    if [ "$expected" != "$actual" ]; then
+        echo "FAIL: expected cksum $expected, got $actual"
+        exit 1
+    fi
+}
+
+# Stops the server
+stop_server() {
+    kill $server
+    wait $server 2>/dev/null
+}
+
+start_server
+download "$@"
+if [ "$gets" -ge $holes ]; then
+    echo "FAIL: $holes holes took $gets requests"
+    exit 1
+fi
+stop_server
+echo "PASS: $holes holes resumed in $gets requests"
+
+start_server -S
+download "$@"
+stop_server
+echo "PASS: with only the first range sent, in $gets requests"
+
+start_server -F full -N 2
+download "$@"
+stop_server
+echo "PASS: with some ranges sent in full, in $gets requests"
+
+start_server -F reset -N 2
+download "$@"
+stop_server
+echo "PASS: with some connections reset, in $gets requests"
+
+start_server -F empty -N 1
+resume "$@"
+stop_server
+if [ $status -eq 0 ] || grep -q "(verified)" "$dir/downloader.log"; then
+    echo "FAIL: the download finished without the ranges"
+    exit 1
+fi
+echo "PASS: with the ranges never sent, the download failed after $gets" \
+    "requests"
@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Downloads sparse objects from a test_server which does not send ranges,
+# sending all of a resource with a 200 whatever range is asked for: first
+# for every request (-R), and then for every few (-F full), as a server
+# whose mirrors do not all send ranges might. Each download must still
+# finish, with the CRC32C it is given, and match the same object generated
+# locally. A server that never sends ranges must be sent each resource only
+# once, and one that sometimes does not must have a response adopted as all
+# of the resource, with the rest stopped.
+#
+# Run from the repository root, after make:
+#
+# ./test/norange_download.sh [num_workers] [downloader options...]
+
+workers=${1:-4}
+shift 1 2>/dev/null
+sizes="4M 9M 1M 16M"
+
+dir=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+# Starts a test_server with the given options, setting `server` and `port`
+start_server() {
+    rm -f "$dir/requests.log" "$dir/server.log"
+    ./test_server -b 16M -L "$dir/requests.log" "$@" > "$dir/server.log" &
+    server=$!
+    port=
+    for attempt in $(seq 50); do
+        port=$(sed -n 's/^listening on //p' "$dir/server.log")
+        [ -n "$port" ] && break
+        sleep 0.1
+    done
+    if [ -z "$port" ]; then
+        echo "test_server did not start"
+        exit 1
+    fi
+}
+
+# Downloads every size from the server, and checks what was written
+download() {
+    for size in $sizes; do
+        echo "localhost:$port/sparse/$size crc32c=$(./test_server -c "$size")"
+    done > "$dir/urls.txt"
+
+    rm -rf "$dir/out"
+    ./downloader -m 1M "$@" "$dir/urls.txt" "$workers" "$dir/out" \
+        > "$dir/downloader.log" 2> "$dir/errors.log"
+    status=$?
+
+    verified=$(grep -c "(verified)" "$dir/downloader.log")
+    if [ $status -ne 0 ] || [ "$verified" -ne 4 ]; then
+        echo "FAIL: $verified of 4 downloads verified"
+        cat "$dir/downloader.log" "$dir/errors.log"
+        exit 1
+    fi
+
+    for size in $sizes; do
+        expected=$(./test_server -g "$size" | cksum)
+        actual=$(cksum < "$dir/out/localhost:${port}_sparse_$size")
+        if [ "$expected" != "$actual" ]; then
+            echo "FAIL: $size expected cksum $expected, got $actual"
+            exit 1
+        fi
+    done
+}
+
+start_server -R
+download "$@"
+for size in $sizes; do
+    gets=$(grep -c "^GET /sparse/$size " "$dir/requests.log")
+    if [ "$gets" -ne 1 ]; then
+        echo "FAIL: $size was asked for $gets times by a server without ranges"
+        exit 1
+    fi
+done
+kill $server
+wait $server 2>/dev/null
+echo "PASS: without ranges, each download was sent once"
+
+start_server -F full -N 4
+download "$@"
+adopted=$(grep -c "^server sent all of" "$dir/errors.log")
+if [ "$adopted" -eq 0 ]; then
+    echo "FAIL: no response sent in full was adopted"
+    cat "$dir/errors.log"
+    exit 1
+fi
+wasted=$(sed -n 's/^wasted \([0-9]*\) bytes.*/\1/p' "$dir/downloader.log")
+echo "PASS: with some ranges sent in full, $adopted adopted, wasting" \
+    "${wasted:-0} bytes"
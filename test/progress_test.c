@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "progress.h"
+
+/*
+ * Tests progress counts: that bytes added from several threads at once are
+ * all counted, that file slots are given out and reused, and that the
+ * reporter shows the totals, gauges and files, and keeps the rate up to
+ * date while bytes arrive.
+ *
+ * ./progress_test
+ */
+
+#define NUM_THREADS 4
+#define ADDS_PER_THREAD 1024
+#define ADD_SIZE 128
+#define INTERVAL 0.05
+
+typedef struct {
+    Progress* progress;
+    int connection;
+    int file;
+    bool* stop; // Adds until set, if not NULL
+} Adder;
+
+static void* add(void* arg) {
+    Adder* adder = (Adder*) arg;
+
+    if (adder->stop) {
+        while (!__atomic_load_n(adder->stop, __ATOMIC_RELAXED)) {
+            progress_add(adder->progress, adder->file, adder->connection,
+                         1024);
+            usleep(1000);
+        }
+        return NULL;
+    }
+
+    for (int i = 0; i < ADDS_PER_THREAD; i++) {
+        progress_add(adder->progress, adder->file, adder->connection,
+                     ADD_SIZE);
+    }
+    return NULL;
+}
+
+static char* read_all(FILE* file) {
+    long size = ftell(file);
+    rewind(file);
+
+    char* data = malloc(size + 1);
+    data[fread(data, 1, size, file)] = '\0';
+    return data;
+}
+
+void test_files() {
+    Progress* progress = progress_alloc(3, 1);
+
+    CHECK(progress_file_start(progress, "a") == 0);
+    CHECK(progress_file_start(progress, "b") == 1);
+    CHECK(progress_file_start(progress, "c") == 2);
+    CHECK(progress_file_start(progress, "d") == -1);
+
+    progress_file_end(progress, 1);
+    CHECK(progress_file_start(progress, "d") == 1);
+
+    // Slot -1 is ignored
+    progress_file_size(progress, -1, 100, 0);
+    progress_file_end(progress, -1);
+    progress_add(progress, -1, 0, 100);
+
+    // Never started, so there is nothing to stop and no rate
+    progress_stop(progress);
+    CHECK(progress_rate(progress) == 0);
+    progress_free(progress);
+}
+
+void test_report() {
+    Progress* progress = progress_alloc(3, NUM_THREADS);
+    FILE* out = tmpfile();
+
+    int a = progress_file_start(progress, "localhost:8080/a");
+    int b = progress_file_start(progress, "localhost:8080/b");
+    int c = progress_file_start(progress, "localhost:8080/c");
+    CHECK(b == 1);
+    progress_file_size(progress, a, 1024 * 1024, 0);
+    progress_file_end(progress, c);
+
+    progress_gauge(progress, PROGRESS_CONNECTIONS, NUM_THREADS);
+    progress_gauge(progress, PROGRESS_TODO, 4);
+    progress_gauge(progress, PROGRESS_TODO, -1);
+    progress_gauge(progress, PROGRESS_DONE, 1);
+
+    // Every connection adds to the same file at once
+    pthread_t threads[NUM_THREADS];
+    Adder adders[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        adders[i] = (Adder){progress, i, a, NULL};
+        pthread_create(&threads[i], NULL, add, &adders[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(progress_start(progress, INTERVAL, out) == 0);
+    usleep(INTERVAL * 3 * 1000000);
+    progress_stop(progress);
+
+    char* report = read_all(out);
+    fclose(out);
+
+    CHECK(strstr(report, " 512.0 KiB received, ETA ") != NULL);
+    CHECK(strstr(report, "; 4 connections, 4 receiving at ") != NULL);
+    CHECK(strstr(report, "; 3 queued, 1 done\n") != NULL);
+    CHECK(strstr(report, "\n    localhost:8080/a: 512.0 KiB of 1.0 MiB "
+                         "(50%) at ") != NULL);
+    CHECK(strstr(report, "\n    localhost:8080/b: 0 B at 0 B/s\n") != NULL);
+    CHECK(strstr(report, "localhost:8080/c") == NULL);
+    CHECK(strstr(report, " 512.0 KiB received, at ") != NULL);
+
+    // The reporter can be stopped more than once
+    progress_stop(progress);
+
+    free(report);
+    progress_free(progress);
+}
+
+void test_rate() {
+    Progress* progress = progress_alloc(1, 1);
+    FILE* out = tmpfile();
+    bool stop = false;
+
+    Adder adder = {progress, 0, -1, &stop};
+    pthread_t thread;
+    pthread_create(&thread, NULL, add, &adder);
+    CHECK(progress_start(progress, INTERVAL, out) == 0);
+
+    // The rate is known once the reporter has sampled
+    bool rated = false;
+    for (int i = 0; i < 200 && !rated; i++) {
+        usleep(10000);
+        rated = progress_rate(progress) > 0;
+    }
+    CHECK(rated);
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    progress_free(progress);
+    fclose(out);
+}
+
+int main(int argc, char** argv) {
+    test_files();
+    test_report();
+    test_rate();
+
+    return check_result();
+}
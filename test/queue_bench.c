@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.h"
+
+/*
+ * Throughput and latency benchmark for the Queue, built once against each
+ * implementation (queue_bench_mutex and queue_bench_ring). Like queue_test,
+ * N items are pushed through a queue of NUM_THREADS slots, but by a
+ * configurable number of producers and consumers. Each item is stamped when
+ * put, and its latency is the time until a consumer gets it.
+ *
+ * ./queue_bench_<impl> [consumers] [producers]
+ */
+
+#define NUM_THREADS 16
+#define N 1000000
+
+typedef struct {
+    int value;
+    uint64_t stamp; // Nanoseconds at queue_put
+} Task;
+
+typedef struct {
+    Queue* queue;
+    Task* tasks;
+    uint64_t* latencies; // Indexed by task value
+    int first;
+    int count;
+    long sum;
+} Worker;
+
+static uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void* produce(void* arg) {
+    Worker* worker = (Worker*) arg;
+
+    for (int i = worker->first; i < worker->first + worker->count; i++) {
+        Task* task = &worker->tasks[i];
+        task->value = i;
+        task->stamp = now_ns();
+        queue_put(worker->queue, task);
+    }
+    return NULL;
+}
+
+void* consume(void* arg) {
+    Worker* worker = (Worker*) arg;
+
+    Task* task;
+    while ((task = (Task*) queue_get(worker->queue)) != NULL) {
+        worker->latencies[task->value] = now_ns() - task->stamp;
+        worker->sum += task->value;
+    }
+    return NULL;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+    int num_consumers = argc > 1 ? atoi(argv[1]) : NUM_THREADS;
+    int num_producers = argc > 2 ? atoi(argv[2]) : 1;
+    if (num_consumers < 1 || num_producers < 1) {
+        fprintf(stderr, "usage: %s [consumers] [producers]\n", argv[0]);
+        exit(1);
+    }
+
+    const char* name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1
+                                             : argv[0];
+
+    Queue* queue = queue_alloc(NUM_THREADS);
+    Task* tasks = malloc(sizeof(Task) * N);
+    uint64_t* latencies = malloc(sizeof(uint64_t) * N);
+    pthread_t* consumers = malloc(sizeof(pthread_t) * num_consumers);
+    pthread_t* producers = malloc(sizeof(pthread_t) * num_producers);
+    Worker* workers = calloc(num_consumers + num_producers, sizeof(Worker));
+
+    uint64_t started = now_ns();
+
+    for (int i = 0; i < num_consumers; i++) {
+        workers[i] = (Worker){queue, tasks, latencies, 0, 0, 0};
+        pthread_create(&consumers[i], NULL, consume, &workers[i]);
+    }
+
+    int share = N / num_producers;
+    for (int i = 0; i < num_producers; i++) {
+        Worker* worker = &workers[num_consumers + i];
+        int first = i * share;
+        int count = i == num_producers - 1 ? N - first : share;
+        *worker = (Worker){queue, tasks, latencies, first, count, 0};
+        pthread_create(&producers[i], NULL, produce, worker);
+    }
+
+    for (int i = 0; i < num_producers; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < num_consumers; i++) {
+        queue_put(queue, NULL);
+    }
+
+    long sum = 0;
+    for (int i = 0; i < num_consumers; i++) {
+        pthread_join(consumers[i], NULL);
+        sum += workers[i].sum;
+    }
+
+    double elapsed = (now_ns() - started) / 1e9;
+    long expected = (long) N * (N - 1) / 2;
+
+    qsort(latencies, N, sizeof(uint64_t), compare_latency);
+
+    printf("%s: %d producers, %d consumers\n", name, num_producers,
+           num_consumers);
+    printf("  %.0f ops/sec (%.3f s)\n", N / elapsed, elapsed);
+    printf("  latency p50 %lu ns, p90 %lu ns, p99 %lu ns, p99.9 %lu ns, "
+           "max %lu ns\n",
+           latencies[N / 2], latencies[N * 9 / 10], latencies[N * 99 / 100],
+           latencies[N * 999 / 1000], latencies[N - 1]);
+    printf("  total sum: %ld, expected sum: %ld%s\n", sum, expected,
+           sum == expected ? "" : " MISMATCH");
+
+    free(workers);
+    free(producers);
+    free(consumers);
+    free(latencies);
+    free(tasks);
+    queue_free(queue);
+
+    return sum == expected ? 0 : 1;
+}
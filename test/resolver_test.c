@@ -0,0 +1,249 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "connection.h"
+#include "resolver.h"
+
+/*
+ * Tests the resolver cache and the happy eyeballs connector against
+ * /etc/hosts and local listening sockets, so that no network is needed.
+ *
+ * ./resolver_test
+ */
+
+#define NUM_THREADS 16
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void* look_up_localhost(void* arg) {
+    AddressList addresses;
+    int result = resolver_lookup((Resolver*) arg, "localhost", 80, &addresses);
+    return (void*) (intptr_t) (result == 0 && addresses.count > 0);
+}
+
+void test_resolve_host() {
+    AddressList addresses;
+    CHECK(resolve_host("localhost", 80, &addresses) == 0);
+    CHECK(addresses.count > 0);
+
+    struct sockaddr_in* address = (struct sockaddr_in*) &addresses.addresses[0];
+    CHECK(address->sin_port == htons(80));
+
+    CHECK(resolve_host("::1", 8080, &addresses) == 0);
+    CHECK(addresses.count == 1 && addresses.addresses[0].ss_family == AF_INET6);
+}
+
+void test_shared_lookups() {
+    Resolver* resolver = resolver_alloc(2, 60, -1);
+    pthread_t threads[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, look_up_localhost, resolver);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        void* ok;
+        pthread_join(threads[i], &ok);
+        CHECK(ok);
+    }
+
+    // Every thread shared the one resolution
+    CHECK(resolver_resolutions(resolver) == 1);
+
+    // A different port is a different entry
+    AddressList addresses;
+    CHECK(resolver_lookup(resolver, "localhost", 8080, &addresses) == 0);
+    CHECK(resolver_resolutions(resolver) == 2);
+
+    resolver_free(resolver);
+}
+
+void test_expiry() {
+    Resolver* resolver = resolver_alloc(1, 0.05, -1);
+    AddressList addresses;
+
+    CHECK(resolver_lookup(resolver, "localhost", 80, &addresses) == 0);
+    CHECK(resolver_lookup(resolver, "localhost", 80, &addresses) == 0);
+    CHECK(resolver_resolutions(resolver) == 1);
+
+    // Once expired, the stale entry is still used while it is refreshed
+    usleep(100000);
+    CHECK(resolver_try_lookup(resolver, "localhost", 80, &addresses) ==
+          RESOLVE_DONE);
+    usleep(100000);
+    CHECK(resolver_resolutions(resolver) == 2);
+
+    resolver_free(resolver);
+}
+
+void test_failure() {
+    Resolver* resolver = resolver_alloc(1, 60, -1);
+    AddressList addresses;
+
+    CHECK(resolver_lookup(resolver, "nohost.invalid", 80, &addresses) == -1);
+    CHECK(resolver_try_lookup(resolver, "nohost.invalid", 80, &addresses) ==
+          RESOLVE_FAILED);
+    CHECK(resolver_resolutions(resolver) == 1);
+
+    resolver_free(resolver);
+}
+
+void test_notify() {
+    int notify_fd = eventfd(0, 0);
+    Resolver* resolver = resolver_alloc(1, 60, notify_fd);
+    AddressList addresses;
+
+    CHECK(resolver_try_lookup(resolver, "localhost", 80, &addresses) ==
+          RESOLVE_PENDING);
+
+    uint64_t count;
+    CHECK(read(notify_fd, &count, sizeof(count)) == sizeof(count));
+    CHECK(resolver_try_lookup(resolver, "localhost", 80, &addresses) ==
+          RESOLVE_DONE);
+
+    resolver_free(resolver);
+    close(notify_fd);
+}
+
+/**
+ * @brief Listens on a loopback port chosen by the kernel.
+ *
+ * @param family AF_INET or AF_INET6.
+ * @param backlog The listen backlog.
+ * @param address Filled in with the address to connect to.
+ * @param length Filled in with the length of the address.
+ * @return int The listening socket.
+ */
+int listen_loopback(int family, int backlog, struct sockaddr_storage* address,
+                    socklen_t* length) {
+    int sockfd = socket(family, SOCK_STREAM, 0);
+    memset(address, 0, sizeof(*address));
+
+    if (family == AF_INET6) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*) address;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_loopback;
+        *length = sizeof(*in6);
+    } else {
+        struct sockaddr_in* in = (struct sockaddr_in*) address;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *length = sizeof(*in);
+    }
+
+    if (bind(sockfd, (struct sockaddr*) address, *length) == -1 ||
+        listen(sockfd, backlog) == -1 ||
+        getsockname(sockfd, (struct sockaddr*) address, length) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    return sockfd;
+}
+
+/**
+ * @brief Connects with a Connector, as connect_host does.
+ */
+int race(const AddressList* addresses) {
+    Connector connector;
+    connector_start(&connector, addresses, CONNECT_TIMEOUT);
+
+    int sockfd;
+    while ((sockfd = connector_step(&connector)) == CONNECT_PENDING) {
+        struct pollfd pfds[MAX_ADDRESSES];
+        int sockets[MAX_ADDRESSES];
+        int count = connector_sockets(&connector, sockets);
+        for (int i = 0; i < count; i++) {
+            pfds[i] = (struct pollfd){.fd = sockets[i], .events = POLLOUT};
+        }
+        poll(pfds, count, connector_timeout(&connector));
+    }
+    return sockfd;
+}
+
+void test_fallback() {
+    AddressList addresses = {.count = 2};
+
+    // Nothing listens on the first address once its listener is closed, so
+    // it is refused and the second is tried straight away.
+    int closed = listen_loopback(AF_INET6, 1, &addresses.addresses[0],
+                                 &addresses.lengths[0]);
+    close(closed);
+    int listener = listen_loopback(AF_INET, 1, &addresses.addresses[1],
+                                   &addresses.lengths[1]);
+
+    double started = now();
+    int sockfd = race(&addresses);
+    CHECK(sockfd >= 0);
+    CHECK(now() - started < CONNECT_ATTEMPT_DELAY);
+
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    getpeername(sockfd, (struct sockaddr*) &peer, &length);
+    CHECK(peer.ss_family == AF_INET);
+
+    close(sockfd);
+    close(listener);
+
+    // Every address refused
+    addresses.count = 1;
+    CHECK(race(&addresses) == -1);
+}
+
+void test_race() {
+    AddressList addresses = {.count = 2};
+
+    // Once its one slot is taken, a listener with no backlog never answers
+    // another connection, so the second address wins the race once it
+    // starts, CONNECT_ATTEMPT_DELAY later.
+    int stuck = listen_loopback(AF_INET, 0, &addresses.addresses[0],
+                                &addresses.lengths[0]);
+    int listener = listen_loopback(AF_INET6, 1, &addresses.addresses[1],
+                                   &addresses.lengths[1]);
+
+    int filler = socket(AF_INET, SOCK_STREAM, 0);
+    connect(filler, (struct sockaddr*) &addresses.addresses[0],
+            addresses.lengths[0]);
+
+    double started = now();
+    int sockfd = race(&addresses);
+    double elapsed = now() - started;
+    CHECK(sockfd >= 0);
+    CHECK(elapsed >= CONNECT_ATTEMPT_DELAY && elapsed < 1);
+
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    getpeername(sockfd, (struct sockaddr*) &peer, &length);
+    CHECK(peer.ss_family == AF_INET6);
+
+    close(sockfd);
+    close(filler);
+    close(listener);
+    close(stuck);
+}
+
+int main(int argc, char** argv) {
+    test_resolve_host();
+    test_shared_lookups();
+    test_expiry();
+    test_failure();
+    test_notify();
+    test_fallback();
+    test_race();
+
+    return check_result();
+}
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "header.h"
+#include "scan.h"
+
+/*
+ * Benchmarks the scanners on realistic response headers, against the strstr
+ * calls they replace, and the header parser at each level the CPU supports.
+ * Before timing anything, checks that every level agrees with the scalar
+ * scanners on random input.
+ *
+ * ./scan_bench [iterations]
+ */
+
+#define DEFAULT_ITERATIONS 500000
+#define CHECK_INPUTS 200000
+#define MAX_INPUT 512
+
+static const char* headers[] = {
+    // A small static file from nginx
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx\r\n"
+    "Date: Mon, 12 Oct 2026 04:12:33 GMT\r\n"
+    "Content-Type: image/png\r\n"
+    "Content-Length: 1432\r\n"
+    "Accept-Ranges: bytes\r\n\r\n",
+
+    // A ranged response from Apache
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Date: Mon, 12 Oct 2026 04:12:33 GMT\r\n"
+    "Server: Apache/2.4.41 (Ubuntu)\r\n"
+    "Last-Modified: Tue, 06 Oct 2026 21:40:02 GMT\r\n"
+    "ETag: \"5f7cf1e2-1e8480\"\r\n"
+    "Cache-Control: public, max-age=86400\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Range: bytes 0-262143/2000000\r\n"
+    "Content-Length: 262144\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Connection: keep-alive\r\n\r\n",
+
+    // An object from a CDN
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/javascript; charset=utf-8\r\n"
+    "Content-Length: 48213\r\n"
+    "Connection: keep-alive\r\n"
+    "Date: Mon, 12 Oct 2026 04:12:33 GMT\r\n"
+    "Last-Modified: Thu, 01 Oct 2026 08:00:00 GMT\r\n"
+    "ETag: \"a1b2c3d4e5f60718293a4b5c6d7e8f90\"\r\n"
+    "Cache-Control: public, max-age=31536000, immutable\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Timing-Allow-Origin: *\r\n"
+    "Strict-Transport-Security: max-age=63072000; includeSubDomains\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Age: 81234\r\n"
+    "Via: 1.1 varnish, 1.1 varnish\r\n"
+    "X-Served-By: cache-syd10136-SYD, cache-akl10320-AKL\r\n"
+    "X-Cache: HIT, HIT\r\n"
+    "X-Cache-Hits: 12, 3\r\n"
+    "X-Timer: S1760242353.123456,VS0,VE0\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "alt-svc: h3=\":443\";ma=86400\r\n\r\n",
+};
+
+#define NUM_HEADERS (int) (sizeof(headers) / sizeof(headers[0]))
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Checks that every supported level agrees with the scalar scanners,
+ * at every alignment and on inputs dense with delimiters.
+ *
+ * @return int 0 if they agree, -1 if not.
+ */
+static int check_levels() {
+    static const char alphabet[] = "\r\n:a ";
+    char input[MAX_INPUT];
+    uint64_t state = 88172645463325252ULL;
+
+    for (int i = 0; i < CHECK_INPUTS; i++) {
+        size_t offset = i % 32;
+        size_t length = (i * 7919) % (MAX_INPUT - offset);
+        for (size_t j = 0; j < length; j++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            // Mostly ordinary bytes, so that matches are spread out
+            input[offset + j] = state % 16 ? 'a' : alphabet[state % 5];
+        }
+
+        const char* data = input + offset;
+        scan_use(SCAN_SCALAR);
+        size_t colon = scan_for(data, length, ':', '\n');
+        size_t end = scan_header_end(data, length);
+
+        for (ScanLevel level = SCAN_SSE2; level <= SCAN_AVX2; level++) {
+            if (scan_use(level) &&
+                (scan_for(data, length, ':', '\n') != colon ||
+                 scan_header_end(data, length) != end)) {
+                fprintf(stderr, "%s disagrees with scalar on input %d\n",
+                        scan_level_name(level), i);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void report(const char* name, double* elapsed, long iterations) {
+    printf("%-20s", name);
+    for (int i = 0; i < NUM_HEADERS; i++) {
+        printf("%12.1f", elapsed[i] / iterations * 1e9);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    ScanLevel best = scan_level();
+    double elapsed[NUM_HEADERS];
+    volatile size_t sink = 0;
+
+    if (check_levels() == -1) {
+        return 1;
+    }
+    printf("All levels agree. Chosen at startup: %s\n\n",
+           scan_level_name(best));
+
+    printf("ns per header       ");
+    for (int i = 0; i < NUM_HEADERS; i++) {
+        printf("%9zu B", strlen(headers[i]));
+    }
+    printf("\n");
+
+    // The strstr calls the parser replaced: the end of the header, then
+    // each field that was looked for.
+    for (int i = 0; i < NUM_HEADERS; i++) {
+        double started = now();
+        for (long j = 0; j < iterations; j++) {
+            sink += strstr(headers[i], "\r\n\r\n") - headers[i];
+            sink += strstr(headers[i], "Accept-Ranges:") != NULL;
+            sink += strstr(headers[i], "Content-Length:") != NULL;
+        }
+        elapsed[i] = now() - started;
+    }
+    report("strstr", elapsed, iterations);
+
+    for (ScanLevel level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        if (!scan_use(level)) {
+            continue;
+        }
+
+        char name[32];
+        for (int i = 0; i < NUM_HEADERS; i++) {
+            size_t length = strlen(headers[i]);
+            double started = now();
+            for (long j = 0; j < iterations; j++) {
+                sink += scan_header_end(headers[i], length);
+            }
+            elapsed[i] = now() - started;
+        }
+        snprintf(name, sizeof(name), "header end, %s", scan_level_name(level));
+        report(name, elapsed, iterations);
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+            size_t length = strlen(headers[i]);
+            double started = now();
+            for (long j = 0; j < iterations; j++) {
+                HeaderParser parser;
+                header_parser_init(&parser);
+                sink += header_parser_parse(&parser, headers[i], length);
+            }
+            elapsed[i] = now() - started;
+        }
+        snprintf(name, sizeof(name), "parse, %s", scan_level_name(level));
+        report(name, elapsed, iterations);
+    }
+
+    scan_use(best);
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue.h"
+#include "scheduler.h"
+
+/*
+ * Stress benchmark comparing the shared Queue against the work stealing
+ * Scheduler, at 1 to 64 threads, on two workloads:
+ *   flat   - the main thread submits every item, workers only consume
+ *   fanout - the main thread submits a few roots, and every item below a
+ *            given depth spawns two children, as split ranges do
+ *
+ * ./scheduler_bench [max_threads]
+ */
+
+#define FLAT_ITEMS 1000000
+#define FANOUT_ROOTS 64
+#define FANOUT_DEPTH 14
+
+typedef struct {
+    Queue* queue;
+    Scheduler* scheduler;
+    int id;
+    int num_threads;
+
+    long* remaining; // Items not yet processed, shared by every thread
+    long sum;
+} Worker;
+
+// Items are depths, offset by one so that no item is NULL
+#define ITEM(depth) ((void*) (intptr_t) ((depth) + 1))
+#define DEPTH(item) ((int) (intptr_t) (item) -1)
+
+/**
+ * @brief Processes an item, returning whether it was the last one.
+ */
+static int process(Worker* worker, void* item, void (*spawn)(Worker*, void*)) {
+    int depth = DEPTH(item);
+    worker->sum += depth;
+
+    if (depth > 0) {
+        spawn(worker, ITEM(depth - 1));
+        spawn(worker, ITEM(depth - 1));
+    }
+    return __atomic_sub_fetch(worker->remaining, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+static void queue_spawn(Worker* worker, void* item) {
+    queue_put(worker->queue, item);
+}
+
+static void scheduler_spawn(Worker* worker, void* item) {
+    scheduler_push(worker->scheduler, worker->id, item);
+}
+
+void* queue_worker(void* arg) {
+    Worker* worker = (Worker*) arg;
+    void* item;
+
+    while ((item = queue_get(worker->queue)) != NULL) {
+        if (process(worker, item, queue_spawn)) {
+            for (int i = 0; i < worker->num_threads; i++) {
+                queue_put(worker->queue, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+void* scheduler_worker(void* arg) {
+    Worker* worker = (Worker*) arg;
+
+    while (true) {
+        void* item = scheduler_try_get(worker->scheduler, worker->id);
+        if (item) {
+            if (process(worker, item, scheduler_spawn)) {
+                scheduler_shutdown(worker->scheduler);
+            }
+        } else if (!scheduler_wait(worker->scheduler, 100)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs a workload, returning the millions of items processed per
+ * second.
+ */
+double run(bool use_scheduler, int num_threads, int roots, int depth) {
+    long per_root = (2L << depth) - 1;
+    long total = roots * per_root;
+    long remaining = total;
+
+    pthread_t threads[num_threads];
+    Worker workers[num_threads];
+    Queue* queue = use_scheduler ? NULL : queue_alloc(total + num_threads);
+    Scheduler* scheduler = use_scheduler ? scheduler_alloc(num_threads) : NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i] = (Worker){queue, scheduler, i, num_threads, &remaining, 0};
+        pthread_create(&threads[i], NULL,
+                       use_scheduler ? scheduler_worker : queue_worker,
+                       &workers[i]);
+    }
+
+    for (int i = 0; i < roots; i++) {
+        if (use_scheduler) {
+            scheduler_submit(scheduler, ITEM(depth));
+        } else {
+            queue_put(queue, ITEM(depth));
+        }
+    }
+
+    long sum = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        sum += workers[i].sum;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Every root contributes depth * 1 + (depth - 1) * 2 + ... to the sum
+    long expected = 0;
+    for (int d = depth; d >= 0; d--) {
+        expected += (long) d << (depth - d);
+    }
+    expected *= roots;
+    if (sum != expected) {
+        printf("total sum: %ld, expected sum: %ld\n", sum, expected);
+        exit(EXIT_FAILURE);
+    }
+
+    if (queue) {
+        queue_free(queue);
+    }
+    if (scheduler) {
+        scheduler_free(scheduler);
+    }
+
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return total / seconds / 1e6;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+
+    printf("Mitems/s   %-21s %-21s\n", "flat", "fanout");
+    printf("threads    %-10s %-10s %-10s %-10s\n", "queue", "scheduler",
+           "queue", "scheduler");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        printf("%-10d", threads);
+        printf(" %-10.2f", run(false, threads, FLAT_ITEMS, 0));
+        printf(" %-10.2f", run(true, threads, FLAT_ITEMS, 0));
+        printf(" %-10.2f", run(false, threads, FANOUT_ROOTS, FANOUT_DEPTH));
+        printf(" %-10.2f\n", run(true, threads, FANOUT_ROOTS, FANOUT_DEPTH));
+        fflush(stdout);
+    }
+
+    return 0;
+}
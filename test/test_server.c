@@ -0,0 +1,919 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "digest.h"
+
+/*
+ * A small HTTP/1.1 server for testing the downloader without a network. It
+ * serves the files in a directory, and generated objects of any size which
+ * take no space:
+ *
+ *   /sparse/<size> - <size> bytes (a K, M or G suffix may be given), all
+ *                    zero except that the offset of every 64 KiB boundary
+ *                    is written there, as 8 little-endian bytes, so that a
+ *                    range written in the wrong place shows up. Anything
+ *                    after a further slash is ignored, so /sparse/64K/1 and
+ *                    /sparse/64K/2 are different URLs for the same object.
+ *
+ * HEAD, byte ranges, If-Range and persistent connections are supported,
+ * with a thread per connection. Several ranges are sent as a
+ * multipart/byteranges body.
+ *
+ * ./test_server [-p port] [-d directory] [-R] [-S] [-C] [-l latency_ms]
+ *               [-b bytes_per_second] [-L log_file] [-F faults] [-N every]
+ *     Serves on localhost, and prints "listening on <port>" once ready. Port
+ *     0, the default, picks a free port. For benchmarks, the server can be
+ *     made to ignore ranges (-R), send only the first of several ranges
+ *     (-S), close the connection after every response (-C), wait before
+ *     every response (-l), and send no faster than a rate on each
+ *     connection (-b, which may have a K, M or G suffix). With -L,
+ *     a line is appended to the log file for each request:
+ *
+ *         <method> <path> <status> <body bytes> <microseconds>
+ *
+ *     timed from the request arriving to the last byte of the response
+ *     being sent, or to the client closing the connection.
+ *
+ *     With -F, every Nth GET (-N, 3 by default) goes wrong, in turn in each
+ *     of the ways in a comma separated list:
+ *
+ *         error  - a 503 is sent instead
+ *         reset  - the connection is reset half way through the body
+ *         stall  - half the body is sent, then nothing until the client
+ *                  closes the connection
+ *         silent - nothing is sent until the client closes the connection
+ *         full   - the Range field is ignored, and all of the resource is
+ *                  sent with a 200
+ *         close  - the body is sent without a Content-Length, so that it
+ *                  ends when the connection closes, which it does half way
+ *                  through
+ *         empty  - a 206 is sent without any of the ranges asked for: an
+ *                  empty body for one range, or a multipart body without
+ *                  any parts for several
+ * ./test_server -g <size>
+ *     Writes /sparse/<size> to stdout, to check a download against.
+ * ./test_server -c <size>
+ *     Prints the CRC32C of /sparse/<size>, worked out a piece at a time
+ *     rather than combined from ranges as the downloader does.
+ */
+
+#define REQUEST_SIZE 16384
+#define SEND_SIZE (256 * 1024)
+#define PATH_LEN 1024
+#define SPARSE_PREFIX "/sparse/"
+#define SPARSE_STRIDE 65536
+#define MAX_FAULTS 16
+#define MAX_RANGES 64
+#define BOUNDARY "test server parts"
+
+// Ways a response can be made to go wrong
+typedef enum {
+    FAULT_NONE,
+    FAULT_ERROR,  // A 503 instead
+    FAULT_RESET,  // Reset half way through the body
+    FAULT_STALL,  // Half the body, then nothing
+    FAULT_SILENT, // Nothing at all
+    FAULT_FULL,   // All of the resource, whatever range was asked for
+    FAULT_CLOSE,  // No Content-Length, and closed half way through the body
+    FAULT_EMPTY,  // None of the ranges asked for, in a 206 which claims them
+} Fault;
+
+typedef struct {
+    bool found;
+    bool generated; // True for a /sparse/ object, false for a file
+    int fd;         // The file, if not generated
+    off_t size;
+    char etag[64];
+} Resource;
+
+static const char* root = ".";
+static bool ranges = true;      // False to ignore Range fields
+static bool single = false;     // True to send only the first range asked
+                                // for
+static bool close_all = false;  // True to close after every response
+static long latency_ms = 0;     // How long to wait before each response
+static off_t rate = 0;          // Bytes per second per connection, 0 for any
+static int log_fd = -1;         // The request log, or -1 for none
+static int fault_every = 3;     // Every how many GETs a fault is injected
+static int gets = 0;            // GETs so far, updated atomically
+
+// The faults to inject, in turn
+static Fault faults[MAX_FAULTS];
+static int num_faults = 0;
+
+/**
+ * @brief The microseconds since an earlier time.
+ */
+static long long micros_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * @brief Parses a size in bytes, which may have a K, M or G suffix.
+ *
+ * @param str The size e.g. 5G
+ * @return off_t The size, or -1 if it is not a valid size.
+ */
+static off_t parse_size(const char* str) {
+    char* end;
+    long long size = strtoll(str, &end, 10);
+    long long unit = 1;
+
+    switch (*end) {
+        case 'G':
+            unit *= 1024;
+            // fall through
+        case 'M':
+            unit *= 1024;
+            // fall through
+        case 'K':
+            unit *= 1024;
+            end++;
+            break;
+    }
+
+    if (end == str || *end != '\0' || size < 0 || size > LLONG_MAX / unit) {
+        return -1;
+    }
+    return size * unit;
+}
+
+/**
+ * @brief Fills a buffer with part of a /sparse/ object.
+ *
+ * @param buffer
+ * @param offset The offset in the object of the first byte.
+ * @param length The number of bytes.
+ */
+static void fill_sparse(char* buffer, off_t offset, size_t length) {
+    memset(buffer, 0, length);
+
+    off_t end = offset + length;
+    for (off_t mark = offset / SPARSE_STRIDE * SPARSE_STRIDE; mark < end;
+         mark += SPARSE_STRIDE) {
+        for (int i = 0; i < 8; i++) {
+            if (mark + i >= offset && mark + i < end) {
+                buffer[mark + i - offset] = (uint64_t) mark >> (8 * i);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finds the resource a request path names.
+ *
+ * @param path e.g. /sparse/5G or /files/a.bin
+ * @param resource Filled in, with found set false if there is none.
+ */
+static void find_resource(const char* path, Resource* resource) {
+    memset(resource, 0, sizeof(Resource));
+    resource->fd = -1;
+
+    if (strncmp(path, SPARSE_PREFIX, strlen(SPARSE_PREFIX)) == 0) {
+        char size[32];
+        const char* name = path + strlen(SPARSE_PREFIX);
+        snprintf(size, sizeof(size), "%.*s", (int) strcspn(name, "/"), name);
+        resource->size = parse_size(size);
+        resource->generated = resource->found = resource->size >= 0;
+        snprintf(resource->etag, sizeof(resource->etag), "\"sparse-%llx\"",
+                 (unsigned long long) resource->size);
+        return;
+    }
+
+    char file[PATH_LEN];
+    struct stat st;
+    snprintf(file, PATH_LEN, "%s%s", root, path);
+    if (strstr(path, "..") || stat(file, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (resource->fd = open(file, O_RDONLY)) == -1) {
+        return;
+    }
+
+    resource->found = true;
+    resource->size = st.st_size;
+    snprintf(resource->etag, sizeof(resource->etag), "\"%llx-%llx\"",
+             (unsigned long long) st.st_mtime,
+             (unsigned long long) st.st_size);
+}
+
+/**
+ * @brief Finds a header field in a request, case-insensitively.
+ *
+ * @param request The request, NUL terminated.
+ * @param name The field name e.g. "Range".
+ * @param value Filled in with the value.
+ * @param size The size of value.
+ * @return true The request has the field.
+ * @return false The request does not have the field.
+ */
+static bool find_field(const char* request, const char* name, char* value,
+                       size_t size) {
+    size_t name_length = strlen(name);
+    const char* line = strstr(request, "\r\n");
+
+    while (line && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, name_length) == 0 &&
+            line[name_length] == ':') {
+            const char* start = line + name_length + 1;
+            while (*start == ' ') {
+                start++;
+            }
+            size_t length = strcspn(start, "\r\n");
+            snprintf(value, size, "%.*s", (int) length, start);
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+/**
+ * @brief Works out one range of a Range field.
+ *
+ * @param range The range e.g. 0-499, followed by the end of the field or a
+ * comma.
+ * @param size The size of the resource.
+ * @param start Set to the offset of the first byte.
+ * @param end Set to one past the last byte, which is at most start when the
+ * range cannot be satisfied.
+ * @return const char* What follows the range, or NULL if it is malformed.
+ */
+static const char* parse_range(const char* range, off_t size, off_t* start,
+                               off_t* end) {
+    long long first = -1, last = -1;
+    int consumed = 0;
+
+    if (sscanf(range, "-%lld%n", &last, &consumed) == 1) {
+        // A suffix: the last bytes
+        *start = last < size ? size - last : 0;
+        *end = size;
+    } else if (sscanf(range, "%lld-%n", &first, &consumed) == 1) {
+        *start = first;
+        *end = size;
+        range += consumed;
+        consumed = 0;
+        if (sscanf(range, "%lld%n", &last, &consumed) == 1) {
+            *end = last + 1 < size ? last + 1 : size;
+        }
+    } else {
+        return NULL;
+    }
+
+    range += consumed;
+    return *range == ',' || *range == '\0' ? range : NULL;
+}
+
+/**
+ * @brief Works out the ranges to send from a Range field. Those which cannot
+ * be satisfied are left out, and with -S, all but the first.
+ *
+ * @param field The field's value e.g. bytes=0-499,1000-1499
+ * @param size The size of the resource.
+ * @param starts Set to the offset of the first byte of each range.
+ * @param ends Set to one past the last byte of each range.
+ * @return int The number of ranges, 0 if none can be satisfied, or -1 if the
+ * field is not a list of at most MAX_RANGES byte ranges, and so is ignored.
+ */
+static int parse_ranges(const char* field, off_t size, off_t* starts,
+                        off_t* ends) {
+    if (strncmp(field, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    int count = 0, listed = 0;
+    const char* range = field + 6;
+    while (true) {
+        if (listed++ == MAX_RANGES ||
+            (range = parse_range(range, size, &starts[count],
+                                 &ends[count])) == NULL) {
+            return -1;
+        }
+        count += starts[count] < ends[count];
+        if (*range == '\0') {
+            break;
+        }
+        range++;
+    }
+    return single && count > 1 ? 1 : count;
+}
+
+/**
+ * @brief Sends all of a buffer.
+ *
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int send_all(int sockfd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(sockfd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends [start, end) of a resource, no faster than the rate if there
+ * is one.
+ *
+ * @param sent Set to the number of bytes sent.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int send_body(int sockfd, Resource* resource, off_t start, off_t end,
+                     char* buffer, off_t* sent) {
+    // Paced in pieces of a hundredth of a second's worth
+    size_t piece = SEND_SIZE;
+    if (rate > 0 && rate / 100 < SEND_SIZE) {
+        piece = rate / 100 > 0 ? rate / 100 : 1;
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    *sent = 0;
+
+    while (start < end) {
+        size_t length = end - start < piece ? end - start : piece;
+
+        if (resource->generated) {
+            fill_sparse(buffer, start, length);
+        } else {
+            ssize_t got = pread(resource->fd, buffer, length, start);
+            if (got <= 0) {
+                return -1;
+            }
+            length = got;
+        }
+
+        if (send_all(sockfd, buffer, length) == -1) {
+            return -1;
+        }
+        start += length;
+        *sent += length;
+
+        if (rate > 0) {
+            long long due = *sent * 1000000LL / rate - micros_since(&started);
+            if (due > 0) {
+                usleep(due);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes a field out of a response header.
+ *
+ * @param header The header, NUL terminated.
+ * @param length The length of the header.
+ * @param name The field's name e.g. "Content-Length".
+ * @return int The length of the header without the field.
+ */
+static int drop_field(char* header, int length, const char* name) {
+    char line[64];
+    snprintf(line, sizeof(line), "\r\n%s:", name);
+    char* field = strstr(header, line);
+    if (field == NULL) {
+        return length;
+    }
+
+    char* next = strstr(field + 2, "\r\n");
+    memmove(field, next, header + length + 1 - next);
+    return length - (next - field);
+}
+
+/**
+ * @brief Formats the delimiter and header of a part of a multipart/byteranges
+ * body.
+ *
+ * @param part The part's header is written here.
+ * @param first True for the first part, which no line break comes before.
+ * @return int The length of the part's header.
+ */
+static int part_header(char* part, size_t size, bool first, off_t start,
+                       off_t end, off_t total) {
+    return snprintf(part, size,
+                    "%s--" BOUNDARY "\r\n"
+                    "Content-Type: application/octet-stream\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    first ? "" : "\r\n", (long long) start,
+                    (long long) end - 1, (long long) total);
+}
+
+/**
+ * @brief Sends several ranges of a resource as a multipart/byteranges body,
+ * or measures it.
+ *
+ * @param sockfd The socket, or -1 to only measure the body.
+ * @param cut The number of bytes of the ranges to send before stopping,
+ * for a fault, or -1 to send them all.
+ * @param sent Set to the number of body bytes sent, or that would be.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int send_parts(int sockfd, Resource* resource, int count,
+                      const off_t* starts, const off_t* ends, off_t cut,
+                      char* buffer, off_t* sent) {
+    const char* close_delimiter = "\r\n--" BOUNDARY "--\r\n";
+    char part[256];
+    *sent = 0;
+
+    for (int i = 0; i < count && cut != 0; i++) {
+        int length = part_header(part, sizeof(part), i == 0, starts[i],
+                                 ends[i], resource->size);
+        off_t end = cut >= 0 && ends[i] - starts[i] > cut ? starts[i] + cut
+                                                           : ends[i];
+        off_t body = end - starts[i];
+
+        if (sockfd != -1 &&
+            (send_all(sockfd, part, length) == -1 ||
+             send_body(sockfd, resource, starts[i], end, buffer, &body) ==
+                 -1)) {
+            return -1;
+        }
+        *sent += length + body;
+        cut -= cut >= 0 ? body : 0;
+    }
+
+    if (cut != 0) {
+        if (sockfd != -1 &&
+            send_all(sockfd, close_delimiter, strlen(close_delimiter)) == -1) {
+            return -1;
+        }
+        *sent += strlen(close_delimiter);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a comma separated list of faults into `faults`.
+ *
+ * @param list e.g. reset,stall
+ * @return int 0 on success, -1 if a fault is not known.
+ */
+static int parse_faults(const char* list) {
+    const char* names[] = {"error", "reset", "stall", "silent",
+                           "full", "close", "empty"};
+
+    while (*list && num_faults < MAX_FAULTS) {
+        size_t length = strcspn(list, ",");
+        Fault fault = FAULT_NONE;
+        for (int i = 0; i < 7; i++) {
+            if (strlen(names[i]) == length &&
+                strncmp(list, names[i], length) == 0) {
+                fault = FAULT_ERROR + i;
+            }
+        }
+        if (fault == FAULT_NONE) {
+            return -1;
+        }
+        faults[num_faults++] = fault;
+        list += length + (list[length] == ',');
+    }
+    return 0;
+}
+
+/**
+ * @brief Counts a GET, and chooses the fault to inject into its response.
+ *
+ * @return Fault The fault, or FAULT_NONE.
+ */
+static Fault next_fault(void) {
+    if (num_faults == 0) {
+        return FAULT_NONE;
+    }
+    int get = __atomic_add_fetch(&gets, 1, __ATOMIC_RELAXED);
+    if (get % fault_every != 0) {
+        return FAULT_NONE;
+    }
+    return faults[(get / fault_every - 1) % num_faults];
+}
+
+/**
+ * @brief Waits, sending nothing, until the client closes the connection.
+ */
+static void wait_for_close(int sockfd) {
+    char discard[1024];
+    while (recv(sockfd, discard, sizeof(discard), 0) > 0) {
+    }
+}
+
+/**
+ * @brief Appends a request to the request log, if there is one.
+ *
+ * @param method
+ * @param path
+ * @param status The response's status code.
+ * @param bytes The number of body bytes sent, which may be fewer than asked
+ * for if the client closed the connection.
+ * @param arrived When the request arrived.
+ */
+static void log_request(const char* method, const char* path, int status,
+                        off_t bytes, const struct timespec* arrived) {
+    if (log_fd == -1) {
+        return;
+    }
+
+    // A line is appended with a single write, so lines are never mixed up
+    char line[PATH_LEN + 128];
+    int length = snprintf(line, sizeof(line), "%s %s %d %lld %lld\n", method,
+                          path, status, (long long) bytes,
+                          micros_since(arrived));
+    if (length > 0 && length < (int) sizeof(line) &&
+        write(log_fd, line, length) != length) {
+        perror("test_server log");
+    }
+}
+
+/**
+ * @brief Answers one request.
+ *
+ * @param sockfd
+ * @param request The request's header, NUL terminated.
+ * @param buffer A SEND_SIZE buffer to send the body from.
+ * @return int 0 if the connection may be kept open, -1 if not.
+ */
+static int handle_request(int sockfd, const char* request, char* buffer) {
+    struct timespec arrived;
+    clock_gettime(CLOCK_MONOTONIC, &arrived);
+
+    char method[8], path[PATH_LEN], version[16], value[256];
+    if (sscanf(request, "%7s %1023s %15s", method, path, version) != 3) {
+        return -1;
+    }
+
+    bool keep_alive = strcmp(version, "HTTP/1.1") == 0 && !close_all;
+    if (find_field(request, "Connection", value, sizeof(value))) {
+        keep_alive = !close_all &&
+                     (strcasecmp(value, "keep-alive") == 0 ||
+                      (keep_alive && strcasecmp(value, "close") != 0));
+    }
+    if (latency_ms > 0) {
+        usleep(latency_ms * 1000);
+    }
+
+    Fault fault = strcmp(method, "GET") == 0 ? next_fault() : FAULT_NONE;
+    keep_alive = keep_alive && fault != FAULT_CLOSE;
+    const char* connection = keep_alive ? "keep-alive" : "close";
+    if (fault == FAULT_SILENT) {
+        wait_for_close(sockfd);
+        log_request(method, path, 0, 0, &arrived);
+        return -1;
+    }
+
+    Resource resource;
+    find_resource(path, &resource);
+    if (fault == FAULT_ERROR) {
+        int length = snprintf(buffer, SEND_SIZE,
+                              "HTTP/1.1 503 Service Unavailable\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: %s\r\n\r\n",
+                              connection);
+        int result = send_all(sockfd, buffer, length);
+        log_request(method, path, 503, 0, &arrived);
+        if (resource.fd != -1) {
+            close(resource.fd);
+        }
+        return result == 0 && keep_alive ? 0 : -1;
+    }
+    if (!resource.found) {
+        int length = snprintf(buffer, SEND_SIZE,
+                              "HTTP/1.1 404 Not Found\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: %s\r\n\r\n",
+                              connection);
+        int result = send_all(sockfd, buffer, length);
+        log_request(method, path, 404, 0, &arrived);
+        return result == 0 && keep_alive ? 0 : -1;
+    }
+
+    off_t starts[MAX_RANGES], ends[MAX_RANGES];
+    char range[MAX_RANGES * 48];
+    int ranged = -1;
+    if (ranges && fault != FAULT_FULL &&
+        find_field(request, "Range", range, sizeof(range))) {
+        char if_range[256];
+        bool matches = !find_field(request, "If-Range", if_range,
+                                   sizeof(if_range)) ||
+                       strcmp(if_range, resource.etag) == 0;
+        if (matches) {
+            ranged = parse_ranges(range, resource.size, starts, ends);
+        }
+    }
+    off_t start = ranged == 1 ? starts[0] : 0;
+    off_t end = ranged == 1 ? ends[0] : resource.size;
+
+    int length, status;
+    off_t multipart_length = 0;
+    int parts = fault == FAULT_EMPTY ? 0 : ranged;
+    if (ranged == 0) {
+        status = 416;
+        length = snprintf(buffer, SEND_SIZE,
+                          "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                          "Content-Range: bytes */%lld\r\n"
+                          "Content-Length: 0\r\n"
+                          "Connection: %s\r\n\r\n",
+                          (long long) resource.size, connection);
+        start = end = 0;
+    } else if (ranged > 1) {
+        status = 206;
+        send_parts(-1, &resource, parts, starts, ends, -1, NULL,
+                   &multipart_length);
+        length = snprintf(buffer, SEND_SIZE,
+                          "HTTP/1.1 206 Partial Content\r\n"
+                          "Content-Type: multipart/byteranges; "
+                          "boundary=\"" BOUNDARY "\"\r\n"
+                          "Content-Length: %lld\r\n"
+                          "Accept-Ranges: bytes\r\n"
+                          "ETag: %s\r\n"
+                          "Connection: %s\r\n\r\n",
+                          (long long) multipart_length, resource.etag,
+                          connection);
+    } else if (ranged == 1) {
+        status = 206;
+        length = snprintf(buffer, SEND_SIZE,
+                          "HTTP/1.1 206 Partial Content\r\n"
+                          "Content-Range: bytes %lld-%lld/%lld\r\n"
+                          "Content-Length: %lld\r\n"
+                          "Accept-Ranges: bytes\r\n"
+                          "ETag: %s\r\n"
+                          "Connection: %s\r\n\r\n",
+                          (long long) start, (long long) end - 1,
+                          (long long) resource.size,
+                          (long long) (parts ? end - start : 0),
+                          resource.etag, connection);
+    } else {
+        status = 200;
+        length = snprintf(buffer, SEND_SIZE,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Length: %lld\r\n"
+                          "%s"
+                          "ETag: %s\r\n"
+                          "Connection: %s\r\n\r\n",
+                          (long long) resource.size,
+                          ranges ? "Accept-Ranges: bytes\r\n" : "",
+                          resource.etag, connection);
+    }
+
+    // A body without a length ends when the connection closes
+    if (fault == FAULT_CLOSE) {
+        length = drop_field(buffer, length, "Content-Length");
+    }
+
+    // A reset, a stall or a close cuts the body off half way, or the ranges'
+    // bytes of a multipart body
+    bool cut = fault == FAULT_RESET || fault == FAULT_STALL ||
+               fault == FAULT_CLOSE;
+    off_t half = 0;
+    for (int i = 0; i < ranged; i++) {
+        half += ends[i] - starts[i];
+    }
+    half /= 2;
+    if (cut) {
+        end = start + (end - start) / 2;
+    } else if (fault == FAULT_EMPTY && ranged == 1) {
+        end = start;
+    }
+
+    off_t sent = 0;
+    int result = send_all(sockfd, buffer, length);
+    if (result == 0 && strcmp(method, "HEAD") != 0 && ranged > 1) {
+        result = send_parts(sockfd, &resource, parts, starts, ends,
+                            cut ? half : -1, buffer, &sent);
+    } else if (result == 0 && strcmp(method, "HEAD") != 0) {
+        result = send_body(sockfd, &resource, start, end, buffer, &sent);
+    }
+
+    if (fault == FAULT_STALL) {
+        wait_for_close(sockfd);
+    } else if (fault == FAULT_RESET) {
+        // Closing with a zero linger time sends a reset
+        struct linger linger = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    log_request(method, path, status, sent, &arrived);
+
+    if (resource.fd != -1) {
+        close(resource.fd);
+    }
+    return result == 0 && keep_alive &&
+                   (fault == FAULT_NONE || fault == FAULT_FULL ||
+                    fault == FAULT_EMPTY)
+               ? 0
+               : -1;
+}
+
+/**
+ * @brief Serves one connection, a request at a time, until it is closed.
+ * Requests may be pipelined.
+ */
+static void* serve_connection(void* arg) {
+    int sockfd = (int) (intptr_t) arg;
+    char* request = malloc(REQUEST_SIZE + 1);
+    char* buffer = malloc(SEND_SIZE);
+    size_t length = 0;
+
+    while (true) {
+        request[length] = '\0';
+        char* header_end = strstr(request, "\r\n\r\n");
+
+        if (header_end == NULL) {
+            if (length == REQUEST_SIZE) {
+                break;
+            }
+            ssize_t got = recv(sockfd, request + length,
+                               REQUEST_SIZE - length, 0);
+            if (got <= 0) {
+                break;
+            }
+            length += got;
+            continue;
+        }
+
+        // Anything after the header is the next request
+        size_t used = header_end + 4 - request;
+        header_end[2] = '\0';
+        if (handle_request(sockfd, request, buffer) == -1) {
+            break;
+        }
+        memmove(request, request + used, length - used);
+        length -= used;
+    }
+
+    close(sockfd);
+    free(request);
+    free(buffer);
+    return NULL;
+}
+
+static int serve(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t address_length = sizeof(address);
+    if (bind(listener, (struct sockaddr*) &address, address_length) == -1 ||
+        listen(listener, SOMAXCONN) == -1 ||
+        getsockname(listener, (struct sockaddr*) &address, &address_length) ==
+            -1) {
+        perror("test_server");
+        return 1;
+    }
+
+    printf("listening on %d\n", ntohs(address.sin_port));
+    fflush(stdout);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (true) {
+        int sockfd = accept(listener, NULL, NULL);
+        if (sockfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection,
+                           (void*) (intptr_t) sockfd) != 0) {
+            close(sockfd);
+        }
+    }
+}
+
+/**
+ * @brief Writes a /sparse/ object to stdout, or prints its CRC32C.
+ *
+ * @param size The size of the object.
+ * @param crc_only True to print the CRC32C rather than the object.
+ * @return int The exit status.
+ */
+static int generate(off_t size, bool crc_only) {
+    char* buffer = malloc(SEND_SIZE);
+    uint32_t crc = 0;
+
+    for (off_t offset = 0; offset < size; offset += SEND_SIZE) {
+        size_t length = size - offset < SEND_SIZE ? size - offset : SEND_SIZE;
+        fill_sparse(buffer, offset, length);
+        if (crc_only) {
+            crc = crc32c(crc, buffer, length);
+        } else if (fwrite(buffer, 1, length, stdout) != length) {
+            free(buffer);
+            return 1;
+        }
+    }
+
+    free(buffer);
+    if (crc_only) {
+        printf("%08x\n", crc);
+    }
+    return fflush(stdout) == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    const char* usage = "usage: ./test_server [-p port] [-d directory] [-R] "
+                        "[-S] [-C] [-l latency_ms]\n"
+                        "                     [-b bytes_per_second] "
+                        "[-L log_file] [-F faults] [-N every]\n"
+                        "       ./test_server -g size\n"
+                        "       ./test_server -c size\n";
+    int port = 0;
+    off_t size = -1;
+    bool crc_only = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:d:RSCl:b:L:F:N:g:c:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                root = optarg;
+                break;
+            case 'R':
+                ranges = false;
+                break;
+            case 'S':
+                single = true;
+                break;
+            case 'C':
+                close_all = true;
+                break;
+            case 'l':
+                latency_ms = atol(optarg);
+                break;
+            case 'b':
+                if ((rate = parse_size(optarg)) == -1) {
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            case 'L':
+                log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                if (log_fd == -1) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (parse_faults(optarg) == -1) {
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            case 'N':
+                if ((fault_every = atoi(optarg)) < 1) {
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            case 'c':
+                crc_only = true;
+                // fall through
+            case 'g':
+                if ((size = parse_size(optarg)) == -1) {
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+
+    if (size >= 0) {
+        return generate(size, crc_only);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    return serve(port);
+}
@@ -0,0 +1,161 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "trace.h"
+
+/*
+ * Tests tracing: that nothing is recorded until it is enabled, that spans
+ * from several threads all reach the histograms, that a full ring keeps the
+ * most recent spans, and that the Chrome trace and Prometheus summary hold
+ * what was recorded.
+ *
+ * ./trace_test
+ */
+
+#define NUM_THREADS 4
+#define SPANS_PER_THREAD 1000
+#define OVERFLOW 100
+
+static char* read_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return strdup("");
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* data = malloc(size + 1);
+    data[fread(data, 1, size, file)] = '\0';
+    fclose(file);
+    return data;
+}
+
+static int count(const char* haystack, const char* needle) {
+    int found = 0;
+    for (const char* at = strstr(haystack, needle); at;
+         at = strstr(at + 1, needle)) {
+        found++;
+    }
+    return found;
+}
+
+/**
+ * @brief The value of a line of a Prometheus summary, or -1 if it has no
+ * such line.
+ */
+static long long metric(const char* summary, const char* name) {
+    char line[256];
+    snprintf(line, sizeof(line), "\n%s ", name);
+    const char* at = strstr(summary, line);
+    return at ? atoll(at + strlen(line)) : -1;
+}
+
+static void* record(void* arg) {
+    int index = (int) (long) arg;
+    trace_thread("recorder", index);
+    trace_context(index);
+
+    for (int i = 0; i < SPANS_PER_THREAD; i++) {
+        trace_end(TRACE_WRITE, trace_begin(), 10);
+    }
+    return NULL;
+}
+
+void test_disabled() {
+    CHECK(trace_begin() == 0);
+    trace_thread("main", -1);
+    trace_end(TRACE_RANGE, trace_begin(), 1);
+
+    char path[] = "/tmp/trace_test_XXXXXX";
+    close(mkstemp(path));
+    CHECK(trace_write_prometheus(path) == 0);
+    char* summary = read_file(path);
+    CHECK(metric(summary,
+                 "downloader_phase_seconds_count{phase=\"range\"}") == 0);
+    free(summary);
+    remove(path);
+}
+
+void test_enabled() {
+    trace_enable();
+    trace_thread("main", -1);
+    trace_name(0, "localhost:8080/a \"quoted\" name");
+
+    // Spans from several threads at once
+    pthread_t threads[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, record, (void*) i);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // A span of about 3 ms, made by starting it in the past
+    trace_context(0);
+    trace_end(TRACE_CONNECT, trace_begin() - 3000000, 0);
+
+    // More spans than the main thread's ring can hold, so that its oldest,
+    // the connect span among them, are dropped from the trace
+    for (int i = 0; i < TRACE_RING_SIZE + OVERFLOW; i++) {
+        trace_end(TRACE_HASH, trace_begin(), 1);
+    }
+
+    char chrome_path[] = "/tmp/trace_test_XXXXXX";
+    char summary_path[] = "/tmp/trace_test_XXXXXX";
+    close(mkstemp(chrome_path));
+    close(mkstemp(summary_path));
+    CHECK(trace_write_chrome(chrome_path) == 0);
+    CHECK(trace_write_prometheus(summary_path) == 0);
+    trace_free();
+
+    char* summary = read_file(summary_path);
+    CHECK(metric(summary, "downloader_phase_seconds_count{phase=\"write\"}") ==
+          NUM_THREADS * SPANS_PER_THREAD);
+    CHECK(metric(summary, "downloader_phase_bytes_total{phase=\"write\"}") ==
+          NUM_THREADS * SPANS_PER_THREAD * 10);
+    CHECK(metric(summary, "downloader_phase_seconds_bucket"
+                          "{phase=\"write\",le=\"+Inf\"}") ==
+          NUM_THREADS * SPANS_PER_THREAD);
+    CHECK(metric(summary, "downloader_phase_seconds_count{phase=\"hash\"}") ==
+          TRACE_RING_SIZE + OVERFLOW);
+    CHECK(metric(summary, "downloader_trace_dropped_spans_total") ==
+          OVERFLOW + 1);
+
+    // The 3 ms span is under 4.096 ms but not 2.048 ms
+    CHECK(metric(summary, "downloader_phase_seconds_bucket"
+                          "{phase=\"connect\",le=\"0.002048\"}") == 0);
+    CHECK(metric(summary, "downloader_phase_seconds_bucket"
+                          "{phase=\"connect\",le=\"0.004096\"}") == 1);
+    free(summary);
+
+    char* chrome = read_file(chrome_path);
+    CHECK(strncmp(chrome, "{\"displayTimeUnit\"", 18) == 0);
+    CHECK(count(chrome, "\"ph\": \"X\"") ==
+          NUM_THREADS * SPANS_PER_THREAD + TRACE_RING_SIZE);
+    CHECK(count(chrome, "\"name\": \"connect\"") == 0);
+    CHECK(count(chrome, "\"name\": \"write\"") ==
+          NUM_THREADS * SPANS_PER_THREAD);
+    CHECK(count(chrome, "\"thread_name\"") == NUM_THREADS + 1);
+    CHECK(strstr(chrome, "\"args\": {\"name\": \"recorder 3\"}") != NULL);
+    CHECK(strstr(chrome, "\"args\": {\"name\": \"main\"}") != NULL);
+    CHECK(strstr(chrome, "\"url\": \"localhost:8080/a "
+                         "\\\"quoted\\\" name\"") != NULL);
+    CHECK(strstr(chrome, "\n]}\n") != NULL);
+    free(chrome);
+
+    remove(chrome_path);
+    remove(summary_path);
+}
+
+int main(int argc, char** argv) {
+    test_disabled();
+    test_enabled();
+
+    return check_result();
+}
@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "uring.h"
+
+/*
+ * Tests moving pieces from a socket to a file through io_uring: that pieces
+ * land at their offsets, that a recv which comes up short cancels its write,
+ * that a recv which takes too long times out, and that clearing the fixed
+ * files lets a socket be closed. Passes without testing anything if
+ * io_uring is unavailable.
+ *
+ * ./uring_test
+ */
+
+#define BODY_SIZE (URING_BUFFER_SIZE * 5 / 2)
+
+typedef struct {
+    int sockfd;
+    const char* data;
+    size_t length;
+} Sender;
+
+static void* send_all(void* arg) {
+    Sender* sender = (Sender*) arg;
+    size_t sent = 0;
+    while (sent < sender->length) {
+        ssize_t bytes =
+            send(sender->sockfd, sender->data + sent, sender->length - sent, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        sent += bytes;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Waits for the three completions of a piece's chain, by operation.
+ */
+static void wait_chain(Uring* uring, int slot, int results[3]) {
+    for (int i = 0; i < 3; i++) {
+        UringEvent event;
+        CHECK(uring_wait(uring, &event) == 0);
+        CHECK(event.slot == slot);
+        results[event.op] = event.result;
+    }
+}
+
+static FILE* open_file(int* fd) {
+    FILE* file = tmpfile();
+    *fd = fileno(file);
+    return file;
+}
+
+void test_move(Uring* uring) {
+    int sockets[2], fd;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    FILE* file = open_file(&fd);
+    CHECK(uring_files(uring, sockets[0], fd) == 0);
+
+    char* body = malloc(BODY_SIZE);
+    for (size_t i = 0; i < BODY_SIZE; i++) {
+        body[i] = i * 7 + i / 4096;
+    }
+    Sender sender = {sockets[1], body, BODY_SIZE};
+    pthread_t thread;
+    pthread_create(&thread, NULL, send_all, &sender);
+
+    // Pieces alternate between the buffers, as a body's do
+    int slot = 0;
+    for (off_t offset = 0; offset < BODY_SIZE; offset += URING_BUFFER_SIZE) {
+        size_t length = BODY_SIZE - offset < URING_BUFFER_SIZE
+                            ? BODY_SIZE - offset
+                            : URING_BUFFER_SIZE;
+        int results[3];
+        uring_move(uring, slot, length, offset, 5.0);
+        wait_chain(uring, slot, results);
+
+        CHECK(results[URING_RECV] == (int) length);
+        CHECK(results[URING_TIMEOUT] == -ECANCELED);
+        CHECK(results[URING_WRITE] == (int) length);
+        slot = (slot + 1) % URING_SLOTS;
+    }
+    pthread_join(thread, NULL);
+
+    char* written = malloc(BODY_SIZE);
+    CHECK(pread(fd, written, BODY_SIZE, 0) == BODY_SIZE);
+    CHECK(memcmp(written, body, BODY_SIZE) == 0);
+
+    CHECK(uring_files(uring, -1, -1) == 0);
+    close(sockets[0]);
+    close(sockets[1]);
+    fclose(file);
+    free(written);
+    free(body);
+}
+
+void test_short(Uring* uring) {
+    int sockets[2], fd;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    FILE* file = open_file(&fd);
+    CHECK(uring_files(uring, sockets[0], fd) == 0);
+
+    // The peer closes after part of the piece
+    CHECK(send(sockets[1], "partial", 7, 0) == 7);
+    close(sockets[1]);
+
+    int results[3];
+    uring_move(uring, 1, 4096, 100, 5.0);
+    wait_chain(uring, 1, results);
+    CHECK(results[URING_RECV] == 7);
+    CHECK(results[URING_WRITE] == -ECANCELED);
+    CHECK(memcmp(uring_buffer(uring, 1), "partial", 7) == 0);
+
+    // Nothing was written
+    CHECK(lseek(fd, 0, SEEK_END) == 0);
+
+    CHECK(uring_files(uring, -1, -1) == 0);
+    close(sockets[0]);
+    fclose(file);
+}
+
+void test_timeout(Uring* uring) {
+    int sockets[2], fd;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    FILE* file = open_file(&fd);
+    CHECK(uring_files(uring, sockets[0], fd) == 0);
+
+    int results[3];
+    uring_move(uring, 0, 4096, 0, 0.05);
+    wait_chain(uring, 0, results);
+    CHECK(results[URING_TIMEOUT] == -ETIME);
+    CHECK(results[URING_RECV] == -ECANCELED);
+    CHECK(results[URING_WRITE] == -ECANCELED);
+
+    // Once the ring lets go of the socket, closing it closes the connection
+    CHECK(uring_files(uring, -1, -1) == 0);
+    close(sockets[0]);
+    char byte;
+    CHECK(recv(sockets[1], &byte, 1, 0) == 0);
+
+    close(sockets[1]);
+    fclose(file);
+}
+
+int main(int argc, char** argv) {
+    Uring* uring = uring_alloc();
+    if (uring == NULL) {
+        printf("io_uring is unavailable, nothing tested\n");
+        printf("all tests passed\n");
+        return 0;
+    }
+
+    test_move(uring);
+    test_short(uring);
+    test_timeout(uring);
+    uring_free(uring);
+
+    return check_result();
+}
@@ -1,61 +1,76 @@
 import sys
 import subprocess
 import statistics
+import tempfile
 
 from sys import stderr
 
 
-USAGE = "USAGE: python3 ./timer.py [downloader] [file]"
+USAGE = "USAGE: python3 ./timer.py [downloader] [file] [engines]"
 
+# The engines to compare at each connection count, unless given as e.g.
+# threads,epoll
+ENGINES = ["threads", "epoll"]
 
-def get_time(exe: str, file: str, threads: int):
-    args = ["time", "-f", "%e", exe, file, str(threads), "timer"]
-    result = subprocess.run(args, stderr=subprocess.PIPE)
-    return float(result.stderr.decode())
 
+def get_time(exe: str, file: str, threads: int, engine: str):
+    # time writes to its own file, as the downloader reports retries and
+    # errors on stderr
+    with tempfile.NamedTemporaryFile(mode="r") as output:
+        args = ["time", "-f", "%e", "-o", output.name,
+                exe, "-e", engine, file, str(threads), "timer"]
+        subprocess.run(args)
+        return float(output.read())
 
-def average(exe: str, file: str, threads: int):
+
+def average(exe: str, file: str, threads: int, engine: str):
     times = []
     for i in range(5):
         print(f"Iteration: {i + 1}", end="\n\n\n")
-        times.append(get_time(exe, file, threads))
+        times.append(get_time(exe, file, threads, engine))
     times.sort()
     return statistics.mean(times[1:-1])
 
 
-def print_results(results):
-    for i in results:
-        print(i)
+def print_results(engines, results):
+    print("threads", *engines, sep="\t")
+    for threads, times in results:
+        print(threads, *(f"{time:.2f}" for time in times), sep="\t")
 
 
-def run(exe: str, file: str):
+def run(exe: str, file: str, engines):
     final = 1
     results = []
     try:
         for threads in [1, 2, 4, 8, 16, 24, 32, 40, 50]:
             final = threads
-            print(f"\n\n\nThreads: {threads}")
-            results.append((threads, average(exe, file, threads)))
-            threads *= 2
+            times = []
+            for engine in engines:
+                print(f"\n\n\nThreads: {threads}, engine: {engine}")
+                times.append(average(exe, file, threads, engine))
+            results.append((threads, times))
     except Exception as ex:
         print(f"Failed when threads = {final}")
         print(ex)
     finally:
-        print_results(results)
+        print_results(engines, results)
 
 
 def main():
     exe = ""
     file = ""
+    engines = ENGINES
     try:
         exe = sys.argv[1]
         file = sys.argv[2]
+        if len(sys.argv) > 3:
+            engines = sys.argv[3].split(",")
     except Exception as ex:
         print(USAGE)
         print("\n\n")
         print(ex, file=stderr)
 
-    run(exe, file)
+    run(exe, file, engines)
 
 
 if __name__ == "__main__":